@@ -9,57 +9,132 @@
 #include "motion.h"
 #include "alg.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define MAX2(x, y) ((x) > (y) ? (x) : (y))
 #define MAX3(x, y, z) ((x) > (y) ? ((x) > (z) ? (x) : (z)) : ((y) > (z) ? (y) : (z)))
 
 /**
- * alg_locate_center_size
- *      Locates the center and size of the movement.
+ * scale_location
+ *      Maps a location found on the scaled down detection picture to the
+ *      full picture, keeping the box edges on even pixels.
  */
-void alg_locate_center_size(struct images *imgs, int width, int height, struct coord *cent, int tot_labels)
+static void scale_location(int scale, struct coord *cent)
+{
+    cent->x = cent->x * scale + scale / 2;
+    cent->y = cent->y * scale + scale / 2;
+    cent->minx *= scale;
+    cent->miny *= scale;
+    cent->maxx = cent->maxx * scale + scale - 1;
+    cent->maxy = cent->maxy * scale + scale - 1;
+    cent->minx += cent->minx % 2;
+    cent->miny += cent->miny % 2;
+    cent->maxx -= cent->maxx % 2;
+    cent->maxy -= cent->maxy % 2;
+    cent->width = cent->maxx - cent->minx;
+    cent->height = cent->maxy - cent->miny;
+}
+
+/**
+ * scale_labels
+ *      Maps the label boxes to the full picture, see scale_location.
+ */
+static void scale_labels(struct images *imgs, int tot_labels)
 {
-    unsigned char *out = imgs->out;
-    int *labels = imgs->labels;
-    int x, y, l, centc = 0, xdist = 0, ydist = 0;
     struct label_center *label_coord = imgs->labels_all;
+    struct coord c;
+    int l;
+
+    for (l = 0; l < tot_labels; l++) {
+        c.x = label_coord[l].x;
+        c.y = label_coord[l].y;
+        c.minx = label_coord[l].minx;
+        c.maxx = label_coord[l].maxx;
+        c.miny = label_coord[l].miny;
+        c.maxy = label_coord[l].maxy;
+
+        scale_location(imgs->motion_scale, &c);
+
+        label_coord[l].x = c.x;
+        label_coord[l].y = c.y;
+        label_coord[l].minx = c.minx;
+        label_coord[l].maxx = c.maxx;
+        label_coord[l].miny = c.miny;
+        label_coord[l].maxy = c.maxy;
+    }
+}
 
-    /* If Labeling enabled - locate center of all labels. */
-    if (tot_labels) {
+/**
+ * count_motion
+ *      Counts the motion pixels of out in each row and column, for when
+ *      out changed since alg_diff_standard counted them. With SSE2 16
+ *      pixels are compared at a time and only the motion pixels among
+ *      them are looked at for the columns.
+ */
+static void count_motion(struct images *imgs)
+{
+    unsigned char *out = imgs->out;
+    int *row_count = imgs->row_count;
+    int *col_count = imgs->col_count;
+    int width = imgs->motion_width;
+    int height = imgs->motion_height;
+    int x, y, line;
 
-        for (x = 0; x < tot_labels; x++) {
-            label_coord[x].x = 0;
-            label_coord[x].y = 0;
-            label_coord[x].c = 0;
-            label_coord[x].minx = width;
-            label_coord[x].maxx = 0;
-            label_coord[x].miny = height;
-            label_coord[x].maxy = 0;
-            label_coord[x].is_sub_box = 0;
-        }
+    memset(col_count, 0, width * sizeof(*col_count));
 
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                /* Check for valid label */
-                if (*labels & 32768) {
-                    /* Find the label number */
-                    int current_label = (*labels ^ 32768);
-
-                    label_coord[current_label].x += x;
-                    label_coord[current_label].y += y;
-                    label_coord[current_label].c++;
-
-                    if (label_coord[current_label].minx > x)
-                        label_coord[current_label].minx = x;
-                    if (label_coord[current_label].maxx < x)
-                        label_coord[current_label].maxx = x;
-                    if (label_coord[current_label].miny > y)
-                        label_coord[current_label].miny = y;
-                    if (label_coord[current_label].maxy < y)
-                        label_coord[current_label].maxy = y;
+    for (y = 0; y < height; y++, out += width) {
+        line = 0;
+        x = 0;
+
+#ifdef __SSE2__
+        {
+            const __m128i zero = _mm_setzero_si128();
+
+            for (; x + 16 <= width; x += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(out + x));
+                unsigned int bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xffff;
+
+                line += __builtin_popcount(bits);
+
+                while (bits) {
+                    col_count[x + __builtin_ctz(bits)]++;
+                    bits &= bits - 1;
                 }
-                labels++;
             }
         }
+#endif
+
+        for (; x < width; x++) {
+            if (out[x]) {
+                col_count[x]++;
+                line++;
+            }
+        }
+
+        row_count[y] = line;
+    }
+
+    imgs->counted = 1;
+}
+
+/**
+ * alg_locate_center_size
+ *      Locates the center and size of the movement on the detection picture
+ *      of width x height. The location and the label boxes are in pixels of
+ *      the full picture. The sums and extents of the labels come from
+ *      alg_labeling and those of the motion from the row and column counts,
+ *      so out is not scanned again unless it was despeckled.
+ */
+void alg_locate_center_size(struct images *imgs, int width, int height, struct coord *cent, int tot_labels)
+{
+    int x, y, l;
+    long long centc = 0, sumx = 0, sumy = 0, xdist = 0, ydist = 0;
+    struct label_center *label_coord = imgs->labels_all;
+
+    /* If Labeling enabled - locate center of all labels. */
+    if (tot_labels) {
 
         for(l = 0; l < tot_labels; ++l) {
             /* Calculate center of all labels */
@@ -86,6 +161,10 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
                     }
             }
         }
+
+        if (imgs->motion_scale > 1)
+            scale_labels(imgs, tot_labels);
+
         /* Set cent to largest label,
          * for box drawing / track moving / 3x3 detection / lightswitch ...
          */
@@ -109,43 +188,29 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
         cent->minx = width;
         cent->miny = height;
 
+        if (!imgs->counted)
+            count_motion(imgs);
+
         /* Locate movement */
         for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(out++)) {
-                    cent->x += x;
-                    cent->y += y;
-                    centc++;
-                }
-            }
+            sumy += (long long)y * imgs->row_count[y];
+            centc += imgs->row_count[y];
         }
+
+        for (x = 0; x < width; x++)
+            sumx += (long long)x * imgs->col_count[x];
+
         if (centc) {
-            cent->x = cent->x / centc;
-            cent->y = cent->y / centc;
+            cent->x = sumx / centc;
+            cent->y = sumy / centc;
         }
 
-        /* Now we find the size of the Motion. */
-        /* First reset pointers back to initial value. */
-        centc = 0;
-        out = imgs->out;
+        /* Now we find the size of the Motion, from the same counts. */
+        for (x = 0; x < width; x++)
+            xdist += (long long)abs(x - cent->x) * imgs->col_count[x];
 
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(out++)) {
-                    if (x > cent->x)
-                        xdist += x - cent->x;
-                    else if (x < cent->x)
-                        xdist += cent->x - x;
-
-                    if (y > cent->y)
-                        ydist += y - cent->y;
-                    else if (y < cent->y)
-                        ydist += cent->y - y;
-
-                    centc++;
-                }
-            }
-        }
+        for (y = 0; y < height; y++)
+            ydist += (long long)abs(y - cent->y) * imgs->row_count[y];
 
         if (centc) {
             cent->minx = cent->x - xdist / centc * 2;
@@ -196,6 +261,9 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
      */
     cent->y = (cent->miny + cent->maxy) / 2;
 
+    if (imgs->motion_scale > 1)
+        scale_location(imgs->motion_scale, cent);
+
     /* Set as first label, so drawing box/cross will work */
     imgs->labels_all[0].x = cent->x;
     imgs->labels_all[0].y = cent->y;
@@ -213,15 +281,13 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
 void alg_draw_location(struct coord *cent, struct images *imgs, int width, unsigned char *new,
                        int style, int mode, int process_thisframe, int tot_labels)
 {
-    unsigned char *out = imgs->out;
+    unsigned char *out = imgs->out_image;
     int x, y;
 
     /* If label is not used, draw cent/coord stored in first position */
     if (!tot_labels)
         tot_labels = 1;
 
-    out = imgs->out;
-
     /* Debug image always gets a 'normal' box. */
     if ((mode == LOCATE_BOTH) && process_thisframe) {
         int width_miny = width * cent->miny;
@@ -303,7 +369,7 @@ void alg_draw_location(struct coord *cent, struct images *imgs, int width, unsig
 void alg_draw_red_location(struct coord *cent, struct images *imgs, int width, unsigned char *new,
                            int style, int mode, int process_thisframe, int tot_labels)
 {
-    unsigned char *out = imgs->out;
+    unsigned char *out = imgs->out_image;
     unsigned char *new_u, *new_v;
     int x, y, v, cwidth, cblock;
 
@@ -312,8 +378,8 @@ void alg_draw_red_location(struct coord *cent, struct images *imgs, int width, u
         tot_labels = 1;
 
     cwidth = width / 2;
-    cblock = imgs->motionsize / 4;
-    x = imgs->motionsize;
+    cblock = imgs->width * imgs->height / 4;
+    x = imgs->width * imgs->height;
     v = x + cblock;
     new_u = new + x;
     new_v = new + v;
@@ -535,14 +601,37 @@ typedef struct {
     short y, xl, xr, dy;
 } Segment;
 
+/**
+ * label_span
+ *      Adds the pixels xl to xr of row y to the sums and extents of a label.
+ */
+static inline void label_span(struct label_center *lc, int y, int xl, int xr)
+{
+    int n = xr - xl + 1;
+
+    lc->x += (xl + xr) * n / 2;
+    lc->y += y * n;
+    lc->c += n;
+
+    if (lc->minx > xl)
+        lc->minx = xl;
+    if (lc->maxx < xr)
+        lc->maxx = xr;
+    if (lc->miny > y)
+        lc->miny = y;
+    if (lc->maxy < y)
+        lc->maxy = y;
+}
+
 /**
  * iflood
- *
+ *      Fills the label. If lc is given, the filled pixels are added to its
+ *      sums and extents.
  */
-static int iflood(int x, int y, int width, int height,
-                  unsigned char *out, int *labels, int newvalue, int oldvalue)
+static int iflood(int x, int y, int width, int height, unsigned char *out,
+                  uint16_t *labels, int newvalue, int oldvalue, struct label_center *lc)
 {
-    int l, x1, x2, dy;
+    int l, x1, x2, dy, xs;
     Segment stack[MAXS], *sp = stack;    /* Stack of filled segments. */
     int count = 0;
 
@@ -564,6 +653,9 @@ static int iflood(int x, int y, int width, int height,
             count++;
         }
 
+        if (lc && x < x1)
+            label_span(lc, y, x + 1, x1);
+
         if (x >= x1)
             goto skip;
 
@@ -575,11 +667,14 @@ static int iflood(int x, int y, int width, int height,
         x = x1 + 1;
 
         do {
-            for (; x < width && out[y * width + x] != 0 && labels[y * width + x] == oldvalue; x++) {
+            for (xs = x; x < width && out[y * width + x] != 0 && labels[y * width + x] == oldvalue; x++) {
                 labels[y * width + x] = newvalue;
                 count++;
             }
 
+            if (lc && x > xs)
+                label_span(lc, y, xs, x - 1);
+
             PUSH(y, l, x - 1, dy);
 
             if (x > x2 + 1)
@@ -603,20 +698,22 @@ static int alg_labeling(struct context *cnt)
 {
     struct images *imgs = &cnt->imgs;
     unsigned char *out = imgs->out;
-    int *labels = imgs->labels;
+    uint16_t *labels = imgs->labels;
     int ix, iy, pixelpos;
-    int width = imgs->width;
-    int height = imgs->height;
+    int width = imgs->motion_width;
+    int height = imgs->motion_height;
+    int area = imgs->motion_scale * imgs->motion_scale;
     int labelsize = 0;
     int mark_as_label = 2; /* 0 = no label, 1 = no label and no motion, > 1 = label id*/
     int *tot_labels = &cnt->current_image->total_labels;
+    struct label_center *lc;
     int diffs = 0;
 
     *tot_labels = 0;
     imgs->labelsize_max = 0;
 
     /* Init: 0 means no label set / not checked. */
-    memset(labels, 0, width * height * sizeof(labels));
+    memset(labels, 0, width * height * sizeof(*labels));
     pixelpos = 0;
 
     for (iy = 0; iy < height - 1; iy++) {
@@ -631,16 +728,30 @@ static int alg_labeling(struct context *cnt)
             if (labels[pixelpos] > 0)
                 continue;
 
-            labelsize = iflood(ix, iy, width, height, out, labels, mark_as_label, 0);
+            labelsize = iflood(ix, iy, width, height, out, labels, mark_as_label, 0, NULL);
 
-            if (labelsize > cnt->threshold) {
+            /* threshold is in pixels of the full picture */
+            if (labelsize * area > cnt->threshold) {
                 /* Only care about MAX_LABELS, NB: this is MAX_LABELS first, not MAX_LABELS best. */
                 /* but with large enough number, probalby doesn't matter */
                 if (*tot_labels == MAX_LABELS)
                     goto SKIP_REM_LABELS;
 
-                /* Label above threshold? Mark it again (add 32768 to labelnumber). */
-                labelsize = iflood(ix, iy, width, height, out, labels, *tot_labels + 32768, mark_as_label);
+                lc = &imgs->labels_all[*tot_labels];
+                lc->x = lc->y = lc->c = 0;
+                lc->minx = width;
+                lc->maxx = 0;
+                lc->miny = height;
+                lc->maxy = 0;
+                lc->is_sub_box = 0;
+
+                /*
+                 * Label above threshold? Mark it again (add 32768 to labelnumber),
+                 * this time gathering its center and extents for
+                 * alg_locate_center_size.
+                 */
+                labelsize = iflood(ix, iy, width, height, out, labels, *tot_labels + 32768,
+                                   mark_as_label, lc) * area;
                 diffs += labelsize;
 
                 if (imgs->labelsize_max < labelsize) {
@@ -649,7 +760,14 @@ static int alg_labeling(struct context *cnt)
                 }
                 (*tot_labels)++;
             }
-            mark_as_label++;
+
+            /*
+             * The ids only tell the pixel of this label from the unchecked
+             * ones when it is marked again, so they can be reused. They must
+             * stay below the 32768 of the labels above threshold.
+             */
+            if (++mark_as_label == 32768)
+                mark_as_label = 2;
         }
         pixelpos++; /* Compensate for ix < width - 1 */
     }
@@ -913,29 +1031,34 @@ int alg_despeckle(struct context *cnt, int olddiffs)
 {
     int diffs = 0;
     unsigned char *out = cnt->imgs.out;
-    int width = cnt->imgs.width;
-    int height = cnt->imgs.height;
+    int width = cnt->imgs.motion_width;
+    int height = cnt->imgs.motion_height;
+    int area = cnt->imgs.motion_scale * cnt->imgs.motion_scale;
     int done = 0, i, len = strlen(cnt->conf.despeckle_filter);
     unsigned char *common_buffer = cnt->imgs.common_buffer;
 
     for (i = 0; i < len; i++) {
+        /* Erode and dilate change out, the counts of alg_diff_standard are gone */
+        if (strchr("EeDd", cnt->conf.despeckle_filter[i]))
+            cnt->imgs.counted = 0;
+
         switch (cnt->conf.despeckle_filter[i]) {
         case 'E':
-            if ((diffs = erode9(out, width, height, common_buffer, 0)) == 0)
+            if ((diffs = erode9(out, width, height, common_buffer, 0) * area) == 0)
                 i = len;
             done = 1;
             break;
         case 'e':
-            if ((diffs = erode5(out, width, height, common_buffer, 0)) == 0)
+            if ((diffs = erode5(out, width, height, common_buffer, 0) * area) == 0)
                 i = len;
             done = 1;
             break;
         case 'D':
-            diffs = dilate9(out, width, height, common_buffer);
+            diffs = dilate9(out, width, height, common_buffer) * area;
             done = 1;
             break;
         case 'd':
-            diffs = dilate5(out, width, height, common_buffer);
+            diffs = dilate5(out, width, height, common_buffer) * area;
             done = 1;
             break;
         /* No further despeckle after labeling! */
@@ -965,7 +1088,7 @@ void alg_tune_smartmask(struct context *cnt)
     int motionsize = cnt->imgs.motionsize;
     unsigned char *smartmask = cnt->imgs.smartmask;
     unsigned char *smartmask_final = cnt->imgs.smartmask_final;
-    int *smartmask_buffer = cnt->imgs.smartmask_buffer;
+    uint16_t *smartmask_buffer = cnt->imgs.smartmask_buffer;
     int sensitivity = cnt->lastrate * (11 - cnt->smartmask_speed);
 
     for (i = 0; i < motionsize; i++) {
@@ -989,9 +1112,9 @@ void alg_tune_smartmask(struct context *cnt)
             smartmask_final[i] = 255;
     }
     /* Further expansion (here:erode due to inverted logic!) of the mask. */
-    diff = erode9(smartmask_final, cnt->imgs.width, cnt->imgs.height,
+    diff = erode9(smartmask_final, cnt->imgs.motion_width, cnt->imgs.motion_height,
                   cnt->imgs.common_buffer, 255);
-    diff = erode5(smartmask_final, cnt->imgs.width, cnt->imgs.height,
+    diff = erode5(smartmask_final, cnt->imgs.motion_width, cnt->imgs.motion_height,
                   cnt->imgs.common_buffer, 255);
 }
 
@@ -1000,58 +1123,82 @@ void alg_tune_smartmask(struct context *cnt)
 
 /**
  * alg_diff_standard
- *
+ *      Makes the motion image of the detection picture new, counting its
+ *      motion pixels in each row and column on the way for
+ *      alg_switchfilter and alg_locate_center_size. Returns the changed
+ *      pixels, counted in pixels of the full picture.
  */
 int alg_diff_standard(struct context *cnt, unsigned char *new)
 {
     struct images *imgs = &cnt->imgs;
-    int i, diffs = 0;
+    int i, x, y, line, diffs = 0;
+    int width = imgs->motion_width;
+    int height = imgs->motion_height;
+    int *row_count = imgs->row_count;
+    int *col_count = imgs->col_count;
     int noise = cnt->noise;
     int smartmask_speed = cnt->smartmask_speed;
     unsigned char *ref = imgs->ref;
     unsigned char *out = imgs->out;
     unsigned char *mask = imgs->mask;
     unsigned char *smartmask_final = imgs->smartmask_final;
-    int *smartmask_buffer = imgs->smartmask_buffer;
+    uint16_t *smartmask_buffer = imgs->smartmask_buffer;
 
     i = imgs->motionsize;
     memset(out + i, 128, i / 2); /* Motion pictures are now b/w i.o. green */
     memset(out, 0, i);
+    memset(col_count, 0, width * sizeof(*col_count));
 
-    for (; i > 0; i--) {
-        register unsigned char curdiff = (int)(abs(*ref - *new)); /* Using a temp variable is 12% faster. */
-        /* Apply fixed mask */
-        if (mask)
-            curdiff = ((int)(curdiff * *mask++) / 255);
+    for (y = 0; y < height; y++) {
+        line = 0;
 
-        if (smartmask_speed) {
+        for (x = 0; x < width; x++) {
+            register unsigned char curdiff = (int)(abs(*ref - *new)); /* Using a temp variable is 12% faster. */
+            /* Apply fixed mask */
+            if (mask)
+                curdiff = ((int)(curdiff * *mask++) / 255);
+
+            if (smartmask_speed) {
+                if (curdiff > noise) {
+                    /*
+                     * Increase smart_mask sensitivity every frame when motion
+                     * is detected. (with speed=5, mask is increased by 1 every
+                     * second. To be able to increase by 5 every second (with
+                     * speed=10) we add 5 here. NOT related to the 5 at ratio-
+                     * calculation.
+                     */
+                    if (cnt->event_nr != cnt->prev_event &&
+                        *smartmask_buffer <= UINT16_MAX - SMARTMASK_SENSITIVITY_INCR)
+                        (*smartmask_buffer) += SMARTMASK_SENSITIVITY_INCR;
+                    /* Apply smart_mask */
+                    if (!*smartmask_final)
+                        curdiff = 0;
+                }
+                smartmask_final++;
+                smartmask_buffer++;
+            }
+            /* Pixel still in motion after all the masks? */
             if (curdiff > noise) {
-                /*
-                 * Increase smart_mask sensitivity every frame when motion
-                 * is detected. (with speed=5, mask is increased by 1 every
-                 * second. To be able to increase by 5 every second (with
-                 * speed=10) we add 5 here. NOT related to the 5 at ratio-
-                 * calculation.
-                 */
-                if (cnt->event_nr != cnt->prev_event)
-                    (*smartmask_buffer) += SMARTMASK_SENSITIVITY_INCR;
-                /* Apply smart_mask */
-                if (!*smartmask_final)
-                    curdiff = 0;
+                *out = *new;
+                diffs++;
+
+                /* A black pixel is no motion in out */
+                if (*new) {
+                    col_count[x]++;
+                    line++;
+                }
             }
-            smartmask_final++;
-            smartmask_buffer++;
-        }
-        /* Pixel still in motion after all the masks? */
-        if (curdiff > noise) {
-            *out = *new;
-            diffs++;
+            out++;
+            ref++;
+            new++;
         }
-        out++;
-        ref++;
-        new++;
+
+        row_count[y] = line;
     }
-    return diffs;
+
+    imgs->counted = 1;
+
+    return diffs * imgs->motion_scale * imgs->motion_scale;
 }
 
 /**
@@ -1067,8 +1214,8 @@ static char alg_diff_fast(struct context *cnt, int max_n_changes, unsigned char
 
     if (!step % 2)
         step++;
-    /* We're checking only 1 of several pixels. */
-    max_n_changes /= step;
+    /* We're checking only 1 of several pixels, of a scaled down picture. */
+    max_n_changes /= step * imgs->motion_scale * imgs->motion_scale;
 
     i = imgs->motionsize;
 
@@ -1117,7 +1264,7 @@ int alg_lightswitch(struct context *cnt, int diffs)
         cnt->conf.lightswitch = 100;
 
     /* Is lightswitch percent of the image changed? */
-    if (diffs > (imgs->motionsize * cnt->conf.lightswitch / 100))
+    if (diffs > (imgs->width * imgs->height * cnt->conf.lightswitch / 100))
         return 1;
 
     return 0;
@@ -1125,35 +1272,37 @@ int alg_lightswitch(struct context *cnt, int diffs)
 
 /**
  * alg_switchfilter
- *
+ *      Looks at the motion pixels of each row, as counted by
+ *      alg_diff_standard.
  */
 int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
 {
-    int linediff = diffs / cnt->imgs.height;
-    unsigned char *out = cnt->imgs.out;
-    int y, x, line;
+    int width = cnt->imgs.motion_width;
+    int height = cnt->imgs.motion_height;
+    int linediff = diffs / (cnt->imgs.motion_scale * cnt->imgs.motion_scale) / height;
+    int y, line;
     int lines = 0, vertlines = 0;
 
-    for (y = 0; y < cnt->imgs.height; y++) {
-        line = 0;
-        for (x = 0; x < cnt->imgs.width; x++) {
-            if (*(out++))
-                line++;
-        }
+    if (!cnt->imgs.counted)
+        count_motion(&cnt->imgs);
 
-        if (line > cnt->imgs.width / 18)
+    for (y = 0; y < height; y++) {
+        line = cnt->imgs.row_count[y];
+
+        if (line > width / 18)
             vertlines++;
 
         if (line > linediff * 2)
             lines++;
     }
 
-    if (vertlines > cnt->imgs.height / 10 && lines < vertlines / 3 &&
-        (vertlines > cnt->imgs.height / 4 || lines - vertlines > lines / 2)) {
+    if (vertlines > height / 10 && lines < vertlines / 3 &&
+        (vertlines > height / 4 || lines - vertlines > lines / 2)) {
         if (cnt->conf.text_changes) {
             char tmp[80];
             sprintf(tmp, "%d %d", lines, vertlines);
-            draw_text(newimg, cnt->imgs.width - 10, 20, cnt->imgs.width, tmp, cnt->conf.text_double);
+            draw_text(newimg, cnt->imgs.width - 10, 20, cnt->imgs.width, cnt->imgs.height, tmp,
+                      cnt->text_scale);
         }
         return diffs;
     }
@@ -1182,8 +1331,8 @@ void alg_update_reference_frame(struct context *cnt, int action)
     int accept_timer = cnt->lastrate * ACCEPT_STATIC_OBJECT_TIME;
 #endif
     int i, threshold_ref;
-    int *ref_dyn = cnt->imgs.ref_dyn;
-    unsigned char *image_virgin = cnt->imgs.image_virgin;
+    uint16_t *ref_dyn = cnt->imgs.ref_dyn;
+    unsigned char *image_virgin = cnt->imgs.image_detect;
     unsigned char *ref = cnt->imgs.ref;
     unsigned char *smartmask = cnt->imgs.smartmask_final;
     unsigned char *out = cnt->imgs.out;
@@ -1227,8 +1376,132 @@ void alg_update_reference_frame(struct context *cnt, int action)
 
     } else {   /* action == RESET_REF_FRAME - also used to initialize the frame at startup. */
         /* Copy fresh image */
-        memcpy(cnt->imgs.ref, cnt->imgs.image_virgin, cnt->imgs.size);
+        memcpy(cnt->imgs.ref, cnt->imgs.image_detect, cnt->imgs.motionsize);
         /* Reset static objects */
-        memset(cnt->imgs.ref_dyn, 0, cnt->imgs.motionsize * sizeof(cnt->imgs.ref_dyn));
+        memset(cnt->imgs.ref_dyn, 0, cnt->imgs.motionsize * sizeof(*cnt->imgs.ref_dyn));
     }
 }
+
+/**
+ * alg_scale_down
+ *      Scales a plane of width x height down scale times in both directions,
+ *      each pixel being the rounded average of a scale x scale box. dst may
+ *      be src, a row is only written behind the rows read for it. With SSE2
+ *      16 pixels are done at a time when scaling by 2.
+ */
+void alg_scale_down(unsigned char *dst, const unsigned char *src, int width, int height, int scale)
+{
+    int dwidth = width / scale, dheight = height / scale;
+    int area = scale * scale;
+    int x, y, i, j;
+
+    for (y = 0; y < dheight; y++) {
+        const unsigned char *row = src + y * scale * width;
+        unsigned char *out = dst + y * dwidth;
+
+        x = 0;
+
+#ifdef __SSE2__
+        if (scale == 2) {
+            const __m128i lo = _mm_set1_epi16(0x00ff);
+            const __m128i two = _mm_set1_epi16(2);
+
+            for (; x + 16 <= dwidth; x += 16) {
+                const unsigned char *s = row + x * 2;
+                __m128i a0 = _mm_loadu_si128((const __m128i *)s);
+                __m128i a1 = _mm_loadu_si128((const __m128i *)(s + 16));
+                __m128i b0 = _mm_loadu_si128((const __m128i *)(s + width));
+                __m128i b1 = _mm_loadu_si128((const __m128i *)(s + width + 16));
+                __m128i s0, s1;
+
+                /* Sums of the pixel pairs of both rows */
+                s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, lo), _mm_srli_epi16(a0, 8)),
+                                   _mm_add_epi16(_mm_and_si128(b0, lo), _mm_srli_epi16(b0, 8)));
+                s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, lo), _mm_srli_epi16(a1, 8)),
+                                   _mm_add_epi16(_mm_and_si128(b1, lo), _mm_srli_epi16(b1, 8)));
+                s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+                s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+
+                _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(s0, s1));
+            }
+        }
+#endif
+
+        for (; x < dwidth; x++) {
+            const unsigned char *s = row + x * scale;
+            int sum = 0;
+
+            for (j = 0; j < scale; j++, s += width) {
+                for (i = 0; i < scale; i++)
+                    sum += s[i];
+            }
+
+            out[x] = (sum + area / 2) / area;
+        }
+    }
+}
+
+/**
+ * alg_scale_up
+ *      Scales a plane of width x height up scale times in both directions by
+ *      repeating the pixels, the other way round of alg_scale_down.
+ */
+void alg_scale_up(unsigned char *dst, const unsigned char *src, int width, int height, int scale)
+{
+    int dwidth = width * scale;
+    int x, y, i;
+
+    for (y = 0; y < height; y++) {
+        unsigned char *out = dst;
+
+        for (x = 0; x < width; x++) {
+            for (i = 0; i < scale; i++)
+                *out++ = src[x];
+        }
+
+        for (i = 1; i < scale; i++)
+            memcpy(dst + i * dwidth, dst, dwidth);
+
+        src += width;
+        dst += scale * dwidth;
+    }
+}
+
+/**
+ * alg_detection_image
+ *      Sets image_detect to the picture motion is detected on. Called
+ *      whenever image_virgin has a new frame. Without a detection_scale it
+ *      is image_virgin itself, only the Y plane of it is looked at.
+ */
+void alg_detection_image(struct images *imgs)
+{
+    if (imgs->motion_scale == 1)
+        imgs->image_detect = imgs->image_virgin;
+    else
+        alg_scale_down(imgs->image_detect, imgs->image_virgin, imgs->width, imgs->height,
+                       imgs->motion_scale);
+}
+
+/**
+ * alg_motion_image
+ *      Scales the motion image out of the detection picture up into
+ *      out_image for the outputs. Without a detection_scale out_image is out.
+ */
+void alg_motion_image(struct images *imgs)
+{
+    int scale = imgs->motion_scale;
+    int size = imgs->width * imgs->height;
+
+    if (scale == 1)
+        return;
+
+    alg_scale_up(imgs->out_image, imgs->out, imgs->motion_width, imgs->motion_height, scale);
+
+    if (imgs->type == VIDEO_PALETTE_GREY)
+        return;
+
+    alg_scale_up(imgs->out_image + size, imgs->out + imgs->motionsize,
+                 imgs->motion_width / 2, imgs->motion_height / 2, scale);
+    alg_scale_up(imgs->out_image + size + size / 4, imgs->out + imgs->motionsize * 5 / 4,
+                 imgs->motion_width / 2, imgs->motion_height / 2, scale);
+}
@@ -43,5 +43,9 @@ void alg_threshold_tune(struct context *, int, int);
 int alg_despeckle(struct context *, int);
 void alg_tune_smartmask(struct context *);
 void alg_update_reference_frame(struct context *, int);
+void alg_scale_down(unsigned char *, const unsigned char *, int width, int height, int scale);
+void alg_scale_up(unsigned char *, const unsigned char *, int width, int height, int scale);
+void alg_detection_image(struct images *);
+void alg_motion_image(struct images *);
 
 #endif /* _INCLUDE_ALG_H */
@@ -51,7 +51,9 @@ struct config conf_template = {
     height:                         DEF_HEIGHT,
     quality:                        DEF_QUALITY,
     rotate_deg:                     0,
+    flip_axis:                      "none",
     max_changes:                    DEF_CHANGES,
+    detection_scale:                1,
     threshold_tune:                 0,
     output_pictures:                "on",
     motion_img:                     0,
@@ -66,6 +68,8 @@ struct config conf_template = {
     frame_limit:                    DEF_MAXFRAMERATE,
     quiet:                          1,
     picture_type:                   "jpeg",
+    output_queue:                   0,
+    output_queue_policy:            "block",
     noise:                          DEF_NOISELEVEL,
     noise_tune:                     1,
     minimum_frame_time:             0,
@@ -78,6 +82,7 @@ struct config conf_template = {
     roundrobin_frames:              1,
     roundrobin_skip:                1,
     pre_capture:                    0,
+    pre_capture_compressed:         0,
     post_capture:                   0,
     switchfilter:                   0,
     ffmpeg_output:                  0,
@@ -87,6 +92,10 @@ struct config conf_template = {
     ffmpeg_bps:                     DEF_FFMPEG_BPS,
     ffmpeg_vbr:                     DEF_FFMPEG_VBR,
     ffmpeg_video_codec:             DEF_FFMPEG_CODEC,
+    ffmpeg_threads:                 1,
+    ffmpeg_gop:                     0,
+    ffmpeg_preset:                  NULL,
+    ffmpeg_tune:                    NULL,
 #ifdef HAVE_SDL
     sdl_threadnr:                   0,
 #endif
@@ -107,17 +116,22 @@ struct config conf_template = {
     tuner_number:                   0,
     timelapse:                      0,
     timelapse_mode:                 DEF_TIMELAPSE_MODE,
+    continuous:                     0,
+    continuous_segments:            1440,
     video_device:                   VIDEO_DEVICE,
     v4l2_palette:                   DEF_PALETTE,
+    mjpeg_decode_scale:             1,
     vidpipe:                        NULL,
     filepath:                       NULL,
     imagepath:                      DEF_IMAGEPATH,
     moviepath:                      DEF_MOVIEPATH,
     snappath:                       DEF_SNAPPATH,
     timepath:                       DEF_TIMEPATH,
+    continuous_path:                DEF_CONTINUOUSPATH,
     on_event_start:                 NULL,
     on_event_end:                   NULL,
     mask_file:                      NULL,
+    smart_mask_file:                NULL,
     smart_mask_speed:               0,
 #if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
     sql_log_image:                  1,
@@ -125,6 +139,8 @@ struct config conf_template = {
     sql_log_movie:                  0,
     sql_log_timelapse:              0,
     sql_query:                      DEF_SQL_QUERY,
+    sql_queue:                      1000,
+    sql_spill_file:                 NULL,
     database_type:                  NULL,
     database_dbname:                NULL,
     database_host:                  "localhost",
@@ -147,11 +163,14 @@ struct config conf_template = {
     netcam_keepalive:               "off",
     netcam_proxy:                   NULL,
     netcam_tolerant_check:          0,
+    netcam_event_driven:            0,
+    netcam_keyframes_only:          0,
     text_changes:                   0,
     text_left:                      NULL,
     text_right:                     DEF_TIMESTAMP,
     text_event:                     DEF_EVENTSTAMP,
     text_double:                    0,
+    text_scale:                     1,
     despeckle_filter:               NULL,
     area_detect:                    NULL,
     minimum_motion_frames:          1,
@@ -281,6 +300,16 @@ config_param config_params[] = {
     print_int
     },
     {
+    "mjpeg_decode_scale",
+    "# Decode the frames of MJPEG/JPEG cameras at 1/2, 1/4 or 1/8 of their size, which\n"
+    "# takes much less time than decoding them at full size (default: 1 = full size).\n"
+    "# Pictures and movies are made from the smaller images too.",
+    0,
+    CONF_OFFSET(mjpeg_decode_scale),
+    copy_int,
+    print_int
+    },
+    {
     "input",
     "# The video input to be used (default: -1)\n"
     "# Should normally be set to 0 or 1 for video/TV cards, and -1 for USB cameras",
@@ -316,6 +345,15 @@ config_param config_params[] = {
     print_int
     },
     {
+    "flip_axis",
+    "# Flip the captured image before rotating it: none (default), h (mirror left\n"
+    "# to right) or v (upside down).",
+    0,
+    CONF_OFFSET(flip_axis),
+    copy_string,
+    print_string
+    },
+    {
     "width",
     "# Image width (pixels). Valid range: Camera dependent, default: 352",
     0,
@@ -352,8 +390,9 @@ config_param config_params[] = {
     },
     {
     "netcam_url",
-    "# URL to use if you are using a network camera, size will be autodetected (incl http:// ftp:// mjpg:// or file:///)\n"
-    "# Must be a URL that returns single jpeg pictures or a raw mjpeg stream. Default: Not defined",
+    "# URL to use if you are using a network camera, size will be autodetected (incl http:// ftp:// mjpg:// rtsp:// or file:///)\n"
+    "# Must be a URL that returns single jpeg pictures, a raw mjpeg stream or, with rtsp://,\n"
+    "# a video stream that decodes to YUV420P (e.g. H.264, requires ffmpeg). Default: Not defined",
     0,
     CONF_OFFSET(netcam_url),
     copy_string,
@@ -362,7 +401,8 @@ config_param config_params[] = {
     {
     "netcam_userpass",
     "# Username and password for network camera (only if required). Default: not defined\n"
-    "# Syntax is user:password",
+    "# Syntax is user:password\n"
+    "# Basic authentication is used, or Digest if the camera asks for it.",
     0,
     CONF_OFFSET(netcam_userpass),
     copy_string,
@@ -374,6 +414,7 @@ config_param config_params[] = {
     "# off:   The historical implementation using HTTP/1.0, closing the socket after each http request.\n"
     "# force: Use HTTP/1.0 requests with keep alive header to reuse the same connection.\n"
     "# on:    Use HTTP/1.1 requests that support keep alive as default.\n"
+    "#        Non-streaming cameras get the request for the next picture pipelined.\n"
     "# Default: off",
     0,
     CONF_OFFSET(netcam_keepalive),
@@ -399,6 +440,29 @@ config_param config_params[] = {
     copy_bool,
     print_bool
     },
+    {
+    "netcam_event_driven",
+    "# Let the arrival of frames from the network camera drive the main loop instead\n"
+    "# of pacing it with frame_limit. Motion never sleeps while a new frame is waiting,\n"
+    "# never runs detection twice on the same frame and the detection rate follows\n"
+    "# the measured frame rate of the camera. Default: off",
+    0,
+    CONF_OFFSET(netcam_event_driven),
+    copy_bool,
+    print_bool
+    },
+#ifdef HAVE_FFMPEG
+    {
+    "netcam_keyframes_only",
+    "# Only decode the key frames of an rtsp:// network camera stream and run the\n"
+    "# motion detection on those. Lowers the CPU load a lot, but motion is only\n"
+    "# detected at the key frame rate of the camera. Default: off",
+    0,
+    CONF_OFFSET(netcam_keyframes_only),
+    copy_bool,
+    print_bool
+    },
+#endif /* HAVE_FFMPEG */
     {
     "auto_brightness",
     "# Let motion regulate the brightness of a video device (default: off).\n"
@@ -512,6 +576,17 @@ config_param config_params[] = {
     print_bool
     },
     {
+    "detection_scale",
+    "# Detect motion on the picture scaled down by this factor in both directions,\n"
+    "# which saves CPU time on large pictures. Width and height must be multiples of\n"
+    "# twice the factor. threshold still counts pixels of the full picture.\n"
+    "# Valid range: 1 - 8 (default: 1 = full size)",
+    0,
+    CONF_OFFSET(detection_scale),
+    copy_int,
+    print_int
+    },
+    {
     "despeckle_filter",
     "# Despeckle motion image using (e)rode or (d)ilate or (l)abel (Default: not defined)\n"
     "# Recommended value is EedDl. Any combination (and number of) of E, e, d, and D is valid.\n"
@@ -553,6 +628,16 @@ config_param config_params[] = {
     print_int
     },
     {
+    "smart_mask_file",
+    "# File to keep the smart mask in, so it is not learned again after a restart.\n"
+    "# Written whenever the smart mask changes. Only used if smart_mask_speed is set\n"
+    "# at start. Use a different file for each camera, e.g. with %t (Default: not defined)",
+    0,
+    CONF_OFFSET(smart_mask_file),
+    copy_string,
+    print_string
+    },
+    {
     "lightswitch",
     "# Ignore sudden massive light intensity changes given as a percentage of the picture\n"
     "# area that changed intensity. If set to 1, motion will do some kind of\n"
@@ -586,6 +671,18 @@ config_param config_params[] = {
     print_int
     },
     {
+    "pre_capture_compressed",
+    "# Keep the pre-captured pictures as jpeg (at the quality given by the quality\n"
+    "# option) and decode them only when motion is detected. Uses a fraction of the\n"
+    "# memory, which allows large pre_capture values, but costs one jpeg compression\n"
+    "# per frame, done by the writer thread with output_queue. Only for YUV420P\n"
+    "# cameras. (default: off)",
+    0,
+    CONF_OFFSET(pre_capture_compressed),
+    copy_bool,
+    print_bool
+    },
+    {
     "post_capture",
     "# Number of frames to capture after motion is no longer detected (default: 0)",
     0,
@@ -664,6 +761,27 @@ config_param config_params[] = {
     copy_string,
     print_string
     },
+    {
+    "output_queue",
+    "# Number of pictures and movie frames that may wait to be written by a separate\n"
+    "# writer thread, so slow storage doesn't stall the capture and the detection.\n"
+    "# Every waiting picture or frame keeps a copy of the image in memory.\n"
+    "# 0 writes them from the motion loop itself (default: 0)",
+    0,
+    CONF_OFFSET(output_queue),
+    copy_int,
+    print_int
+    },
+    {
+    "output_queue_policy",
+    "# What to do when the output queue is full\n"
+    "# block: wait for the writer thread, drop: drop the new picture or movie frame\n"
+    "# (default: block)",
+    0,
+    CONF_OFFSET(output_queue_policy),
+    copy_string,
+    print_string
+    },
 #ifdef HAVE_FFMPEG
     {
     "ffmpeg_output_movies",
@@ -707,6 +825,26 @@ config_param config_params[] = {
     print_string
     },
     {
+    "ffmpeg_continuous",
+    "# Use ffmpeg to record the camera all the time into segments of this\n"
+    "# many seconds, kept in a ring of ffmpeg_continuous_segments files.\n"
+    "# The index file of the ring tells where in the segments motion was detected.\n"
+    "# Default value 0 = off",
+    0,
+    CONF_OFFSET(continuous),
+    copy_int,
+    print_int
+    },
+    {
+    "ffmpeg_continuous_segments",
+    "# Number of segments in the continuous recording ring, the oldest one\n"
+    "# is overwritten by the next (default: 1440, one day of 60 second segments)",
+    0,
+    CONF_OFFSET(continuous_segments),
+    copy_int,
+    print_int
+    },
+    {
     "ffmpeg_bps",
     "# Bitrate to be used by the ffmpeg encoder (default: 400000)\n"
     "# This option is ignored if ffmpeg_variable_bitrate is not 0 (disabled)",
@@ -739,13 +877,55 @@ config_param config_params[] = {
     "# flv - gives you a flash video with extension .flv\n"
     "# ffv1 - FF video codec 1 for Lossless Encoding ( experimental )\n"
     "# mov - QuickTime ( testing )\n"
-    "# ogg - Ogg/Theora ( testing )",
+    "# ogg - Ogg/Theora ( testing )\n"
+    "# copy - store the frames of a network camera as they are received,\n"
+    "# without encoding them again. Gives you files with extension .mkv\n"
+    "# Text, rotation and deinterlacing are not applied to these movies.\n"
+    "# For H.264 cameras pre_capture should cover one key frame interval.",
     0,
     CONF_OFFSET(ffmpeg_video_codec),
     copy_string,
     print_string
     },
     {
+    "ffmpeg_threads",
+    "# Number of threads used by the ffmpeg encoder (default: 1)\n"
+    "# 0 = one thread per processor. More threads let the codecs which support it\n"
+    "# encode slices or whole frames in parallel.",
+    0,
+    CONF_OFFSET(ffmpeg_threads),
+    copy_int,
+    print_int
+    },
+    {
+    "ffmpeg_gop",
+    "# Distance in frames between two key frames of the videos (default: 0)\n"
+    "# 0 = codec default, 10 for mpeg1 and 12 for the other codecs.\n"
+    "# Timelapse movies always use the codec default.",
+    0,
+    CONF_OFFSET(ffmpeg_gop),
+    copy_int,
+    print_int
+    },
+    {
+    "ffmpeg_preset",
+    "# Encoder preset, passed as is to the codecs which know it, like libx264\n"
+    "# (e.g. ultrafast, veryfast, medium). Default: not defined",
+    0,
+    CONF_OFFSET(ffmpeg_preset),
+    copy_string,
+    print_string
+    },
+    {
+    "ffmpeg_tune",
+    "# Encoder tuning, passed as is to the codecs which know it, like libx264\n"
+    "# (e.g. zerolatency, film). Default: not defined",
+    0,
+    CONF_OFFSET(ffmpeg_tune),
+    copy_string,
+    print_string
+    },
+    {
     "ffmpeg_deinterlace",
     "# Use ffmpeg to deinterlace video. Necessary if you use an analog camera\n"
     "# and see horizontal combing on moving objects in video or pictures.\n"
@@ -890,6 +1070,15 @@ config_param config_params[] = {
     print_bool
     },
     {
+    "text_scale",
+    "# Scale the characters drawn on images by this factor, 1 - 10. text_double\n"
+    "# is the same as 2. (default: 1)",
+    0,
+    CONF_OFFSET(text_scale),
+    copy_int,
+    print_int
+    },
+    {
     "exif_text",
     "# Text to include in a JPEG EXIF comment\n"
     "# May be any text, including conversion specifiers.\n"
@@ -975,6 +1164,17 @@ config_param config_params[] = {
     copy_string,
     print_string
     },
+    {
+    "continuous_path",
+    "# Directory of the continuous recording ring relative to target_dir\n"
+    "# Default: "DEF_CONTINUOUSPATH"\n"
+    "# Every camera needs its own directory. Conversion specifiers are\n"
+    "# expanded once, when the camera starts.",
+    0,
+    CONF_OFFSET(continuous_path),
+    copy_string,
+    print_string
+    },
 #endif /* HAVE_FFMPEG */
     {
     "ipv6_enabled",
@@ -1420,6 +1620,25 @@ config_param config_params[] = {
     print_string
     },
     {
+    "sql_queue",
+    "# Maximum number of rows waiting for the database. The rows are written by\n"
+    "# a database thread, many in one transaction. (default: 1000)",
+    0,
+    CONF_OFFSET(sql_queue),
+    copy_int,
+    print_int
+    },
+    {
+    "sql_spill_file",
+    "# File for the rows that don't fit in the queue or are still waiting when\n"
+    "# motion stops. They are written to the database when it has caught up.\n"
+    "# Use a different file for each camera, e.g. with %t (default: not defined)",
+    0,
+    CONF_OFFSET(sql_spill_file),
+    copy_string,
+    print_string
+    },
+    {
     "database_type",
     "\n############################################################\n"
     "# Database Options \n"
@@ -27,7 +27,9 @@ struct config {
     int height;
     int quality;
     int rotate_deg;
+    const char *flip_axis;
     int max_changes;
+    int detection_scale;
     int threshold_tune;
     const char *output_pictures;
     int motion_img;
@@ -44,6 +46,8 @@ struct config {
     int useextpipe; /* ext_pipe on or off */
     const char *extpipe; /* full Command-line for pipe -- must accept YUV420P images  */
     const char *picture_type;
+    int output_queue;
+    const char *output_queue_policy;
     int noise;
     int noise_tune;
     int minimum_frame_time;
@@ -56,6 +60,7 @@ struct config {
     int roundrobin_frames;
     int roundrobin_skip;
     int pre_capture;
+    int pre_capture_compressed;
     int post_capture;
     int switchfilter;
     int ffmpeg_output;
@@ -64,6 +69,10 @@ struct config {
     int ffmpeg_vbr;
     int ffmpeg_deinterlace;
     const char *ffmpeg_video_codec;
+    int ffmpeg_threads;
+    int ffmpeg_gop;
+    const char *ffmpeg_preset;
+    const char *ffmpeg_tune;
 #ifdef HAVE_SDL
     int sdl_threadnr;
 #endif
@@ -84,23 +93,30 @@ struct config {
     int tuner_number;
     int timelapse;
     const char *timelapse_mode;
+    int continuous;
+    int continuous_segments;
     const char *video_device;
     int v4l2_palette;
+    int mjpeg_decode_scale;
     const char *vidpipe;
     const char *filepath;
     const char *imagepath;
     const char *moviepath;
     const char *snappath;
     const char *timepath;
+    const char *continuous_path;
     char *on_event_start;
     char *on_event_end;
     const char *mask_file;
+    const char *smart_mask_file;
     int smart_mask_speed;
     int sql_log_image;
     int sql_log_snapshot;
     int sql_log_movie;
     int sql_log_timelapse;
     const char *sql_query;
+    int sql_queue;
+    const char *sql_spill_file;
     const char *database_type;
     const char *database_dbname;
     const char *database_host;
@@ -120,11 +136,14 @@ struct config {
     const char *netcam_keepalive;
     const char *netcam_proxy;
     unsigned int netcam_tolerant_check;
+    int netcam_event_driven;
+    int netcam_keyframes_only;
     int text_changes;
     const char *text_left;
     const char *text_right;
     const char *text_event;
     int text_double;
+    int text_scale;
     const char *despeckle_filter;
     const char *area_detect;
     int minimum_motion_frames;
@@ -0,0 +1,1366 @@
+/*
+ *    database.c
+ *
+ *    Logging of the created files to a database. event_sqlnewfile expands
+ *    the parameters of sql_query and queues them, a single database thread
+ *    writes the rows of all cameras with a prepared statement, as many as
+ *    are waiting in one transaction. Connecting, reconnecting and a slow
+ *    database server then no longer stall the capture. Rows that don't fit
+ *    in the queue go to the spill file (sql_spill_file) and are written
+ *    when the database has caught up.
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+
+#include "motion.h"
+#include "database.h"
+#include "writer.h"
+#include <ctype.h>
+
+#if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
+
+#ifdef HAVE_MYSQL
+#include <errmsg.h>
+#endif
+
+#define DATABASE_BATCH          256     /* max rows per transaction */
+#define DATABASE_RETRY          10      /* seconds between connection attempts */
+#define DATABASE_BUSY_TIMEOUT   5000    /* ms to wait for a locked sqlite3 database */
+#define DATABASE_STATEMENT      "motion_sql_query"
+
+#define DATABASE_OK             0
+#define DATABASE_FAILED         -1      /* the row was rejected */
+#define DATABASE_LOST           -2      /* try again once reconnected */
+
+/* A row: the values of the parameters, one after the other */
+struct database_job {
+    struct database_job *next;
+    int count;                      /* values */
+    char values[];                  /* count NUL terminated strings */
+};
+
+static pthread_mutex_t database_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t database_ready = PTHREAD_COND_INITIALIZER;   /* rows queued, camera stops */
+static pthread_cond_t database_done = PTHREAD_COND_INITIALIZER;    /* camera let go */
+static struct database *database_list;
+static pthread_t database_thread;
+static int database_running;
+static int database_exit;           /* set by the last camera that stops */
+
+static const char *database_name(int type)
+{
+    switch (type) {
+    case DATABASE_MYSQL:
+        return "MySQL";
+    case DATABASE_PGSQL:
+        return "PostgreSQL";
+    default:
+        return "SQLite3";
+    }
+}
+
+/**
+ * database_parse
+ *
+ *      Splits sql_query into the text of the statement and its parameters.
+ *      Every quoted literal with a conversion specifier in it becomes a
+ *      parameter, and so does every unquoted word with one, like %q in
+ *      values(%q, ...). The values then never need quoting and a file name
+ *      with a ' in it can't break the statement.
+ */
+static void database_parse(struct database *db, const char *query)
+{
+    char *text = mymalloc(strlen(query) + 1);
+    char *end = text;
+    const char *p = query, *q;
+    int i;
+
+    db->nparams = 0;
+
+    while (*p) {
+        if (*p == '\'' || *p == '"') {
+            /* Literal or quoted identifier, '' is an escaped quote */
+            for (q = p + 1; *q; q++) {
+                if (*q == *p) {
+                    if (q[1] != *p)
+                        break;
+                    q++;
+                }
+            }
+
+            /* Unterminated, up to the end */
+            if (!*q)
+                q--;
+        } else if (!isspace((unsigned char)*p) && !strchr(",();=", *p)) {
+            for (q = p; q[1] && !isspace((unsigned char)q[1]) && !strchr(",();='\"", q[1]); q++)
+                ;
+        } else {
+            *end++ = *p++;
+            continue;
+        }
+
+        /* p to q is a quoted literal or a word */
+        if (*p != '"' && memchr(p, '%', q - p + 1)) {
+            struct database_param *param;
+            char *format;
+
+            if (db->nparams == DATABASE_MAX_PARAMS)
+                break;
+
+            param = &db->param[db->nparams];
+            param->quoted = *p == '\'';
+            param->format = format = mymalloc(q - p + 2);
+
+            if (param->quoted) {
+                for (p++; p < q; p++) {
+                    if (*p == '\'')
+                        p++;
+                    *format++ = *p;
+                }
+            } else {
+                memcpy(format, p, q - p + 1);
+            }
+
+            *end = '\0';
+            db->text[db->nparams++] = mystrdup(text);
+            end = text;
+        } else {
+            memcpy(end, p, q - p + 1);
+            end += q - p + 1;
+        }
+
+        if (*q)
+            q++;
+
+        p = q;
+    }
+
+    *end = '\0';
+    db->text[db->nparams] = mystrdup(text);
+    free(text);
+
+    if (*p) {
+        MOTION_LOG(WRN, TYPE_DB, NO_ERRNO, "%s: sql_query has more than %d parameters,"
+                   " sending plain SQL", DATABASE_MAX_PARAMS);
+
+        for (i = 0; i <= db->nparams; i++) {
+            free(db->text[i]);
+            if (i < db->nparams)
+                free(db->param[i].format);
+        }
+
+        db->text[0] = mystrdup("");
+        db->text[1] = mystrdup("");
+        db->param[0].format = mystrdup(query);
+        db->param[0].quoted = 0;
+        db->nparams = 1;
+        db->plain = 1;
+    }
+}
+
+/**
+ * database_statement
+ *
+ *      Returns sql_query with placeholders for the parameters, to be freed
+ *      by the caller.
+ */
+static char *database_statement(struct database *db)
+{
+    size_t size = 1;
+    char *sql, *end;
+    int i;
+
+    for (i = 0; i <= db->nparams; i++)
+        size += strlen(db->text[i]) + 4;
+
+    end = sql = mymalloc(size);
+
+    for (i = 0; i <= db->nparams; i++) {
+        end += sprintf(end, "%s", db->text[i]);
+
+        if (i == db->nparams)
+            break;
+
+        if (db->type == DATABASE_PGSQL)
+            end += sprintf(end, "$%d", i + 1);
+        else
+            *end++ = '?';
+    }
+
+    *end = '\0';
+
+    return sql;
+}
+
+/**
+ * database_escape
+ *
+ *      Copies a value into a literal of plain SQL, 'to' must have room for
+ *      2 * strlen(from) + 1 bytes.
+ *
+ * Returns: the length of the escaped value
+ */
+static size_t database_escape(struct database *db, char *to, const char *from)
+{
+    char *start = to;
+
+#ifdef HAVE_MYSQL
+    if (db->type == DATABASE_MYSQL)
+        return mysql_real_escape_string(db->mysql, to, from, strlen(from));
+#endif
+#ifdef HAVE_PGSQL
+    if (db->type == DATABASE_PGSQL)
+        return PQescapeStringConn(db->pg, to, from, strlen(from), NULL);
+#endif
+
+    for (; *from; from++) {
+        if (*from == '\'')
+            *to++ = '\'';
+        *to++ = *from;
+    }
+
+    *to = '\0';
+
+    return to - start;
+}
+
+/**
+ * database_render
+ *
+ *      Returns sql_query with the values filled in, for a database that
+ *      can't prepare it, to be freed by the caller.
+ */
+static char *database_render(struct database *db, char **values)
+{
+    size_t size = 1;
+    char *sql, *end;
+    int i;
+
+    for (i = 0; i <= db->nparams; i++)
+        size += strlen(db->text[i]);
+
+    for (i = 0; i < db->nparams; i++)
+        size += 2 * strlen(values[i]) + 3;
+
+    end = sql = mymalloc(size);
+
+    for (i = 0; i <= db->nparams; i++) {
+        end += sprintf(end, "%s", db->text[i]);
+
+        if (i == db->nparams)
+            break;
+
+        if (db->param[i].quoted) {
+            *end++ = '\'';
+            end += database_escape(db, end, values[i]);
+            *end++ = '\'';
+        } else {
+            end += sprintf(end, "%s", values[i]);
+        }
+    }
+
+    *end = '\0';
+
+    return sql;
+}
+
+/**
+ * database_values
+ *
+ *      Points values at the values of a row.
+ *
+ * Returns: 0 on success, -1 if the row has the wrong number of values
+ */
+static int database_values(struct database *db, struct database_job *job, char **values)
+{
+    char *p = job->values;
+    int i;
+
+    if (job->count != db->nparams)
+        return -1;
+
+    for (i = 0; i < job->count; i++) {
+        values[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_MYSQL
+static int database_mysql_error(struct database *db, const char *sql, unsigned int error,
+                                const char *msg)
+{
+    /* Errors of the client library mean the connection is gone */
+    if (error >= CR_MIN_ERROR && error <= CR_MAX_ERROR) {
+        MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Lost the connection to the MySQL database"
+                   " %s: %s", db->cnt->conf.database_dbname, msg);
+        return DATABASE_LOST;
+    }
+
+    MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: MySQL query [%s] failed: %s (%u)", sql, msg, error);
+
+    return DATABASE_FAILED;
+}
+#endif /* HAVE_MYSQL */
+
+#ifdef HAVE_PGSQL
+static int database_pgsql_result(struct database *db, const char *sql, PGresult *res)
+{
+    ExecStatusType status = PQresultStatus(res);
+
+    PQclear(res);
+
+    if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK)
+        return DATABASE_OK;
+
+    if (PQstatus(db->pg) == CONNECTION_BAD) {
+        MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Lost the connection to the PostgreSQL"
+                   " database %s: %s", db->cnt->conf.database_dbname, PQerrorMessage(db->pg));
+        return DATABASE_LOST;
+    }
+
+    MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: PGSQL query [%s] failed: %s", sql,
+               PQerrorMessage(db->pg));
+
+    return DATABASE_FAILED;
+}
+#endif /* HAVE_PGSQL */
+
+#ifdef HAVE_SQLITE3
+static int database_sqlite3_error(struct database *db, const char *sql, int rc)
+{
+    /* Locked by another process for longer than the busy timeout */
+    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        MOTION_LOG(WRN, TYPE_DB, NO_ERRNO, "%s: SQLite database %s is locked, trying"
+                   " again later", db->cnt->conf.sqlite3_db);
+        return DATABASE_LOST;
+    }
+
+    MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: SQLite query [%s] failed: %s", sql,
+               sqlite3_errmsg(db->sqlite3));
+
+    return DATABASE_FAILED;
+}
+#endif /* HAVE_SQLITE3 */
+
+/**
+ * database_exec
+ *
+ *      Runs plain SQL.
+ *
+ * Returns: DATABASE_OK, DATABASE_FAILED or DATABASE_LOST
+ */
+static int database_exec(struct database *db, const char *sql)
+{
+    switch (db->type) {
+#ifdef HAVE_MYSQL
+    case DATABASE_MYSQL:
+        if (mysql_query(db->mysql, sql))
+            return database_mysql_error(db, sql, mysql_errno(db->mysql), mysql_error(db->mysql));
+        return DATABASE_OK;
+#endif
+#ifdef HAVE_PGSQL
+    case DATABASE_PGSQL:
+        return database_pgsql_result(db, sql, PQexec(db->pg, sql));
+#endif
+#ifdef HAVE_SQLITE3
+    case DATABASE_SQLITE3:
+    {
+        int rc = sqlite3_exec(db->sqlite3, sql, NULL, NULL, NULL);
+
+        if (rc != SQLITE_OK)
+            return database_sqlite3_error(db, sql, rc);
+        return DATABASE_OK;
+    }
+#endif
+    }
+
+    return DATABASE_FAILED;
+}
+
+/**
+ * database_row
+ *
+ *      Inserts a row with the prepared statement, or as plain SQL if the
+ *      statement could not be prepared.
+ *
+ * Returns: DATABASE_OK, DATABASE_FAILED or DATABASE_LOST
+ */
+static int database_row(struct database *db, struct database_job *job)
+{
+    char *values[DATABASE_MAX_PARAMS];
+    int rc;
+
+    if (database_values(db, job, values)) {
+        MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Spilled row with %d values doesn't fit"
+                   " sql_query, skipped", job->count);
+        return DATABASE_FAILED;
+    }
+
+    if (db->plain || !db->prepared) {
+        char *sql = database_render(db, values);
+
+        rc = database_exec(db, sql);
+        free(sql);
+        return rc;
+    }
+
+    switch (db->type) {
+#ifdef HAVE_MYSQL
+    case DATABASE_MYSQL:
+    {
+        MYSQL_BIND bind[DATABASE_MAX_PARAMS];
+        int i;
+
+        memset(bind, 0, sizeof(bind));
+
+        for (i = 0; i < db->nparams; i++) {
+            bind[i].buffer_type = MYSQL_TYPE_STRING;
+            bind[i].buffer = values[i];
+            bind[i].buffer_length = strlen(values[i]);
+        }
+
+        if (mysql_stmt_bind_param(db->mysql_stmt, bind) ||
+            mysql_stmt_execute(db->mysql_stmt))
+            return database_mysql_error(db, DATABASE_STATEMENT, mysql_stmt_errno(db->mysql_stmt),
+                                        mysql_stmt_error(db->mysql_stmt));
+        return DATABASE_OK;
+    }
+#endif
+#ifdef HAVE_PGSQL
+    case DATABASE_PGSQL:
+        return database_pgsql_result(db, DATABASE_STATEMENT,
+                                     PQexecPrepared(db->pg, DATABASE_STATEMENT, db->nparams,
+                                                    (const char * const *)values, NULL, NULL, 0));
+#endif
+#ifdef HAVE_SQLITE3
+    case DATABASE_SQLITE3:
+    {
+        int i;
+
+        for (i = 0; i < db->nparams; i++)
+            sqlite3_bind_text(db->sqlite3_stmt, i + 1, values[i], -1, SQLITE_STATIC);
+
+        rc = sqlite3_step(db->sqlite3_stmt);
+        sqlite3_reset(db->sqlite3_stmt);
+        sqlite3_clear_bindings(db->sqlite3_stmt);
+
+        if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+            return database_sqlite3_error(db, DATABASE_STATEMENT, rc);
+        return DATABASE_OK;
+    }
+#endif
+    }
+
+    return DATABASE_FAILED;
+}
+
+/**
+ * database_prepare
+ *
+ *      Prepares the statement for a new connection. If the database can't
+ *      prepare it we go on with plain SQL.
+ */
+static void database_prepare(struct database *db)
+{
+    const char *error = NULL;
+    char *sql;
+
+    db->prepared = 0;
+
+    if (db->plain)
+        return;
+
+    sql = database_statement(db);
+
+    switch (db->type) {
+#ifdef HAVE_MYSQL
+    case DATABASE_MYSQL:
+        if (!(db->mysql_stmt = mysql_stmt_init(db->mysql))) {
+            error = mysql_error(db->mysql);
+        } else if (mysql_stmt_prepare(db->mysql_stmt, sql, strlen(sql))) {
+            error = mysql_stmt_error(db->mysql_stmt);
+        } else if (mysql_stmt_param_count(db->mysql_stmt) != (unsigned long)db->nparams) {
+            error = "wrong number of parameters";
+        } else {
+            db->prepared = 1;
+        }
+        break;
+#endif
+#ifdef HAVE_PGSQL
+    case DATABASE_PGSQL:
+    {
+        PGresult *res = PQprepare(db->pg, DATABASE_STATEMENT, sql, db->nparams, NULL);
+
+        if (PQresultStatus(res) == PGRES_COMMAND_OK)
+            db->prepared = 1;
+        else
+            error = PQerrorMessage(db->pg);
+
+        PQclear(res);
+        break;
+    }
+#endif
+#ifdef HAVE_SQLITE3
+    case DATABASE_SQLITE3:
+        if (sqlite3_prepare_v2(db->sqlite3, sql, -1, &db->sqlite3_stmt, NULL) != SQLITE_OK)
+            error = sqlite3_errmsg(db->sqlite3);
+        else if (sqlite3_bind_parameter_count(db->sqlite3_stmt) != db->nparams)
+            error = "wrong number of parameters";
+        else
+            db->prepared = 1;
+        break;
+#endif
+    }
+
+    if (!db->prepared) {
+        MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Can't prepare [%s]: %s - sending plain SQL",
+                   sql, error ? error : "unknown error");
+        db->plain = 1;
+    }
+
+    free(sql);
+}
+
+/**
+ * database_disconnect
+ *
+ *      Closes the connection, the statement goes with it.
+ */
+static void database_disconnect(struct database *db)
+{
+#ifdef HAVE_MYSQL
+    if (db->mysql_stmt) {
+        mysql_stmt_close(db->mysql_stmt);
+        db->mysql_stmt = NULL;
+    }
+
+    if (db->mysql) {
+        mysql_close(db->mysql);
+        db->mysql = NULL;
+    }
+#endif
+#ifdef HAVE_PGSQL
+    if (db->pg) {
+        PQfinish(db->pg);
+        db->pg = NULL;
+    }
+#endif
+#ifdef HAVE_SQLITE3
+    if (db->sqlite3_stmt) {
+        sqlite3_finalize(db->sqlite3_stmt);
+        db->sqlite3_stmt = NULL;
+    }
+
+    if (db->sqlite3) {
+        sqlite3_close(db->sqlite3);
+        db->sqlite3 = NULL;
+    }
+#endif
+
+    db->connected = 0;
+    db->prepared = 0;
+}
+
+/**
+ * database_connect
+ *
+ *      Connects to the database of the camera and prepares the statement.
+ *      SQLite3 databases are switched to WAL mode, so that the commits
+ *      don't wait for the readers and only sync the log.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int database_connect(struct database *db)
+{
+    struct context *cnt = db->cnt;
+
+    switch (db->type) {
+#ifdef HAVE_MYSQL
+    case DATABASE_MYSQL:
+        db->mysql = mysql_init(NULL);
+
+        if (!db->mysql || !mysql_real_connect(db->mysql, cnt->conf.database_host,
+                cnt->conf.database_user, cnt->conf.database_password,
+                cnt->conf.database_dbname, cnt->conf.database_port, NULL, 0)) {
+            MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Cannot connect to MySQL database %s on"
+                       " host %s with user %s: %s", cnt->conf.database_dbname,
+                       cnt->conf.database_host, cnt->conf.database_user,
+                       db->mysql ? mysql_error(db->mysql) : "out of memory");
+            database_disconnect(db);
+            return -1;
+        }
+        break;
+#endif
+#ifdef HAVE_PGSQL
+    case DATABASE_PGSQL:
+    {
+        char connstring[255];
+
+        /*
+         * Create the connection string.
+         * Quote the values so we can have null values (blank)
+         */
+        snprintf(connstring, 255,
+                 "dbname='%s' host='%s' user='%s' password='%s' port='%d'",
+                  cnt->conf.database_dbname, /* dbname */
+                  (cnt->conf.database_host ? cnt->conf.database_host : ""), /* host (may be blank) */
+                  (cnt->conf.database_user ? cnt->conf.database_user : ""), /* user (may be blank) */
+                  (cnt->conf.database_password ? cnt->conf.database_password : ""), /* password (may be blank) */
+                  cnt->conf.database_port
+        );
+
+        db->pg = PQconnectdb(connstring);
+
+        if (PQstatus(db->pg) == CONNECTION_BAD) {
+            MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Connection to PostgreSQL database '%s'"
+                       " failed: %s", cnt->conf.database_dbname, PQerrorMessage(db->pg));
+            database_disconnect(db);
+            return -1;
+        }
+        break;
+    }
+#endif
+#ifdef HAVE_SQLITE3
+    case DATABASE_SQLITE3:
+    {
+        char *errmsg = NULL;
+
+        if (sqlite3_open(cnt->conf.sqlite3_db, &db->sqlite3) != SQLITE_OK) {
+            MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Can't open database %s: %s",
+                       cnt->conf.sqlite3_db, sqlite3_errmsg(db->sqlite3));
+            database_disconnect(db);
+            return -1;
+        }
+
+        sqlite3_busy_timeout(db->sqlite3, DATABASE_BUSY_TIMEOUT);
+
+        if (sqlite3_exec(db->sqlite3, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL",
+                         NULL, NULL, &errmsg) != SQLITE_OK) {
+            MOTION_LOG(WRN, TYPE_DB, NO_ERRNO, "%s: Can't switch %s to WAL mode: %s",
+                       cnt->conf.sqlite3_db, errmsg);
+            sqlite3_free(errmsg);
+        }
+        break;
+    }
+#endif
+    }
+
+    db->connected = 1;
+    database_prepare(db);
+
+    MOTION_LOG(NTC, TYPE_DB, NO_ERRNO, "%s: Connected to the %s database", database_name(db->type));
+
+    return 0;
+}
+
+/**
+ * database_batch
+ *
+ *      Writes a list of rows in one transaction. If a row is rejected, the
+ *      transaction is rolled back and the rows are written one by one, so
+ *      only the bad ones are lost.
+ *
+ * Returns: the number of rows done with, written or rejected. The others
+ *          have to be written again once reconnected.
+ */
+static int database_batch(struct database *db, struct database_job *head, int count)
+{
+    struct database_job *job;
+    int i, rc = DATABASE_OK;
+
+    if (count > 1) {
+        if ((rc = database_exec(db, "BEGIN")) == DATABASE_LOST)
+            return 0;
+
+        for (job = head; job && rc == DATABASE_OK; job = job->next)
+            rc = database_row(db, job);
+
+        if (rc == DATABASE_OK)
+            rc = database_exec(db, "COMMIT");
+
+        if (rc == DATABASE_OK) {
+            db->written += count;
+            db->batches++;
+            return count;
+        }
+
+        if (rc == DATABASE_LOST || database_exec(db, "ROLLBACK") == DATABASE_LOST)
+            return 0;
+    }
+
+    for (job = head, i = 0; job; job = job->next, i++) {
+        if ((rc = database_row(db, job)) == DATABASE_LOST)
+            return i;
+
+        if (rc == DATABASE_OK)
+            db->written++;
+        else
+            db->failed++;
+
+        db->batches++;
+    }
+
+    return count;
+}
+
+/**
+ * database_write_row
+ *
+ *      Appends a row to a spill file: the values separated by tabs, with
+ *      backslash escapes for tabs, newlines and backslashes.
+ */
+static void database_write_row(FILE *file, struct database_job *job)
+{
+    const char *p = job->values;
+    int i;
+
+    for (i = 0; i < job->count; i++, p++) {
+        if (i)
+            fputc('\t', file);
+
+        for (; *p; p++) {
+            if (*p == '\\')
+                fputs("\\\\", file);
+            else if (*p == '\t')
+                fputs("\\t", file);
+            else if (*p == '\n')
+                fputs("\\n", file);
+            else
+                fputc(*p, file);
+        }
+    }
+
+    fputc('\n', file);
+}
+
+/**
+ * database_read_row
+ *
+ *      Makes a row of a line of a spill file.
+ */
+static struct database_job *database_read_row(const char *line)
+{
+    struct database_job *job = mymalloc(sizeof(struct database_job) + strlen(line) + 1);
+    char *to = job->values;
+
+    job->count = 1;
+
+    for (; *line && *line != '\n'; line++) {
+        if (*line == '\t') {
+            *to++ = '\0';
+            job->count++;
+        } else if (*line == '\\' && line[1]) {
+            line++;
+            *to++ = *line == 't' ? '\t' : *line == 'n' ? '\n' : *line;
+        } else {
+            *to++ = *line;
+        }
+    }
+
+    *to = '\0';
+
+    return job;
+}
+
+/**
+ * database_drop
+ *
+ *      Counts a row that could neither be queued nor spilled.
+ *      Must be called with the database mutex locked.
+ */
+static void database_drop(struct database *db)
+{
+    db->dropped++;
+
+    if (db->drop_burst++ == 0)
+        MOTION_LOG(WRN, TYPE_DB, NO_ERRNO, "%s: Database queue full (%d), dropping rows",
+                   db->size);
+}
+
+/**
+ * database_spill
+ *
+ *      Appends the rows handed over by database_put to the spill file. The
+ *      file is written by the database thread and without the database
+ *      mutex, so that a slow disk doesn't hold up motion_loop. Must be
+ *      called with the database mutex locked, which is released meanwhile.
+ */
+static void database_spill(struct database *db)
+{
+    struct database_job *head = db->spill_head, *job;
+    FILE *file;
+    int count = 0, dropped = 0;
+
+    if (!head)
+        return;
+
+    db->spill_head = db->spill_tail = NULL;
+    db->spill_depth = 0;
+
+    pthread_mutex_unlock(&database_mutex);
+
+    file = myfopen(db->spill, "a", 0);
+
+    while ((job = head) != NULL) {
+        head = job->next;
+
+        if (file) {
+            database_write_row(file, job);
+            count++;
+        } else {
+            dropped++;
+        }
+
+        free(job);
+    }
+
+    if (file)
+        myfclose(file);
+
+    pthread_mutex_lock(&database_mutex);
+
+    if (count) {
+        db->spilled += count;
+        db->spill_pending = 1;
+    }
+
+    while (dropped--)
+        database_drop(db);
+}
+
+/**
+ * database_replay_keep
+ *
+ *      Stops replaying the spill file. The rows of the list and the ones
+ *      not read yet are kept in the .replay file for the next time.
+ */
+static void database_replay_keep(struct database *db, struct database_job *head)
+{
+    char name[PATH_MAX], tmp[PATH_MAX];
+    char buffer[4096];
+    size_t len;
+    FILE *file;
+
+    if ((size_t)snprintf(name, sizeof(name), "%s.replay", db->spill) >= sizeof(name) ||
+        (size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", name) >= sizeof(tmp)) {
+        MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Name of %s is too long, rows already"
+                   " written from it will be written again", db->spill);
+    } else if ((file = fopen(tmp, "w"))) {
+        for (; head; head = head->next)
+            database_write_row(file, head);
+
+        while ((len = fread(buffer, 1, sizeof(buffer), db->replay)) > 0)
+            fwrite(buffer, 1, len, file);
+
+        if (fclose(file) == 0)
+            rename(tmp, name);
+        else
+            unlink(tmp);
+    } else {
+        MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO, "%s: Can't write %s, rows already written"
+                   " from %s will be written again", tmp, name);
+    }
+
+    fclose(db->replay);
+    db->replay = NULL;
+}
+
+/**
+ * database_replay
+ *
+ *      Writes the next batch of rows of the spill file. The spill file is
+ *      renamed to <sql_spill_file>.replay first, so that rows can be spilled
+ *      meanwhile.
+ *
+ * Returns: 0 on success, -1 if the connection was lost
+ */
+static int database_replay(struct database *db)
+{
+    struct database_job *head = NULL, **tail = &head, *job;
+    char name[PATH_MAX];
+    char *line = NULL;
+    size_t size = 0;
+    int count = 0, done;
+
+    snprintf(name, sizeof(name), "%s.replay", db->spill);
+
+    if (!db->replay) {
+        pthread_mutex_lock(&database_mutex);
+
+        if (access(name, F_OK) && rename(db->spill, name)) {
+            db->spill_pending = 0;
+            pthread_mutex_unlock(&database_mutex);
+            return 0;
+        }
+
+        pthread_mutex_unlock(&database_mutex);
+
+        if (!(db->replay = fopen(name, "r"))) {
+            MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO, "%s: Can't read spilled rows from %s", name);
+            pthread_mutex_lock(&database_mutex);
+            db->spill_pending = 0;
+            pthread_mutex_unlock(&database_mutex);
+            return 0;
+        }
+
+        MOTION_LOG(NTC, TYPE_DB, NO_ERRNO, "%s: Writing the spilled rows of %s", name);
+    }
+
+    while (count < DATABASE_BATCH && getline(&line, &size, db->replay) > 0) {
+        *tail = job = database_read_row(line);
+        tail = &job->next;
+        count++;
+    }
+
+    free(line);
+
+    if (count == 0) {
+        fclose(db->replay);
+        db->replay = NULL;
+        unlink(name);
+
+        MOTION_LOG(NTC, TYPE_DB, NO_ERRNO, "%s: All spilled rows of %s written", name);
+
+        /* More rows may have been spilled meanwhile */
+        pthread_mutex_lock(&database_mutex);
+        if (access(db->spill, F_OK))
+            db->spill_pending = 0;
+        pthread_mutex_unlock(&database_mutex);
+
+        return 0;
+    }
+
+    for (done = database_batch(db, head, count); done > 0; done--) {
+        job = head;
+        head = job->next;
+        free(job);
+    }
+
+    if (head) {
+        database_replay_keep(db, head);
+
+        while ((job = head) != NULL) {
+            head = job->next;
+            free(job);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * database_serve
+ *
+ *      Does the next piece of work for a camera: (re)connecting, writing a
+ *      batch of queued rows or else a batch of spilled rows. Must be called
+ *      with the database mutex locked, which is released meanwhile.
+ *
+ * Returns: 1 if there may be more to do right away, 0 if not
+ */
+static int database_serve(struct database *db)
+{
+    struct database_job *head, *job;
+    int count, done, rc;
+
+    if (!db->head && !db->spill_pending)
+        return 0;
+
+    if (!db->connected) {
+        /* A camera that stops gets one more attempt */
+        if (time(NULL) < db->retry && !db->stop)
+            return 0;
+
+        pthread_mutex_unlock(&database_mutex);
+        rc = database_connect(db);
+        pthread_mutex_lock(&database_mutex);
+
+        if (rc) {
+            db->retry = time(NULL) + DATABASE_RETRY;
+            return 0;
+        }
+    }
+
+    if (db->head) {
+        /* Take a batch off the queue, motion_loop keeps appending meanwhile */
+        head = job = db->head;
+
+        for (count = 1; count < DATABASE_BATCH && job->next; count++)
+            job = job->next;
+
+        if ((db->head = job->next) == NULL)
+            db->tail = NULL;
+
+        job->next = NULL;
+
+        pthread_mutex_unlock(&database_mutex);
+
+        for (done = rc = database_batch(db, head, count); done > 0; done--) {
+            job = head;
+            head = job->next;
+            free(job);
+        }
+
+        pthread_mutex_lock(&database_mutex);
+
+        db->depth -= rc;
+
+        /* Put back what wasn't written */
+        if (head) {
+            for (job = head; job->next; job = job->next)
+                ;
+
+            if ((job->next = db->head) == NULL)
+                db->tail = job;
+
+            db->head = head;
+        }
+    } else {
+        pthread_mutex_unlock(&database_mutex);
+        rc = database_replay(db);
+        pthread_mutex_lock(&database_mutex);
+
+        head = rc ? db->head : NULL;
+    }
+
+    if (head) {
+        pthread_mutex_unlock(&database_mutex);
+        database_disconnect(db);
+        pthread_mutex_lock(&database_mutex);
+        /* Reconnect right away, back off if that fails */
+        db->retry = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * database_finish
+ *
+ *      Lets go of a camera that stops. The rows still waiting are spilled,
+ *      or dropped if there is no spill file. Must be called with the
+ *      database mutex locked.
+ */
+static void database_finish(struct database *db)
+{
+    struct database **prev;
+    struct database_job *job;
+
+    /* The queued rows are older than the ones already waiting to be spilled */
+    if (db->head && db->spill) {
+        if ((db->tail->next = db->spill_head) == NULL)
+            db->spill_tail = db->tail;
+
+        db->spill_head = db->head;
+    } else {
+        while ((job = db->head) != NULL) {
+            db->head = job->next;
+            database_drop(db);
+            free(job);
+        }
+    }
+
+    db->head = db->tail = NULL;
+    db->depth = 0;
+
+    database_spill(db);
+
+    pthread_mutex_unlock(&database_mutex);
+
+    if (db->replay)
+        database_replay_keep(db, NULL);
+
+    database_disconnect(db);
+
+    pthread_mutex_lock(&database_mutex);
+
+    for (prev = &database_list; *prev != db; prev = &(*prev)->next)
+        ;
+
+    *prev = db->next;
+    db->stop = 2;
+
+    pthread_cond_broadcast(&database_done);
+}
+
+/**
+ * database_loop
+ *
+ *      The database thread, shared by all cameras. Writes a batch of rows
+ *      for each camera in turn, and sleeps when there is nothing to do or
+ *      the databases are waiting to be reconnected. Ends when the last
+ *      camera has stopped, see database_stop.
+ */
+static void *database_loop(void *arg ATTRIBUTE_UNUSED)
+{
+    struct database *db, *next;
+    struct timespec wakeup;
+    int busy;
+
+    pthread_mutex_lock(&database_mutex);
+
+    while (!database_exit) {
+        busy = 0;
+
+        for (db = database_list; db; db = next) {
+            pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)db->cnt->threadnr));
+
+            database_spill(db);
+
+            if (database_serve(db))
+                busy = 1;
+
+            next = db->next;
+
+            if (db->stop && (!db->head || !db->connected))
+                database_finish(db);
+        }
+
+        if (!busy) {
+            clock_gettime(CLOCK_REALTIME, &wakeup);
+            wakeup.tv_sec++;
+            pthread_cond_timedwait(&database_ready, &database_mutex, &wakeup);
+        }
+    }
+
+    pthread_mutex_unlock(&database_mutex);
+
+    return NULL;
+}
+
+/**
+ * database_free
+ *
+ *      Frees the statement and the spill file name of a camera with it.
+ */
+static void database_free(struct database *db)
+{
+    int i;
+
+    for (i = 0; i <= db->nparams; i++) {
+        free(db->text[i]);
+        if (i < db->nparams)
+            free(db->param[i].format);
+    }
+
+    free(db->spill);
+    free(db);
+}
+
+/**
+ * database_start
+ *
+ *      Sets up the logging of a camera to the database set by database_type,
+ *      and starts the database thread if it isn't running yet. The camera
+ *      is connected by the database thread.
+ *
+ * Returns: 0 on success (or no database), -1 on error
+ */
+int database_start(struct context *cnt)
+{
+    struct database *db;
+    const char *type = cnt->conf.database_type;
+    char tmp[PATH_MAX];
+    int dbtype = 0;
+
+    if (!type || !cnt->conf.sql_query)
+        return 0;
+
+#ifdef HAVE_MYSQL
+    if (!strcmp(type, "mysql") && cnt->conf.database_dbname)
+        dbtype = DATABASE_MYSQL;
+#endif
+#ifdef HAVE_PGSQL
+    if (!strcmp(type, "postgresql") && cnt->conf.database_dbname)
+        dbtype = DATABASE_PGSQL;
+#endif
+#ifdef HAVE_SQLITE3
+    if (!strcmp(type, "sqlite3") && cnt->conf.sqlite3_db)
+        dbtype = DATABASE_SQLITE3;
+#endif
+
+    if (!dbtype) {
+        MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Database type %s is not supported or no"
+                   " database is set", type);
+        return -1;
+    }
+
+    db = mymalloc(sizeof(struct database));
+    db->cnt = cnt;
+    db->type = dbtype;
+    db->size = cnt->conf.sql_queue > 0 ? cnt->conf.sql_queue : 1;
+
+    database_parse(db, cnt->conf.sql_query);
+
+    if (cnt->conf.sql_spill_file) {
+        mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.sql_spill_file, cnt->currenttime_tm,
+                   NULL, 0);
+        db->spill = mystrdup(tmp);
+
+        snprintf(tmp, sizeof(tmp), "%s.replay", db->spill);
+        db->spill_pending = !access(db->spill, F_OK) || !access(tmp, F_OK);
+    }
+
+    pthread_mutex_lock(&database_mutex);
+
+    /* The last camera is still stopping the thread */
+    while (database_exit)
+        pthread_cond_wait(&database_done, &database_mutex);
+
+    if (!database_running &&
+        pthread_create(&database_thread, NULL, &database_loop, NULL) == 0)
+        database_running = 1;
+
+    if (!database_running) {
+        pthread_mutex_unlock(&database_mutex);
+        MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO, "%s: Could not start the database thread");
+        database_free(db);
+        return -1;
+    }
+
+    db->next = database_list;
+    database_list = db;
+    cnt->database = db;
+
+    pthread_cond_signal(&database_ready);
+    pthread_mutex_unlock(&database_mutex);
+
+    MOTION_LOG(NTC, TYPE_DB, NO_ERRNO, "%s: Logging to the %s database through a queue"
+               " of %d rows, %d parameters", database_name(db->type), db->size, db->nparams);
+
+    return 0;
+}
+
+/**
+ * database_stop
+ *
+ *      Waits for the database thread to write the rows of the camera, if
+ *      the database can take them, and reports the statistics of the queue.
+ *      The last camera to stop also stops the database thread.
+ */
+void database_stop(struct context *cnt)
+{
+    struct database *db = cnt->database;
+
+    if (!db)
+        return;
+
+    pthread_mutex_lock(&database_mutex);
+
+    db->stop = 1;
+    pthread_cond_signal(&database_ready);
+
+    while (db->stop != 2)
+        pthread_cond_wait(&database_done, &database_mutex);
+
+    if (!database_list) {
+        database_exit = 1;
+        pthread_cond_signal(&database_ready);
+        pthread_mutex_unlock(&database_mutex);
+
+        pthread_join(database_thread, NULL);
+
+        pthread_mutex_lock(&database_mutex);
+        database_exit = 0;
+        database_running = 0;
+        pthread_cond_broadcast(&database_done);
+    }
+
+    pthread_mutex_unlock(&database_mutex);
+
+    cnt->database = NULL;
+
+    MOTION_LOG(NTC, TYPE_DB, NO_ERRNO, "%s: Database queue: %lu rows, %lu written in %lu"
+               " transactions, %lu failed, %lu spilled, %lu dropped", db->queued, db->written,
+               db->batches, db->failed, db->spilled, db->dropped);
+
+    database_free(db);
+}
+
+/**
+ * database_put
+ *
+ *      Queues a row for a created file. The values of the parameters are
+ *      expanded right away, for the current image, or for the stamp of the
+ *      job when called by the writer thread.
+ *
+ * Parameters:
+ *
+ *      cnt         current thread's context struct
+ *      filename    the file, for %f
+ *      sqltype     its FTYPE_*, for %n
+ */
+void database_put(struct context *cnt, const char *filename, int sqltype)
+{
+    const struct image_stamp *stamp = writer_stamp(cnt);
+    struct database *db = cnt->database;
+    struct database_job *job;
+    char value[PATH_MAX];
+    size_t size = 0, len;
+    int i;
+
+    job = mymalloc(sizeof(struct database_job));
+
+    for (i = 0; i < db->nparams; i++) {
+        if (stamp)
+            len = mystrftime_stamped(cnt, stamp, value, sizeof(value), db->param[i].format,
+                                     &stamp->timestamp_tm, filename, sqltype) + 1;
+        else
+            len = mystrftime(cnt, value, sizeof(value), db->param[i].format,
+                             &cnt->current_image->timestamp_tm, filename, sqltype) + 1;
+        job = myrealloc(job, sizeof(struct database_job) + size + len, "database_put");
+        memcpy(job->values + size, value, len);
+        size += len;
+    }
+
+    job->next = NULL;
+    job->count = db->nparams;
+
+    pthread_mutex_lock(&database_mutex);
+
+    db->queued++;
+
+    if (db->depth >= db->size) {
+        /* The database thread writes the spill file, up to sql_queue rows wait for it */
+        if (db->spill && db->spill_depth < db->size) {
+            if (db->spill_tail)
+                db->spill_tail->next = job;
+            else
+                db->spill_head = job;
+
+            db->spill_tail = job;
+            db->spill_depth++;
+
+            pthread_cond_signal(&database_ready);
+        } else {
+            database_drop(db);
+            free(job);
+        }
+    } else {
+        if (db->drop_burst) {
+            MOTION_LOG(NTC, TYPE_DB, NO_ERRNO, "%s: Database queue has room again, %lu"
+                       " rows were dropped", db->drop_burst);
+            db->drop_burst = 0;
+        }
+
+        if (db->tail)
+            db->tail->next = job;
+        else
+            db->head = job;
+
+        db->tail = job;
+        db->depth++;
+
+        pthread_cond_signal(&database_ready);
+    }
+
+    pthread_mutex_unlock(&database_mutex);
+}
+
+#endif /* HAVE_MYSQL || HAVE_PGSQL || HAVE_SQLITE3 */
@@ -0,0 +1,96 @@
+/*
+ *    database.h
+ *
+ *    Include file for database.c
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+#ifndef _INCLUDE_DATABASE_H_
+#define _INCLUDE_DATABASE_H_
+
+#include "motion.h"
+
+#if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
+
+#define DATABASE_MYSQL          1
+#define DATABASE_PGSQL          2
+#define DATABASE_SQLITE3        3
+
+#define DATABASE_MAX_PARAMS     32  /* placeholders in the statement */
+
+/*
+ * A parameter of the statement: a quoted literal or an unquoted word of
+ * sql_query with conversion specifiers in it. The parameter value is the
+ * format expanded by mystrftime when the file is created.
+ */
+struct database_param {
+    char *format;
+    int quoted;                     /* was a literal, quote it in plain SQL */
+};
+
+struct database_job;
+
+/* Database connection and queue of a camera, served by the database thread */
+struct database {
+    struct database *next;          /* list of the cameras logging to a database */
+    struct context *cnt;
+    int type;                       /* DATABASE_* */
+
+    /*
+     * sql_query split at the parameters: text[0] param[0] text[1] ...
+     * text[nparams]. Without any parameters, or too many, the whole query
+     * is the only parameter and there is no statement to prepare.
+     */
+    char *text[DATABASE_MAX_PARAMS + 1];
+    struct database_param param[DATABASE_MAX_PARAMS];
+    int nparams;
+    int plain;                      /* run as plain SQL, not prepared */
+
+    /* Protected by the database mutex */
+    struct database_job *head;      /* rows, oldest first */
+    struct database_job *tail;
+    int size;                       /* max rows waiting */
+    int depth;                      /* rows waiting or being written */
+    int stop;                       /* database_stop waits for the thread */
+    char *spill;                    /* sql_spill_file, NULL if none */
+    struct database_job *spill_head; /* rows for the spill file, oldest first */
+    struct database_job *spill_tail;
+    int spill_depth;                /* rows waiting for the spill file */
+    int spill_pending;              /* rows in the spill file */
+
+    /* Only used by the database thread */
+    int connected;
+    time_t retry;                   /* next connection attempt */
+    int prepared;
+    FILE *replay;                   /* spill file being written to the database */
+#ifdef HAVE_MYSQL
+    MYSQL *mysql;
+    MYSQL_STMT *mysql_stmt;
+#endif
+#ifdef HAVE_PGSQL
+    PGconn *pg;
+#endif
+#ifdef HAVE_SQLITE3
+    sqlite3 *sqlite3;
+    sqlite3_stmt *sqlite3_stmt;
+#endif
+
+    /* Statistics, reported when the camera stops */
+    unsigned long queued;
+    unsigned long written;
+    unsigned long failed;
+    unsigned long spilled;
+    unsigned long dropped;
+    unsigned long batches;
+    unsigned long drop_burst;       /* rows dropped since the last queued one */
+};
+
+int database_start(struct context *);
+void database_stop(struct context *);
+void database_put(struct context *, const char *, int);
+
+#endif /* HAVE_MYSQL || HAVE_PGSQL || HAVE_SQLITE3 */
+
+#endif /* _INCLUDE_DATABASE_H_ */
@@ -12,23 +12,26 @@
 #include <ctype.h>
 #include "motion.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* Highest ascii value is 126 (~) */
 #define ASCII_MAX 127
 
-unsigned char *small_char_arr_ptr[ASCII_MAX];
+/* Character cell at scale 1: 7x8 pixels, 6 pixels apart, lines 9 pixels apart */
+#define GLYPH_WIDTH     7
+#define GLYPH_HEIGHT    8
+#define GLYPH_ADVANCE   6
+#define LINE_SPACE      9
 
-unsigned char *big_char_arr_ptr[ASCII_MAX];
+unsigned char *char_arr_ptr[ASCII_MAX];
 
 struct draw_char {
     unsigned char ascii;
     unsigned char pix[8][7];
 };
 
-struct big_char {
-    unsigned char ascii;
-    unsigned char pix[16][14];
-};
-
 struct draw_char draw_table[]= {
     {
         ' ',
@@ -1072,97 +1075,278 @@ struct draw_char draw_table[]= {
     }
 };
 
-struct big_char big_table[sizeof(draw_table) / sizeof(struct draw_char)];
-
 #define NEWLINE "\\n"
+
+/* A line of the text being rendered */
+struct text_line {
+    const char *text;
+    int len;
+    int x, y;                   /* top left corner in the image */
+};
+
 /**
- * draw_textn
+ * text_lines
+ *
+ *      Splits the text at the NEWLINE sequences, places the lines like
+ *      draw_text does and drops the characters not fitting in the image
+ *      width. Called twice, with lines NULL to count the lines first.
+ *
+ * Returns: number of lines
  */
-static int draw_textn(unsigned char *image, unsigned int startx, unsigned int starty, unsigned int width, const char *text, int len, unsigned int factor)
+static int text_lines(struct text_line *lines, int startx, int starty, int width,
+                      const char *text, int scale)
 {
-    int pos, x, y, line_offset, next_char_offs;
-    unsigned char *image_ptr, *char_ptr, **char_arr_ptr;
+    const int advance = GLYPH_ADVANCE * scale;
+    const char *begin, *end;
+    int num_nl = 0, n = 0;
 
-    if (startx > width / 2)
-        startx -= len * (6 * (factor + 1));
+    for (end = text; (end = strstr(end, NEWLINE)); end += sizeof(NEWLINE) - 1)
+        num_nl++;
+
+    if (!lines)
+        return num_nl + 1;
+
+    /* Scroll the text up the image by the number of newlines. */
+    starty -= LINE_SPACE * scale * num_nl;
+
+    for (begin = text; n <= num_nl; n++) {
+        struct text_line *line = &lines[n];
+        int skip;
+
+        end = strstr(begin, NEWLINE);
+        line->text = begin;
+        line->len = end ? end - begin : (int)strlen(begin);
+        line->x = startx;
+        line->y = starty + LINE_SPACE * scale * n;
 
-    if (startx + len * 6 * (factor + 1) >= width)
-        len = (width-startx-1)/(6*(factor+1));
+        /* Text right of the middle is right aligned. */
+        if (startx > width / 2)
+            line->x -= line->len * advance;
+
+        /* Drop the characters starting left of the image... */
+        if (line->x < 0) {
+            skip = (-line->x + advance - 1) / advance;
+            if (skip > line->len)
+                skip = line->len;
+            line->text += skip;
+            line->len -= skip;
+            line->x += skip * advance;
+        }
+
+        /* ...and those not ending before its right edge. */
+        if (line->x + line->len * advance >= width)
+            line->len = line->x < width ? (width - line->x - 1) / advance : 0;
+
+        if (end)
+            begin = end + sizeof(NEWLINE) - 1;
+    }
 
-    line_offset = width - 7 * (factor + 1);
-    next_char_offs = width * 8 * (factor + 1) - 6 * (factor + 1);
+    return n;
+}
+
+/**
+ * text_overlay_render
+ *
+ *      Renders the text into the masks of the overlay. The overlay covers
+ *      the part of the image the text is drawn on: keep is 0 where a
+ *      character pixel is, set is 255 where it is white.
+ *
+ * Returns: 0 on success, -1 if the text doesn't fit the image
+ */
+static int text_overlay_render(struct text_overlay *ov, int startx, int starty,
+                               int width, int height, const char *text, int scale)
+{
+    struct text_line *lines;
+    int nlines, i, pos, x0, y0, x1, y1, size;
+
+    nlines = text_lines(NULL, startx, starty, width, text, scale);
+    lines = mymalloc(nlines * sizeof(struct text_line));
+    text_lines(lines, startx, starty, width, text, scale);
+
+    /* Bounding box of the characters drawn, within the image */
+    x0 = width;
+    y0 = height;
+    x1 = y1 = 0;
+
+    for (i = 0; i < nlines; i++) {
+        if (!lines[i].len)
+            continue;
+
+        if (lines[i].x < x0)
+            x0 = lines[i].x;
+        if (lines[i].y < y0)
+            y0 = lines[i].y;
+        if (lines[i].x + ((lines[i].len - 1) * GLYPH_ADVANCE + GLYPH_WIDTH) * scale > x1)
+            x1 = lines[i].x + ((lines[i].len - 1) * GLYPH_ADVANCE + GLYPH_WIDTH) * scale;
+        if (lines[i].y + GLYPH_HEIGHT * scale > y1)
+            y1 = lines[i].y + GLYPH_HEIGHT * scale;
+    }
+
+    if (y0 < 0)
+        y0 = 0;
+    if (x1 > width)
+        x1 = width;
+    if (y1 > height)
+        y1 = height;
+
+    if (x0 >= x1 || y0 >= y1) {
+        free(lines);
+        ov->width = ov->height = 0;
+        return -1;
+    }
+
+    ov->x = x0;
+    ov->y = y0;
+    ov->width = x1 - x0;
+    ov->height = y1 - y0;
+
+    size = ov->width * ov->height;
+
+    if (size > ov->size) {
+        free(ov->keep);
+        ov->keep = mymalloc(2 * size);
+        ov->size = size;
+    }
 
-    image_ptr = image + startx + starty * width;
+    ov->set = ov->keep + size;
+    memset(ov->keep, 0xff, size);
+    memset(ov->set, 0, size);
 
-    char_arr_ptr = factor ? big_char_arr_ptr : small_char_arr_ptr;
+    /*
+     * Characters overlap by a column, each is drawn over the previous one
+     * like draw_textn did on the image.
+     */
+    for (i = 0; i < nlines; i++) {
+        for (pos = 0; pos < lines[i].len; pos++) {
+            int c = (unsigned char)lines[i].text[pos];
+            int cx = lines[i].x + pos * GLYPH_ADVANCE * scale - x0;
+            int cy = lines[i].y - y0;
+            const unsigned char *char_ptr;
+            int x, y;
 
-    for (pos = 0; pos < len; pos++) {
-        int pos_check = (int)text[pos];
+            if (c >= ASCII_MAX)
+                continue;
 
-        char_ptr = char_arr_ptr[pos_check];
+            char_ptr = char_arr_ptr[c];
 
-        for (y = 8 * (factor + 1); y--;) {
-            for (x = 7 * (factor + 1); x--;) {
+            for (y = 0; y < GLYPH_HEIGHT * scale; y++) {
+                const unsigned char *pix = char_ptr + (y / scale) * GLYPH_WIDTH;
+                int row = cy + y;
 
-                if (pos_check < 0) {
-                    image_ptr++;
-                    char_ptr++;
+                if (row < 0 || row >= ov->height)
                     continue;
-                }
 
-                switch(*char_ptr) {
-                case 1:
-                    *image_ptr = 0;
-                     break;
-                case 2:
-                    *image_ptr = 255;
-                    break;
-                default:
-                    break;
-                }
+                for (x = 0; x < GLYPH_WIDTH * scale; x++) {
+                    int offset = row * ov->width + cx + x;
+
+                    if (!pix[x / scale] || cx + x >= ov->width)
+                        continue;
 
-                image_ptr++;
-                char_ptr++;
+                    ov->keep[offset] = 0;
+                    ov->set[offset] = pix[x / scale] == 2 ? 255 : 0;
+                }
             }
-            image_ptr += line_offset;
         }
-        image_ptr -= next_char_offs;
     }
 
+    free(lines);
+
     return 0;
 }
 
 /**
- * draw_text
+ * text_overlay_blit
+ *
+ *      Draws the rendered text on the image: the pixels of the characters
+ *      are replaced, the others kept.
  */
-int draw_text(unsigned char *image, unsigned int startx, unsigned int starty, unsigned int width, const char *text, unsigned int factor)
+static void text_overlay_blit(const struct text_overlay *ov, unsigned char *image,
+                              unsigned int width)
 {
-    int num_nl = 0;
-    const char *end, *begin;
-    const int line_space = (factor + 1) * 9;
+    unsigned char *row = image + ov->y * width + ov->x;
+    const unsigned char *keep = ov->keep, *set = ov->set;
+    int x, y;
 
-    /* Count the number of newlines in "text" so we scroll it up the image. */
-    end = text;
+    for (y = 0; y < ov->height; y++, row += width, keep += ov->width, set += ov->width) {
+        x = 0;
+#ifdef __SSE2__
+        for (; x + 16 <= ov->width; x += 16) {
+            __m128i pix = _mm_loadu_si128((const __m128i *)(row + x));
 
-    while ((end = strstr(end, NEWLINE))) {
-        num_nl++;
-        end += sizeof(NEWLINE)-1;
+            pix = _mm_and_si128(pix, _mm_loadu_si128((const __m128i *)(keep + x)));
+            pix = _mm_or_si128(pix, _mm_loadu_si128((const __m128i *)(set + x)));
+            _mm_storeu_si128((__m128i *)(row + x), pix);
+        }
+#endif
+        for (; x < ov->width; x++)
+            row[x] = (row[x] & keep[x]) | set[x];
     }
+}
 
-    starty -= line_space * num_nl;
+/**
+ * draw_text_overlay
+ *
+ *      Draws text like draw_text, keeping the rendered text in the overlay.
+ *      As long as the same text is drawn at the same place, the overlay is
+ *      only copied to the image. The overlay is freed by free_text_overlay.
+ *
+ * Returns: 0
+ */
+int draw_text_overlay(struct text_overlay *ov, unsigned char *image, unsigned int startx,
+                      unsigned int starty, unsigned int width, unsigned int height,
+                      const char *text, unsigned int scale)
+{
+    if (scale < 1)
+        scale = 1;
 
-    begin = end = text;
+    if (!ov->text || strcmp(ov->text, text) || ov->startx != startx || ov->starty != starty ||
+        ov->image_width != width || ov->image_height != height || ov->scale != scale) {
+        free(ov->text);
+        ov->text = NULL;
 
-    while ((end = strstr(end, NEWLINE))) {
-        int len = end-begin;
+        if (text_overlay_render(ov, startx, starty, width, height, text, scale))
+            return 0;
 
-        draw_textn(image, startx, starty, width, begin, len, factor);
-        end += sizeof(NEWLINE)-1;
-        begin = end;
-        starty += line_space;
+        ov->text = mystrdup(text);
+        ov->startx = startx;
+        ov->starty = starty;
+        ov->image_width = width;
+        ov->image_height = height;
+        ov->scale = scale;
     }
 
-    draw_textn(image, startx, starty, width, begin, strlen(begin), factor);
+    text_overlay_blit(ov, image, width);
+
+    return 0;
+}
+
+/**
+ * free_text_overlay
+ */
+void free_text_overlay(struct text_overlay *ov)
+{
+    free(ov->text);
+    free(ov->keep);
+    memset(ov, 0, sizeof(*ov));
+}
+
+/**
+ * draw_text
+ *
+ *      Draws the text on the Y plane of the image. The top left corner of
+ *      the text is at startx, starty; text right of the middle of the image
+ *      ends at startx instead. A "\n" in the text starts a new line, the
+ *      lines above scroll up. The characters are scale times their normal
+ *      size.
+ */
+int draw_text(unsigned char *image, unsigned int startx, unsigned int starty, unsigned int width,
+              unsigned int height, const char *text, unsigned int scale)
+{
+    struct text_overlay ov;
+
+    memset(&ov, 0, sizeof(ov));
+    draw_text_overlay(&ov, image, startx, starty, width, height, text, scale);
+    free_text_overlay(&ov);
 
     return 0;
 }
@@ -1172,34 +1356,18 @@ int draw_text(unsigned char *image, unsigned int startx, unsigned int starty, un
  */
 int initialize_chars(void)
 {
-    unsigned int i, x, y;
+    unsigned int i;
     size_t draw_table_size;
 
     draw_table_size = sizeof(draw_table) / sizeof(struct draw_char);
 
-    /* Fill the structure 'big_table' with double sized characters. */
-    for (i = 0; i < draw_table_size; i++) {
-        big_table[i].ascii = draw_table[i].ascii;
-
-        for(x = 0; x < 14; x++) {
-            for(y = 0; y < 16; y++)
-                big_table[i].pix[y][x] = draw_table[i].pix[y / 2][x / 2];
-
-        }
-    }
-
     /* First init all char ptr's to a space character. */
-    for (i = 0; i < ASCII_MAX; i++) {
-        small_char_arr_ptr[i] = &draw_table[0].pix[0][0];
-        big_char_arr_ptr[i] = &big_table[0].pix[0][0];
-    }
+    for (i = 0; i < ASCII_MAX; i++)
+        char_arr_ptr[i] = &draw_table[0].pix[0][0];
 
-    /* Build [big_]char_arr_ptr table to point to each available ascii. */
-    for (i = 0; i < draw_table_size; i++) {
-        small_char_arr_ptr[(int)draw_table[i].ascii] = &draw_table[i].pix[0][0];
-        big_char_arr_ptr[(int)draw_table[i].ascii] = &big_table[i].pix[0][0];
-    }
+    /* Build char_arr_ptr table to point to each available ascii. */
+    for (i = 0; i < draw_table_size; i++)
+        char_arr_ptr[(int)draw_table[i].ascii] = &draw_table[i].pix[0][0];
 
     return 0;
 }
-
@@ -12,42 +12,203 @@
 #include "picture.h"   /* already includes motion.h */
 #include "event.h"
 #include "video.h"
+#include "writer.h"
+#include "database.h"
+#include <spawn.h>
+#include <limits.h>
+
+extern char **environ;
 
 /* Various functions (most doing the actual action) */
 
+/* Pipe to the command helper process, -1 if there is none */
+static int command_helper_fd = -1;
+/* Taken to write to command_helper_fd and to close it */
+static pthread_mutex_t command_helper_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * command_helper_run
+ *      Main loop of the command helper process. It reads the commands, each
+ *      terminated by a 0 byte, and starts each one with /bin/sh in its own
+ *      session. It ends when motion closes the pipe.
+ */
+static void command_helper_run(int fd)
+{
+    char buf[PIPE_BUF * 2];
+    size_t used = 0;
+    int i;
+
+    /*
+     * Nothing the helper inherited from motion is passed on to the commands,
+     * except the console because we would like to see error messages. The
+     * descriptors stay open for the helper itself, e.g. for the log file.
+     */
+    for (i = getdtablesize(); i > 2; --i)
+        fcntl(i, F_SETFD, FD_CLOEXEC);
+
+    while (1) {
+        ssize_t len = read(fd, buf + used, sizeof(buf) - used);
+        char *cmd, *end;
+
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len <= 0)
+            _exit(0);
+
+        used += len;
+        cmd = buf;
+
+        while ((end = memchr(cmd, 0, used - (cmd - buf))) != NULL) {
+            if (!fork()) {
+                /* Detach from parent */
+                setsid();
+
+                execl("/bin/sh", "sh", "-c", cmd, NULL);
+
+                /* if above function succeeds the program never reach here */
+                MOTION_LOG(ALR, TYPE_EVENTS, SHOW_ERRNO, "%s: Unable to start external"
+                           " command '%s'", cmd);
+
+                _exit(1);
+            }
+
+            cmd = end + 1;
+        }
+
+        used -= cmd - buf;
+        memmove(buf, cmd, used);
+
+        /* Commands are never longer than PIPE_BUF, drop the garbage if so */
+        if (used == sizeof(buf))
+            used = 0;
+    }
+}
+
+/**
+ * command_helper_start
+ *      Forks the process which starts the external commands (on_event_start
+ *      etc.) for motion. It is forked once at startup while motion is still
+ *      small, so starting a command later doesn't have to copy the page
+ *      tables of a daemon with many cameras and large image buffers.
+ */
+void command_helper_start(void)
+{
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) == -1) {
+        MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Could not create the pipe to"
+                   " the command helper");
+        return;
+    }
+
+    pid = fork();
+
+    if (pid == 0) {
+        close(fds[1]);
+        command_helper_run(fds[0]);
+    }
+
+    close(fds[0]);
+
+    if (pid == -1) {
+        MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Could not start the command"
+                   " helper, commands are started directly");
+        close(fds[1]);
+        return;
+    }
+
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    command_helper_fd = fds[1];
+}
+
 /**
  * exec_command
  *      Execute 'command' with 'arg' as its argument.
  *      if !arg command is started with no arguments
- *      Before we call execl we need to close all the file handles
- *      that the fork inherited from the parent in order not to pass
- *      the open handles on to the shell
+ *      The command is handed to the command helper process. Without one it is
+ *      started with posix_spawn, which unlike fork doesn't copy the address
+ *      space of motion. The descriptors of motion are not passed on to the
+ *      shell where the C library lets us close them.
+ *      Run by the writer thread, the command is expanded with the stamp of
+ *      its job.
  */
 static void exec_command(struct context *cnt, char *command, char *filename, int filetype)
 {
+    const struct image_stamp *image = writer_stamp(cnt);
     char stamp[PATH_MAX];
-    mystrftime(cnt, stamp, sizeof(stamp), command, &cnt->current_image->timestamp_tm, filename, filetype);
+    size_t len;
+    int sent = 0;
 
-    if (!fork()) {
-        int i;
+    if (image)
+        mystrftime_stamped(cnt, image, stamp, sizeof(stamp), command, &image->timestamp_tm,
+                           filename, filetype);
+    else
+        mystrftime(cnt, stamp, sizeof(stamp), command, &cnt->current_image->timestamp_tm,
+                   filename, filetype);
+    len = strlen(stamp) + 1;
 
-        /* Detach from parent */
-        setsid();
+    /*
+     * Writes of up to PIPE_BUF bytes are atomic, the lock only keeps another
+     * thread from closing the pipe, and a descriptor opened again under the
+     * same number, while we write.
+     */
+    if (len <= PIPE_BUF) {
+        pthread_mutex_lock(&command_helper_mutex);
 
-        /*
-         * Close any file descriptor except console because we will
-         * like to see error messages
-         */
-        for (i = getdtablesize(); i > 2; --i)
-            close(i);
+        if (command_helper_fd != -1) {
+            if (write(command_helper_fd, stamp, len) == (ssize_t)len) {
+                sent = 1;
+            } else {
+                MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Command helper is gone,"
+                           " commands are started directly");
+                close(command_helper_fd);
+                command_helper_fd = -1;
+            }
+        }
 
-        execl("/bin/sh", "sh", "-c", stamp, " &", NULL);
+        pthread_mutex_unlock(&command_helper_mutex);
+    }
 
-        /* if above function succeeds the program never reach here */
-        MOTION_LOG(ALR, TYPE_EVENTS, SHOW_ERRNO, "%s: Unable to start external command '%s'",
+    if (sent) {
+        MOTION_LOG(DBG, TYPE_EVENTS, NO_ERRNO, "%s: Executing external command '%s'",
                    stamp);
+        return;
+    }
+
+    {
+        char *argv[] = { "sh", "-c", stamp, NULL };
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        pid_t pid;
+        int ret;
+
+        posix_spawn_file_actions_init(&actions);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+        /* Close any file descriptor except console */
+        posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
 
-        exit(1);
+        posix_spawnattr_init(&attr);
+        /* Detach from parent */
+#ifdef POSIX_SPAWN_SETSID
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#else
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+#endif
+
+        ret = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (ret) {
+            errno = ret;
+            MOTION_LOG(ALR, TYPE_EVENTS, SHOW_ERRNO, "%s: Unable to start external command '%s'",
+                       stamp);
+            return;
+        }
     }
 
     MOTION_LOG(DBG, TYPE_EVENTS, NO_ERRNO, "%s: Executing external command '%s'",
@@ -116,99 +277,11 @@ static void event_sqlnewfile(struct context *cnt, int type  ATTRIBUTE_UNUSED,
     int sqltype = (unsigned long)arg;
 
     /* Only log the file types we want */
-    if (!(cnt->conf.database_type) || (sqltype & cnt->sql_mask) == 0)
+    if (!cnt->database || (sqltype & cnt->sql_mask) == 0)
         return;
 
-    /*
-     * We place the code in a block so we only spend time making space in memory
-     * for the sqlquery and timestr when we actually need it.
-     */
-    {
-        char sqlquery[PATH_MAX];
-
-        mystrftime(cnt, sqlquery, sizeof(sqlquery), cnt->conf.sql_query,
-                   &cnt->current_image->timestamp_tm, filename, sqltype);
-
-#ifdef HAVE_MYSQL
-        if (!strcmp(cnt->conf.database_type, "mysql")) {
-            if (mysql_query(cnt->database, sqlquery) != 0) {
-                int error_code = mysql_errno(cnt->database);
-
-                MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO, "%s: Mysql query failed %s error code %d",
-                           mysql_error(cnt->database), error_code);
-                /* Try to reconnect ONCE if fails continue and discard this sql query */
-                if (error_code >= 2000) {
-                    // Close connection before start a new connection
-                    mysql_close(cnt->database);
-
-                    cnt->database = (MYSQL *) mymalloc(sizeof(MYSQL));
-                    mysql_init(cnt->database);
-
-                    if (!mysql_real_connect(cnt->database, cnt->conf.database_host,
-                                            cnt->conf.database_user, cnt->conf.database_password,
-                                            cnt->conf.database_dbname, 0, NULL, 0)) {
-                        MOTION_LOG(ALR, TYPE_DB, NO_ERRNO, "%s: Cannot reconnect to MySQL"
-                                   " database %s on host %s with user %s MySQL error was %s",
-                                   cnt->conf.database_dbname,
-                                   cnt->conf.database_host, cnt->conf.database_user,
-                                   mysql_error(cnt->database));
-                    } else {
-                        MOTION_LOG(INF, TYPE_DB, NO_ERRNO, "%s: Re-Connection to Mysql database '%s' Succeed",
-                                   cnt->conf.database_dbname);
-                        if (mysql_query(cnt->database, sqlquery) != 0) {
-                            int error_my = mysql_errno(cnt->database);
-                            MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO, "%s: after re-connection Mysql query failed %s error code %d",
-                                       mysql_error(cnt->database), error_my);
-                        }
-                    }
-                }
-            }
-        }
-#endif /* HAVE_MYSQL */
-
-#ifdef HAVE_PGSQL
-        if (!strcmp(cnt->conf.database_type, "postgresql")) {
-            PGresult *res;
-
-            res = PQexec(cnt->database_pg, sqlquery);
-
-            if (PQstatus(cnt->database_pg) == CONNECTION_BAD) {
-
-                MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Connection to PostgreSQL database '%s' failed: %s",
-                           cnt->conf.database_dbname, PQerrorMessage(cnt->database_pg));
-
-                // This function will close the connection to the server and attempt to reestablish a new connection to the same server,
-                // using all the same parameters previously used. This may be useful for error recovery if a working connection is lost
-                PQreset(cnt->database_pg);
-
-                if (PQstatus(cnt->database_pg) == CONNECTION_BAD) {
-                    MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Re-Connection to PostgreSQL database '%s' failed: %s",
-                               cnt->conf.database_dbname, PQerrorMessage(cnt->database_pg));
-                } else {
-                    MOTION_LOG(INF, TYPE_DB, NO_ERRNO, "%s: Re-Connection to PostgreSQL database '%s' Succeed",
-                               cnt->conf.database_dbname);
-                }
-
-            } else if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-                MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO, "%s: PGSQL query [%s] failed", sqlquery);
-                PQclear(res);
-            }
-        }
-#endif /* HAVE_PGSQL */
-
-#ifdef HAVE_SQLITE3
-        if ((!strcmp(cnt->conf.database_type, "sqlite3")) && (cnt->conf.sqlite3_db)) {
-            int res;
-            char *errmsg = 0;
-            res = sqlite3_exec(cnt->database_sqlite3, sqlquery, NULL, 0, &errmsg);
-            if (res != SQLITE_OK ) {
-                MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: SQLite error was %s",
-                           errmsg);
-                sqlite3_free(errmsg);
-            }
-        }
-#endif /* HAVE_SQLITE3 */
-    }
+    /* Written by the database thread */
+    database_put(cnt, filename, sqltype);
 }
 
 #endif /* defined HAVE_MYSQL || defined HAVE_PGSQL || defined(HAVE_SQLITE3) */
@@ -339,7 +412,7 @@ static void event_imagem_detect(struct context *cnt, int type ATTRIBUTE_UNUSED,
         snprintf(filenamem, PATH_MAX, "%sm", filename);
         snprintf(fullfilenamem, PATH_MAX, "%s/%s.%s", cnt->conf.filepath, filenamem, imageext(cnt));
 
-        put_picture(cnt, fullfilenamem, cnt->imgs.out, FTYPE_IMAGE_MOTION);
+        put_picture(cnt, fullfilenamem, cnt->imgs.out_image, FTYPE_IMAGE_MOTION);
     }
 }
 
@@ -407,17 +480,80 @@ static void on_movie_end_command(struct context *cnt, int type ATTRIBUTE_UNUSED,
         exec_command(cnt, cnt->conf.on_movie_end, filename, filetype);
 }
 
+/*
+ * Frames kept while the pipe to the extpipe program is full. More are
+ * dropped, whole frames only, so the program never sees a torn frame.
+ */
+#define EXTPIPE_BACKLOG         4
+/* Room we ask for in the pipe, the default of 64k is less than a frame */
+#define EXTPIPE_PIPE_SIZE       (1024 * 1024)
+
+/**
+ * extpipe_flush
+ *
+ *      Writes as much of the backlog as fits in the pipe without waiting.
+ *
+ * Returns: 0 if the backlog is empty now, -1 if not
+ */
+static int extpipe_flush(struct context *cnt)
+{
+    struct extpipe_backlog *backlog = &cnt->extpipe_backlog;
+    int fd = fileno(cnt->extpipe);
+    unsigned char *frame;
+    ssize_t n;
+
+    while (backlog->count && !backlog->error) {
+        frame = backlog->frames + (size_t)backlog->head * cnt->imgs.size;
+        n = write(fd, frame + backlog->done, cnt->imgs.size - backlog->done);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return -1;
+
+            MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Error writing to the extpipe,"
+                       " dropping the frames of this event");
+            backlog->error = 1;
+            break;
+        }
+
+        if ((backlog->done += n) == (size_t)cnt->imgs.size) {
+            backlog->head = (backlog->head + 1) % EXTPIPE_BACKLOG;
+            backlog->count--;
+            backlog->done = 0;
+            backlog->written++;
+            backlog->drop_burst = 0;
+        }
+    }
+
+    backlog->dropped += backlog->count;
+    backlog->count = 0;
+
+    return 0;
+}
+
 static void event_extpipe_end(struct context *cnt, int type ATTRIBUTE_UNUSED,
             unsigned char *dummy ATTRIBUTE_UNUSED, char *dummy1 ATTRIBUTE_UNUSED,
             void *dummy2 ATTRIBUTE_UNUSED, struct tm *tm ATTRIBUTE_UNUSED)
 {
+    struct extpipe_backlog *backlog = &cnt->extpipe_backlog;
+
     if (cnt->extpipe_open) {
+        int fd = fileno(cnt->extpipe);
+
         cnt->extpipe_open = 0;
-        fflush(cnt->extpipe);
-        MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, "%s: CLOSING: extpipe file desc %d, error state %d",
-                   fileno(cnt->extpipe), ferror(cnt->extpipe));
-        MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, "%s: pclose return: %d",
+
+        /* The program ends with the pipe, so it may as well get the backlog first */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        extpipe_flush(cnt);
+
+        MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, "%s: CLOSING: extpipe file desc %d, %lu"
+                   " frames written, %lu dropped", fd, backlog->written, backlog->dropped);
+        MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, "%s: pclose return: %d",
                    pclose(cnt->extpipe));
+
+        free(backlog->frames);
+        memset(backlog, 0, sizeof(*backlog));
+
         event(cnt, EVENT_FILECLOSE, NULL, cnt->extpipefilename, (void *)FTYPE_MPEG, NULL);
     }
 }
@@ -430,6 +566,7 @@ static void event_create_extpipe(struct context *cnt, int type ATTRIBUTE_UNUSED,
         char stamp[PATH_MAX] = "";
         const char *moviepath;
         FILE *fd_dummy = NULL;
+        int fd;
 
         /*
          *  conf.mpegpath would normally be defined but if someone deleted it by control interface
@@ -484,27 +621,93 @@ static void event_create_extpipe(struct context *cnt, int type ATTRIBUTE_UNUSED,
         }
 
         setbuf(cnt->extpipe, NULL);
+
+        /*
+         * The frames are written straight to the pipe, without waiting for
+         * the program. A larger pipe lets it fall behind for a moment.
+         */
+        fd = fileno(cnt->extpipe);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+        fcntl(fd, F_SETPIPE_SZ, EXTPIPE_PIPE_SIZE);
+#endif
+
         cnt->extpipe_open = 1;
     }
 }
 
+/**
+ * event_extpipe_put
+ *
+ *      Writes a frame to the extpipe program. motion_loop never waits for
+ *      the program: what doesn't fit in the pipe is copied to the backlog,
+ *      and if that is full too the frame is dropped.
+ */
 static void event_extpipe_put(struct context *cnt, int type ATTRIBUTE_UNUSED,
             unsigned char *img, char *dummy1 ATTRIBUTE_UNUSED,
             void *dummy2 ATTRIBUTE_UNUSED, struct tm *tm ATTRIBUTE_UNUSED)
 {
+    struct extpipe_backlog *backlog = &cnt->extpipe_backlog;
+    ssize_t n = 0;
+    int slot;
+
     /* Check use_extpipe enabled and ext_pipe not NULL */
     if ((cnt->conf.useextpipe) && (cnt->extpipe != NULL)) {
         MOTION_LOG(DBG, TYPE_EVENTS, NO_ERRNO, "%s:");
 
         /* Check that is open */
-        if ((cnt->extpipe_open) && (fileno(cnt->extpipe) > 0)) {
-            if (!fwrite(img, cnt->imgs.size, 1, cnt->extpipe))
-                MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Error writting in pipe , state error %d",
-                           ferror(cnt->extpipe));
-        } else {
+        if (!cnt->extpipe_open || fileno(cnt->extpipe) <= 0) {
             MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, "%s: pipe %s not created or closed already ",
                        cnt->extpipe);
+            return;
+        }
+
+        if (backlog->error) {
+            backlog->dropped++;
+            return;
+        }
+
+        /* Older frames first */
+        if (extpipe_flush(cnt) == 0) {
+            n = write(fileno(cnt->extpipe), img, cnt->imgs.size);
+
+            if (n == cnt->imgs.size) {
+                backlog->written++;
+                backlog->drop_burst = 0;
+                return;
+            }
+
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Error writing to the"
+                               " extpipe, dropping the frames of this event");
+                    backlog->error = 1;
+                    backlog->dropped++;
+                    return;
+                }
+
+                n = 0;
+            }
+        }
+
+        if (backlog->count == EXTPIPE_BACKLOG) {
+            backlog->dropped++;
+
+            if (backlog->drop_burst++ == 0)
+                MOTION_LOG(WRN, TYPE_EVENTS, NO_ERRNO, "%s: extpipe program can't keep up,"
+                           " dropping frames");
+            return;
         }
+
+        if (!backlog->frames)
+            backlog->frames = mymalloc((size_t)EXTPIPE_BACKLOG * cnt->imgs.size);
+
+        /* A started frame has to be finished first */
+        slot = (backlog->head + backlog->count) % EXTPIPE_BACKLOG;
+        memcpy(backlog->frames + (size_t)slot * cnt->imgs.size, img, cnt->imgs.size);
+
+        if (backlog->count++ == 0)
+            backlog->done = n;
     }
 }
 
@@ -515,6 +718,11 @@ static void event_new_video(struct context *cnt, int type ATTRIBUTE_UNUSED,
 {
     cnt->movie_last_shot = -1;
 
+    /*
+     * Nominal frame rate of the new movie. The frames of ffmpeg movies are
+     * placed by their capture time, this only sets the time resolution and
+     * the rate the encoder plans its bitrate for.
+     */
     cnt->movie_fps = cnt->lastrate;
 
     MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, "%s FPS %d",
@@ -528,10 +736,24 @@ static void event_new_video(struct context *cnt, int type ATTRIBUTE_UNUSED,
 
 #ifdef HAVE_FFMPEG
 
-static void grey2yuv420p(unsigned char *u, unsigned char *v, int width, int height)
+/*
+ * Points y, u and v at the planes of an image. Greyscale images only have
+ * the Y plane, their u and v are NULL and ffmpeg supplies neutral chroma.
+ */
+static void image_planes(struct context *cnt, unsigned char *img, unsigned char **y,
+                         unsigned char **u, unsigned char **v)
 {
-    memset(u, 128, width * height / 4);
-    memset(v, 128, width * height / 4);
+    int size = cnt->imgs.width * cnt->imgs.height;
+
+    *y = img;
+
+    if (cnt->imgs.type == VIDEO_PALETTE_GREY) {
+        *u = NULL;
+        *v = NULL;
+    } else {
+        *u = img + size;
+        *v = *u + size / 4;
+    }
 }
 
 
@@ -539,15 +761,26 @@ static void event_ffmpeg_newfile(struct context *cnt, int type ATTRIBUTE_UNUSED,
             unsigned char *img, char *dummy1 ATTRIBUTE_UNUSED,
             void *dummy2 ATTRIBUTE_UNUSED, struct tm *currenttime_tm)
 {
-    int width = cnt->imgs.width;
-    int height = cnt->imgs.height;
-    unsigned char *convbuf, *y, *u, *v;
+    unsigned char *y, *u, *v;
     char stamp[PATH_MAX];
     const char *moviepath;
+    const char *codec = cnt->conf.ffmpeg_video_codec;
 
     if (!cnt->conf.ffmpeg_output && !cnt->conf.ffmpeg_output_debug)
         return;
 
+    /*
+     * Only netcams give us compressed packets to copy, everything else
+     * (and the motion movie, which shows the motion image) is encoded.
+     */
+    if (codec && !strcmp(codec, FFMPEG_PASSTHROUGH_CODEC)) {
+        if (!cnt->netcam || cnt->conf.ffmpeg_output_debug)
+            MOTION_LOG(WRN, TYPE_EVENTS, NO_ERRNO, "%s: ffmpeg_video_codec %s is only"
+                       " supported for normal movies of netcams - using %s",
+                       FFMPEG_PASSTHROUGH_CODEC, DEF_FFMPEG_CODEC);
+        codec = DEF_FFMPEG_CODEC;
+    }
+
     /*
      *  conf.mpegpath would normally be defined but if someone deleted it by control interface
      *  it is better to revert to the default than fail
@@ -567,58 +800,40 @@ static void event_ffmpeg_newfile(struct context *cnt, int type ATTRIBUTE_UNUSED,
     snprintf(cnt->newfilename, PATH_MAX - 4, "%s/%s", cnt->conf.filepath, stamp);
 
     if (cnt->conf.ffmpeg_output) {
-        if (cnt->imgs.type == VIDEO_PALETTE_GREY) {
-            convbuf = mymalloc((width * height) / 2);
-            y = img;
-            u = convbuf;
-            v = convbuf + (width * height) / 4;
-            grey2yuv420p(u, v, width, height);
-        } else {
-            convbuf = NULL;
-            y = img;
-            u = img + width * height;
-            v = u + (width * height) / 4;
-        }
+        image_planes(cnt, img, &y, &u, &v);
 
-        if ((cnt->ffmpeg_output =
-            ffmpeg_open((char *)cnt->conf.ffmpeg_video_codec, cnt->newfilename, y, u, v,
+        if (FFMPEG_PASSTHROUGH(cnt) && cnt->netcam)
+            cnt->ffmpeg_output = netcam_open_passthrough(cnt->netcam, cnt->newfilename);
+        else
+            cnt->ffmpeg_output = ffmpeg_open((char *)codec, cnt->newfilename, y, u, v,
                          cnt->imgs.width, cnt->imgs.height, cnt->movie_fps, cnt->conf.ffmpeg_bps,
-                         cnt->conf.ffmpeg_vbr)) == NULL) {
+                         cnt->conf.ffmpeg_vbr, cnt->conf.ffmpeg_gop, cnt->conf.ffmpeg_threads,
+                         cnt->conf.ffmpeg_preset, cnt->conf.ffmpeg_tune);
+
+        if (cnt->ffmpeg_output == NULL) {
             MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: ffopen_open error creating (new) file [%s]",
                        cnt->newfilename);
             cnt->finish = 1;
             return;
         }
 
-        ((struct ffmpeg *)cnt->ffmpeg_output)->udata = convbuf;
         event(cnt, EVENT_FILECREATE, NULL, cnt->newfilename, (void *)FTYPE_MPEG, NULL);
     }
 
     if (cnt->conf.ffmpeg_output_debug) {
-        if (cnt->imgs.type == VIDEO_PALETTE_GREY) {
-            convbuf = mymalloc((width * height) / 2);
-            y = cnt->imgs.out;
-            u = convbuf;
-            v = convbuf + (width * height) / 4;
-            grey2yuv420p(u, v, width, height);
-        } else {
-            y = cnt->imgs.out;
-            u = cnt->imgs.out + width *height;
-            v = u + (width * height) / 4;
-            convbuf = NULL;
-        }
+        image_planes(cnt, cnt->imgs.out_image, &y, &u, &v);
 
         if ((cnt->ffmpeg_output_debug =
-            ffmpeg_open((char *)cnt->conf.ffmpeg_video_codec, cnt->motionfilename, y, u, v,
+            ffmpeg_open((char *)codec, cnt->motionfilename, y, u, v,
                          cnt->imgs.width, cnt->imgs.height, cnt->movie_fps, cnt->conf.ffmpeg_bps,
-                         cnt->conf.ffmpeg_vbr)) == NULL) {
+                         cnt->conf.ffmpeg_vbr, cnt->conf.ffmpeg_gop, cnt->conf.ffmpeg_threads,
+                         cnt->conf.ffmpeg_preset, cnt->conf.ffmpeg_tune)) == NULL) {
             MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: ffopen_open error creating (motion) file [%s]",
                        cnt->motionfilename);
             cnt->finish = 1;
             return;
         }
 
-        cnt->ffmpeg_output_debug->udata = convbuf;
         event(cnt, EVENT_FILECREATE, NULL, cnt->motionfilename, (void *)FTYPE_MPEG_MOTION, NULL);
     }
 }
@@ -628,9 +843,7 @@ static void event_ffmpeg_timelapse(struct context *cnt,
             char *dummy1 ATTRIBUTE_UNUSED, void *dummy2 ATTRIBUTE_UNUSED,
             struct tm *currenttime_tm)
 {
-    int width = cnt->imgs.width;
-    int height = cnt->imgs.height;
-    unsigned char *convbuf, *y, *u, *v;
+    unsigned char *y, *u, *v;
 
     if (!cnt->ffmpeg_timelapse) {
         char tmp[PATH_MAX];
@@ -650,43 +863,29 @@ static void event_ffmpeg_timelapse(struct context *cnt,
         /* PATH_MAX - 4 to allow for .mpg to be appended without overflow */
         snprintf(cnt->timelapsefilename, PATH_MAX - 4, "%s/%s", cnt->conf.filepath, tmp);
 
-        if (cnt->imgs.type == VIDEO_PALETTE_GREY) {
-            convbuf = mymalloc((width * height) / 2);
-            y = img;
-            u = convbuf;
-            v = convbuf + (width * height) / 4;
-            grey2yuv420p(u, v, width, height);
-        } else {
-            convbuf = NULL;
-            y = img;
-            u = img + width * height;
-            v = u + (width * height) / 4;
-        }
+        image_planes(cnt, img, &y, &u, &v);
 
         if ((cnt->ffmpeg_timelapse =
             ffmpeg_open((char *)TIMELAPSE_CODEC, cnt->timelapsefilename, y, u, v,
                          cnt->imgs.width, cnt->imgs.height, 24, cnt->conf.ffmpeg_bps,
-                         cnt->conf.ffmpeg_vbr)) == NULL) {
+                         cnt->conf.ffmpeg_vbr, 0, cnt->conf.ffmpeg_threads, NULL, NULL)) == NULL) {
             MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: ffopen_open error creating "
                        "(timelapse) file [%s]", cnt->timelapsefilename);
             cnt->finish = 1;
             return;
         }
 
-        cnt->ffmpeg_timelapse->udata = convbuf;
         event(cnt, EVENT_FILECREATE, NULL, cnt->timelapsefilename, (void *)FTYPE_MPEG_TIMELAPSE, NULL);
     }
 
-    y = img;
-
-    if (cnt->imgs.type == VIDEO_PALETTE_GREY)
-        u = cnt->ffmpeg_timelapse->udata;
-    else
-        u = img + width * height;
+    if (cnt->writer) {
+        writer_put_movie(cnt, cnt->ffmpeg_timelapse, img, NULL);
+        return;
+    }
 
-    v = u + (width * height) / 4;
+    image_planes(cnt, img, &y, &u, &v);
 
-    if (ffmpeg_put_other_image(cnt->ffmpeg_timelapse, y, u, v) == -1) {
+    if (ffmpeg_put_other_image(cnt->ffmpeg_timelapse, y, u, v, NULL) == -1) {
         cnt->finish = 1;
         cnt->restart = 0;
     }
@@ -697,26 +896,31 @@ static void event_ffmpeg_put(struct context *cnt, int type ATTRIBUTE_UNUSED,
             unsigned char *img, char *dummy1 ATTRIBUTE_UNUSED,
             void *dummy2 ATTRIBUTE_UNUSED, struct tm *tm ATTRIBUTE_UNUSED)
 {
-    if (cnt->ffmpeg_output) {
-        int width = cnt->imgs.width;
-        int height = cnt->imgs.height;
-        unsigned char *y = img;
-        unsigned char *u, *v;
+    struct timeval *tv = &cnt->current_image->timestamp_tv;
 
-        if (cnt->imgs.type == VIDEO_PALETTE_GREY)
-            u = cnt->ffmpeg_timelapse->udata;
-        else
-            u = y + (width * height);
+    if (cnt->ffmpeg_output && cnt->ffmpeg_output->passthrough) {
+        if (cnt->writer) {
+            writer_put_packets(cnt, cnt->ffmpeg_output, &cnt->current_image->packets);
+        } else if (ffmpeg_put_packets(cnt->ffmpeg_output, &cnt->current_image->packets) == -1) {
+            cnt->finish = 1;
+            cnt->restart = 0;
+        }
+    } else if (cnt->ffmpeg_output && cnt->writer) {
+        writer_put_movie(cnt, cnt->ffmpeg_output, img, tv);
+    } else if (cnt->ffmpeg_output) {
+        unsigned char *y, *u, *v;
 
-        v = u + (width * height) / 4;
-        if (ffmpeg_put_other_image(cnt->ffmpeg_output, y, u, v) == -1) {
+        image_planes(cnt, img, &y, &u, &v);
+        if (ffmpeg_put_other_image(cnt->ffmpeg_output, y, u, v, tv) == -1) {
             cnt->finish = 1;
             cnt->restart = 0;
         }
     }
 
-    if (cnt->ffmpeg_output_debug) {
-        if (ffmpeg_put_image(cnt->ffmpeg_output_debug) == -1) {
+    if (cnt->ffmpeg_output_debug && cnt->writer) {
+        writer_put_movie(cnt, cnt->ffmpeg_output_debug, cnt->imgs.out_image, tv);
+    } else if (cnt->ffmpeg_output_debug) {
+        if (ffmpeg_put_image(cnt->ffmpeg_output_debug, tv) == -1) {
             cnt->finish = 1;
             cnt->restart = 0;
         }
@@ -730,20 +934,22 @@ static void event_ffmpeg_closefile(struct context *cnt,
 {
 
     if (cnt->ffmpeg_output) {
-        if (cnt->ffmpeg_output->udata)
-            free(cnt->ffmpeg_output->udata);
-
-        ffmpeg_close(cnt->ffmpeg_output);
+        if (cnt->writer) {
+            writer_close_movie(cnt, cnt->ffmpeg_output);
+        } else {
+            ffmpeg_close(cnt->ffmpeg_output);
+        }
         cnt->ffmpeg_output = NULL;
 
         event(cnt, EVENT_FILECLOSE, NULL, cnt->newfilename, (void *)FTYPE_MPEG, NULL);
     }
 
     if (cnt->ffmpeg_output_debug) {
-        if (cnt->ffmpeg_output_debug->udata)
-            free(cnt->ffmpeg_output_debug->udata);
-
-        ffmpeg_close(cnt->ffmpeg_output_debug);
+        if (cnt->writer) {
+            writer_close_movie(cnt, cnt->ffmpeg_output_debug);
+        } else {
+            ffmpeg_close(cnt->ffmpeg_output_debug);
+        }
         cnt->ffmpeg_output_debug = NULL;
 
         event(cnt, EVENT_FILECLOSE, NULL, cnt->motionfilename, (void *)FTYPE_MPEG_MOTION, NULL);
@@ -756,10 +962,11 @@ static void event_ffmpeg_timelapseend(struct context *cnt,
             struct tm *tm ATTRIBUTE_UNUSED)
 {
     if (cnt->ffmpeg_timelapse) {
-        if (cnt->ffmpeg_timelapse->udata)
-            free(cnt->ffmpeg_timelapse->udata);
-
-        ffmpeg_close(cnt->ffmpeg_timelapse);
+        if (cnt->writer) {
+            writer_close_movie(cnt, cnt->ffmpeg_timelapse);
+        } else {
+            ffmpeg_close(cnt->ffmpeg_timelapse);
+        }
         cnt->ffmpeg_timelapse = NULL;
 
         event(cnt, EVENT_FILECLOSE, NULL, cnt->timelapsefilename, (void *)FTYPE_MPEG_TIMELAPSE, NULL);
@@ -769,6 +976,92 @@ static void event_ffmpeg_timelapseend(struct context *cnt,
 #endif /* HAVE_FFMPEG */
 
 
+/*
+ * Tell whether a handler has anything to do for a camera with its current
+ * configuration. Handlers that are not enabled are left out of the event
+ * table of the camera, see event_table_build.
+ */
+#if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
+static int sql_enabled(struct context *cnt)
+{
+    return cnt->conf.database_type != NULL;
+}
+#endif
+
+static int on_picture_save_enabled(struct context *cnt)
+{
+    return cnt->conf.on_picture_save || cnt->conf.on_movie_start;
+}
+
+static int beep_enabled(struct context *cnt)
+{
+    return !cnt->conf.quiet;
+}
+
+static int on_motion_detected_enabled(struct context *cnt)
+{
+    return cnt->conf.on_motion_detected != NULL;
+}
+
+static int on_area_detected_enabled(struct context *cnt)
+{
+    return cnt->conf.on_area_detected != NULL;
+}
+
+static int on_event_start_enabled(struct context *cnt)
+{
+    return cnt->conf.on_event_start != NULL;
+}
+
+static int on_event_end_enabled(struct context *cnt)
+{
+    return cnt->conf.on_event_end != NULL;
+}
+
+static int on_movie_end_enabled(struct context *cnt)
+{
+    return cnt->conf.on_movie_end != NULL;
+}
+
+static int on_camera_lost_enabled(struct context *cnt)
+{
+    return cnt->conf.on_camera_lost != NULL;
+}
+
+static int motion_img_enabled(struct context *cnt)
+{
+    return cnt->conf.motion_img;
+}
+
+#if defined(HAVE_V4L) || defined(HAVE_V4L2)
+static int vidpipe_enabled(struct context *cnt)
+{
+    return cnt->conf.vidpipe != NULL;
+}
+
+static int motionvidpipe_enabled(struct context *cnt)
+{
+    return cnt->conf.motionvidpipe != NULL;
+}
+#endif
+
+static int stream_enabled(struct context *cnt)
+{
+    return cnt->conf.stream_port;
+}
+
+#ifdef HAVE_FFMPEG
+static int ffmpeg_enabled(struct context *cnt)
+{
+    return cnt->conf.ffmpeg_output || cnt->conf.ffmpeg_output_debug;
+}
+#endif
+
+static int extpipe_enabled(struct context *cnt)
+{
+    return cnt->conf.useextpipe && cnt->conf.extpipe;
+}
+
 /*
  * Starting point for all events
  */
@@ -776,136 +1069,204 @@ static void event_ffmpeg_timelapseend(struct context *cnt,
 struct event_handlers {
     int type;
     event_handler handler;
+    int (*enabled)(struct context *);   /* NULL if always */
 };
 
 struct event_handlers event_handlers[] = {
 #if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
     {
     EVENT_FILECREATE,
-    event_sqlnewfile
+    event_sqlnewfile,
+    sql_enabled
     },
 #endif
     {
     EVENT_FILECREATE,
-    on_picture_save_command
+    on_picture_save_command,
+    on_picture_save_enabled
     },
     {
     EVENT_FILECREATE,
-    event_newfile
+    event_newfile,
+    NULL
     },
     {
     EVENT_MOTION,
-    event_beep
+    event_beep,
+    beep_enabled
     },
     {
     EVENT_MOTION,
-    on_motion_detected_command
+    on_motion_detected_command,
+    on_motion_detected_enabled
     },
     {
     EVENT_AREA_DETECTED,
-    on_area_command
+    on_area_command,
+    on_area_detected_enabled
     },
     {
     EVENT_FIRSTMOTION,
-    on_event_start_command
+    on_event_start_command,
+    on_event_start_enabled
     },
     {
     EVENT_ENDMOTION,
-    on_event_end_command
+    on_event_end_command,
+    on_event_end_enabled
     },
     {
     EVENT_IMAGE_DETECTED,
-    event_image_detect
+    event_image_detect,
+    NULL
     },
     {
     EVENT_IMAGEM_DETECTED,
-    event_imagem_detect
+    event_imagem_detect,
+    motion_img_enabled
     },
     {
     EVENT_IMAGE_SNAPSHOT,
-    event_image_snapshot
+    event_image_snapshot,
+    NULL
     },
 #ifdef HAVE_SDL
     {
     EVENT_SDL_PUT,
-    event_sdl_put
+    event_sdl_put,
+    NULL
     },
 #endif
 #if defined(HAVE_V4L) || defined(HAVE_V4L2)
     {
     EVENT_IMAGE,
-    event_vid_putpipe
+    event_vid_putpipe,
+    vidpipe_enabled
     },
     {
     EVENT_IMAGEM,
-    event_vid_putpipe
+    event_vid_putpipe,
+    motionvidpipe_enabled
     },
 #endif /* HAVE_V4L || HAVE_V4L2 */
     {
     EVENT_STREAM,
-    event_stream_put
+    event_stream_put,
+    stream_enabled
     },
     {
     EVENT_FIRSTMOTION,
-    event_new_video
+    event_new_video,
+    NULL
     },
 #ifdef HAVE_FFMPEG
     {
     EVENT_FIRSTMOTION,
-    event_ffmpeg_newfile
+    event_ffmpeg_newfile,
+    ffmpeg_enabled
     },
     {
     EVENT_IMAGE_DETECTED,
-    event_ffmpeg_put
-    },
-    {
-    EVENT_FFMPEG_PUT,
-    event_ffmpeg_put
+    event_ffmpeg_put,
+    ffmpeg_enabled
     },
     {
     EVENT_ENDMOTION,
-    event_ffmpeg_closefile
+    event_ffmpeg_closefile,
+    NULL
     },
     {
     EVENT_TIMELAPSE,
-    event_ffmpeg_timelapse
+    event_ffmpeg_timelapse,
+    NULL
     },
     {
     EVENT_TIMELAPSEEND,
-    event_ffmpeg_timelapseend
+    event_ffmpeg_timelapseend,
+    NULL
     },
 #endif /* HAVE_FFMPEG */
     {
     EVENT_FILECLOSE,
-    on_movie_end_command
+    on_movie_end_command,
+    on_movie_end_enabled
     },
     {
     EVENT_FIRSTMOTION,
-    event_create_extpipe
+    event_create_extpipe,
+    extpipe_enabled
     },
     {
     EVENT_IMAGE_DETECTED,
-    event_extpipe_put
+    event_extpipe_put,
+    extpipe_enabled
     },
     {
     EVENT_FFMPEG_PUT,
-    event_extpipe_put
+    event_extpipe_put,
+    extpipe_enabled
     },
     {
     EVENT_ENDMOTION,
-    event_extpipe_end
+    event_extpipe_end,
+    NULL
     },
     {
     EVENT_CAMERA_LOST,
-    event_camera_lost
+    event_camera_lost,
+    on_camera_lost_enabled
     },
     {
     EVENT_STOP,
-    event_stop_stream
+    event_stop_stream,
+    stream_enabled
     },
-    {0, NULL}
+    {0, NULL, NULL}
 };
 
+/**
+ * event_table_build
+ *
+ *      Lists the enabled handlers of each event type in cnt->event_table,
+ *      so that event() doesn't look at the others. Called by motion_init
+ *      and once a second by motion_loop, in case the config was changed
+ *      through the web control. The table is only written when it changes,
+ *      under the event_table_mutex of the camera: its writer thread may be
+ *      dispatching a file event meanwhile. The handlers still check their
+ *      own config.
+ */
+void event_table_build(struct context *cnt)
+{
+    unsigned char table[EVENT_LAST + 1][EVENT_HANDLERS_MAX + 1];
+    int count[EVENT_LAST + 1];
+    int i, type;
+
+    memset(table, 0, sizeof(table));
+    memset(count, 0, sizeof(count));
+
+    for (i = 0; event_handlers[i].handler; i++) {
+        type = event_handlers[i].type;
+
+        if (event_handlers[i].enabled && !event_handlers[i].enabled(cnt))
+            continue;
+
+        if (count[type] == EVENT_HANDLERS_MAX) {
+            MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, "%s: More than %d handlers for event"
+                       " type %d", EVENT_HANDLERS_MAX, type);
+            continue;
+        }
+
+        /* Index + 1, 0 ends the list */
+        table[type][count[type]++] = i + 1;
+    }
+
+    if (memcmp(cnt->event_table, table, sizeof(table))) {
+        pthread_mutex_lock(&cnt->event_table_mutex);
+        memcpy(cnt->event_table, table, sizeof(table));
+        pthread_mutex_unlock(&cnt->event_table_mutex);
+    }
+}
+
 
 /**
  * event
@@ -921,10 +1282,36 @@ struct event_handlers event_handlers[] = {
  */
 void event(struct context *cnt, int type, unsigned char *image, char *filename, void *eventdata, struct tm *tm)
 {
-    int i=-1;
+    unsigned char handlers[EVENT_HANDLERS_MAX + 1];
+    const unsigned char *handler;
 
-    while (event_handlers[++i].handler) {
-        if (type == event_handlers[i].type)
-            event_handlers[i].handler(cnt, type, image, filename, eventdata, tm);
+    /*
+     * With an output queue the files are written by the writer thread,
+     * so the events about them have to be queued behind the writes.
+     */
+    if ((type == EVENT_FILECREATE || type == EVENT_FILECLOSE) && cnt->writer &&
+        !writer_event(cnt, type, filename, eventdata))
+        return;
+
+    writer_forget(cnt);
+
+    /*
+     * motion_loop is the one that rebuilds the table, it reads it as is.
+     * The writer thread takes a copy, the table may change while the
+     * handlers run.
+     */
+    if (writer_thread(cnt)) {
+        pthread_mutex_lock(&cnt->event_table_mutex);
+        memcpy(handlers, cnt->event_table[type], sizeof(handlers));
+        pthread_mutex_unlock(&cnt->event_table_mutex);
+        handler = handlers;
+    } else {
+        handler = cnt->event_table[type];
     }
+
+    for (; *handler; handler++)
+        event_handlers[*handler - 1].handler(cnt, type, image, filename, eventdata, tm);
+
+    /* The copies queued for the image must not be shared beyond this event */
+    writer_forget(cnt);
 }
@@ -32,10 +32,16 @@
 #define EVENT_FFMPEG_PUT        19
 #define EVENT_SDL_PUT           20
 
+#define EVENT_LAST              EVENT_SDL_PUT
+#define EVENT_HANDLERS_MAX      8   /* enabled handlers of one event type */
+
+struct context;
 
 typedef void(* event_handler)(struct context *, int, unsigned char *, char *, void *, struct tm *);
 
 void event(struct context *, int, unsigned char *, char *, void *, struct tm *);
 const char * imageext(struct context *);
+void command_helper_start(void);
+void event_table_build(struct context *);
 
 #endif /* _INCLUDE_EVENT_H_ */
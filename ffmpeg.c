@@ -88,11 +88,88 @@ AVFrame *ffmpeg_prepare_frame(struct ffmpeg *, unsigned char *,
 /* This is the trailer used to end mpeg1 videos. */
 static unsigned char mpeg1_trailer[] = {0x00, 0x00, 0x01, 0xb7};
 
+/*
+ * Neutral chroma line for greyscale images, used for every line of the U
+ * and V planes when the codec has no grey pixel format. Set up by ffmpeg_init.
+ */
+#define GREY_CHROMA_WIDTH 4096
+static unsigned char grey_chroma[GREY_CHROMA_WIDTH];
+
 
 // FFMPEG API changed in 0.8
 #if defined FF_API_NEW_AVIO
 
-// TODO
+/**
+ * movie_write
+ *      Write function of the AVIOContext of a movie file.
+ */
+static int movie_write(void *opaque, uint8_t *buf, int size)
+{
+    if (myseqwrite(opaque, buf, size) < 0)
+        return AVERROR(EIO);
+
+    return size;
+}
+
+/**
+ * movie_seek
+ *      Seek function of the AVIOContext of a movie file.
+ */
+static int64_t movie_seek(void *opaque, int64_t offset, int whence)
+{
+    struct seqfile *file = opaque;
+
+    if (whence & AVSEEK_SIZE)
+        return file->end;
+
+    return myseqseek(file, offset, whence & ~AVSEEK_FORCE);
+}
+
+/**
+ * movie_open
+ *      Opens a movie file for libavformat. Instead of its file protocol we
+ *      use myseqopen, which preallocates the file and keeps the movie data
+ *      from filling up the page cache.
+ *
+ *  Returns 0 on success and -1 on error.
+ */
+static int movie_open(struct ffmpeg *ffmpeg, const char *filename, int append)
+{
+    unsigned char *buffer;
+
+    if ((ffmpeg->file = myseqopen(filename, append)) == NULL)
+        return -1;
+
+    if ((buffer = av_malloc(BUFSIZE_1MEG)) != NULL)
+        ffmpeg->oc->pb = avio_alloc_context(buffer, BUFSIZE_1MEG, 1, ffmpeg->file,
+                                            NULL, movie_write, movie_seek);
+
+    if (!buffer || !ffmpeg->oc->pb) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Could not allocate output"
+                   " context for %s", filename);
+        av_free(buffer);
+        myseqclose(ffmpeg->file);
+        ffmpeg->file = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * movie_close
+ *      Flushes and closes a movie file opened with movie_open.
+ */
+static void movie_close(struct ffmpeg *ffmpeg)
+{
+    avio_flush(ffmpeg->oc->pb);
+    av_free(ffmpeg->oc->pb->buffer);
+    av_free(ffmpeg->oc->pb);
+    ffmpeg->oc->pb = NULL;
+
+    myseqclose(ffmpeg->file);
+    ffmpeg->file = NULL;
+}
 
 #else
 
@@ -284,6 +361,8 @@ void ffmpeg_init()
                LIBAVFORMAT_BUILD);
     av_register_all();
 
+    memset(grey_chroma, 128, sizeof(grey_chroma));
+
 #if LIBAVCODEC_BUILD > 4680
     av_log_set_callback((void *)ffmpeg_avcodec_log);
     av_log_set_level(AV_LOG_ERROR);
@@ -438,6 +517,30 @@ static AVOutputFormat *get_oformat(const char *codec, char *filename)
     return of;
 }
 
+/**
+ * ffmpeg_set_planes
+ *      Points the planes of a frame at the image. The U and V planes of
+ *      greyscale images all read the same neutral line (line size 0).
+ */
+static void ffmpeg_set_planes(struct ffmpeg *ffmpeg, AVFrame *picture,
+                              unsigned char *y, unsigned char *u, unsigned char *v)
+{
+    picture->data[0] = y;
+    picture->linesize[0] = ffmpeg->c->width;
+
+    if (ffmpeg->grey) {
+        picture->data[1] = grey_chroma;
+        picture->data[2] = grey_chroma;
+        picture->linesize[1] = 0;
+        picture->linesize[2] = 0;
+    } else {
+        picture->data[1] = u;
+        picture->data[2] = v;
+        picture->linesize[1] = ffmpeg->c->width / 2;
+        picture->linesize[2] = ffmpeg->c->width / 2;
+    }
+}
+
 /**
  * ffmpeg_open
  *      Opens an mpeg file using the new libavformat method. Both mpeg1
@@ -450,13 +553,18 @@ static AVOutputFormat *get_oformat(const char *codec, char *filename)
  */
 struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
                            unsigned char *y, unsigned char *u, unsigned char *v,
-                           int width, int height, int rate, int bps, int vbr)
+                           int width, int height, int rate, int bps, int vbr,
+                           int gop, int threads, const char *preset, const char *tune)
 {
     AVCodecContext *c;
     AVCodec *codec;
     struct ffmpeg *ffmpeg;
     int is_mpeg1;
     int ret;
+#if defined FF_API_NEW_AVIO
+    AVDictionary *opts = NULL;
+    AVDictionaryEntry *opt = NULL;
+#endif
     /*
      * Allocate space for our ffmpeg structure. This structure contains all the
      * codec and image information we need to generate movies.
@@ -467,6 +575,8 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
     memset(ffmpeg, 0, sizeof(struct ffmpeg));
 
     ffmpeg->vbr = vbr;
+    ffmpeg->rate = rate;
+    ffmpeg->last_pts = -1;
 
     /* Store codec name in ffmpeg->codec, with buffer overflow check. */
     snprintf(ffmpeg->codec, sizeof(ffmpeg->codec), "%s", ffmpeg_video_codec);
@@ -556,7 +666,25 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
      * Set codec specific parameters.
      * Set intra frame distance in frames depending on codec.
      */
-    c->gop_size = is_mpeg1 ? 10 : 12;
+    if (gop > 0)
+        c->gop_size = gop;
+    else
+        c->gop_size = is_mpeg1 ? 10 : 12;
+
+    /*
+     * Let the encoder split the work over several threads. Slice threading
+     * adds no delay, frame threading (ffv1, libx264) holds back up to one
+     * packet per thread, see ffmpeg_flush.
+     */
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads > 1) {
+        c->thread_count = threads;
+#ifdef FF_THREAD_FRAME
+        c->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+#endif
+    }
 
     /* Some formats want stream headers to be separate. */
     if (!strcmp(ffmpeg->oc->oformat->name, "mp4") ||
@@ -596,12 +724,52 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
     /* Set the picture format - need in ffmpeg starting round April-May 2005 */
     c->pix_fmt = PIX_FMT_YUV420P;
 
+    /*
+     * Greyscale images are encoded as they are if the codec knows a grey
+     * format, otherwise they get the neutral chroma line for all lines.
+     */
+    if (!u) {
+        ffmpeg->grey = 1;
+
+        if (codec->pix_fmts) {
+            const enum PixelFormat *fmt;
+
+            for (fmt = codec->pix_fmts; *fmt != PIX_FMT_NONE; fmt++)
+                if (*fmt == PIX_FMT_GRAY8)
+                    c->pix_fmt = PIX_FMT_GRAY8;
+        }
+
+        if (c->pix_fmt != PIX_FMT_GRAY8 && width / 2 > GREY_CHROMA_WIDTH) {
+            MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Greyscale images wider than"
+                       " %d pixels are not supported by codec %s", GREY_CHROMA_WIDTH * 2,
+                       ffmpeg_video_codec);
+            ffmpeg_cleanups(ffmpeg);
+            return NULL;
+        }
+    }
+
+#if defined FF_API_NEW_AVIO
+    /* Private options of the encoder, the codecs which don't know them leave them. */
+    if (preset)
+        av_dict_set(&opts, "preset", preset, 0);
+    if (tune)
+        av_dict_set(&opts, "tune", tune, 0);
+#else
+    if (preset || tune)
+        MOTION_LOG(WRN, TYPE_ENCODER, NO_ERRNO, "%s: ffmpeg_preset and ffmpeg_tune"
+                   " need a newer ffmpeg, ignored");
+#if LIBAVCODEC_VERSION_MAJOR < 53
+    if (threads > 1)
+        avcodec_thread_init(c, threads);
+#endif
+#endif
+
     /* Get a mutex lock. */
     pthread_mutex_lock(&global_lock);
 
     /* Open the codec */
 #if defined FF_API_NEW_AVIO
-    ret = avcodec_open2(c, codec, NULL /* options */ );
+    ret = avcodec_open2(c, codec, &opts);
 #else
     ret = avcodec_open(c, codec);
 #endif
@@ -611,6 +779,9 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
         pthread_mutex_unlock(&global_lock);
         MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: avcodec_open - could not open codec %s",
                    ffmpeg_video_codec);
+#if defined FF_API_NEW_AVIO
+        av_dict_free(&opts);
+#endif
         ffmpeg_cleanups(ffmpeg);
         return NULL;
     }
@@ -618,6 +789,17 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
     /* Release the lock. */
     pthread_mutex_unlock(&global_lock);
 
+#if defined FF_API_NEW_AVIO
+    while ((opt = av_dict_get(opts, "", opt, AV_DICT_IGNORE_SUFFIX)))
+        MOTION_LOG(WRN, TYPE_ENCODER, NO_ERRNO, "%s: Codec %s does not support"
+                   " the option %s=%s, ignored", ffmpeg_video_codec, opt->key, opt->value);
+    av_dict_free(&opts);
+#endif
+
+    if (c->thread_count > 1)
+        MOTION_LOG(INF, TYPE_ENCODER, NO_ERRNO, "%s: Encoding with %d threads",
+                   c->thread_count);
+
     ffmpeg->video_outbuf = NULL;
 
     if (!(ffmpeg->oc->oformat->flags & AVFMT_RAWPICTURE)) {
@@ -646,15 +828,20 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
 
 
     /* Set the frame data. */
-    ffmpeg->picture->data[0] = y;
-    ffmpeg->picture->data[1] = u;
-    ffmpeg->picture->data[2] = v;
-    ffmpeg->picture->linesize[0] = ffmpeg->c->width;
-    ffmpeg->picture->linesize[1] = ffmpeg->c->width / 2;
-    ffmpeg->picture->linesize[2] = ffmpeg->c->width / 2;
+    ffmpeg_set_planes(ffmpeg, ffmpeg->picture, y, u, v);
 
     /* Open the output file, if needed. */
     if (!(ffmpeg->oc->oformat->flags & AVFMT_NOFILE)) {
+#if defined FF_API_NEW_AVIO
+        /* mpeg1 movies are appended to, like with the append file protocol */
+        if (movie_open(ffmpeg, filename, is_mpeg1) < 0) {
+            if (errno == EACCES)
+                MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Can't write movie %s"
+                           " - check access rights to target directory", filename);
+            ffmpeg_cleanups(ffmpeg);
+            return NULL;
+        }
+#else
         char file_proto[256];
 
         /*
@@ -662,20 +849,12 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
          * url_fopen, but no protocol (=> default) for other codecs.
          */
         if (is_mpeg1)
-#if defined FF_API_NEW_AVIO
-            snprintf(file_proto, sizeof(file_proto), "%s", filename);
-#else
             snprintf(file_proto, sizeof(file_proto), APPEND_PROTO ":%s", filename);
-#endif
         else
             snprintf(file_proto, sizeof(file_proto), "%s", filename);
 
 
-#if defined FF_API_NEW_AVIO
-        if (avio_open(&ffmpeg->oc->pb, file_proto, URL_WRONLY) < 0) {
-#else
         if (url_fopen(&ffmpeg->oc->pb, file_proto, URL_WRONLY) < 0) {
-#endif
             /* Path did not exist? */
             if (errno == ENOENT) {
                 /* Create path for file (don't use file_proto)... */
@@ -684,12 +863,8 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
                     return NULL;
                 }
 
-#if defined FF_API_NEW_AVIO
-                if (avio_open(&ffmpeg->oc->pb, file_proto, URL_WRONLY) < 0) {
-#else
                 /* And retry opening the file (use file_proto). */
                 if (url_fopen(&ffmpeg->oc->pb, file_proto, URL_WRONLY) < 0) {
-#endif
                     MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO, "%s: url_fopen -"
                                " error opening file %s", filename);
                     ffmpeg_cleanups(ffmpeg);
@@ -710,6 +885,7 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
                 return NULL;
             }
         }
+#endif /* FF_API_NEW_AVIO */
     }
 
     /* Write the stream header, if any. */
@@ -721,6 +897,105 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
     return ffmpeg;
 }
 
+/**
+ * ffmpeg_open_passthrough
+ *      Opens a movie file which gets the compressed packets of the camera
+ *      copied into it. No encoder is opened, the stream only describes the
+ *      packets we are given. Matroska is used as container as it accepts
+ *      about any codec and any time base.
+ *
+ *  Returns
+ *      A new allocated ffmpeg struct or NULL if any error happens.
+ */
+struct ffmpeg *ffmpeg_open_passthrough(char *filename, int codec_id,
+                                       unsigned char *extradata, int extradata_size,
+                                       int tb_num, int tb_den, int width, int height)
+{
+#if defined FF_API_NEW_AVIO
+    AVCodecContext *c;
+    struct ffmpeg *ffmpeg;
+
+    ffmpeg = mymalloc(sizeof(struct ffmpeg));
+    memset(ffmpeg, 0, sizeof(struct ffmpeg));
+
+    ffmpeg->passthrough = 1;
+    ffmpeg->src_time_base.num = tb_num;
+    ffmpeg->src_time_base.den = tb_den;
+    ffmpeg->start_dts = AV_NOPTS_VALUE;
+    ffmpeg->last_dts = AV_NOPTS_VALUE;
+    snprintf(ffmpeg->codec, sizeof(ffmpeg->codec), "%s", FFMPEG_PASSTHROUGH_CODEC);
+
+    ffmpeg->oc = avformat_alloc_context();
+
+    if (!ffmpeg->oc) {
+        MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO, "%s: Memory error while allocating"
+                   " output media context");
+        free(ffmpeg);
+        return NULL;
+    }
+
+    ffmpeg->oc->oformat = av_guess_format("matroska", NULL, NULL);
+    if (!ffmpeg->oc->oformat) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Could not guess format for %s",
+                   FFMPEG_PASSTHROUGH_CODEC);
+        ffmpeg_cleanups(ffmpeg);
+        return NULL;
+    }
+
+    /* The 4 allows for ".mkv" to be appended. */
+    strncat(filename, ".mkv", 4);
+    snprintf(ffmpeg->oc->filename, sizeof(ffmpeg->oc->filename), "%s", filename);
+
+    ffmpeg->video_st = avformat_new_stream(ffmpeg->oc, NULL);
+    if (!ffmpeg->video_st) {
+        MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO, "%s: avformat_new_stream - could"
+                   " not alloc stream");
+        ffmpeg_cleanups(ffmpeg);
+        return NULL;
+    }
+
+    ffmpeg->c     = c = AVSTREAM_CODEC_PTR(ffmpeg->video_st);
+    c->codec_id   = codec_id;
+    c->codec_type = AVMEDIA_TYPE_VIDEO;
+    c->width      = width;
+    c->height     = height;
+    c->pix_fmt    = PIX_FMT_YUV420P;
+    c->time_base  = ffmpeg->src_time_base;
+    ffmpeg->video_st->time_base = ffmpeg->src_time_base;
+
+    /* H.264 and friends need the SPS/PPS of the camera in the container. */
+    if (extradata && extradata_size > 0) {
+        c->extradata = av_mallocz(extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (c->extradata) {
+            memcpy(c->extradata, extradata, extradata_size);
+            c->extradata_size = extradata_size;
+        }
+    }
+
+    if (ffmpeg->oc->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+    if (movie_open(ffmpeg, filename, 0) < 0) {
+        ffmpeg_cleanups(ffmpeg);
+        return NULL;
+    }
+
+    if (avformat_write_header(ffmpeg->oc, NULL) < 0) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Could not write header"
+                   " of %s", filename);
+        movie_close(ffmpeg);
+        ffmpeg_cleanups(ffmpeg);
+        return NULL;
+    }
+
+    return ffmpeg;
+#else
+    MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: ffmpeg_video_codec %s needs"
+               " libavformat 54.6.100 or newer", FFMPEG_PASSTHROUGH_CODEC);
+    return NULL;
+#endif /* FF_API_NEW_AVIO */
+}
+
 /**
  * ffmpeg_cleanups
  *      Clean up ffmpeg struct if something was wrong.
@@ -733,7 +1008,7 @@ void ffmpeg_cleanups(struct ffmpeg *ffmpeg)
     unsigned int i;
 
     /* Close each codec */
-    if (ffmpeg->video_st) {
+    if (ffmpeg->video_st && !ffmpeg->passthrough) {
         pthread_mutex_lock(&global_lock);
 #if LIBAVCODEC_BUILD > 4680
         if (ffmpeg->video_st->codec->priv_data != NULL)
@@ -744,6 +1019,10 @@ void ffmpeg_cleanups(struct ffmpeg *ffmpeg)
         free(ffmpeg->video_outbuf);
     }
 
+    /* The copied codec header is ours, not the encoder's */
+    if (ffmpeg->passthrough && ffmpeg->c)
+        av_freep(&ffmpeg->c->extradata);
+
     /* Free the streams */
     for (i = 0; i < ffmpeg->oc->nb_streams; i++)
         av_freep(&ffmpeg->oc->streams[i]);
@@ -756,6 +1035,62 @@ void ffmpeg_cleanups(struct ffmpeg *ffmpeg)
     free(ffmpeg);
 }
 
+#ifdef FFMPEG_AVWRITEFRAME_NEWAPI
+/**
+ * ffmpeg_packet_time
+ *      Converts the time stamps of an encoded packet from the time base of
+ *      the codec (frames) to the one the muxer chose for the stream.
+ */
+static void ffmpeg_packet_time(struct ffmpeg *ffmpeg, AVPacket *pkt)
+{
+    AVRational codec_tb = AVSTREAM_CODEC_PTR(ffmpeg->video_st)->time_base;
+
+    if (pkt->pts != (int64_t)AV_NOPTS_VALUE)
+        pkt->pts = av_rescale_q(pkt->pts, codec_tb, ffmpeg->video_st->time_base);
+    if (pkt->dts != (int64_t)AV_NOPTS_VALUE)
+        pkt->dts = av_rescale_q(pkt->dts, codec_tb, ffmpeg->video_st->time_base);
+}
+#endif /* FFMPEG_AVWRITEFRAME_NEWAPI */
+
+/**
+ * ffmpeg_flush
+ *      Writes the packets still held by the encoder. Codecs with B-frames or
+ *      frame threading return the packets of the last frames only once they
+ *      are asked for them with an empty frame.
+ *
+ * Returns
+ *      Function returns nothing.
+ */
+static void ffmpeg_flush(struct ffmpeg *ffmpeg)
+{
+#if defined FF_API_NEW_AVIO
+    AVCodecContext *c = AVSTREAM_CODEC_PTR(ffmpeg->video_st);
+    AVPacket pkt;
+    int got_packet;
+
+    if (ffmpeg->oc->oformat->flags & AVFMT_RAWPICTURE)
+        return;
+
+    for (;;) {
+        av_init_packet(&pkt);
+        pkt.data = ffmpeg->video_outbuf;
+        pkt.size = ffmpeg->video_outbuf_size;
+
+        if (avcodec_encode_video2(c, &pkt, NULL, &got_packet) < 0 || !got_packet)
+            break;
+
+        pkt.stream_index = ffmpeg->video_st->index;
+        ffmpeg_packet_time(ffmpeg, &pkt);
+
+        if (av_write_frame(ffmpeg->oc, &pkt) != 0) {
+            MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO, "%s: Error while writing"
+                       " delayed video frame");
+            break;
+        }
+    }
+#endif /* FF_API_NEW_AVIO */
+}
+
 /**
  * ffmpeg_close
  *      Closes a video file.
@@ -768,7 +1103,8 @@ void ffmpeg_close(struct ffmpeg *ffmpeg)
     unsigned int i;
 
     /* Close each codec */
-    if (ffmpeg->video_st) {
+    if (ffmpeg->video_st && !ffmpeg->passthrough) {
+        ffmpeg_flush(ffmpeg);
         pthread_mutex_lock(&global_lock);
         avcodec_close(AVSTREAM_CODEC_PTR(ffmpeg->video_st));
         pthread_mutex_unlock(&global_lock);
@@ -779,6 +1115,10 @@ void ffmpeg_close(struct ffmpeg *ffmpeg)
     /* Write the trailer, if any. */
     av_write_trailer(ffmpeg->oc);
 
+    /* The copied codec header is ours, not the encoder's */
+    if (ffmpeg->passthrough)
+        av_freep(&ffmpeg->c->extradata);
+
     /* Free the streams. */
     for (i = 0; i < ffmpeg->oc->nb_streams; i++)
         av_freep(&ffmpeg->oc->streams[i]);
@@ -786,7 +1126,7 @@ void ffmpeg_close(struct ffmpeg *ffmpeg)
     if (!(ffmpeg->oc->oformat->flags & AVFMT_NOFILE)) {
         /* Close the output file. */
 #if defined FF_API_NEW_AVIO
-        avio_close(ffmpeg->oc->pb);
+        movie_close(ffmpeg);
 #elif LIBAVFORMAT_BUILD >= (52<<16)
         url_fclose(ffmpeg->oc->pb);
 #else
@@ -803,6 +1143,77 @@ void ffmpeg_close(struct ffmpeg *ffmpeg)
     free(ffmpeg);
 }
 
+/**
+ * ffmpeg_frame_pts
+ *      Returns the pts of a frame captured at tv, in frames of the movie
+ *      since its first frame. Without a capture time the frame follows the
+ *      previous one. A pause of more than one second (motion, no motion,
+ *      motion again within one event) is not kept in the movie, the frames
+ *      after it follow the frames before it like they always did.
+ */
+static int64_t ffmpeg_frame_pts(struct ffmpeg *ffmpeg, const struct timeval *tv)
+{
+    int64_t usec, pts;
+
+    if (!tv)
+        return ffmpeg->last_pts + 1;
+
+    if (ffmpeg->last_pts < 0) {
+        ffmpeg->start_time = *tv;
+        return 0;
+    }
+
+    usec = (int64_t)(tv->tv_sec - ffmpeg->start_time.tv_sec) * 1000000 +
+           (tv->tv_usec - ffmpeg->start_time.tv_usec);
+    pts = (usec * ffmpeg->rate + 500000) / 1000000;
+
+    if (pts > ffmpeg->last_pts + ffmpeg->rate || usec < 0) {
+        /* Move the start so that this frame becomes the next one */
+        pts = ffmpeg->last_pts + 1;
+        usec = (int64_t)pts * 1000000 / ffmpeg->rate;
+        ffmpeg->start_time.tv_sec = tv->tv_sec - usec / 1000000;
+        ffmpeg->start_time.tv_usec = tv->tv_usec - usec % 1000000;
+
+        if (ffmpeg->start_time.tv_usec < 0) {
+            ffmpeg->start_time.tv_usec += 1000000;
+            ffmpeg->start_time.tv_sec--;
+        }
+    }
+
+    return pts;
+}
+
+/**
+ * ffmpeg_put_timed
+ *      Encodes a frame with the pts of its capture time. Frames captured
+ *      within the same frame interval of the movie as the previous one are
+ *      skipped. Formats which store no time stamps (raw mpeg1) get the
+ *      frame repeated for the intervals without a frame, the others just
+ *      have a longer frame duration.
+ *
+ * Returns
+ *      value returned by ffmpeg_put_frame call, 0 if the frame was skipped.
+ */
+static int ffmpeg_put_timed(struct ffmpeg *ffmpeg, AVFrame *pic, const struct timeval *tv)
+{
+    int64_t pts = ffmpeg_frame_pts(ffmpeg, tv);
+
+    if (pts <= ffmpeg->last_pts)
+        return 0;
+
+    if (ffmpeg->oc->oformat->flags & AVFMT_NOTIMESTAMPS) {
+        while (ffmpeg->last_pts + 1 < pts) {
+            pic->pts = ++ffmpeg->last_pts;
+            if (ffmpeg_put_frame(ffmpeg, pic) == -1)
+                return -1;
+        }
+    }
+
+    pic->pts = ffmpeg->last_pts = pts;
+
+    return ffmpeg_put_frame(ffmpeg, pic);
+}
+
 /**
  * ffmpeg_put_image
  *      Puts the image pointed to by ffmpeg->picture.
@@ -810,9 +1221,9 @@ void ffmpeg_close(struct ffmpeg *ffmpeg)
  * Returns
  *      value returned by ffmpeg_put_frame call.
  */
-int ffmpeg_put_image(struct ffmpeg *ffmpeg)
+int ffmpeg_put_image(struct ffmpeg *ffmpeg, const struct timeval *tv)
 {
-    return ffmpeg_put_frame(ffmpeg, ffmpeg->picture);
+    return ffmpeg_put_timed(ffmpeg, ffmpeg->picture, tv);
 }
 
 /**
@@ -825,7 +1236,8 @@ int ffmpeg_put_image(struct ffmpeg *ffmpeg)
  *       0 if error allocating picture.
  */
 int ffmpeg_put_other_image(struct ffmpeg *ffmpeg, unsigned char *y,
-                            unsigned char *u, unsigned char *v)
+                            unsigned char *u, unsigned char *v,
+                            const struct timeval *tv)
 {
     AVFrame *picture;
     int ret = 0;
@@ -834,7 +1246,7 @@ int ffmpeg_put_other_image(struct ffmpeg *ffmpeg, unsigned char *y,
     picture = ffmpeg_prepare_frame(ffmpeg, y, u, v);
 
     if (picture) {
-        ret = ffmpeg_put_frame(ffmpeg, picture);
+        ret = ffmpeg_put_timed(ffmpeg, picture, tv);
         if (!ret)
             av_free(picture);
     }
@@ -884,8 +1296,8 @@ int ffmpeg_put_frame(struct ffmpeg *ffmpeg, AVFrame *pic)
 
         out_size = avcodec_encode_video2(AVSTREAM_CODEC_PTR(ffmpeg->video_st),
                                         &pkt, pic, &got_packet_ptr);
-        if (out_size < 0)
-            // Error encondig
+        if (out_size < 0 || !got_packet_ptr)
+            // Error encondig or the frame was buffered
             out_size = 0;
         else
             out_size = pkt.size;
@@ -901,17 +1313,21 @@ int ffmpeg_put_frame(struct ffmpeg *ffmpeg, AVFrame *pic)
              * XXX: in case of B frames, the pts is not yet valid.
              */
 #ifdef FFMPEG_AVWRITEFRAME_NEWAPI
+#   if !defined FF_API_NEW_AVIO
+            /* The old encoder leaves pts and key flag in coded_frame */
             pkt.pts = AVSTREAM_CODEC_PTR(ffmpeg->video_st)->coded_frame->pts;
 
             if (AVSTREAM_CODEC_PTR(ffmpeg->video_st)->coded_frame->key_frame)
-#   if LIBAVCODEC_VERSION_MAJOR < 53
+#       if LIBAVCODEC_VERSION_MAJOR < 53
                 pkt.flags |= PKT_FLAG_KEY;
-#   else
+#       else
                 pkt.flags |= AV_PKT_FLAG_KEY;
-#   endif
+#       endif
 
             pkt.data = ffmpeg->video_outbuf;
             pkt.size = out_size;
+#   endif /* !FF_API_NEW_AVIO */
+            ffmpeg_packet_time(ffmpeg, &pkt);
             ret = av_write_frame(ffmpeg->oc, &pkt);
 #else
             ret = av_write_frame(ffmpeg->oc, ffmpeg->video_st->index,
@@ -933,6 +1349,89 @@ int ffmpeg_put_frame(struct ffmpeg *ffmpeg, AVFrame *pic)
     return ret;
 }
 
+/**
+ * ffmpeg_put_packets
+ *      Writes the compressed packets stored with an image into a movie
+ *      opened by ffmpeg_open_passthrough. Nothing is written until the
+ *      first key packet, and again after packets were lost on the way
+ *      (sequence number gap), since they could not be decoded anyway.
+ *
+ * Returns
+ *      0 on success or -1 if any error happens.
+ */
+int ffmpeg_put_packets(struct ffmpeg *ffmpeg, struct packet_data *packets)
+{
+#if defined FF_API_NEW_AVIO
+    AVPacket pkt;
+    unsigned char *data = packets->data;
+    int i;
+
+    if (packets->count == 0)
+        return 0;
+
+    if (ffmpeg->got_key && packets->seq != ffmpeg->next_seq) {
+        if (!(packets->info[0].flags & PACKET_KEY))
+            MOTION_LOG(WRN, TYPE_ENCODER, NO_ERRNO, "%s: Packets lost, waiting"
+                       " for next key frame");
+        ffmpeg->got_key = 0;
+    }
+    ffmpeg->next_seq = packets->seq + 1;
+
+    for (i = 0; i < packets->count; data += packets->info[i].size, i++) {
+        struct packet_info *info = &packets->info[i];
+        int64_t dts = info->dts, pts = info->pts;
+
+        if (!ffmpeg->got_key) {
+            if (!(info->flags & PACKET_KEY))
+                continue;
+            ffmpeg->got_key = 1;
+        }
+
+        if (dts == AV_NOPTS_VALUE)
+            dts = pts;
+        if (dts == AV_NOPTS_VALUE)
+            continue;
+
+        if (ffmpeg->start_dts == AV_NOPTS_VALUE)
+            ffmpeg->start_dts = dts;
+
+        dts = av_rescale_q(dts - ffmpeg->start_dts, ffmpeg->src_time_base,
+                           ffmpeg->video_st->time_base);
+        if (pts == AV_NOPTS_VALUE)
+            pts = dts;
+        else
+            pts = av_rescale_q(pts - ffmpeg->start_dts, ffmpeg->src_time_base,
+                               ffmpeg->video_st->time_base);
+
+        /* The muxer insists on strictly increasing dts and pts >= dts. */
+        if (ffmpeg->last_dts != AV_NOPTS_VALUE && dts <= ffmpeg->last_dts)
+            dts = ffmpeg->last_dts + 1;
+        if (pts < dts)
+            pts = dts;
+        ffmpeg->last_dts = dts;
+
+        av_init_packet(&pkt);
+        pkt.stream_index = ffmpeg->video_st->index;
+        pkt.data = data;
+        pkt.size = info->size;
+        pkt.pts = pts;
+        pkt.dts = dts;
+        if (info->flags & PACKET_KEY)
+            pkt.flags |= AV_PKT_FLAG_KEY;
+
+        if (av_write_frame(ffmpeg->oc, &pkt) < 0) {
+            MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO, "%s: Error while writing"
+                       " video packet");
+            return -1;
+        }
+    }
+
+    return 0;
+#else
+    return -1;
+#endif /* FF_API_NEW_AVIO */
+}
+
 /**
  * ffmpeg_prepare_frame
  *      Allocates and prepares a picture frame by setting up the U, Y and V pointers in
@@ -960,12 +1459,7 @@ AVFrame *ffmpeg_prepare_frame(struct ffmpeg *ffmpeg, unsigned char *y,
         picture->quality = ffmpeg->vbr;
 
     /* Setup pointers and line widths. */
-    picture->data[0] = y;
-    picture->data[1] = u;
-    picture->data[2] = v;
-    picture->linesize[0] = ffmpeg->c->width;
-    picture->linesize[1] = ffmpeg->c->width / 2;
-    picture->linesize[2] = ffmpeg->c->width / 2;
+    ffmpeg_set_planes(ffmpeg, picture, y, u, v);
 
     return picture;
 }
@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <sys/time.h>
 
 /*
  * Define a codec name/identifier for timelapse videos, so that we can
@@ -35,6 +36,16 @@
  */
 #define TIMELAPSE_CODEC "mpeg1_tl"
 
+/*
+ * Codec name which makes motion store the packets delivered by the camera
+ * as they are, without decoding and encoding them again.
+ */
+#define FFMPEG_PASSTHROUGH_CODEC "copy"
+#define FFMPEG_PASSTHROUGH(cnt) ((cnt)->conf.ffmpeg_output && (cnt)->conf.ffmpeg_video_codec && \
+                                 !strcmp((cnt)->conf.ffmpeg_video_codec, FFMPEG_PASSTHROUGH_CODEC))
+
+struct packet_data;
+
 struct ffmpeg {
 #ifdef HAVE_FFMPEG
     AVFormatContext *oc;
@@ -45,9 +56,21 @@ struct ffmpeg {
     uint8_t *video_outbuf;
     int video_outbuf_size;
 
-    void *udata;            /* U & V planes for greyscale images */
+    int grey;               /* images have no U & V planes */
     int vbr;                /* variable bitrate setting */
     char codec[20];         /* codec name */
+    struct seqfile *file;   /* movie file, see movie_open */
+
+    int rate;               /* frame rate of the movie, 1 / time base */
+    struct timeval start_time; /* capture time of the frame with pts 0 */
+    int64_t last_pts;       /* pts of the last frame encoded, -1 if none */
+
+    int passthrough;        /* packets are copied, no encoder is used */
+    AVRational src_time_base; /* time base of the camera packets */
+    int64_t start_dts;      /* dts of the first packet written */
+    int64_t last_dts;       /* dts of the last packet written */
+    unsigned int next_seq;  /* expected sequence number of the next packets */
+    int got_key;            /* a key packet has been written */
 #else
     int dummy;
 #endif
@@ -66,24 +89,52 @@ struct ffmpeg *ffmpeg_open(
     char *ffmpeg_video_codec,
     char *filename,
     unsigned char *y,    /* YUV420 Y plane */
-    unsigned char *u,    /* YUV420 U plane */
-    unsigned char *v,    /* YUV420 V plane */
+    unsigned char *u,    /* YUV420 U plane, NULL for greyscale images */
+    unsigned char *v,    /* YUV420 V plane, NULL for greyscale images */
     int width,
     int height,
     int rate,            /* framerate, fps */
     int bps,             /* bitrate; bits per second */
-    int vbr              /* variable bitrate */
+    int vbr,             /* variable bitrate */
+    int gop,             /* key frame distance, 0 = codec default */
+    int threads,         /* encoder threads, 0 = one per processor */
+    const char *preset,  /* encoder preset or NULL */
+    const char *tune     /* encoder tuning or NULL */
     );
 
-/* Puts the image pointed to by the picture member of struct ffmpeg. */
-int ffmpeg_put_image(struct ffmpeg *);
+/*
+ * Open a movie file which gets the compressed packets of the camera copied
+ * into it (see FFMPEG_PASSTHROUGH_CODEC). The extradata and time base are the
+ * ones of the camera stream.
+ */
+struct ffmpeg *ffmpeg_open_passthrough(
+    char *filename,
+    int codec_id,                /* CodecID of the camera stream */
+    unsigned char *extradata,    /* codec global header, may be NULL */
+    int extradata_size,
+    int tb_num,                  /* time base of pts/dts of the packets */
+    int tb_den,
+    int width,
+    int height
+    );
+
+/* Puts the compressed packets stored with an image. */
+int ffmpeg_put_packets(struct ffmpeg *, struct packet_data *);
+
+/*
+ * Puts the image pointed to by the picture member of struct ffmpeg. The
+ * capture time gives the pts of the frame, NULL puts it one frame after the
+ * previous one.
+ */
+int ffmpeg_put_image(struct ffmpeg *, const struct timeval *);
 
-/* Puts the image defined by u, y and v (YUV420 format). */
+/* Puts the image defined by u, y and v (YUV420 format, u and v unused if grey). */
 int ffmpeg_put_other_image(
     struct ffmpeg *ffmpeg,
     unsigned char *y,
     unsigned char *u,
-    unsigned char *v
+    unsigned char *v,
+    const struct timeval *tv  /* capture time or NULL, see ffmpeg_put_image */
     );
 
 /* Closes the mpeg file. */
@@ -751,6 +751,219 @@ ERR_EXIT:
     return -1;
 }
 
+#if JPEG_LIB_VERSION >= 70
+#define DCT_ROWS(comp) ((comp)->DCT_v_scaled_size)
+#define MIN_DCT_ROWS(dinfo) ((dinfo)->min_DCT_v_scaled_size)
+#else
+#define DCT_ROWS(comp) ((comp)->DCT_scaled_size)
+#define MIN_DCT_ROWS(dinfo) ((dinfo)->min_DCT_scaled_size)
+#endif
+
+/* Decompressor kept from frame to frame, see jpeg_decoder_new */
+struct jpeg_decoder {
+    struct jpeg_decompress_struct dinfo;
+    struct my_error_mgr jerr;
+    int scale;                      /* decode at 1/scale of the jpeg size */
+    size_t row_size;                /* bytes of each row buffer */
+    unsigned char *rows;            /* 3 * 17 row buffers */
+    JSAMPROW row[3][17];            /* 16 for libjpeg, the last for a chroma row kept */
+};
+
+/**
+ * jpeg_decoder_new
+ *
+ *      Sets up a decompressor for the frames of a camera. Unlike
+ *      decode_jpeg_raw it isn't created and destroyed for every frame, and
+ *      the Huffman tables of the stream (or the standard ones, which MJPEG
+ *      frames leave out) are only set up once. scale 2, 4 or 8 decodes the
+ *      frames at that fraction of their size, which libjpeg does while
+ *      transforming the blocks for much less than a full size decode.
+ *
+ * Returns: the decoder, NULL on error
+ */
+struct jpeg_decoder *jpeg_decoder_new(int scale)
+{
+    struct jpeg_decoder *dec = mymalloc(sizeof(struct jpeg_decoder));
+
+    dec->dinfo.err = jpeg_std_error(&dec->jerr.pub);
+    dec->jerr.pub.error_exit = my_error_exit;
+    dec->jerr.original_emit_message = dec->jerr.pub.emit_message;
+    dec->jerr.pub.emit_message = my_emit_message;
+    dec->scale = scale;
+
+    if (setjmp(dec->jerr.setjmp_buffer)) {
+        free(dec);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&dec->dinfo);
+
+    return dec;
+}
+
+/**
+ * jpeg_decoder_free
+ */
+void jpeg_decoder_free(struct jpeg_decoder *dec)
+{
+    if (!dec)
+        return;
+
+    jpeg_destroy_decompress(&dec->dinfo);
+    free(dec->rows);
+    free(dec);
+}
+
+/**
+ * jpeg_decoder_rows
+ *
+ *      Makes the row buffers wide enough for the blocks of the frame.
+ */
+static void jpeg_decoder_rows(struct jpeg_decoder *dec)
+{
+    size_t size = (dec->dinfo.comp_info[0].width_in_blocks + 4) * DCTSIZE;
+    int c, r;
+
+    if (size <= dec->row_size)
+        return;
+
+    dec->rows = myrealloc(dec->rows, 3 * 17 * size, "jpeg_decoder_rows");
+    dec->row_size = size;
+
+    for (c = 0; c < 3; c++)
+        for (r = 0; r < 17; r++)
+            dec->row[c][r] = dec->rows + (c * 17 + r) * size;
+}
+
+/**
+ * jpeg_decoder_yuv420p
+ *
+ *      Decodes a frame of the camera into a YUV 4:2:0 image of width x
+ *      height, straight from the rows libjpeg returns. Frames of another
+ *      size or layout (interlaced, 4:1:1 ...) go through decode_jpeg_raw.
+ *
+ * Returns: as decode_jpeg_raw
+ */
+int jpeg_decoder_yuv420p(struct jpeg_decoder *dec, unsigned char *jpeg_data, int len,
+                         unsigned char *map, int width, int height)
+{
+    struct jpeg_decompress_struct *dinfo = &dec->dinfo;
+    JSAMPARRAY scanarray[3] = { dec->row[0], dec->row[1], dec->row[2] };
+    unsigned char *plane[3];
+    int rows[3], fh[3], fv[3], crow[3] = { 0, 0, 0 };
+    int c, r, x, lines;
+
+    plane[0] = map;
+    plane[1] = map + width * height;
+    plane[2] = plane[1] + (width * height) / 4;
+
+    dec->jerr.warning_seen = 0;
+
+    if (setjmp(dec->jerr.setjmp_buffer)) {
+        /* The tables of the stream stay for the next frame */
+        jpeg_abort_decompress(dinfo);
+        return -1;
+    }
+
+    jpeg_buffer_src(dinfo, jpeg_data, len);
+    jpeg_read_header(dinfo, TRUE);
+
+    dinfo->raw_data_out = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    dinfo->do_fancy_upsampling = FALSE;
+#endif
+    dinfo->out_color_space = JCS_YCbCr;
+    dinfo->dct_method = JDCT_IFAST;
+    dinfo->scale_num = 1;
+    dinfo->scale_denom = dec->scale;
+    guarantee_huff_tables(dinfo);
+    jpeg_start_decompress(dinfo);
+
+    lines = 0;
+
+    if (dinfo->output_components == 3 && dinfo->output_width == (unsigned int)width &&
+        dinfo->output_height == (unsigned int)height) {
+        /* Each component is at the size of its plane or twice that */
+        for (c = 0; c < 3; c++) {
+            jpeg_component_info *comp = &dinfo->comp_info[c];
+            unsigned int w = c ? width / 2 : width;
+            unsigned int h = c ? height / 2 : height;
+
+            rows[c] = comp->v_samp_factor * DCT_ROWS(comp);
+            fh[c] = comp->downsampled_width == w ? 1 : comp->downsampled_width == 2 * w ? 2 : 0;
+            fv[c] = comp->downsampled_height == h ? 1 : comp->downsampled_height == 2 * h ? 2 : 0;
+
+            if (!fh[c] || !fv[c] || rows[c] > 16)
+                break;
+        }
+
+        if (c == 3 && fh[0] == 1 && fv[0] == 1)
+            lines = dinfo->max_v_samp_factor * MIN_DCT_ROWS(dinfo);
+    }
+
+    if (!lines) {
+        jpeg_abort_decompress(dinfo);
+
+        if (dec->scale > 1) {
+            MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO, "%s: Can't decode %dx%d jpeg at 1/%d",
+                       dinfo->image_width, dinfo->image_height, dec->scale);
+            return -1;
+        }
+
+        return decode_jpeg_raw(jpeg_data, len, 0, 420, width, height, plane[0],
+                               plane[1], plane[2]);
+    }
+
+    jpeg_decoder_rows(dec);
+
+    while (dinfo->output_scanline < dinfo->output_height) {
+        int line = dinfo->output_scanline;
+
+        jpeg_read_raw_data(dinfo, scanarray, lines);
+
+        for (r = 0; r < rows[0] && line + r < height; r++)
+            memcpy(plane[0] + (line + r) * width, dec->row[0][r], width);
+
+        for (c = 1; c < 3; c++) {
+            for (r = 0; r < rows[c]; r++, crow[c]++) {
+                int out = crow[c] / fv[c];
+                unsigned char *dst = plane[c] + out * (width / 2);
+                const unsigned char *src = dec->row[c][r];
+                const unsigned char *src2 = src;
+
+                if (fv[c] == 2) {
+                    /* The first row of a pair may have come with the last pass */
+                    if (!(crow[c] & 1)) {
+                        if (r + 1 == rows[c])
+                            memcpy(dec->row[c][16], src, dec->row_size);
+                        continue;
+                    }
+
+                    src = r ? dec->row[c][r - 1] : dec->row[c][16];
+                }
+
+                if (out >= height / 2)
+                    continue;
+
+                if (fh[c] == 1 && fv[c] == 1) {
+                    memcpy(dst, src, width / 2);
+                } else if (fh[c] == 1) {
+                    for (x = 0; x < width / 2; x++)
+                        dst[x] = (src[x] + src2[x]) >> 1;
+                } else {
+                    for (x = 0; x < width / 2; x++)
+                        dst[x] = (((src[2 * x] + src[2 * x + 1]) >> 1) +
+                                  ((src2[2 * x] + src2[2 * x + 1]) >> 1)) >> 1;
+                }
+            }
+        }
+    }
+
+    jpeg_finish_decompress(dinfo);
+
+    return dec->jerr.warning_seen ? 1 : 0;
+}
+
 /*
  * jpeg_data:       Buffer with jpeg data to decode, must be grayscale mode
  * len:             Length of buffer
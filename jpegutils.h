@@ -57,4 +57,11 @@ int encode_jpeg_raw(unsigned char *jpeg_data, int len, int quality,
                     int itype, int ctype, unsigned int width,
                     unsigned int height, unsigned char *raw0,
                     unsigned char *raw1, unsigned char *raw2);
+
+struct jpeg_decoder;
+
+struct jpeg_decoder *jpeg_decoder_new(int scale);
+void jpeg_decoder_free(struct jpeg_decoder *dec);
+int jpeg_decoder_yuv420p(struct jpeg_decoder *dec, unsigned char *jpeg_data, int len,
+                         unsigned char *map, int width, int height);
 #endif
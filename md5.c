@@ -26,6 +26,7 @@ These notices must be retained in any copies of any part of this
 documentation and/or software.
 */
 
+#include <string.h>
 #include "md5.h"
 
 /*
@@ -49,7 +50,7 @@ documentation and/or software.
 #define S43 15
 #define S44 21
 
-static void MD5Transform(UINT4 [4], unsigned char [64]);
+static void MD5Transform(UINT4 [4], unsigned char *);
 static void Encode(unsigned char *, UINT4 *, unsigned int);
 static void Decode(UINT4 *, unsigned char *, unsigned int);
 static void MD5_memcpy(POINTER, POINTER, unsigned int);
@@ -189,7 +190,7 @@ void MD5Final (
  */
 static void MD5Transform (state, block)
 UINT4 state[4];
-unsigned char block[64];
+unsigned char *block;                                     /* 64 bytes */
 {
   UINT4 a = state[0], b = state[1], c = state[2], d = state[3], x[16];
 
@@ -346,3 +347,118 @@ void MD5(unsigned char *message,unsigned long message_length,unsigned char *md)
 
   return;
 }
+
+/**
+ * CvtHex
+ *      Calculates H(A1) as per HTTP Digest spec -- taken from RFC 2617.
+ */
+static void CvtHex(IN HASH Bin, OUT HASHHEX Hex)
+{
+    unsigned short i;
+    unsigned char j;
+
+    for (i = 0; i < HASHLEN; i++) {
+        j = (Bin[i] >> 4) & 0xf;
+        if (j <= 9)
+            Hex[i*2] = (j + '0');
+         else
+            Hex[i*2] = (j + 'a' - 10);
+        j = Bin[i] & 0xf;
+        if (j <= 9)
+            Hex[i*2+1] = (j + '0');
+         else
+            Hex[i*2+1] = (j + 'a' - 10);
+    };
+    Hex[HASHHEXLEN] = '\0';
+};
+
+/**
+ * DigestCalcHA1
+ *      Calculates H(A1) as per spec.
+ */
+void DigestCalcHA1(
+    IN char * pszAlg,
+    IN char * pszUserName,
+    IN char * pszRealm,
+    IN char * pszPassword,
+    IN char * pszNonce,
+    IN char * pszCNonce,
+    OUT HASHHEX SessionKey
+    )
+{
+    MD5_CTX Md5Ctx;
+    HASH HA1;
+
+    MD5Init(&Md5Ctx);
+    MD5Update(&Md5Ctx, (unsigned char *)pszUserName, strlen(pszUserName));
+    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+    MD5Update(&Md5Ctx, (unsigned char *)pszRealm, strlen(pszRealm));
+    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+    MD5Update(&Md5Ctx, (unsigned char *)pszPassword, strlen(pszPassword));
+    MD5Final((unsigned char *)HA1, &Md5Ctx);
+
+    if (strcmp(pszAlg, "md5-sess") == 0) {
+        MD5Init(&Md5Ctx);
+        MD5Update(&Md5Ctx, (unsigned char *)HA1, HASHLEN);
+        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+        MD5Update(&Md5Ctx, (unsigned char *)pszNonce, strlen(pszNonce));
+        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+        MD5Update(&Md5Ctx, (unsigned char *)pszCNonce, strlen(pszCNonce));
+        MD5Final((unsigned char *)HA1, &Md5Ctx);
+    };
+    CvtHex(HA1, SessionKey);
+};
+
+/**
+ * DigestCalcResponse
+ *      Calculates request-digest/response-digest as per HTTP Digest spec.
+ */
+void DigestCalcResponse(
+    IN HASHHEX HA1,           /* H(A1) */
+    IN char * pszNonce,       /* nonce from server */
+    IN char * pszNonceCount,  /* 8 hex digits */
+    IN char * pszCNonce,      /* client nonce */
+    IN char * pszQop,         /* qop-value: "", "auth", "auth-int" */
+    IN char * pszMethod,      /* method from the request */
+    IN char * pszDigestUri,   /* requested URL */
+    IN HASHHEX HEntity,       /* H(entity body) if qop="auth-int" */
+    OUT HASHHEX Response      /* request-digest or response-digest */
+    )
+{
+    MD5_CTX Md5Ctx;
+    HASH HA2;
+    HASH RespHash;
+    HASHHEX HA2Hex;
+
+    // Calculate H(A2)
+    MD5Init(&Md5Ctx);
+    MD5Update(&Md5Ctx, (unsigned char *)pszMethod, strlen(pszMethod));
+    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+    MD5Update(&Md5Ctx, (unsigned char *)pszDigestUri, strlen(pszDigestUri));
+
+    if (strcmp(pszQop, "auth-int") == 0) {
+        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+        MD5Update(&Md5Ctx, (unsigned char *)HEntity, HASHHEXLEN);
+    }
+    MD5Final((unsigned char *)HA2, &Md5Ctx);
+    CvtHex(HA2, HA2Hex);
+
+    // Calculate response
+    MD5Init(&Md5Ctx);
+    MD5Update(&Md5Ctx, (unsigned char *)HA1, HASHHEXLEN);
+    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+    MD5Update(&Md5Ctx, (unsigned char *)pszNonce, strlen(pszNonce));
+    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+
+    if (*pszQop) {
+        MD5Update(&Md5Ctx, (unsigned char *)pszNonceCount, strlen(pszNonceCount));
+        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+        MD5Update(&Md5Ctx, (unsigned char *)pszCNonce, strlen(pszCNonce));
+        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+        MD5Update(&Md5Ctx, (unsigned char *)pszQop, strlen(pszQop));
+        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
+    }
+    MD5Update(&Md5Ctx, (unsigned char *)HA2Hex, HASHHEXLEN);
+    MD5Final((unsigned char *)RespHash, &Md5Ctx);
+    CvtHex(RespHash, Response);
+};
@@ -74,4 +74,20 @@ void MD5Update(MD5_CTX *, unsigned char *, unsigned int);
 void MD5Final(unsigned char [16], MD5_CTX *);
 void MD5(unsigned char *message, unsigned long message_length, unsigned char *md);
 
+/* HTTP Digest authentication (RFC 2617) */
+#define HASHLEN 16
+typedef char HASH[HASHLEN];
+#define HASHHEXLEN 32
+typedef char HASHHEX[HASHHEXLEN+1];
+#define IN
+#define OUT
+
+void DigestCalcHA1(IN char *pszAlg, IN char *pszUserName, IN char *pszRealm,
+                   IN char *pszPassword, IN char *pszNonce, IN char *pszCNonce,
+                   OUT HASHHEX SessionKey);
+void DigestCalcResponse(IN HASHHEX HA1, IN char *pszNonce, IN char *pszNonceCount,
+                        IN char *pszCNonce, IN char *pszQop, IN char *pszMethod,
+                        IN char *pszDigestUri, IN HASHHEX HEntity,
+                        OUT HASHHEX Response);
+
 #endif // MD5_H
@@ -15,6 +15,11 @@
 #include "event.h"
 #include "picture.h"
 #include "rotate.h"
+#include "jpegutils.h"
+#include "writer.h"
+#include "segment.h"
+#include "smartmask.h"
+#include "database.h"
 
 /* Forward declarations */
 static int motion_init(struct context *cnt);
@@ -113,12 +118,19 @@ static void image_ring_resize(struct context *cnt, int new_size)
                 memcpy(tmp, cnt->imgs.image_ring, sizeof(struct image_data) * smallest);
 
 
-            /* In the new buffers, allocate image memory */
+            /*
+             * The new buffers are left empty, image_ring_compress allocates
+             * their image memory once the ring gets to them. With
+             * pre_capture_compressed most never need a raw one.
+             */
             {
                 int i;
-                for(i = smallest; i < new_size; i++) {
-                    tmp[i].image = mymalloc(cnt->imgs.size);
-                    memset(tmp[i].image, 0x80, cnt->imgs.size);  /* initialize to grey */
+
+                /* Buffers dropped from the end of the old ring */
+                for (i = smallest; i < cnt->imgs.image_ring_size; i++) {
+                    free(cnt->imgs.image_ring[i].image);
+                    packet_free(&cnt->imgs.image_ring[i].packets);
+                    packet_free(&cnt->imgs.image_ring[i].compressed);
                 }
             }
 
@@ -153,17 +165,406 @@ static void image_ring_destroy(struct context *cnt)
         return;
 
     /* Free all image buffers */
-    for (i = 0; i < cnt->imgs.image_ring_size; i++)
+    for (i = 0; i < cnt->imgs.image_ring_size; i++) {
         free(cnt->imgs.image_ring[i].image);
-
+        packet_free(&cnt->imgs.image_ring[i].packets);
+        packet_free(&cnt->imgs.image_ring[i].compressed);
+    }
 
     /* Free the ring */
     free(cnt->imgs.image_ring);
+    free(cnt->imgs.image_ring_scratch);
 
     cnt->imgs.image_ring = NULL;
+    cnt->imgs.image_ring_scratch = NULL;
     cnt->imgs.image_ring_size = 0;
 }
 
+/* Alignment of the parts of the image arena */
+#define ARENA_ALIGN             64
+#define ARENA_HUGEPAGE_SIZE     (2 * 1024 * 1024)
+
+/**
+ * image_arena_create
+ *
+ * This routine is called from motion_init to allocate the buffers used to
+ * detect motion in one anonymous mapping: the reference frame, the motion
+ * image, the smartmask and label buffers and the common buffer. Each part
+ * starts on a cache line. The mapping is aligned for transparent huge
+ * pages and asks for them, so the detection passes over the buffers need
+ * far fewer TLB entries. The mapping is zeroed by the kernel.
+ *
+ * The images swapped by the capture (image_virgin and the ring) are not
+ * part of it.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     0 on success, -1 on error
+ */
+static int image_arena_create(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int scaled = imgs->motion_scale > 1;
+    struct {
+        void *ptr;
+        size_t size;
+    } part[] = {
+        { &imgs->ref, imgs->motionsize },
+        /* Always with chroma planes, the overlays color them */
+        { &imgs->out, imgs->motionsize * 3 / 2 },
+        { &imgs->ref_dyn, imgs->motionsize * sizeof(*imgs->ref_dyn) },
+        { &imgs->smartmask, imgs->motionsize },
+        { &imgs->smartmask_final, imgs->motionsize },
+        { &imgs->smartmask_buffer, imgs->motionsize * sizeof(*imgs->smartmask_buffer) },
+        { &imgs->labels, imgs->motionsize * sizeof(*imgs->labels) },
+        { &imgs->row_count, imgs->motion_height * sizeof(*imgs->row_count) },
+        { &imgs->col_count, imgs->motion_width * sizeof(*imgs->col_count) },
+        /* For temp. usage in some places, only despeckle & the bayer conversions for now */
+        { &imgs->common_buffer, 3 * imgs->width * imgs->height },
+        /* Only needed for a detection_scale, see alg_detection_image */
+        { &imgs->image_detect, scaled ? imgs->motionsize : 0 },
+        { &imgs->out_image, scaled ? imgs->size : 0 },
+    };
+    unsigned int i;
+    size_t size = 0, extra = 0, head;
+    unsigned char *map;
+
+    for (i = 0; i < sizeof(part) / sizeof(part[0]); i++)
+        size += (part[i].size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    size = (size + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+
+#ifdef MADV_HUGEPAGE
+    /* Map a huge page more, to start on a huge page boundary */
+    if (size >= ARENA_HUGEPAGE_SIZE)
+        extra = ARENA_HUGEPAGE_SIZE;
+#endif
+
+    map = mmap(NULL, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (map == MAP_FAILED) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not map %zu bytes for the images", size);
+        return -1;
+    }
+
+    if (extra) {
+        /* Give back the pages before and after the aligned part */
+        head = (ARENA_HUGEPAGE_SIZE - ((uintptr_t)map & (ARENA_HUGEPAGE_SIZE - 1))) &
+               (ARENA_HUGEPAGE_SIZE - 1);
+
+        if (head)
+            munmap(map, head);
+
+        munmap(map + head + size, extra - head);
+        map += head;
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* Not supported by all kernels, the mapping works without */
+    madvise(map, size, MADV_HUGEPAGE);
+#endif
+
+    imgs->arena = map;
+    imgs->arena_size = size;
+
+    for (i = 0; i < sizeof(part) / sizeof(part[0]); i++) {
+        *(void **)part[i].ptr = map;
+        map += (part[i].size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    }
+
+    /* Else image_detect is image_virgin, set with each frame */
+    if (!scaled) {
+        imgs->image_detect = NULL;
+        imgs->out_image = imgs->out;
+    }
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Mapped %zu bytes for the images", size);
+
+    return 0;
+}
+
+/**
+ * image_arena_destroy
+ *
+ * This routine is called from motion_cleanup to unmap the buffers allocated
+ * by image_arena_create.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void image_arena_destroy(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+
+    if (!imgs->arena)
+        return;
+
+    munmap(imgs->arena, imgs->arena_size);
+
+    imgs->arena = NULL;
+    imgs->ref = imgs->out = NULL;
+    imgs->image_detect = imgs->out_image = NULL;
+    imgs->ref_dyn = NULL;
+    imgs->smartmask = imgs->smartmask_final = NULL;
+    imgs->smartmask_buffer = NULL;
+    imgs->labels = NULL;
+    imgs->row_count = imgs->col_count = NULL;
+    imgs->common_buffer = NULL;
+}
+
+/**
+ * image_ring_collect
+ *
+ * Attaches the jpegs compressed by the writer thread to their images in the
+ * ring buffer. A jpeg of an image that was replaced or saved meanwhile is
+ * dropped.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void image_ring_collect(struct context *cnt)
+{
+    struct writer_jpeg *jpeg, *next;
+
+    for (jpeg = writer_compressed(cnt); jpeg; jpeg = next) {
+        next = jpeg->next;
+
+        if (jpeg->slot < cnt->imgs.image_ring_size) {
+            struct image_data *img = &cnt->imgs.image_ring[jpeg->slot];
+
+            if (img->image && !(img->flags & IMAGE_SAVED) && !img->compressed.used &&
+                img->timestamp_tv.tv_sec == jpeg->timestamp_tv.tv_sec &&
+                img->timestamp_tv.tv_usec == jpeg->timestamp_tv.tv_usec) {
+                struct packet_data tmp = img->compressed;
+
+                img->compressed = jpeg->jpeg;
+                jpeg->jpeg = tmp;
+            }
+        }
+
+        packet_free(&jpeg->jpeg);
+        free(jpeg);
+    }
+}
+
+/**
+ * image_ring_compress
+ *
+ * Called when the image ring buffer advances to a new image. With
+ * pre_capture_compressed, only the images within minimum_motion_frames of
+ * the new one are kept raw. The oldest of those is compressed to jpeg and
+ * the raw buffers of the images compressed already are dropped, one of
+ * them is handed on to the new image. The pre_capture part of the ring
+ * then holds jpegs only.
+ *
+ * With an output queue the writer thread compresses and the jpeg arrives
+ * some frames later, until then the image stays raw. Without one, or if
+ * the queue is full, the image is compressed right here.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void image_ring_compress(struct context *cnt)
+{
+    struct image_data *img = &cnt->imgs.image_ring[cnt->imgs.image_ring_in];
+    int raw_frames = cnt->conf.minimum_motion_frames + 1;
+    int size = cnt->imgs.image_ring_size;
+
+    if (cnt->writer)
+        image_ring_collect(cnt);
+
+    /* The jpeg of the image previously held here is not needed anymore */
+    packet_clear(&img->compressed);
+
+    if (cnt->conf.pre_capture_compressed && cnt->imgs.type == VIDEO_PALETTE_YUV420P &&
+        size > raw_frames) {
+        int slot = (cnt->imgs.image_ring_in + size - raw_frames) % size;
+        struct image_data *old = &cnt->imgs.image_ring[slot];
+        int i;
+
+        if (old->image && !(old->flags & IMAGE_SAVED) && !old->compressed.used &&
+            (!cnt->writer || writer_compress(cnt, slot, old))) {
+            struct image_stamp stamp;
+            int len;
+
+            if (!cnt->imgs.image_ring_scratch)
+                cnt->imgs.image_ring_scratch = mymalloc(cnt->imgs.size);
+
+            image_stamp_get(cnt, old, &stamp);
+            len = put_picture_memory(cnt, cnt->imgs.image_ring_scratch, cnt->imgs.size,
+                                     old->image, cnt->conf.quality, &stamp);
+
+            if (len > 0)
+                packet_append(&old->compressed, cnt->imgs.image_ring_scratch, len,
+                              PACKET_KEY, 0, 0);
+        }
+
+        /*
+         * All the older images are looked at, the jpegs of the writer thread
+         * may come late. Without a jpeg (e.g. compression failed), an image
+         * stays raw.
+         */
+        for (i = raw_frames; i < size; i++) {
+            old = &cnt->imgs.image_ring[(cnt->imgs.image_ring_in + size - i) % size];
+
+            if (old->image && (old->compressed.used || (old->flags & IMAGE_SAVED))) {
+                if (img->image)
+                    free(old->image);
+                else
+                    img->image = old->image;
+
+                old->image = NULL;
+            }
+        }
+    }
+
+    if (!img->image) {
+        img->image = mymalloc(cnt->imgs.size);
+        memset(img->image, 0x80, cnt->imgs.size);  /* initialize to grey */
+    }
+}
+
+/**
+ * image_ring_decompress
+ *
+ * Decodes the jpeg of an image kept compressed by image_ring_compress into
+ * the scratch buffer, and lets the image point at it until
+ * image_ring_release is called.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *      img      Pointer to the image in the ring buffer
+ *
+ * Returns:     nothing
+ */
+static void image_ring_decompress(struct context *cnt, struct image_data *img)
+{
+    unsigned char *image;
+
+    if (!cnt->imgs.image_ring_scratch)
+        cnt->imgs.image_ring_scratch = mymalloc(cnt->imgs.size);
+
+    image = cnt->imgs.image_ring_scratch;
+
+    if (img->compressed.used == 0 ||
+        decode_jpeg_raw(img->compressed.data, img->compressed.used, 0, 420,
+                        cnt->imgs.width, cnt->imgs.height, image,
+                        image + cnt->imgs.width * cnt->imgs.height,
+                        image + (cnt->imgs.width * cnt->imgs.height * 5) / 4) < 0) {
+        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Could not decode pre_capture image");
+        memset(image, 0x80, cnt->imgs.size);
+    }
+
+    img->image = image;
+}
+
+/**
+ * image_ring_release
+ *
+ * Undoes image_ring_decompress once the image has been processed.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *      img      Pointer to the image in the ring buffer
+ *
+ * Returns:     nothing
+ */
+static void image_ring_release(struct context *cnt, struct image_data *img)
+{
+    if (img->image == cnt->imgs.image_ring_scratch)
+        img->image = NULL;
+}
+
+/**
+ * packet_append
+ *
+ * Appends one compressed packet to the packets kept with an image.
+ *
+ * Parameters:
+ *
+ *      packets  Pointer to the packet_data of the image
+ *      data     Packet payload
+ *      size     Payload size in bytes
+ *      flags    PACKET_* flags
+ *      pts      Presentation time stamp in the time base of the source
+ *      dts      Decoding time stamp in the time base of the source
+ *
+ * Returns:     nothing
+ */
+void packet_append(struct packet_data *packets, const unsigned char *data,
+                   int size, int flags, int64_t pts, int64_t dts)
+{
+    struct packet_info *info;
+
+    if (packets->used + size > packets->size) {
+        packets->size = packets->used + size + packets->used / 2;
+        packets->data = myrealloc(packets->data, packets->size, "packet_append");
+    }
+
+    if (packets->count == packets->alloc) {
+        packets->alloc = packets->alloc ? packets->alloc * 2 : 4;
+        packets->info = myrealloc(packets->info, packets->alloc * sizeof(struct packet_info),
+                                  "packet_append");
+    }
+
+    memcpy(packets->data + packets->used, data, size);
+    packets->used += size;
+
+    info = &packets->info[packets->count++];
+    info->size = size;
+    info->flags = flags;
+    info->pts = pts;
+    info->dts = dts;
+}
+
+/**
+ * packet_clear
+ *
+ * Forgets the packets kept with an image, but keeps the memory for reuse.
+ *
+ * Parameters:
+ *
+ *      packets  Pointer to the packet_data of the image
+ *
+ * Returns:     nothing
+ */
+void packet_clear(struct packet_data *packets)
+{
+    packets->used = 0;
+    packets->count = 0;
+}
+
+/**
+ * packet_free
+ *
+ * Releases the memory of the packets kept with an image.
+ *
+ * Parameters:
+ *
+ *      packets  Pointer to the packet_data of the image
+ *
+ * Returns:     nothing
+ */
+void packet_free(struct packet_data *packets)
+{
+    free(packets->data);
+    free(packets->info);
+    memset(packets, 0, sizeof(struct packet_data));
+}
+
 /**
  * image_save_as_preview
  *
@@ -185,6 +586,9 @@ static void image_save_as_preview(struct context *cnt, struct image_data *img)
     memcpy(&cnt->imgs.preview_image.image, img, sizeof(struct image_data));
     /* restore image pointer */
     cnt->imgs.preview_image.image = image;
+    /* The compressed data stays with the ring buffer */
+    memset(&cnt->imgs.preview_image.packets, 0, sizeof(struct packet_data));
+    memset(&cnt->imgs.preview_image.compressed, 0, sizeof(struct packet_data));
 
     /* Copy image */
     memcpy(cnt->imgs.preview_image.image, img->image, cnt->imgs.size);
@@ -527,7 +931,13 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
         /* Set inte global cotext that we are working with this image */
         cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_out];
 
-        if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot < cnt->conf.frame_limit) {
+        /* Images kept as jpeg only (pre_capture_compressed) are decoded now */
+        if (!cnt->current_image->image)
+            image_ring_decompress(cnt, cnt->current_image);
+
+        /* Stale frames are only there to keep the loop going, see netcam_event_driven */
+        if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot < cnt->conf.frame_limit &&
+            !(cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_STALE)) {
             if (cnt->log_level >= DBG) {
                 char tmp[32];
                 const char *t;
@@ -546,9 +956,9 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
                 mystrftime(cnt, tmp, sizeof(tmp), "%H%M%S-%q",
                            &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tm, NULL, 0);
                 draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 20,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
+                          cnt->imgs.width, cnt->imgs.height, tmp, cnt->text_scale);
                 draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 30,
-                          cnt->imgs.width, t, cnt->conf.text_double);
+                          cnt->imgs.width, cnt->imgs.height, t, cnt->text_scale);
             }
 
             /* Output the picture to jpegs and ffmpeg */
@@ -558,14 +968,11 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
 
             /*
              * Check if we must add any "filler" frames into movie to keep up fps
-             * Only if we are recording videos ( ffmpeg or extenal pipe )
+             * Only if we are recording videos to an external pipe, the movies
+             * of ffmpeg get the capture time of each frame (see ffmpeg_put_frame).
              */
             if ((cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot == 0) &&
-#ifdef HAVE_FFMPEG
-                (cnt->ffmpeg_output || (cnt->conf.useextpipe && cnt->extpipe))) {
-#else
                 (cnt->conf.useextpipe && cnt->extpipe)) {
-#endif
                 /*
                  * movie_last_shoot is -1 when file is created,
                  * we don't know how many frames there is in first sec
@@ -579,7 +986,7 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
                                        frames);
                             sprintf(tmp, "Fillerframes %d", frames);
                             draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 40,
-                                      cnt->imgs.width, tmp, cnt->conf.text_double);
+                                      cnt->imgs.width, cnt->imgs.height, tmp, cnt->text_scale);
                         }
                     }
                     /* Check how many frames it was last sec */
@@ -625,6 +1032,8 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
             }
         }
 
+        image_ring_release(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out]);
+
         /* Increment to image after last sended */
         if (++cnt->imgs.image_ring_out >= cnt->imgs.image_ring_size)
             cnt->imgs.image_ring_out = 0;
@@ -643,6 +1052,60 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
     cnt->current_image = saved_current_image;
 }
 
+/**
+ * text_scale_update
+ *
+ *      Sets the size of the text drawn on the images from text_scale, or to
+ *      twice the normal size for text_double. Both can be changed while
+ *      running.
+ */
+static void text_scale_update(struct context *cnt)
+{
+    if (cnt->conf.text_double && cnt->conf.text_scale < 2)
+        cnt->text_scale = 2;
+    else if (cnt->conf.text_scale < 1)
+        cnt->text_scale = 1;
+    else if (cnt->conf.text_scale > TEXT_SCALE_MAX)
+        cnt->text_scale = TEXT_SCALE_MAX;
+    else
+        cnt->text_scale = cnt->conf.text_scale;
+}
+
+/**
+ * detection_scale_init
+ *
+ *      Sets the size of the picture motion is detected on from
+ *      detection_scale. The width and height of the scaled down picture must
+ *      stay even for the chroma planes of the motion image, otherwise motion
+ *      is detected on the full picture. Only read at start, as the buffers
+ *      depend on it.
+ */
+static void detection_scale_init(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int scale = cnt->conf.detection_scale;
+
+    if (scale < 1 || scale > DETECTION_SCALE_MAX) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: detection_scale %d out of range 1 - %d,"
+                   " using 1", scale, DETECTION_SCALE_MAX);
+        scale = 1;
+    } else if (imgs->width % (2 * scale) || imgs->height % (2 * scale)) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Width and height %dx%d are not multiples of"
+                   " %d for detection_scale %d, using 1", imgs->width, imgs->height,
+                   2 * scale, scale);
+        scale = 1;
+    }
+
+    imgs->motion_scale = scale;
+    imgs->motion_width = imgs->width / scale;
+    imgs->motion_height = imgs->height / scale;
+    imgs->motionsize = imgs->motion_width * imgs->motion_height;
+
+    if (scale > 1)
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Detecting motion on %dx%d",
+                   imgs->motion_width, imgs->motion_height);
+}
+
 /**
  * motion_init
  *
@@ -655,7 +1118,6 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
  *
  * Returns:     0 OK
  *             -1 Fatal error, open loopback error
- *             -2 Fatal error, open SQL database error
  *             -3 Fatal error, image dimensions are not modulo 16
  */
 static int motion_init(struct context *cnt)
@@ -665,6 +1127,9 @@ static int motion_init(struct context *cnt)
     /* Store thread number in TLS. */
     pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
 
+    pthread_mutex_init(&cnt->event_table_mutex, NULL);
+    event_table_build(cnt);
+
     cnt->currenttime_tm = mymalloc(sizeof(struct tm));
     cnt->eventtime_tm = mymalloc(sizeof(struct tm));
     /* Init frame time */
@@ -713,17 +1178,7 @@ static int motion_init(struct context *cnt)
 
     image_ring_resize(cnt, 1); /* Create a initial precapture ring buffer with 1 frame */
 
-    cnt->imgs.ref = mymalloc(cnt->imgs.size);
-    cnt->imgs.out = mymalloc(cnt->imgs.size);
-    memset(cnt->imgs.out, 0, cnt->imgs.size);
-
-    /* contains the moving objects of ref. frame */
-    cnt->imgs.ref_dyn = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.ref_dyn));
     cnt->imgs.image_virgin = mymalloc(cnt->imgs.size);
-    cnt->imgs.smartmask = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_final = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_buffer = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.smartmask_buffer));
-    cnt->imgs.labels = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.labels));
 
     /* Set output picture type */
     if (!strcmp(cnt->conf.picture_type, "ppm"))
@@ -734,12 +1189,6 @@ static int motion_init(struct context *cnt)
     /* allocate buffer here for preview buffer */
     cnt->imgs.preview_image.image = mymalloc(cnt->imgs.size);
 
-    /*
-     * Allocate a buffer for temp. usage in some places
-     * Only despeckle & bayer2rgb24() for now for now...
-     */
-    cnt->imgs.common_buffer = mymalloc(3 * cnt->imgs.width * cnt->imgs.height);
-
     /*
      * Now is a good time to init rotation data. Since vid_start has been
      * called, we know that we have imgs.width and imgs.height. When capturing
@@ -751,24 +1200,35 @@ static int motion_init(struct context *cnt)
      */
     rotate_init(cnt); /* rotate_deinit is called in main */
 
+    text_scale_update(cnt);
+
+    /* With the output width and height */
+    detection_scale_init(cnt);
+
+    /* ref, out, ref_dyn (the moving objects of ref. frame), smartmask etc. */
+    if (image_arena_create(cnt))
+        return -1;
+
     /* Capture first image, or we will get an alarm on start */
     if (cnt->video_dev > 0) {
         int i;
 
         for (i = 0; i < 5; i++) {
-            if (vid_next(cnt, cnt->imgs.image_virgin) == 0)
+            if (vid_next(cnt, &cnt->imgs.image_virgin) == 0)
                 break;
             SLEEP(2, 0);
         }
 
         if (i >= 5) {
             memset(cnt->imgs.image_virgin, 0x80, cnt->imgs.size);       /* initialize to grey */
-            draw_text(cnt->imgs.image_virgin, 10, 20, cnt->imgs.width,
-                      "Error capturing first image", cnt->conf.text_double);
+            draw_text(cnt->imgs.image_virgin, 10, 20, cnt->imgs.width, cnt->imgs.height,
+                      "Error capturing first image", cnt->text_scale);
             MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Error capturing first image");
         }
     }
 
+    alg_detection_image(&cnt->imgs);
+
     /* create a reference frame */
     alg_update_reference_frame(cnt, RESET_REF_FRAME);
 
@@ -804,69 +1264,8 @@ static int motion_init(struct context *cnt)
         MOTION_LOG(NTC, TYPE_DB, NO_ERRNO, "%s: Database backend %s",
                    cnt->conf.database_type);
 
-#ifdef HAVE_SQLITE3
-    if ((!strcmp(cnt->conf.database_type, "sqlite3")) && cnt->conf.sqlite3_db) {
-        MOTION_LOG(NTC, TYPE_DB, NO_ERRNO, "%s: DB %s",
-                   cnt->conf.sqlite3_db);
-
-        if (sqlite3_open(cnt->conf.sqlite3_db, &cnt->database_sqlite3) != SQLITE_OK) {
-            MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Can't open database %s : %s\n",
-                       cnt->conf.sqlite3_db, sqlite3_errmsg(cnt->database_sqlite3));
-            sqlite3_close(cnt->database_sqlite3);
-            exit(1);
-        }
-    }
-#endif /* HAVE_SQLITE3 */
-
-#ifdef HAVE_MYSQL
-        if ((!strcmp(cnt->conf.database_type, "mysql")) && (cnt->conf.database_dbname)) {
-            // close database to be sure that we are not leaking
-            mysql_close(cnt->database);
-
-            cnt->database = (MYSQL *) mymalloc(sizeof(MYSQL));
-            mysql_init(cnt->database);
-
-            if (!mysql_real_connect(cnt->database, cnt->conf.database_host, cnt->conf.database_user,
-                cnt->conf.database_password, cnt->conf.database_dbname, 0, NULL, 0)) {
-                MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Cannot connect to MySQL database %s on host %s with user %s",
-                           cnt->conf.database_dbname, cnt->conf.database_host,
-                           cnt->conf.database_user);
-                MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: MySQL error was %s", mysql_error(cnt->database));
-                return -2;
-            }
-#if (defined(MYSQL_VERSION_ID)) && (MYSQL_VERSION_ID > 50012)
-            my_bool my_true = TRUE;
-            mysql_options(cnt->database, MYSQL_OPT_RECONNECT, &my_true);
-#endif
-        }
-#endif /* HAVE_MYSQL */
-
-#ifdef HAVE_PGSQL
-        if ((!strcmp(cnt->conf.database_type, "postgresql")) && (cnt->conf.database_dbname)) {
-            char connstring[255];
-
-            /*
-             * Create the connection string.
-             * Quote the values so we can have null values (blank)
-             */
-            snprintf(connstring, 255,
-                     "dbname='%s' host='%s' user='%s' password='%s' port='%d'",
-                      cnt->conf.database_dbname, /* dbname */
-                      (cnt->conf.database_host ? cnt->conf.database_host : ""), /* host (may be blank) */
-                      (cnt->conf.database_user ? cnt->conf.database_user : ""), /* user (may be blank) */
-                      (cnt->conf.database_password ? cnt->conf.database_password : ""), /* password (may be blank) */
-                      cnt->conf.database_port
-            );
-
-            cnt->database_pg = PQconnectdb(connstring);
-            if (PQstatus(cnt->database_pg) == CONNECTION_BAD) {
-                MOTION_LOG(ERR, TYPE_DB, NO_ERRNO, "%s: Connection to PostgreSQL database '%s' failed: %s",
-                           cnt->conf.database_dbname, PQerrorMessage(cnt->database_pg));
-                return -2;
-            }
-        }
-#endif /* HAVE_PGSQL */
-
+        /* The database thread connects, see database.c */
+        database_start(cnt);
 
         /* Set the sql mask file according to the SQL config options*/
 
@@ -888,6 +1287,11 @@ static int motion_init(struct context *cnt)
              */
             cnt->imgs.mask = get_pgm(picture, cnt->imgs.width, cnt->imgs.height);
             myfclose(picture);
+
+            /* Scaled down in place to the picture motion is detected on */
+            if (cnt->imgs.mask && cnt->imgs.motion_scale > 1)
+                alg_scale_down(cnt->imgs.mask, cnt->imgs.mask, cnt->imgs.width,
+                               cnt->imgs.height, cnt->imgs.motion_scale);
         } else {
             MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error opening mask file %s",
                        cnt->conf.mask_file);
@@ -911,7 +1315,10 @@ static int motion_init(struct context *cnt)
     /* Always initialize smart_mask - someone could turn it on later... */
     memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
     memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
-    memset(cnt->imgs.smartmask_buffer, 0, cnt->imgs.motionsize*sizeof(cnt->imgs.smartmask_buffer));
+    memset(cnt->imgs.smartmask_buffer, 0, cnt->imgs.motionsize * sizeof(*cnt->imgs.smartmask_buffer));
+
+    /* Unless it was learned before */
+    smartmask_load(cnt);
 
     /* Set noise level */
     cnt->noise = cnt->conf.noise;
@@ -936,6 +1343,13 @@ static int motion_init(struct context *cnt)
     /* 2 sec startup delay so FPS is calculated correct */
     cnt->startup_frames = cnt->conf.frame_limit * 2;
 
+    /* Start the writer thread if pictures and movies are to be queued */
+    writer_start(cnt);
+
+#ifdef HAVE_FFMPEG
+    segment_start(cnt);
+#endif
+
     return 0;
 }
 
@@ -953,6 +1367,13 @@ static int motion_init(struct context *cnt)
  */
 static void motion_cleanup(struct context *cnt)
 {
+#ifdef HAVE_FFMPEG
+    segment_stop(cnt);
+#endif
+
+    /* Write what is still queued before the buffers go */
+    writer_stop(cnt);
+
     /* Stop stream */
     event(cnt, EVENT_STOP, NULL, NULL, NULL, NULL);
 
@@ -961,51 +1382,15 @@ static void motion_cleanup(struct context *cnt)
         vid_close(cnt);
     }
 
-    if (cnt->imgs.out) {
-        free(cnt->imgs.out);
-        cnt->imgs.out = NULL;
-    }
+    smartmask_close(cnt);
 
-    if (cnt->imgs.ref) {
-        free(cnt->imgs.ref);
-        cnt->imgs.ref = NULL;
-    }
-
-    if (cnt->imgs.ref_dyn) {
-        free(cnt->imgs.ref_dyn);
-        cnt->imgs.ref_dyn = NULL;
-    }
+    image_arena_destroy(cnt); /* ref, out, smartmask etc. */
 
     if (cnt->imgs.image_virgin) {
         free(cnt->imgs.image_virgin);
         cnt->imgs.image_virgin = NULL;
     }
 
-    if (cnt->imgs.labels) {
-        free(cnt->imgs.labels);
-        cnt->imgs.labels = NULL;
-    }
-
-    if (cnt->imgs.smartmask) {
-        free(cnt->imgs.smartmask);
-        cnt->imgs.smartmask = NULL;
-    }
-
-    if (cnt->imgs.smartmask_final) {
-        free(cnt->imgs.smartmask_final);
-        cnt->imgs.smartmask_final = NULL;
-    }
-
-    if (cnt->imgs.smartmask_buffer) {
-        free(cnt->imgs.smartmask_buffer);
-        cnt->imgs.smartmask_buffer = NULL;
-    }
-
-    if (cnt->imgs.common_buffer) {
-        free(cnt->imgs.common_buffer);
-        cnt->imgs.common_buffer = NULL;
-    }
-
     if (cnt->imgs.preview_image.image) {
         free(cnt->imgs.preview_image.image);
         cnt->imgs.preview_image.image = NULL;
@@ -1015,6 +1400,10 @@ static void motion_cleanup(struct context *cnt)
 
     rotate_deinit(cnt); /* cleanup image rotation data */
 
+    free_text_overlay(&cnt->text_changes_overlay);
+    free_text_overlay(&cnt->text_left_overlay);
+    free_text_overlay(&cnt->text_right_overlay);
+
     if (cnt->pipe != -1) {
         close(cnt->pipe);
         cnt->pipe = -1;
@@ -1037,25 +1426,12 @@ static void motion_cleanup(struct context *cnt)
         cnt->eventtime_tm = NULL;
     }
 
-    if (cnt->conf.database_type) {
-#ifdef HAVE_MYSQL
-        if ( (!strcmp(cnt->conf.database_type, "mysql")) && (cnt->conf.database_dbname)) {
-            mysql_close(cnt->database);
-        }
-#endif /* HAVE_MYSQL */
-
-#ifdef HAVE_PGSQL
-        if ((!strcmp(cnt->conf.database_type, "postgresql")) && (cnt->conf.database_dbname)) {
-            PQfinish(cnt->database_pg);
-        }
-#endif /* HAVE_PGSQL */
+#if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
+    /* After the writer, its file events may still log rows */
+    database_stop(cnt);
+#endif
 
-#ifdef HAVE_SQLITE3
-        /* Close the SQLite database */
-        if (cnt->conf.sqlite3_db)
-            sqlite3_close(cnt->database_sqlite3);
-#endif /* HAVE_SQLITE3 */
-    }
+    pthread_mutex_destroy(&cnt->event_table_mutex);
 }
 
 /**
@@ -1078,7 +1454,6 @@ static void *motion_loop(void *arg)
     unsigned int smartmask_lastrate = 0;
     int olddiffs = 0;
     int previous_diffs = 0, previous_location_x = 0, previous_location_y = 0;
-    unsigned int text_size_factor;
     unsigned int passflag = 0;
     long int *rolling_average_data = NULL;
     long int rolling_average_limit, required_frame_time, frame_delay, delay_time_nsec;
@@ -1101,13 +1476,6 @@ static void *motion_loop(void *arg)
     if (motion_init(cnt) < 0)
         goto err;
 
-
-    /* Initialize the double sized characters if needed. */
-    if (cnt->conf.text_double)
-        text_size_factor = 2;
-    else
-        text_size_factor = 1;
-
     /* Initialize area detection */
     area_minx[0] = area_minx[3] = area_minx[6] = 0;
     area_miny[0] = area_miny[1] = area_miny[2] = 0;
@@ -1168,6 +1536,8 @@ static void *motion_loop(void *arg)
         /*
          * Calculate detection rate limit. Above 5fps we limit the detection
          * rate to 3fps to reduce load at higher framerates.
+         * With netcam_event_driven every pass of the loop is a frame of the
+         * camera, so lastrate is the measured rate of the camera.
          */
         cnt->process_thisframe = 0;
         rate_limit++;
@@ -1252,6 +1622,9 @@ static void *motion_loop(void *arg)
             old_image = cnt->current_image;
             cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_in];
 
+            /* Make sure the image has a raw buffer (see pre_capture_compressed) */
+            image_ring_compress(cnt);
+
             /* Init/clear current_image */
             if (cnt->process_thisframe) {
                 /* set diffs to 0 now, will be written after we calculated diffs in new image */
@@ -1269,9 +1642,10 @@ static void *motion_loop(void *arg)
                 cnt->current_image->diffs = old_image->diffs;
                 cnt->current_image->timestamp = old_image->timestamp;
                 cnt->current_image->timestamp_tm = old_image->timestamp_tm;
+                cnt->current_image->timestamp_tv = old_image->timestamp_tv;
                 cnt->current_image->shot = old_image->shot;
                 cnt->current_image->cent_dist = old_image->cent_dist;
-                cnt->current_image->flags = old_image->flags;
+                cnt->current_image->flags = old_image->flags & ~IMAGE_STALE;
                 cnt->current_image->location = old_image->location;
                 cnt->current_image->total_labels = old_image->total_labels;
             }
@@ -1279,10 +1653,14 @@ static void *motion_loop(void *arg)
             /* Store time with pre_captured image */
             cnt->current_image->timestamp = cnt->currenttime;
             localtime_r(&cnt->current_image->timestamp, &cnt->current_image->timestamp_tm);
+            cnt->current_image->timestamp_tv = tv1;
 
             /* Store shot number with pre_captured image */
             cnt->current_image->shot = cnt->shots;
 
+            /* Drop the compressed packets of the image previously held here */
+            packet_clear(&cnt->current_image->packets);
+
         /***** MOTION LOOP - RETRY INITIALIZING SECTION *****/
             /*
              * If a camera is not available we keep on retrying every 10 seconds
@@ -1326,7 +1704,7 @@ static void *motion_loop(void *arg)
              * >0 = non fatal error - copy last image or show grey image with message
              */
             if (cnt->video_dev >= 0)
-                vid_return_code = vid_next(cnt, cnt->current_image->image);
+                vid_return_code = vid_next(cnt, &cnt->current_image->image);
             else
                 vid_return_code = 1; /* Non fatal error */
 
@@ -1335,6 +1713,13 @@ static void *motion_loop(void *arg)
                 cnt->lost_connection = 0;
                 cnt->connectionlosttime = 0;
 
+                /* The time the device took the frame, not when the loop got to it */
+                if (timerisset(&cnt->capture_tv)) {
+                    cnt->current_image->timestamp_tv = cnt->capture_tv;
+                    cnt->current_image->timestamp = cnt->capture_tv.tv_sec;
+                    localtime_r(&cnt->current_image->timestamp, &cnt->current_image->timestamp_tm);
+                }
+
                 /* If all is well reset missing_frame_counter */
                 if (cnt->missing_frame_counter >= MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit) {
                     /* If we previously logged starting a grey image, now log video re-start */
@@ -1354,6 +1739,7 @@ static void *motion_loop(void *arg)
                  * which we will not alter with text and location graphics
                  */
                 memcpy(cnt->imgs.image_virgin, cnt->current_image->image, cnt->imgs.size);
+                alg_detection_image(&cnt->imgs);
 
                 /*
                  * If the camera is a netcam we let the camera decide the pace.
@@ -1408,6 +1794,21 @@ static void *motion_loop(void *arg)
                     break;
                 }
 
+                /*
+                 * A netcam driving the main loop had nothing new for us.
+                 * Don't run the detection on a copy of the previous frame
+                 * but on the next real one, and don't save the copy.
+                 */
+                if (cnt->conf.netcam_url && cnt->conf.netcam_event_driven &&
+                    vid_return_code == NETCAM_NOTHING_NEW_ERROR) {
+                    cnt->current_image->flags |= IMAGE_STALE;
+
+                    if (cnt->process_thisframe) {
+                        cnt->process_thisframe = 0;
+                        rate_limit = cnt->lastrate / 3;
+                    }
+                }
+
                 /*
                  * First missed frame - store timestamp
                  * Don't reset time when thread restarts
@@ -1441,8 +1842,8 @@ static void *motion_loop(void *arg)
                     localtime_r(&cnt->connectionlosttime, &tmptime);
                     memset(cnt->current_image->image, 0x80, cnt->imgs.size);
                     mystrftime(cnt, tmpout, sizeof(tmpout), tmpin, &tmptime, NULL, 0);
-                    draw_text(cnt->current_image->image, 10, 20 * text_size_factor, cnt->imgs.width,
-                              tmpout, cnt->conf.text_double);
+                    draw_text(cnt->current_image->image, 10, 20 * cnt->text_scale, cnt->imgs.width,
+                              cnt->imgs.height, tmpout, cnt->text_scale);
 
                     /* Write error message only once */
                     if (cnt->missing_frame_counter == MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit) {
@@ -1486,9 +1887,9 @@ static void *motion_loop(void *arg)
                      * anyway
                      */
                     if (cnt->detecting_motion || cnt->conf.setup_mode)
-                        cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.image_virgin);
+                        cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.image_detect);
                     else
-                        cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.image_virgin);
+                        cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.image_detect);
 
                     /* Lightswitch feature - has light intensity changed?
                      * This can happen due to change of light conditions or due to a sudden change of the camera
@@ -1553,6 +1954,7 @@ static void *motion_loop(void *arg)
             if ((cnt->smartmask_speed && (cnt->event_nr != cnt->prev_event)) &&
                 (!--smartmask_count)) {
                 alg_tune_smartmask(cnt);
+                smartmask_save(cnt);
                 smartmask_count = smartmask_ratio;
             }
 
@@ -1578,7 +1980,7 @@ static void *motion_loop(void *arg)
              */
             if ((cnt->conf.noise_tune && cnt->shots == 0) &&
                  (!cnt->detecting_motion && (cnt->current_image->diffs <= cnt->threshold)))
-                alg_noise_tune(cnt, cnt->imgs.image_virgin);
+                alg_noise_tune(cnt, cnt->imgs.image_detect);
 
 
             /*
@@ -1605,7 +2007,8 @@ static void *motion_loop(void *arg)
                  * for adding the locate rectangle
                  */
                 if (cnt->current_image->diffs > cnt->threshold)
-                    alg_locate_center_size(&cnt->imgs, cnt->imgs.width, cnt->imgs.height, &cnt->current_image->location, cnt->current_image->total_labels);
+                    alg_locate_center_size(&cnt->imgs, cnt->imgs.motion_width, cnt->imgs.motion_height,
+                                           &cnt->current_image->location, cnt->current_image->total_labels);
 
                 /*
                  * Update reference frame.
@@ -1661,13 +2064,13 @@ static void *motion_loop(void *arg)
                 cnt->conf.setup_mode))
                 overlay_fixed_mask(cnt, cnt->imgs.out);
 
-            /* Initialize the double sized characters if needed. */
-            if (cnt->conf.text_double && text_size_factor == 1) {
-                text_size_factor = 2;
-            /* If text_double is set to off, then reset the scaling text_size_factor. */
-            } else if (!cnt->conf.text_double && text_size_factor == 2) {
-                text_size_factor = 1;
-            }
+            /* The motion image at full size for the outputs, with a detection_scale */
+            if (cnt->imgs.motion_scale > 1 && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug ||
+                cnt->conf.setup_mode || cnt->mpipe >= 0))
+                alg_motion_image(&cnt->imgs);
+
+            /* Follow changes of text_scale and text_double. */
+            text_scale_update(cnt);
 
             /* Add changed pixels in upper right corner of the pictures */
             if (cnt->conf.text_changes) {
@@ -1678,8 +2081,9 @@ static void *motion_loop(void *arg)
                 else
                     sprintf(tmp, "-");
 
-                draw_text(cnt->current_image->image, cnt->imgs.width - 10, 10,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
+                draw_text_overlay(&cnt->text_changes_overlay, cnt->current_image->image,
+                                  cnt->imgs.width - 10, 10, cnt->imgs.width, cnt->imgs.height,
+                                  tmp, cnt->text_scale);
             }
 
             /*
@@ -1690,11 +2094,11 @@ static void *motion_loop(void *arg)
                 char tmp[PATH_MAX];
                 sprintf(tmp, "D:%5d L:%3d N:%3d", cnt->current_image->diffs,
                         cnt->current_image->total_labels, cnt->noise);
-                draw_text(cnt->imgs.out, cnt->imgs.width - 10, cnt->imgs.height - 30 * text_size_factor,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
+                draw_text(cnt->imgs.out_image, cnt->imgs.width - 10, cnt->imgs.height - 30 * cnt->text_scale,
+                          cnt->imgs.width, cnt->imgs.height, tmp, cnt->text_scale);
                 sprintf(tmp, "THREAD %d SETUP", cnt->threadnr);
-                draw_text(cnt->imgs.out, cnt->imgs.width - 10, cnt->imgs.height - 10 * text_size_factor,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
+                draw_text(cnt->imgs.out_image, cnt->imgs.width - 10, cnt->imgs.height - 10 * cnt->text_scale,
+                          cnt->imgs.width, cnt->imgs.height, tmp, cnt->text_scale);
             }
 
             /* Add text in lower left corner of the pictures */
@@ -1702,8 +2106,9 @@ static void *motion_loop(void *arg)
                 char tmp[PATH_MAX];
                 mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_left,
                            &cnt->current_image->timestamp_tm, NULL, 0);
-                draw_text(cnt->current_image->image, 10, cnt->imgs.height - 10 * text_size_factor,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
+                draw_text_overlay(&cnt->text_left_overlay, cnt->current_image->image,
+                                  10, cnt->imgs.height - 10 * cnt->text_scale,
+                                  cnt->imgs.width, cnt->imgs.height, tmp, cnt->text_scale);
             }
 
             /* Add text in lower right corner of the pictures */
@@ -1711,9 +2116,9 @@ static void *motion_loop(void *arg)
                 char tmp[PATH_MAX];
                 mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_right,
                            &cnt->current_image->timestamp_tm, NULL, 0);
-                draw_text(cnt->current_image->image, cnt->imgs.width - 10,
-                          cnt->imgs.height - 10 * text_size_factor,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
+                draw_text_overlay(&cnt->text_right_overlay, cnt->current_image->image,
+                                  cnt->imgs.width - 10, cnt->imgs.height - 10 * cnt->text_scale,
+                                  cnt->imgs.width, cnt->imgs.height, tmp, cnt->text_scale);
             }
 
 
@@ -2038,6 +2443,11 @@ static void *motion_loop(void *arg)
             event(cnt, EVENT_TIMELAPSEEND, NULL, NULL, NULL, cnt->currenttime_tm);
         }
 
+
+    /***** MOTION LOOP - CONTINUOUS RECORDING SECTION *****/
+
+        segment_put(cnt, cnt->current_image);
+
 #endif /* HAVE_FFMPEG */
 
         time_last_frame = time_current_frame;
@@ -2056,11 +2466,11 @@ static void *motion_loop(void *arg)
          * sends all detected pictures to the stream except the 1st per second which is already sent.
          */
         if (cnt->conf.setup_mode) {
-            event(cnt, EVENT_IMAGE, cnt->imgs.out, NULL, &cnt->pipe, cnt->currenttime_tm);
-            event(cnt, EVENT_STREAM, cnt->imgs.out, NULL, NULL, cnt->currenttime_tm);
+            event(cnt, EVENT_IMAGE, cnt->imgs.out_image, NULL, &cnt->pipe, cnt->currenttime_tm);
+            event(cnt, EVENT_STREAM, cnt->imgs.out_image, NULL, NULL, cnt->currenttime_tm);
 #ifdef HAVE_SDL
             if (cnt_list[0]->conf.sdl_threadnr == cnt->threadnr)
-                event(cnt, EVENT_SDL_PUT, cnt->imgs.out, NULL, NULL, cnt->currenttime_tm);
+                event(cnt, EVENT_SDL_PUT, cnt->imgs.out_image, NULL, NULL, cnt->currenttime_tm);
 #endif
         } else {
             event(cnt, EVENT_IMAGE, cnt->current_image->image, NULL,
@@ -2076,7 +2486,7 @@ static void *motion_loop(void *arg)
 #endif
         }
 
-        event(cnt, EVENT_IMAGEM, cnt->imgs.out, NULL, &cnt->mpipe, cnt->currenttime_tm);
+        event(cnt, EVENT_IMAGEM, cnt->imgs.out_image, NULL, &cnt->mpipe, cnt->currenttime_tm);
 
 
     /***** MOTION LOOP - ONCE PER SECOND PARAMETER UPDATE SECTION *****/
@@ -2162,6 +2572,9 @@ static void *motion_loop(void *arg)
                             cnt->conf.sql_log_timelapse * FTYPE_MPEG_TIMELAPSE;
 #endif /* defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3) */
 
+            /* Likewise the handlers of the events */
+            event_table_build(cnt);
+
         }
 
 
@@ -2203,6 +2616,13 @@ static void *motion_loop(void *arg)
         rolling_average /= rolling_average_limit;
         frame_delay = required_frame_time-elapsedtime - (rolling_average - required_frame_time);
 
+        /*
+         * A netcam driving the main loop is waited for in netcam_next,
+         * so we never sleep here while the next frame may be waiting.
+         */
+        if (cnt->conf.netcam_url && cnt->conf.netcam_event_driven)
+            frame_delay = 0;
+
         if (frame_delay > 0) {
             /* Apply delay to meet frame time */
             if (frame_delay > required_frame_time)
@@ -2659,6 +3079,9 @@ int main (int argc, char **argv)
 
     motion_startup(1, argc, argv);
 
+    /* Fork the process starting the external commands while we are small */
+    command_helper_start();
+
 #ifdef HAVE_FFMPEG
     /*
      * FFMpeg initialization is only performed if FFMpeg support was found
@@ -2967,12 +3390,24 @@ int create_path(const char *path)
     return 0;
 }
 
+/*
+ * Write buffers of myfopen. The buffer of an open file is found by its file
+ * descriptor, which no other thread can get before the file is closed. Up to
+ * MYBUFCOUNT buffers are kept for reuse. All threads save their pictures
+ * through these, so they are protected by buffers_lock.
+ */
 #define MYBUFCOUNT 32
 struct MyBuffer {
-    FILE* fh;
+    struct MyBuffer *next;
     char* buffer;
     size_t bufsize;
-} buffers[MYBUFCOUNT];
+};
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct MyBuffer *buffers_spare;     /* buffers kept for reuse */
+static int buffers_spare_count;
+static struct MyBuffer **buffers_used;     /* buffer of each file, by descriptor */
+static int buffers_used_size;
 
 /**
  * myfopen
@@ -2995,11 +3430,6 @@ struct MyBuffer {
  */
 FILE * myfopen(const char *path, const char *mode, size_t bufsize)
 {
-    static int bufferInit = 0;
-    if (!bufferInit) {
-        bufferInit = 1;
-        memset(buffers, 0x00, sizeof(buffers));
-    }
     /* first, just try to open the file */
     FILE *dummy = fopen(path, mode);
 
@@ -3019,53 +3449,38 @@ FILE * myfopen(const char *path, const char *mode, size_t bufsize)
 
     if (dummy) {
         if (bufsize > 0) {
-            int i = 0;
-            for (i = 0; i < MYBUFCOUNT; i++) {
-                int first = -1;
-                if (!buffers[i].fh) {
-                    if (first == -1)
-                        first = i;
-                    if (buffers[i].buffer == NULL ||
-                        buffers[i].bufsize >= bufsize ||
-                        (i == (MYBUFCOUNT - 1) && first >= 0)) {
-                        if (buffers[i].buffer == NULL) {
-                            /* We are allocating a new buffer */
-                            buffers[i].fh = dummy;
-                            buffers[i].buffer = mymalloc(bufsize);
-                            buffers[i].bufsize = bufsize;
-                        }
-                        else if (buffers[i].bufsize >= bufsize) {
-                            /* We are using an old buffer */
-                            buffers[i].fh = dummy;
-                        }
-                        else {
-                            /*
-                             * We are reusing an old buffer, but it is too
-                             * small, realloc it
-                             */
-                            i = first;
-                            buffers[i].fh = dummy;
-                            buffers[i].buffer = myrealloc(buffers[i].buffer,
-                                                          bufsize, "myfopen");
-                            buffers[i].bufsize = bufsize;
-                        }
+            struct MyBuffer *buf;
+            int fd = fileno(dummy);
 
-                        if (buffers[i].buffer == NULL) {
-                            /*
-                             * Our allocation failed, so just use the default
-                             * OS buffers
-                             */
-                            buffers[i].fh = NULL;
-                            buffers[i].bufsize = 0;
-                        }
-                        else {
-                            setvbuf(buffers[i].fh, buffers[i].buffer,
-                                    _IOFBF, buffers[i].bufsize);
-                        }
-                        break;
-                    }
-                }
+            pthread_mutex_lock(&buffers_lock);
+
+            if ((buf = buffers_spare) != NULL) {
+                buffers_spare = buf->next;
+                buffers_spare_count--;
+            } else {
+                buf = mymalloc(sizeof(struct MyBuffer));
+            }
+
+            if (fd >= buffers_used_size) {
+                int size = fd + MYBUFCOUNT;
+
+                buffers_used = myrealloc(buffers_used, size * sizeof(struct MyBuffer *), "myfopen");
+                memset(buffers_used + buffers_used_size, 0,
+                       (size - buffers_used_size) * sizeof(struct MyBuffer *));
+                buffers_used_size = size;
+            }
+
+            buffers_used[fd] = buf;
+
+            pthread_mutex_unlock(&buffers_lock);
+
+            /* We are reusing an old buffer, but it is too small, realloc it */
+            if (buf->bufsize < bufsize) {
+                buf->buffer = myrealloc(buf->buffer, bufsize, "myfopen");
+                buf->bufsize = bufsize;
             }
+
+            setvbuf(dummy, buf->buffer, _IOFBF, buf->bufsize);
         }
     } else {
         /*
@@ -3090,36 +3505,281 @@ FILE * myfopen(const char *path, const char *mode, size_t bufsize)
  */
 int myfclose(FILE* fh)
 {
-    int i = 0;
-    int rval = fclose(fh);
+    struct MyBuffer *buf = NULL;
+    int fd = fileno(fh);
+    int rval;
+
+    /* Until fclose the descriptor, and so its entry, is still ours */
+    pthread_mutex_lock(&buffers_lock);
+
+    if (fd >= 0 && fd < buffers_used_size) {
+        buf = buffers_used[fd];
+        buffers_used[fd] = NULL;
+    }
+
+    pthread_mutex_unlock(&buffers_lock);
+
+    rval = fclose(fh);
 
     if (rval != 0)
         MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error closing file");
 
-    for (i = 0; i < MYBUFCOUNT; i++) {
-        if (buffers[i].fh == fh) {
-            buffers[i].fh = NULL;
-            if ( finish ) {
-                /* Free the buffers */
-                if (buffers[i].buffer)
-                    free(buffers[i].buffer);
-                buffers[i].buffer = NULL;
-                buffers[i].bufsize = 0;
-            }
+    if (buf) {
+        pthread_mutex_lock(&buffers_lock);
+
+        if (!finish && buffers_spare_count < MYBUFCOUNT) {
+            buf->next = buffers_spare;
+            buffers_spare = buf;
+            buffers_spare_count++;
+            buf = NULL;
+        }
+
+        pthread_mutex_unlock(&buffers_lock);
+
+        /* Free the buffer */
+        if (buf) {
+            free(buf->buffer);
+            free(buf);
         }
     }
+
     return rval;
 }
 
+/**
+ * myseqopen
+ *
+ *   Opens a large file which is written mostly sequentially, i.e. a movie.
+ *   The writes bypass stdio as the caller does its own buffering. The file
+ *   is preallocated SEQFILE_CHUNK at a time so it doesn't get fragmented
+ *   when several cameras record at once, and what has been written is handed
+ *   to the disk and dropped from the page cache as we go, so recording movies
+ *   doesn't push everything else out of memory. Missing directories in the
+ *   path are created like with myfopen.
+ *
+ *   An existing file is overwritten in place and only cut to its new size
+ *   by myseqclose, so a file written again and again (see segment.c) keeps
+ *   its blocks on the disk.
+ *
+ * Parameters:
+ *
+ *   path - path to the file to open
+ *   append - write at the end of an existing file instead of overwriting it
+ *
+ * Returns: the file or NULL on error
+ */
+struct seqfile * myseqopen(const char *path, int append)
+{
+    struct seqfile *file;
+    int flags = O_WRONLY | O_CREAT;
+    int fd = open(path, flags, 0666);
+
+    /* path did not exist? */
+    if (fd == -1 && errno == ENOENT) {
+        if (create_path(path) == -1)
+            return NULL;
+
+        fd = open(path, flags, 0666);
+    }
+
+    if (fd == -1) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error opening file %s", path);
+        return NULL;
+    }
+
+    file = mymalloc(sizeof(struct seqfile));
+    file->fd = fd;
+
+    if ((file->stale = lseek(fd, 0, SEEK_END)) == -1)
+        file->stale = 0;
+
+    if (append)
+        file->end = file->stale;
+
+    file->pos = file->end;
+    file->allocated = file->stale;
+    file->flushed = file->end;
+
+    return file;
+}
+
+/**
+ * myseqwrite
+ *
+ *   Writes to a file opened with myseqopen at the current position.
+ *
+ * Returns: size, or -1 on error
+ */
+int myseqwrite(struct seqfile *file, const unsigned char *buf, int size)
+{
+    int done = 0;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    /* Preallocate the next chunk, unless the file system can't */
+    if (file->allocated >= 0 && file->pos + size > file->allocated) {
+        off_t len = file->pos + size + SEQFILE_CHUNK - file->allocated;
+
+        if (fallocate(file->fd, FALLOC_FL_KEEP_SIZE, file->allocated, len) == 0)
+            file->allocated += len;
+        else
+            file->allocated = -1;
+    }
+#endif
+
+    while (done < size) {
+        ssize_t ret = pwrite(file->fd, buf + done, size - done, file->pos + done);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error writing file");
+            return -1;
+        }
+
+        done += ret;
+    }
+
+    file->pos += size;
+
+    if (file->pos > file->end)
+        file->end = file->pos;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    /*
+     * Start the write out of each full chunk and drop the one before it from
+     * the cache, it should be on the disk by now. Without output_queue this
+     * runs in motion_loop, so nothing waits for the disk here: pages still
+     * being written are simply left in the cache.
+     */
+    while (file->end - file->flushed >= SEQFILE_CHUNK) {
+        sync_file_range(file->fd, file->flushed, SEQFILE_CHUNK, SYNC_FILE_RANGE_WRITE);
+
+        if (file->flushed >= SEQFILE_CHUNK)
+            posix_fadvise(file->fd, file->flushed - SEQFILE_CHUNK, SEQFILE_CHUNK,
+                          POSIX_FADV_DONTNEED);
+
+        file->flushed += SEQFILE_CHUNK;
+    }
+#endif
+
+    return size;
+}
+
+/**
+ * myseqseek
+ *
+ *   Moves the position of a file opened with myseqopen, like lseek.
+ *
+ * Returns: the new position, or -1 on error
+ */
+off_t myseqseek(struct seqfile *file, off_t offset, int whence)
+{
+    off_t pos;
+
+    switch (whence) {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = file->pos + offset;
+        break;
+    case SEEK_END:
+        pos = file->end + offset;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return file->pos = pos;
+}
+
+/**
+ * myseqclose
+ *
+ *   Closes a file opened with myseqopen and gives back the space preallocated
+ *   beyond its end.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int myseqclose(struct seqfile *file)
+{
+    int rval = 0;
+
+    if ((file->allocated > file->end || file->stale > file->end) &&
+        ftruncate(file->fd, file->end) != 0)
+        MOTION_LOG(WRN, TYPE_ALL, SHOW_ERRNO, "%s: Could not free preallocated space");
+
+    if (close(file->fd) != 0) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error closing file");
+        rval = -1;
+    }
+
+    free(file);
+
+    return rval;
+}
+
+/**
+ * image_stamp_get
+ *
+ *   Takes the values the conversion specifiers expand to for an image of
+ *   the current event, or for none if img is NULL. Called by motion_loop.
+ */
+void image_stamp_get(const struct context *cnt, const struct image_data *img,
+                     struct image_stamp *stamp)
+{
+    if (img) {
+        stamp->timestamp_tm = img->timestamp_tm;
+        stamp->location = img->location;
+        stamp->diffs = img->diffs;
+        stamp->shot = img->shot;
+        stamp->total_labels = img->total_labels;
+    } else {
+        memset(&stamp->timestamp_tm, 0, sizeof(stamp->timestamp_tm));
+        memset(&stamp->location, 0, sizeof(stamp->location));
+        stamp->diffs = stamp->shot = stamp->total_labels = 0;
+    }
+
+    stamp->event_nr = cnt->event_nr;
+    stamp->noise = cnt->noise;
+    stamp->threshold = cnt->threshold;
+    strcpy(stamp->text_event, cnt->text_event_string);
+}
+
 /**
  * mystrftime
  *
+ *   Expands the format for the current image, see mystrftime_stamped.
+ *   Only for motion_loop, the writer thread has to pass the stamp of its
+ *   job to mystrftime_stamped.
+ */
+size_t mystrftime(const struct context *cnt, char *s, size_t max, const char *userformat,
+                  const struct tm *tm, const char *filename, int sqltype)
+{
+    struct image_stamp stamp;
+
+    image_stamp_get(cnt, cnt->current_image, &stamp);
+
+    return mystrftime_stamped(cnt, &stamp, s, max, userformat, tm, filename, sqltype);
+}
+
+/**
+ * mystrftime_stamped
+ *
  *   Motion-specific variant of strftime(3) that supports additional format
  *   specifiers in the format string.
  *
  * Parameters:
  *
  *   cnt        - current thread's context structure
+ *   stamp      - the image and event values, see image_stamp_get
  *   s          - destination string
  *   max        - max number of bytes to write
  *   userformat - format string
@@ -3130,8 +3790,9 @@ int myfclose(FILE* fh)
  *
  * Returns: number of bytes written to the string s
  */
-size_t mystrftime(const struct context *cnt, char *s, size_t max, const char *userformat,
-                  const struct tm *tm, const char *filename, int sqltype)
+size_t mystrftime_stamped(const struct context *cnt, const struct image_stamp *stamp,
+                          char *s, size_t max, const char *userformat,
+                          const struct tm *tm, const char *filename, int sqltype)
 {
     char formatstring[PATH_MAX] = "";
     char tempstring[PATH_MAX] = "";
@@ -3163,43 +3824,43 @@ size_t mystrftime(const struct context *cnt, char *s, size_t max, const char *us
                 break;
 
             case 'v': // event
-                sprintf(tempstr, "%02d", cnt->event_nr);
+                sprintf(tempstr, "%02d", stamp->event_nr);
                 break;
 
             case 'q': // shots
-                sprintf(tempstr, "%02d", cnt->current_image->shot);
+                sprintf(tempstr, "%02d", stamp->shot);
                 break;
 
             case 'D': // diffs
-                sprintf(tempstr, "%d", cnt->current_image->diffs);
+                sprintf(tempstr, "%d", stamp->diffs);
                 break;
 
             case 'N': // noise
-                sprintf(tempstr, "%d", cnt->noise);
+                sprintf(tempstr, "%d", stamp->noise);
                 break;
 
             case 'i': // motion width
-                sprintf(tempstr, "%d", cnt->current_image->location.width);
+                sprintf(tempstr, "%d", stamp->location.width);
                 break;
 
             case 'J': // motion height
-                sprintf(tempstr, "%d", cnt->current_image->location.height);
+                sprintf(tempstr, "%d", stamp->location.height);
                 break;
 
             case 'K': // motion center x
-                sprintf(tempstr, "%d", cnt->current_image->location.x);
+                sprintf(tempstr, "%d", stamp->location.x);
                 break;
 
             case 'L': // motion center y
-                sprintf(tempstr, "%d", cnt->current_image->location.y);
+                sprintf(tempstr, "%d", stamp->location.y);
                 break;
 
             case 'o': // threshold
-                sprintf(tempstr, "%d", cnt->threshold);
+                sprintf(tempstr, "%d", stamp->threshold);
                 break;
 
             case 'Q': // number of labels
-                sprintf(tempstr, "%d", cnt->current_image->total_labels);
+                sprintf(tempstr, "%d", stamp->total_labels);
                 break;
 
             case 't': // thread number
@@ -3208,8 +3869,8 @@ size_t mystrftime(const struct context *cnt, char *s, size_t max, const char *us
                 break;
 
             case 'C': // text_event
-                if (cnt->text_event_string && cnt->text_event_string[0])
-                    snprintf(tempstr, PATH_MAX, "%s", cnt->text_event_string);
+                if (stamp->text_event[0])
+                    snprintf(tempstr, PATH_MAX, "%s", stamp->text_event);
                 else
                     ++pos_userformat;
                 break;
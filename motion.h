@@ -184,6 +184,9 @@
 
 #define THRESHOLD_TUNE_LENGTH  256
 
+#define TEXT_SCALE_MAX          10  /* largest text_scale */
+#define DETECTION_SCALE_MAX     8   /* largest detection_scale */
+
 #define MISSING_FRAMES_TIMEOUT  30  /* When failing to get picture frame from camera
                                        we reuse the previous frame until
                                        MISSING_FRAMES_TIMEOUT seconds has passed
@@ -206,11 +209,12 @@
 #define DEF_IMAGEPATH           "%v-%Y%m%d%H%M%S-%q"
 #define DEF_MOVIEPATH           "%v-%Y%m%d%H%M%S"
 #define DEF_TIMEPATH            "%Y%m%d-timelapse"
+#define DEF_CONTINUOUSPATH      "continuous-%t"
 
 #define DEF_TIMELAPSE_MODE      "daily"
 
 /* Do not break this line into two or more. Must be ONE line */
-#define DEF_SQL_QUERY "sql_query insert into security(camera, filename, frame, file_type, time_stamp, event_time_stamp) values('%t', '%f', '%q', '%n', '%Y-%m-%d %T', '%C')"
+#define DEF_SQL_QUERY "insert into security(camera, filename, frame, file_type, time_stamp, event_time_stamp) values('%t', '%f', '%q', '%n', '%Y-%m-%d %T', '%C')"
 
 /* OUTPUT Image types */
 #define IMAGE_TYPE_JPEG        0
@@ -249,12 +253,24 @@
 #define RESET_REF_FRAME   2
 
 #define BUFSIZE_1MEG      (1024 * 1024)
+#define SEQFILE_CHUNK     (8 * BUFSIZE_1MEG)   /* preallocation / write out step of myseqwrite */
+
+/* Large file written mostly sequentially, see myseqopen */
+struct seqfile {
+    int fd;
+    off_t pos;                  /* current position */
+    off_t end;                  /* size of the file */
+    off_t allocated;            /* preallocated up to here, -1 if unsupported */
+    off_t flushed;              /* written out up to here */
+    off_t stale;                /* old contents end here, cut off by myseqclose */
+};
 
 /* Forward declaration, used in track.h */
 struct images;
 
 #include "track.h"
 #include "netcam.h"
+#include "event.h"
 
 /*
  * Structure to hold images information
@@ -271,12 +287,39 @@ struct images;
 #define IMAGE_SAVED      8
 #define IMAGE_PRECAP    16
 #define IMAGE_POSTCAP   32
+#define IMAGE_STALE     64  /* copy of the previous frame, the camera had nothing new */
+
+/*
+ * Compressed data as delivered by the camera for one image, kept with the
+ * image in the ring so that passthrough movies can copy it without
+ * re-encoding.  A netcam picture is one packet, an RTSP stream can deliver
+ * several packets (or none) per image.
+ */
+#define PACKET_KEY       1
+
+struct packet_info {
+    int size;                   /* bytes of this packet in data */
+    int flags;                  /* See PACKET_* defines */
+    int64_t pts;                /* time stamps in the time base of the source */
+    int64_t dts;
+};
+
+struct packet_data {
+    unsigned char *data;        /* all packets, one after another */
+    size_t used;
+    size_t size;                /* allocated size of data */
+    struct packet_info *info;
+    int count;                  /* number of packets */
+    int alloc;                  /* allocated entries in info */
+    unsigned int seq;           /* sequence number of the first packet */
+};
 
 struct image_data {
     unsigned char *image;
     int diffs;
     time_t timestamp;           /* Timestamp when image was captured */
     struct tm timestamp_tm;
+    struct timeval timestamp_tv; /* Capture time with sub second precision */
     int shot;                   /* Sub second timestamp count */
 
     /*
@@ -290,6 +333,27 @@ struct image_data {
     struct coord location;      /* coordinates for center and size of last motion detection*/
 
     int total_labels;
+
+    struct packet_data packets; /* compressed source of this image (if kept) */
+    struct packet_data compressed; /* jpeg of the image when image is NULL */
+};
+
+/*
+ * What the conversion specifiers of mystrftime expand to for an image. The
+ * jobs of the writer thread carry a copy, taken by image_stamp_get when
+ * they are queued, since motion_loop goes on changing the current image
+ * and the event meanwhile.
+ */
+struct image_stamp {
+    struct tm timestamp_tm;
+    struct coord location;
+    int diffs;
+    int shot;
+    int total_labels;
+    int event_nr;
+    int noise;
+    int threshold;
+    char text_event[PATH_MAX];
 };
 
 /*
@@ -318,8 +382,28 @@ struct image_data {
  *               These values are set in rotate_init.
  */
 
+/* Text rendered once and drawn on every image while it doesn't change, draw.c */
+struct text_overlay {
+    char *text;                 /* text rendered, NULL if none */
+    unsigned int startx;        /* where it was drawn, see draw_text */
+    unsigned int starty;
+    unsigned int image_width;
+    unsigned int image_height;
+    unsigned int scale;
+    int x, y;                   /* part of the image covered by the text */
+    int width, height;
+    int size;                   /* allocated size of keep and set */
+    unsigned char *keep;        /* 0 for the character pixels, 255 elsewhere */
+    unsigned char *set;         /* 255 for the white character pixels, else 0 */
+};
+
 /* date/time drawing, draw.c */
-int draw_text(unsigned char *image, unsigned int startx, unsigned int starty, unsigned int width, const char *text, unsigned int factor);
+int draw_text(unsigned char *image, unsigned int startx, unsigned int starty, unsigned int width,
+              unsigned int height, const char *text, unsigned int scale);
+int draw_text_overlay(struct text_overlay *ov, unsigned char *image, unsigned int startx,
+                      unsigned int starty, unsigned int width, unsigned int height,
+                      const char *text, unsigned int scale);
+void free_text_overlay(struct text_overlay *ov);
 int initialize_chars(void);
 
 #define MAX_LABELS   50
@@ -343,25 +427,56 @@ struct images {
     int image_ring_size;
     int image_ring_in;                /* Index in image ring buffer we last added a image into */
     int image_ring_out;               /* Index in image ring buffer we want to process next time */
+    unsigned char *image_ring_scratch; /* Buffer to (de)compress ring images in */
+
+    /*
+     * ref, out, ref_dyn, smartmask, smartmask_final, smartmask_buffer,
+     * labels, the row and column counts and common_buffer are parts of
+     * one mapping, see image_arena_create. So are image_detect and
+     * out_image when motion is detected on a scaled down picture.
+     */
+    unsigned char *arena;
+    size_t arena_size;
 
     unsigned char *ref;               /* The reference frame */
     unsigned char *out;               /* Picture buffer for motion images */
-    int *ref_dyn;                     /* Dynamic objects to be excluded from reference frame */
+    unsigned char *image_detect;      /* Y plane of image_virgin motion is detected on */
+    unsigned char *out_image;         /* out at full size for the outputs, see alg_scale_up */
+    uint16_t *ref_dyn;                /* Dynamic objects to be excluded from reference frame */
     unsigned char *image_virgin;      /* Last picture frame with no text or locate overlay */
     struct image_data preview_image;  /* Picture buffer for best image when enables */
     unsigned char *mask;              /* Buffer for the mask file */
     unsigned char *smartmask;
     unsigned char *smartmask_final;
     unsigned char *common_buffer;
-    int *smartmask_buffer;
+    uint16_t *smartmask_buffer;
     int width;
     int height;
     int type;
     int picture_type;                 /* Output picture type IMAGE_JPEG, IMAGE_PPM */
     int size;
+
+    /*
+     * Motion is detected on a picture scaled down motion_scale times
+     * (detection_scale), of motionsize pixels. ref, out, the masks,
+     * ref_dyn and labels have that size. Diffs and locations are in
+     * pixels of the full picture.
+     */
+    int motion_scale;
+    int motion_width;
+    int motion_height;
     int motionsize;
 
-    int *labels;                     /* Hold label information */
+    /*
+     * Motion pixels of out in each row and column of the detection
+     * picture, counted along with the diff. Not valid (counted 0) once out
+     * was despeckled.
+     */
+    int *row_count;
+    int *col_count;
+    int counted;
+
+    uint16_t *labels;                /* Hold label information */
     int labelsize_max;               /* Size of largest label */
     int largest_label;               /* Index of largest label */
     struct label_center labels_all[MAX_LABELS]; /* SHOULD BE DYNAMIC !? */
@@ -369,7 +484,7 @@ struct images {
 
 /* Contains data for image rotation, see rotate.c. */
 struct rotdata {
-    /* Temporary buffer for 90 and 270 degrees rotation. */
+    /* Temporary buffer for 90 and 270 degrees rotation and vertical flips. */
     unsigned char *temp_buf;
     /*
      * Degrees to rotate; copied from conf.rotate_deg. This is the value
@@ -378,6 +493,8 @@ struct rotdata {
      * while Motion is running just causes problems.
      */
     int degrees;
+    /* FLIP_TYPE_*, from conf.flip_axis in the same way */
+    int axis;
     /*
      * Capture width and height - different from output width and height if
      * rotating 90 or 270 degrees.
@@ -386,6 +503,18 @@ struct rotdata {
     int cap_height;
 };
 
+/* Frames waiting for room in the extpipe pipe, see event_extpipe_put */
+struct extpipe_backlog {
+    unsigned char *frames;      /* EXTPIPE_BACKLOG frames, allocated when needed */
+    int head;                   /* oldest frame */
+    int count;
+    size_t done;                /* bytes of the oldest frame already written */
+    int error;                  /* the pipe broke, frames are dropped */
+    unsigned long written;
+    unsigned long dropped;
+    unsigned long drop_burst;   /* frames dropped since the last one written */
+};
+
 /*
  *  These used to be global variables but now each thread will have its
  *  own context
@@ -393,6 +522,7 @@ struct rotdata {
 struct context {
     FILE *extpipe;
     int extpipe_open;
+    struct extpipe_backlog extpipe_backlog;
     char conf_filename[PATH_MAX];
     int threadnr;
     unsigned int daemon;
@@ -406,7 +536,14 @@ struct context {
     struct images imgs;
     struct trackoptions track;
     struct netcam_context *netcam;
+    struct writer *writer;                   /* output queue, NULL when writing from motion_loop */
+    struct segment_ring *segment;            /* continuous recording, NULL if off */
+    struct smartmask_file *smartmask_file;   /* smart_mask_file, NULL if none */
+    /* Enabled handlers of each event type, see event_table_build */
+    unsigned char event_table[EVENT_LAST + 1][EVENT_HANDLERS_MAX + 1];
+    pthread_mutex_t event_table_mutex;       /* taken by the writer thread to read it */
     struct image_data *current_image;        /* Pointer to a structure where the image, diffs etc is stored */
+    struct timeval capture_tv;               /* Capture time of the frame from vid_next, 0 if not known */
     unsigned int new_img;
 
     int locate_motion_mode;
@@ -438,6 +575,10 @@ struct context {
     unsigned int lightswitch_framecounter;
     char text_event_string[PATH_MAX];        /* The text for conv. spec. %C -
                                                 we assume PATH_MAX normally 4096 characters is fine */
+    unsigned int text_scale;                 /* size of the text drawn, from text_scale/text_double */
+    struct text_overlay text_changes_overlay;
+    struct text_overlay text_left_overlay;
+    struct text_overlay text_right_overlay;
     int postcap;                             /* downcounter, frames left to to send post event */
 
     int shots;
@@ -466,18 +607,8 @@ struct context {
 
 #if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
     int sql_mask;
-#endif
-
-#ifdef HAVE_SQLITE3
-    sqlite3 *database_sqlite3;
-#endif
 
-#ifdef HAVE_MYSQL
-    MYSQL *database;
-#endif
-
-#ifdef HAVE_PGSQL
-    PGconn *database_pg;
+    struct database *database;               /* database logging, NULL if none */
 #endif
 
     int movie_fps;
@@ -507,7 +638,17 @@ void * mymalloc(size_t);
 void * myrealloc(void *, size_t, const char *);
 FILE * myfopen(const char *, const char *, size_t);
 int myfclose(FILE *);
+struct seqfile * myseqopen(const char *, int);
+int myseqwrite(struct seqfile *, const unsigned char *, int);
+off_t myseqseek(struct seqfile *, off_t, int);
+int myseqclose(struct seqfile *);
 size_t mystrftime(const struct context *, char *, size_t, const char *, const struct tm *, const char *, int);
+size_t mystrftime_stamped(const struct context *, const struct image_stamp *, char *, size_t,
+                          const char *, const struct tm *, const char *, int);
+void image_stamp_get(const struct context *, const struct image_data *, struct image_stamp *);
 int create_path(const char *);
+void packet_append(struct packet_data *, const unsigned char *, int, int, int64_t, int64_t);
+void packet_clear(struct packet_data *);
+void packet_free(struct packet_data *);
 
 #endif /* _INCLUDE_MOTION_H */
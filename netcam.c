@@ -24,7 +24,9 @@
  *      Two quite different types of netcams are handled.  The simplest
  *      one is the type which supplies a single JPEG frame each time it
  *      is accessed.  The other type is one which supplies an mjpeg
- *      stream of data.
+ *      stream of data.  RTSP cameras (e.g. H.264) are a streaming type
+ *      too; they are read and decoded through libavformat by the
+ *      routines in netcam_rtsp.c.
  *
  *      For each of these cameras, the routine taking care of the netcam
  *      will start up a completely separate thread (which I call the "camera
@@ -39,12 +41,15 @@
  */
 #include "motion.h"
 
+#include <ctype.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <regex.h>                    /* For parsing of the URL */
 #include <sys/socket.h>
 
 #include "netcam_ftp.h"
+#include "netcam_rtsp.h"
+#include "md5.h"
 
 #define CONNECT_TIMEOUT        10     /* Timeout on remote connection attempt */
 #define READ_TIMEOUT            5     /* Default timeout on recv requests */
@@ -73,6 +78,8 @@ static const char *connect_req_keepalive = "Connection: Keep-Alive\r\n";
 
 static const char *connect_auth_req = "Authorization: Basic %s\r\n";
 
+static void netcam_disconnect(netcam_context_ptr);
+
 /*
  * The following three routines (netcam_url_match, netcam_url_parse and
  * netcam_url_free are for 'parsing' (i.e. separating into the relevant
@@ -146,7 +153,7 @@ static void netcam_url_parse(struct url_t *parse_url, const char *text_url)
 {
     char *s;
     int i;
-    const char *re = "(http|ftp|mjpg)://(((.*):(.*))@)?"
+    const char *re = "(http|ftp|mjpg|rtsp)://(((.*):(.*))@)?"
                      "([^/:]|[-.a-z0-9]+)(:([0-9]+))?($|(/[^:]*))";
     regex_t pattbuf;
     regmatch_t matches[10];
@@ -203,6 +210,8 @@ static void netcam_url_parse(struct url_t *parse_url, const char *text_url)
             parse_url->port = 80;
         else if (!strcmp(parse_url->service, "ftp"))
             parse_url->port = 21;
+        else if (!strcmp(parse_url->service, "rtsp"))
+            parse_url->port = 554;
     }
 
     regfree(&pattbuf);
@@ -411,6 +420,237 @@ static int netcam_check_content_type(char *header)
     return ret;
 }
 
+/**
+ * netcam_digest_param
+ *
+ *      Finds a parameter in the 'Digest' challenge of a camera
+ *      (e.g. realm="cam", nonce="abc", qop="auth").
+ *
+ * Parameters:
+ *
+ *      params          Pointer to the parameters of the challenge.
+ *      name            Name of the parameter.
+ *
+ * Returns:             Newly allocated copy of the value (without quotes),
+ *                      or NULL if the parameter is not present.
+ *
+ */
+static char *netcam_digest_param(const char *params, const char *name)
+{
+    const char *ptr = params;
+    const char *key, *val;
+    size_t keylen, vallen;
+    char *ret;
+
+    while (*ptr) {
+        while (*ptr == ' ' || *ptr == ',')
+            ptr++;
+
+        key = ptr;
+
+        while (*ptr && *ptr != '=' && *ptr != ',')
+            ptr++;
+
+        keylen = ptr - key;
+
+        if (*ptr != '=')
+            continue;
+
+        ptr++;
+
+        if (*ptr == '"') {
+            val = ++ptr;
+
+            while (*ptr && *ptr != '"')
+                ptr++;
+
+            vallen = ptr - val;
+
+            if (*ptr)
+                ptr++;
+        } else {
+            val = ptr;
+
+            while (*ptr && *ptr != ',' && *ptr != ' ')
+                ptr++;
+
+            vallen = ptr - val;
+        }
+
+        if (keylen == strlen(name) && !strncasecmp(key, name, keylen)) {
+            ret = mymalloc(vallen + 1);
+            memcpy(ret, val, vallen);
+            ret[vallen] = 0;
+            return ret;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * netcam_check_digest
+ *
+ *     Analyse an HTTP-header line to see if it is a 'WWW-Authenticate: Digest'
+ *     challenge, and if so store the new nonce etc. in the netcam context.
+ *
+ * Parameters:
+ *
+ *      netcam          Pointer to the netcam context.
+ *      header          Pointer to a string containing the header line.
+ *
+ * Returns:
+ *      -1              Not a Digest challenge.
+ *      0               Challenge with the nonce we already used.
+ *      1               Challenge with a new (or stale) nonce.
+ *
+ */
+static int netcam_check_digest(netcam_context_ptr netcam, char *header)
+{
+    struct netcam_digest *digest = &netcam->digest;
+    char *nonce, *stale, *qop, *tok, *saveptr;
+    int ret;
+
+    if (strncasecmp(header, "WWW-Authenticate:", 17))
+        return -1;
+
+    header += 17;
+
+    while (*header == ' ')
+        header++;
+
+    if (strncasecmp(header, "Digest ", 7))
+        return -1;
+
+    header += 7;
+
+    if ((nonce = netcam_digest_param(header, "nonce")) == NULL)
+        return -1;
+
+    stale = netcam_digest_param(header, "stale");
+
+    ret = !digest->nonce || strcmp(digest->nonce, nonce) ||
+          (stale && !strcasecmp(stale, "true"));
+
+    free(stale);
+    free(digest->realm);
+    free(digest->nonce);
+    free(digest->opaque);
+    free(digest->algorithm);
+
+    digest->nonce = nonce;
+    digest->realm = netcam_digest_param(header, "realm");
+    digest->opaque = netcam_digest_param(header, "opaque");
+    digest->algorithm = netcam_digest_param(header, "algorithm");
+    digest->nc = 0;
+
+    if (!digest->realm)
+        digest->realm = mystrdup("");
+
+    /* DigestCalcHA1 only knows the lower case name. */
+    if (digest->algorithm && !strcasecmp(digest->algorithm, "md5-sess"))
+        strcpy(digest->algorithm, "md5-sess");
+
+    /* We only do qop "auth" (the body is not protected). */
+    digest->qop_auth = 0;
+
+    if ((qop = netcam_digest_param(header, "qop")) != NULL) {
+        for (tok = strtok_r(qop, ", ", &saveptr); tok; tok = strtok_r(NULL, ", ", &saveptr)) {
+            if (!strcmp(tok, "auth"))
+                digest->qop_auth = 1;
+        }
+        free(qop);
+    }
+
+    return ret;
+}
+
+/**
+ * netcam_http_send_request
+ *
+ *      Sends the request for the next picture to the camera, with the
+ *      authorization header.  Once the camera challenged us for Digest
+ *      authentication, its nonce is reused with an increasing nonce count,
+ *      so that following requests need no further round trip.
+ *
+ * Parameters:
+ *
+ *      netcam          Pointer to the netcam context.
+ *
+ * Returns:             0 on success, -1 on error.
+ *
+ */
+static int netcam_http_send_request(netcam_context_ptr netcam)
+{
+    struct netcam_digest *digest = &netcam->digest;
+    char *request, *auth = NULL;
+    size_t len;
+    int ret;
+
+    if (digest->nonce && netcam->connect_userpass) {
+        char *user, *pass, *algorithm;
+        char nc[9], cnonce[17];
+        HASHHEX ha1, ha2 = "", response;
+
+        user = mystrdup(netcam->connect_userpass);
+        pass = strchr(user, ':');
+
+        if (pass)
+            *pass++ = 0;
+        else
+            pass = (char *)"";
+
+        algorithm = digest->algorithm ? digest->algorithm : (char *)"md5";
+        snprintf(nc, sizeof(nc), "%08x", ++digest->nc);
+        snprintf(cnonce, sizeof(cnonce), "%08x%08x", (unsigned int)rand(),
+                 (unsigned int)time(NULL));
+
+        DigestCalcHA1(algorithm, user, digest->realm, pass, digest->nonce,
+                      cnonce, ha1);
+        DigestCalcResponse(ha1, digest->nonce, nc, cnonce,
+                           digest->qop_auth ? (char *)"auth" : (char *)"",
+                           (char *)"GET", netcam->connect_path, ha2, response);
+
+        len = strlen(user) + strlen(digest->realm) + strlen(digest->nonce) +
+              strlen(netcam->connect_path) + strlen(algorithm) + HASHHEXLEN +
+              (digest->opaque ? strlen(digest->opaque) : 0) + 200;
+        auth = mymalloc(len);
+
+        ret = snprintf(auth, len, "Authorization: Digest username=\"%s\", realm=\"%s\", "
+                       "nonce=\"%s\", uri=\"%s\", algorithm=%s, response=\"%s\"",
+                       user, digest->realm, digest->nonce, netcam->connect_path,
+                       algorithm, response);
+
+        if (digest->opaque)
+            ret += snprintf(auth + ret, len - ret, ", opaque=\"%s\"", digest->opaque);
+
+        if (digest->qop_auth)
+            ret += snprintf(auth + ret, len - ret, ", qop=auth, nc=%s, cnonce=\"%s\"",
+                            nc, cnonce);
+
+        snprintf(auth + ret, len - ret, "\r\n");
+        free(user);
+    } else if (netcam->connect_auth) {
+        auth = mystrdup(netcam->connect_auth);
+    }
+
+    /* Request, authorization and final CRLF go out in a single packet. */
+    len = strlen(netcam->connect_request) + (auth ? strlen(auth) : 0) + 3;
+    request = mymalloc(len);
+    snprintf(request, len, "%s%s\r\n", netcam->connect_request, auth ? auth : "");
+    free(auth);
+
+    ret = send(netcam->sock, request, strlen(request), 0);
+    free(request);
+
+    if (ret < 0) {
+        MOTION_LOG(ERR, TYPE_NETCAM, SHOW_ERRNO, "%s: Error sending"
+                   " 'connect' request");
+        return -1;
+    }
+
+    return 0;
+}
 
 /**
  * netcam_read_next_header
@@ -544,16 +784,20 @@ static int netcam_read_first_header(netcam_context_ptr netcam)
     int firstflag = 1;
     int aliveflag = 0;    /* If we have seen a Keep-Alive header from cam. */
     int closeflag = 0;    /* If we have seen a Connection: close header from cam. */
+    int lengthflag = 0;   /* If we have seen a Content-length header from cam. */
+    int unauthorized = 0; /* If the cam answered 401 (authorization required). */
+    int challenge = -1;   /* Result of netcam_check_digest on the 401 answer. */
     char *header;
     char *boundary;
 
-    /* Send the initial command to the camera. */
-    if (send(netcam->sock, netcam->connect_request,
-             strlen(netcam->connect_request), 0) < 0) {
-        MOTION_LOG(ERR, TYPE_NETCAM, SHOW_ERRNO, "%s: Error sending"
-                   " 'connect' request");
+    /*
+     * Send the initial command to the camera, unless it was already
+     * sent together with the previous one (pipelining).
+     */
+    if (!netcam->request_pending && netcam_http_send_request(netcam) < 0)
         return -1;
-    }
+
+    netcam->request_pending = FALSE;
 
     /*
      * We expect to get back an HTTP header from the camera.
@@ -591,7 +835,16 @@ static int netcam_read_first_header(netcam_context_ptr netcam)
         }
 
         if (firstflag) {
-            if ((ret = http_result_code(header)) != 200) {
+            /*
+             * For 401 we need the WWW-Authenticate header which follows,
+             * the remaining headers are of no interest.
+             */
+            if ((ret = http_result_code(header)) == 401) {
+                unauthorized = 1;
+                firstflag = 0;
+                free(header);
+                continue;
+            } else if (ret != 200) {
                 MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: HTTP Result code %d",
                            ret);
 
@@ -619,6 +872,13 @@ static int netcam_read_first_header(netcam_context_ptr netcam)
         if (*header == 0)   /* Blank line received */
             break;
 
+        if (unauthorized) {
+            if ((ret = netcam_check_digest(netcam, header)) >= 0)
+                challenge = ret;
+            free(header);
+            continue;
+        }
+
         /* Check if this line is the content type. */
         if ((ret = netcam_check_content_type(header)) >= 0) {
             retval = ret;
@@ -684,6 +944,7 @@ static int netcam_read_first_header(netcam_context_ptr netcam)
             if (ret > 0) {
                 netcam->caps.content_length = 1;     /* Set flag */
                 netcam->receiving->content_length = ret;
+                lengthflag = 1;
             } else {
                 netcam->receiving->content_length = 0;
                 MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Content-length 0");
@@ -711,6 +972,33 @@ static int netcam_read_first_header(netcam_context_ptr netcam)
     }
     free(header);
 
+    if (unauthorized) {
+        /*
+         * We do not read the body of the 401 answer, so this connection
+         * can not be used any more.
+         */
+        netcam_disconnect(netcam);
+
+        if (challenge == 1 && netcam->connect_userpass) {
+            MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: Digest authentication"
+                       " challenge received, retrying");
+            return -1;
+        }
+
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Camera refused authorization"
+                   " - check netcam_userpass");
+        return 401;
+    }
+
+    /*
+     * HTTP/1.1 connections are persistent unless the camera says otherwise,
+     * no Keep-Alive header is needed.
+     */
+    if (netcam->connect_http_11 && !closeflag) {
+        aliveflag = TRUE;
+        netcam->keepalive_thisconn = TRUE;
+    }
+
     if (netcam->caps.streaming == NCS_UNSUPPORTED && netcam->connect_keepalive) {
 
         /* If we are a non-streaming (ie. Jpeg) netcam and keepalive is configured. */
@@ -805,6 +1093,18 @@ static int netcam_read_first_header(netcam_context_ptr netcam)
         }
     }
 
+    /*
+     * With a persistent HTTP/1.1 connection and a known picture size we
+     * ask for the next picture right away (pipelining).  The camera can
+     * then prepare it while we are reading this one, and it is waiting
+     * for us when the motion main loop asks for it.
+     */
+    if (retval == 1 && netcam->connect_keepalive && netcam->connect_http_11 &&
+        lengthflag && !closeflag && !netcam->keepalive_timeup) {
+        if (netcam_http_send_request(netcam) == 0)
+            netcam->request_pending = TRUE;
+    }
+
     return retval;
 }
 
@@ -828,6 +1128,9 @@ static void netcam_disconnect(netcam_context_ptr netcam)
 
         netcam->sock = -1;
     }
+
+    /* A pipelined request is lost with the connection. */
+    netcam->request_pending = FALSE;
 }
 
 /**
@@ -1928,7 +2231,7 @@ static void *netcam_handler_loop(void *arg)
         if (netcam->response) {    /* If html input */
             if (netcam->caps.streaming == NCS_UNSUPPORTED) {
                 /* Non-streaming ie. jpeg */
-                if (!netcam->connect_keepalive ||
+                if (!netcam->connect_keepalive || netcam->sock == -1 ||
                     (netcam->connect_keepalive && netcam->keepalive_timeup)) {
                     /* If keepalive flag set but time up, time to close this socket. */
                     if (netcam->connect_keepalive && netcam->keepalive_timeup) {
@@ -1959,6 +2262,10 @@ static void *netcam_handler_loop(void *arg)
                 }
                 /* Send our request and look at the response. */
                 if ((retval = netcam_read_first_header(netcam)) != 1) {
+                    /* The connection failed, make sure we connect again. */
+                    if (retval == -1)
+                        netcam_disconnect(netcam);
+
                     if (retval > 0) {
                         MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Unrecognized image"
                                    " header (%d)", retval);
@@ -2015,6 +2322,23 @@ static void *netcam_handler_loop(void *arg)
                     MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Trying to re-connect");
 
             }
+#ifdef HAVE_NETCAM_RTSP
+            /* If the RTSP stream was lost, open it again. */
+            if (netcam->rtsp && !netcam->rtsp->format_context) {
+                if (rtsp_connect(netcam) < 0) {
+                    if (!open_error) { /* Log first error */
+                        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO,
+                                   "%s: re-opening camera (rtsp)");
+                        open_error = 1;
+                    }
+                    SLEEP(5, 0);
+                } else if (open_error) {   /* Log re-connection */
+                    MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO,
+                               "%s: camera re-connected");
+                    open_error = 0;
+                }
+            }
+#endif
             continue;
         }
         /*
@@ -2139,8 +2463,8 @@ static int netcam_http_build_url(netcam_context_ptr netcam, struct url_t *url)
      *
      */
 
-    /* Space for final \r\n plus string terminator. */
-    ix = 3;
+    /* Space for the string terminator. */
+    ix = 1;
 
     /* See if username / password is required. */
     if (userpass) { /* If either of the above are non-NULL. */
@@ -2151,7 +2475,7 @@ static int netcam_http_build_url(netcam_context_ptr netcam, struct url_t *url)
         /* Now create the last part (authorization) of the request. */
         request_pass = mymalloc(strlen(connect_auth_req) +
                                 strlen(encuserpass) + 1);
-        ix += sprintf(request_pass, connect_auth_req, encuserpass);
+        sprintf(request_pass, connect_auth_req, encuserpass);
         /* Free the working variables. */
         free(encuserpass);
     }
@@ -2239,14 +2563,16 @@ static int netcam_http_build_url(netcam_context_ptr netcam, struct url_t *url)
         strcat(netcam->connect_request, connect_req_close);
 
 
+    /*
+     * The authorization header is added by netcam_http_send_request, as
+     * it changes with every request once the camera asks for Digest.
+     */
     if (userpass) {
-        strcat(netcam->connect_request, request_pass);
-        free(request_pass);
-        free(userpass);
+        netcam->connect_auth = request_pass;
+        netcam->connect_userpass = userpass;
     }
 
-    /* Put on the final CRLF onto the request. */
-    strcat(netcam->connect_request, "\r\n");
+    netcam->connect_path = mystrdup(ptr);
     free((void *)ptr);
     netcam_url_free(url);  /* Cleanup the url data. */
 
@@ -2402,6 +2728,114 @@ static int netcam_setup_ftp(netcam_context_ptr netcam, struct url_t *url)
     return 0;
 }
 
+#ifdef HAVE_NETCAM_RTSP
+/**
+ * netcam_url_escape
+ *      Percent-encodes the user or password part of 'user:password' for
+ *      the userinfo of a URL, so that e.g. '@', ':' or '/' in a password
+ *      don't end it early.
+ *
+ * Parameters
+ *
+ *      to      Buffer for the result, at least 3 * len + 1 bytes
+ *      from    Start of the part
+ *      len     Length of the part
+ *
+ * Returns:     Pointer to the terminating NUL written to 'to'.
+ *
+ */
+static char *netcam_url_escape(char *to, const char *from, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (; len--; from++) {
+        unsigned char c = *from;
+
+        if (isalnum(c) || strchr("-._~", c)) {
+            *to++ = c;
+        } else {
+            *to++ = '%';
+            *to++ = hex[c >> 4];
+            *to++ = hex[c & 15];
+        }
+    }
+
+    *to = '\0';
+
+    return to;
+}
+
+/**
+ * netcam_setup_rtsp
+ *      This function will build the stream URL handed to libavformat,
+ *      open the stream and set the get_image method accordingly.
+ *
+ * Parameters
+ *
+ *      netcam  Pointer to the netcam_context for the camera
+ *      url     Pointer to the url of the camera
+ *
+ * Returns:     0 on success (camera link ok) or -1 if an error occurred.
+ *
+ */
+static int netcam_setup_rtsp(netcam_context_ptr netcam, struct url_t *url)
+{
+    struct context *cnt = netcam->cnt;
+    const char *userpass;
+    const char *host;
+    const char *path;
+    char *p;
+
+    netcam->rtsp = rtsp_new_context();
+    netcam->rtsp->keyframes_only = cnt->conf.netcam_keyframes_only;
+
+    if (cnt->conf.netcam_proxy)
+        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO, "%s: netcam_proxy is not"
+                   " used for rtsp cameras");
+
+    /* As for http, netcam_userpass takes precedence over the URL. */
+    if (cnt->conf.netcam_userpass)
+        userpass = cnt->conf.netcam_userpass;
+    else
+        userpass = url->userpass;
+
+    /* netcam_start has taken the host out of the URL if there is no proxy. */
+    host = url->host ? url->host : netcam->connect_host;
+    path = url->path ? url->path : "";
+
+    /*
+     * Space for "rtsp://", the escaped user and password, ':', '@', ':',
+     * the port number and terminator.
+     */
+    netcam->rtsp->path = mymalloc(strlen(host) + strlen(path) +
+                                  (userpass ? 3 * strlen(userpass) : 0) + 22);
+    p = netcam->rtsp->path + sprintf(netcam->rtsp->path, "rtsp://");
+
+    if (userpass) {
+        const char *colon = strchr(userpass, ':');
+
+        if (colon) {
+            p = netcam_url_escape(p, userpass, colon - userpass);
+            *p++ = ':';
+            p = netcam_url_escape(p, colon + 1, strlen(colon + 1));
+        } else {
+            p = netcam_url_escape(p, userpass, strlen(userpass));
+        }
+
+        *p++ = '@';
+    }
+
+    sprintf(p, "%s:%d%s", host, url->port, path);
+
+    netcam_url_free(url);
+
+    netcam->caps.streaming = NCS_RTSP;
+    netcam->get_image = netcam_read_rtsp_image;
+
+    return rtsp_connect(netcam);
+}
+#endif /* HAVE_NETCAM_RTSP */
+
 /**
  * netcam_recv
  *
@@ -2547,6 +2981,14 @@ void netcam_cleanup(netcam_context_ptr netcam, int init_retry_flag)
     if (netcam->connect_request != NULL)
         free(netcam->connect_request);
 
+    free(netcam->connect_auth);
+    free(netcam->connect_path);
+    free(netcam->connect_userpass);
+    free(netcam->digest.realm);
+    free(netcam->digest.nonce);
+    free(netcam->digest.opaque);
+    free(netcam->digest.algorithm);
+
 
     if (netcam->boundary != NULL)
         free(netcam->boundary);
@@ -2575,6 +3017,10 @@ void netcam_cleanup(netcam_context_ptr netcam, int init_retry_flag)
 
     if (netcam->ftp != NULL)
         ftp_free_context(netcam->ftp);
+#ifdef HAVE_NETCAM_RTSP
+    else if (netcam->rtsp != NULL)
+        rtsp_free_context(netcam->rtsp);
+#endif
     else
         netcam_disconnect(netcam);
 
@@ -2589,6 +3035,70 @@ void netcam_cleanup(netcam_context_ptr netcam, int init_retry_flag)
     free(netcam);
 }
 
+/**
+ * netcam_wait_image
+ *
+ *      Waits for a picture newer than the one handed out last, if there
+ *      isn't one yet.  Used by netcam_proc_jpeg and netcam_proc_rtsp.
+ *      We wait 0.5 seconds which gives a practical minimum framerate of 2,
+ *      as desired for the motion_loop to function, and hopefully helps in
+ *      synchronizing the camera frames with the motion main loop.  When
+ *      the main loop is driven by the camera (netcam_event_driven) we
+ *      rather wait for two of the camera's frame times, up to one second,
+ *      so slow cameras don't make us hand out the same frame again.
+ *
+ *      Must be called with netcam->mutex locked, which is kept locked.
+ *
+ * Parameters:
+ *      netcam          Pointer to the netcam context
+ *
+ * Returns:             0 if there is a new picture, or
+ *                      NETCAM_GENERAL_ERROR | NETCAM_NOTHING_NEW_ERROR
+ */
+int netcam_wait_image(netcam_context_ptr netcam)
+{
+    struct timespec waittime;
+    struct timeval curtime;
+    long wait_usec = 500000;
+    int retcode;
+
+    if (netcam->imgcnt_last != netcam->imgcnt)
+        return 0;
+
+    if (netcam->cnt->conf.netcam_event_driven &&
+        2 * netcam->av_frame_time > wait_usec) {
+        wait_usec = 2 * netcam->av_frame_time;
+
+        if (wait_usec > 1000000)
+            wait_usec = 1000000;
+    }
+
+    gettimeofday(&curtime, NULL);
+    curtime.tv_usec += wait_usec;
+
+    if (curtime.tv_usec >= 1000000) {
+        curtime.tv_usec -= 1000000;
+        curtime.tv_sec++;
+    }
+
+    waittime.tv_sec = curtime.tv_sec;
+    waittime.tv_nsec = 1000L * curtime.tv_usec;
+
+    do {
+        retcode = pthread_cond_timedwait(&netcam->pic_ready,
+                                         &netcam->mutex, &waittime);
+    } while (retcode == EINTR);
+
+    if (retcode) {    /* We assume a non-zero reply is ETIMEOUT */
+        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO, "%s: no new pic, no signal rcvd");
+        return NETCAM_GENERAL_ERROR | NETCAM_NOTHING_NEW_ERROR;
+    }
+
+    MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: ***new pic delay successful***");
+
+    return 0;
+}
+
 /**
  * netcam_next
  *
@@ -2605,6 +3115,7 @@ void netcam_cleanup(netcam_context_ptr netcam, int init_retry_flag)
 int netcam_next(struct context *cnt, unsigned char *image)
 {
     netcam_context_ptr netcam;
+    int retval;
 
     /*
      * Here we have some more "defensive programming".  This check should
@@ -2632,6 +3143,12 @@ int netcam_next(struct context *cnt, unsigned char *image)
         pthread_mutex_unlock(&netcam->mutex);
     }
 
+#ifdef HAVE_NETCAM_RTSP
+    /* RTSP pictures are decoded by the handler thread already. */
+    if (netcam->rtsp)
+        return netcam_proc_rtsp(netcam, image);
+#endif
+
     /*
      * If an error occurs in the JPEG decompression which follows this,
      * jpeglib will return to the code within this 'if'.  Basically, our
@@ -2642,8 +3159,59 @@ int netcam_next(struct context *cnt, unsigned char *image)
         return NETCAM_GENERAL_ERROR | NETCAM_JPEG_CONV_ERROR;
 
     /* If there was no error, process the latest image buffer. */
-    return netcam_proc_jpeg(netcam, image);
+    retval = netcam_proc_jpeg(netcam, image);
+
+    if (retval != 0)
+        return retval;
+
+#ifdef HAVE_FFMPEG
+    /*
+     * For passthrough movies the JPEG itself is kept with the image, every
+     * one of them is a key frame.  The time stamps are in microseconds.
+     * Images not captured into the ring (e.g. at startup) get none.
+     */
+    if (FFMPEG_PASSTHROUGH(cnt) && cnt->current_image &&
+        image == cnt->current_image->image) {
+        int64_t usec = (int64_t)netcam->jpegbuf->image_time.tv_sec * 1000000 +
+                       netcam->jpegbuf->image_time.tv_usec;
+
+        packet_clear(&cnt->current_image->packets);
+        packet_append(&cnt->current_image->packets,
+                      (unsigned char *)netcam->jpegbuf->ptr,
+                      netcam->jpegbuf->used, PACKET_KEY, usec, usec);
+        cnt->current_image->packets.seq = netcam->imgcnt_last;
+    }
+#endif
+
+    return 0;
+}
+
+#ifdef HAVE_FFMPEG
+/**
+ * netcam_open_passthrough
+ *
+ *      Opens a movie file for the compressed frames of the camera, which
+ *      are copied without decoding and encoding them again (see
+ *      FFMPEG_PASSTHROUGH_CODEC).
+ *
+ * Parameters:
+ *
+ *      netcam          Pointer to the netcam context
+ *      filename        Name of the movie, the extension gets appended to it
+ *
+ * Returns:             Pointer to the ffmpeg struct or NULL on failure.
+ */
+struct ffmpeg *netcam_open_passthrough(netcam_context_ptr netcam, char *filename)
+{
+#ifdef HAVE_NETCAM_RTSP
+    if (netcam->rtsp)
+        return rtsp_open_passthrough(netcam, filename);
+#endif
+
+    return ffmpeg_open_passthrough(filename, CODEC_ID_MJPEG, NULL, 0, 1, 1000000,
+                                   netcam->width, netcam->height);
 }
+#endif /* HAVE_FFMPEG */
 
 /**
  * netcam_start
@@ -2809,9 +3377,21 @@ int netcam_start(struct context *cnt)
 
         strcpy(url.service, "http"); /* Put back a real URL service. */
         retval = netcam_setup_mjpg(netcam, &url);
+    } else if ((url.service) && (!strcmp(url.service, "rtsp"))) {
+#ifdef HAVE_NETCAM_RTSP
+        MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: now calling"
+                   " netcam_setup_rtsp()");
+
+        retval = netcam_setup_rtsp(netcam, &url);
+#else
+        MOTION_LOG(CRT, TYPE_NETCAM, NO_ERRNO, "%s: rtsp netcams need motion"
+                   " built with ffmpeg (libavformat 53.15 or newer)");
+        netcam_url_free(&url);
+        return -1;
+#endif
     } else {
         MOTION_LOG(CRT, TYPE_NETCAM, NO_ERRNO, "%s: Invalid netcam service '%s' - "
-                   "must be http, ftp, mjpg or file.", url.service);
+                   "must be http, ftp, mjpg, rtsp or file.", url.service);
         netcam_url_free(&url);
         return -1;
     }
@@ -2833,19 +3413,25 @@ int netcam_start(struct context *cnt)
     }
 
     /*
-     * If an error occurs in the JPEG decompression which follows this,
-     * jpeglib will return to the code within this 'if'.  If such an error
-     * occurs during startup, we will just abandon this attempt.
+     * RTSP cameras got their dimensions from the decoder when the
+     * stream was opened, all other cameras deliver JPEG images.
      */
-    if (setjmp(netcam->setjmp_buffer)) {
-        MOTION_LOG(CRT, TYPE_NETCAM, NO_ERRNO, "%s: libjpeg decompression failure "
-                   "on first frame - giving up!");
-        return -1;
-    }
+    if (!netcam->rtsp) {
+        /*
+         * If an error occurs in the JPEG decompression which follows this,
+         * jpeglib will return to the code within this 'if'.  If such an error
+         * occurs during startup, we will just abandon this attempt.
+         */
+        if (setjmp(netcam->setjmp_buffer)) {
+            MOTION_LOG(CRT, TYPE_NETCAM, NO_ERRNO, "%s: libjpeg decompression failure "
+                       "on first frame - giving up!");
+            return -1;
+        }
 
-    netcam->netcam_tolerant_check = cnt->conf.netcam_tolerant_check;
-    netcam->JFIF_marker = 0;
-    netcam_get_dimensions(netcam);
+        netcam->netcam_tolerant_check = cnt->conf.netcam_tolerant_check;
+        netcam->JFIF_marker = 0;
+        netcam_get_dimensions(netcam);
+    }
 
     /*
      * Motion currently requires that image height and width is a
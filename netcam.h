@@ -104,6 +104,7 @@ typedef struct file_context {
 #define NCS_UNSUPPORTED         0  /* streaming is not supported */
 #define NCS_MULTIPART           1  /* streaming is done via multipart */
 #define NCS_BLOCK               2  /* streaming is done via MJPG-block */
+#define NCS_RTSP                3  /* streaming is done via RTSP/RTP */
 
 /*
  * struct netcam_context contains all the structures and other data
@@ -173,9 +174,32 @@ typedef struct netcam_context {
                                    and then re-open it with Keep-Alive set again.
                                    Even Keep-Alive netcams need a close/open sometimes. */
 
-    char *connect_request;      /* contains the complete string
-                                   required for connection to the
-                                   camera */
+    char *connect_request;      /* contains the request line and
+                                   headers sent to the camera, less
+                                   the authorization header and the
+                                   final empty line */
+
+    char *connect_auth;         /* 'Authorization: Basic' header line,
+                                   NULL if no user / password is set */
+
+    char *connect_path;         /* request path, needed for Digest
+                                   authentication */
+
+    char *connect_userpass;     /* 'user:password', needed for Digest
+                                   authentication */
+
+    struct netcam_digest {      /* HTTP Digest authentication state: */
+        char *realm;            /*  from the camera's challenge */
+        char *nonce;            /*  NULL until challenged */
+        char *opaque;
+        char *algorithm;        /*  "md5" or "md5-sess" */
+        int qop_auth;           /*  camera offered qop "auth" */
+        unsigned int nc;        /*  requests made with this nonce */
+    } digest;
+
+    int request_pending;        /* set to TRUE if the request for the
+                                   next picture has already been sent
+                                   (HTTP/1.1 pipelining) */
 
     int sock;                   /* fd for the camera's socket.
                                    Note that this value is also
@@ -198,6 +222,10 @@ typedef struct netcam_context {
     struct file_context *file;  /* this structure contains the
                                    context for FILE connection */
 
+    struct rtsp_context *rtsp;  /* this structure contains the
+                                   context for RTSP connection
+                                   (libavformat) */
+
     int (*get_image)(netcam_context_ptr);
                                 /* Function to fetch the image from
                                    the netcam.  It is initialised in
@@ -290,7 +318,9 @@ void netcam_get_dimensions (struct netcam_context *);
 /*     Within netcam.c        */
 int netcam_start (struct context *);
 int netcam_next (struct context *, unsigned char *);
+int netcam_wait_image (struct netcam_context *);
 void netcam_cleanup (struct netcam_context *, int);
+struct ffmpeg *netcam_open_passthrough (struct netcam_context *, char *);
 ssize_t netcam_recv(netcam_context_ptr, void *, size_t);
 
 #endif
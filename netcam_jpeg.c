@@ -242,54 +242,14 @@ static void netcam_output_message(j_common_ptr cinfo)
 static int netcam_init_jpeg(netcam_context_ptr netcam, j_decompress_ptr cinfo)
 {
     netcam_buff_ptr buff;
+    int retcode;
 
-    /*
-     * First we check whether a new image has arrived.  If not, we
-     * setup to wait for 1/2 a frame time.  This will (hopefully)
-     * help in synchronizing the camera frames with the motion main
-     * loop.
-     */
+    /* First we check whether a new image has arrived, else wait for one. */
     pthread_mutex_lock(&netcam->mutex);
 
-    if (netcam->imgcnt_last == netcam->imgcnt) {    /* Need to wait */
-        struct timespec waittime;
-        struct timeval curtime;
-        int retcode;
-
-        /*
-         * We calculate the delay time (representing the desired frame
-         * rate).  This delay time is in *nanoseconds*.
-         * We will wait 0.5 seconds which gives a practical minimum
-         * framerate of 2 which is desired for the motion_loop to
-         * function.
-         */
-        gettimeofday(&curtime, NULL);
-        curtime.tv_usec += 500000;
-
-        if (curtime.tv_usec > 1000000) {
-            curtime.tv_usec -= 1000000;
-            curtime.tv_sec++;
-        }
-
-        waittime.tv_sec = curtime.tv_sec;
-        waittime.tv_nsec = 1000L * curtime.tv_usec;
-
-        do {
-            retcode = pthread_cond_timedwait(&netcam->pic_ready,
-                                             &netcam->mutex, &waittime);
-        } while (retcode == EINTR);
-
-        if (retcode) {    /* We assume a non-zero reply is ETIMEOUT */
-            pthread_mutex_unlock(&netcam->mutex);
-
-            MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO,
-                       "%s: no new pic, no signal rcvd");
-
-            return NETCAM_GENERAL_ERROR | NETCAM_NOTHING_NEW_ERROR;
-        }
-
-        MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO,
-                   "%s: ***new pic delay successful***");
+    if ((retcode = netcam_wait_image(netcam)) != 0) {
+        pthread_mutex_unlock(&netcam->mutex);
+        return retcode;
     }
 
     netcam->imgcnt_last = netcam->imgcnt;
@@ -405,10 +365,6 @@ static int netcam_image_conv(netcam_context_ptr netcam,
     jpeg_finish_decompress(cinfo);
     jpeg_destroy_decompress(cinfo);
 
-    if (netcam->cnt->rotate_data.degrees > 0)
-        /* Rotate as specified */
-        rotate_map(netcam->cnt, image);
-
     MOTION_LOG(DBG, TYPE_NETCAM, NO_ERRNO, "%s: jpeg_error %d",
                netcam->jpeg_error);
 
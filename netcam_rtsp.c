@@ -0,0 +1,594 @@
+/*
+ *      netcam_rtsp.c
+ *
+ *      Module for RTSP/RTP network cameras, which usually deliver an
+ *      H.264 (or MPEG-4) elementary stream instead of JPEG pictures.
+ *      The stream is received and decoded with the same libavformat /
+ *      libavcodec libraries that ffmpeg.c uses for writing movies.
+ *
+ *      The routines here plug into netcam.c in the same way as the ftp
+ *      and file routines do.  netcam_read_rtsp_image is the 'get_image'
+ *      method called by the camera handler thread: it reads packets
+ *      until a complete picture is decoded, copies the YUV420P planes
+ *      into the 'receiving' buffer and makes it the 'latest' one.  The
+ *      motion main loop then only has to copy the picture out (see
+ *      netcam_proc_rtsp), no JPEG decompression takes place.
+ *
+ *      When netcam_keyframes_only is set, only key frames are handed to
+ *      the decoder.  This lowers the CPU load to a fraction of a full
+ *      decode at the cost of detecting at the key frame rate of the camera.
+ *
+ *      With ffmpeg_video_codec set to "copy", every video packet is also
+ *      kept and handed to the motion main loop along with the picture, so
+ *      that movies can be written from the packets of the camera.
+ *
+ *      This software is distributed under the GNU Public license Version 2.
+ *      See also the file 'COPYING'.
+ *
+ */
+#include "ffmpeg.h"    /* must be first to avoid 'shadow' warning */
+#include "motion.h"
+#include "netcam_rtsp.h"
+
+#ifdef HAVE_NETCAM_RTSP
+
+#define RTSP_CONNECT_TIMEOUT   10     /* Timeout on opening the stream [s] */
+#define RTSP_MAX_PENDING       (8 * 1024 * 1024)  /* Packets kept for passthrough */
+
+/**
+ * rtsp_interrupt_cb
+ *
+ *      Called by libavformat while it is blocked in network I/O.  Returning
+ *      non-zero aborts the pending call, which gives us the same timeout
+ *      behaviour as netcam_recv has for the http cameras, and lets the
+ *      handler thread exit quickly when motion is shutting down.
+ *
+ * Parameters:
+ *
+ *      ctx     Pointer to the netcam context
+ *
+ * Returns:     1 to abort the blocking call, 0 to continue waiting.
+ *
+ */
+static int rtsp_interrupt_cb(void *ctx)
+{
+    netcam_context_ptr netcam = ctx;
+
+    if (netcam->finish)
+        return 1;
+
+    return time(NULL) > netcam->rtsp->deadline;
+}
+
+/**
+ * rtsp_new_context
+ *
+ *      Create a new RTSP context structure.
+ *
+ * Parameters
+ *
+ *      None
+ *
+ * Returns:     Pointer to the newly-created structure.
+ *
+ */
+rtsp_context_pointer rtsp_new_context(void)
+{
+    rtsp_context_pointer ret;
+
+    /* Note that mymalloc will exit on any problem. */
+    ret = mymalloc(sizeof(rtsp_context));
+
+    memset(ret, 0, sizeof(rtsp_context));
+    ret->video_stream_index = -1;
+
+    avformat_network_init();
+
+    return ret;
+}
+
+/**
+ * rtsp_close
+ *
+ *      Close the decoder and the stream, keeping the context itself so
+ *      that rtsp_connect can re-open the camera.
+ *
+ * Parameters
+ *
+ *      rtsp    Pointer to the RTSP context
+ *
+ * Returns:     Nothing
+ *
+ */
+static void rtsp_close(rtsp_context_pointer rtsp)
+{
+    if (rtsp->codec_context != NULL) {
+        pthread_mutex_lock(&global_lock);
+        avcodec_close(rtsp->codec_context);
+        pthread_mutex_unlock(&global_lock);
+        rtsp->codec_context = NULL;
+    }
+
+    if (rtsp->format_context != NULL) {
+#if LIBAVFORMAT_BUILD >= (53<<16 | 17<<8)
+        avformat_close_input(&rtsp->format_context);
+#else
+        av_close_input_file(rtsp->format_context);
+#endif
+        rtsp->format_context = NULL;
+    }
+
+    if (rtsp->frame != NULL)
+        av_freep(&rtsp->frame);
+
+    rtsp->video_stream_index = -1;
+}
+
+/**
+ * rtsp_free_context
+ *
+ *      Close any open stream and free the RTSP context.
+ *
+ * Parameters
+ *
+ *      rtsp    Pointer to the RTSP context
+ *
+ * Returns:     Nothing
+ *
+ */
+void rtsp_free_context(rtsp_context_pointer rtsp)
+{
+    if (rtsp == NULL)
+        return;
+
+    rtsp_close(rtsp);
+
+    if (rtsp->path != NULL)
+        free(rtsp->path);
+
+    free(rtsp->extradata);
+    packet_free(&rtsp->packets);
+
+    free(rtsp);
+
+    avformat_network_deinit();
+}
+
+/**
+ * rtsp_connect
+ *
+ *      Open the stream given by netcam->rtsp->path, locate the video
+ *      stream and open a decoder for it.  It is called from netcam_start
+ *      and again by the handler thread whenever the connection was lost.
+ *
+ * Parameters
+ *
+ *      netcam  Pointer to the netcam context
+ *
+ * Returns:     0 on success, -1 on any failure.
+ *
+ */
+int rtsp_connect(netcam_context_ptr netcam)
+{
+    rtsp_context_pointer rtsp = netcam->rtsp;
+    AVDictionary *opts = NULL;
+    AVCodec *codec = NULL;
+    unsigned int i;
+    int ret;
+
+    rtsp_close(rtsp);
+
+    rtsp->format_context = avformat_alloc_context();
+    rtsp->format_context->interrupt_callback.callback = rtsp_interrupt_cb;
+    rtsp->format_context->interrupt_callback.opaque = netcam;
+    rtsp->deadline = time(NULL) + RTSP_CONNECT_TIMEOUT;
+
+    /*
+     * Interleave RTP in the RTSP connection.  Lost UDP packets show up
+     * as smeared blocks in the decoded picture, which would be detected
+     * as motion.
+     */
+    av_dict_set(&opts, "rtsp_transport", "tcp", 0);
+
+    ret = avformat_open_input(&rtsp->format_context, rtsp->path, NULL, &opts);
+    av_dict_free(&opts);
+
+    if (ret < 0) {
+        /* avformat_open_input has already freed the format context. */
+        rtsp->format_context = NULL;
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Unable to open RTSP stream"
+                   " (error %d)", ret);
+        return -1;
+    }
+
+    if (avformat_find_stream_info(rtsp->format_context, NULL) < 0) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Unable to read stream info");
+        rtsp_close(rtsp);
+        return -1;
+    }
+
+    ret = av_find_best_stream(rtsp->format_context, AVMEDIA_TYPE_VIDEO,
+                              -1, -1, &codec, 0);
+    if (ret < 0 || codec == NULL) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: No decodable video stream found");
+        rtsp_close(rtsp);
+        return -1;
+    }
+
+    rtsp->video_stream_index = ret;
+
+    /* We have no use for audio or metadata, so let libavformat drop it. */
+    for (i = 0; i < rtsp->format_context->nb_streams; i++) {
+        if ((int)i != rtsp->video_stream_index)
+            rtsp->format_context->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    rtsp->codec_context = rtsp->format_context->streams[ret]->codec;
+
+    if (rtsp->keyframes_only)
+        rtsp->codec_context->skip_frame = AVDISCARD_NONKEY;
+
+    /* Get a mutex lock, avcodec_open2 is not thread safe. */
+    pthread_mutex_lock(&global_lock);
+    ret = avcodec_open2(rtsp->codec_context, codec, NULL);
+    pthread_mutex_unlock(&global_lock);
+
+    if (ret < 0) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Could not open codec %s",
+                   codec->name);
+        rtsp->codec_context = NULL;
+        rtsp_close(rtsp);
+        return -1;
+    }
+
+    rtsp->frame = avcodec_alloc_frame();
+
+    /*
+     * Remember what passthrough movies need to know about the stream.
+     * The packets pending from before the reconnect are dropped and the
+     * sequence number is skipped, so the movie waits for a key frame.
+     */
+    pthread_mutex_lock(&netcam->mutex);
+
+    free(rtsp->extradata);
+    rtsp->extradata = NULL;
+    rtsp->extradata_size = 0;
+
+    if (rtsp->codec_context->extradata_size > 0) {
+        rtsp->extradata = mymalloc(rtsp->codec_context->extradata_size);
+        memcpy(rtsp->extradata, rtsp->codec_context->extradata,
+               rtsp->codec_context->extradata_size);
+        rtsp->extradata_size = rtsp->codec_context->extradata_size;
+    }
+
+    rtsp->codec_id = rtsp->codec_context->codec_id;
+    rtsp->time_base = rtsp->format_context->streams[rtsp->video_stream_index]->time_base;
+    rtsp->width = rtsp->codec_context->width;
+    rtsp->height = rtsp->codec_context->height;
+    packet_clear(&rtsp->packets);
+    rtsp->packet_seq++;
+
+    pthread_mutex_unlock(&netcam->mutex);
+
+    /*
+     * The first connect decides the picture size.  After a reconnect
+     * the size is checked again for each decoded picture.  Motion needs
+     * a size modulo 16, the pictures are cropped to it (e.g. 1920x1080
+     * to 1920x1072).
+     */
+    if (!netcam->width) {
+        if (rtsp->codec_context->width < 16 || rtsp->codec_context->height < 16) {
+            MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Stream size %dx%d is too small",
+                       rtsp->codec_context->width, rtsp->codec_context->height);
+            rtsp_close(rtsp);
+            return -1;
+        }
+
+        netcam->width = rtsp->codec_context->width & ~15;
+        netcam->height = rtsp->codec_context->height & ~15;
+
+        if ((int)netcam->width != rtsp->codec_context->width ||
+            (int)netcam->height != rtsp->codec_context->height)
+            MOTION_LOG(NTC, TYPE_NETCAM, NO_ERRNO, "%s: Cropping the pictures to %dx%d",
+                       netcam->width, netcam->height);
+    }
+
+    MOTION_LOG(NTC, TYPE_NETCAM, NO_ERRNO, "%s: connected, %s stream %dx%d%s",
+               codec->name, rtsp->codec_context->width,
+               rtsp->codec_context->height,
+               rtsp->keyframes_only ? " (key frames only)" : "");
+
+    return 0;
+}
+
+/**
+ * rtsp_copy_plane
+ *
+ *      Copy one plane of a decoded picture, dropping the line padding
+ *      libavcodec may have added.  Columns and lines beyond the width and
+ *      height are left out, which crops the picture to modulo 16.
+ *
+ * Parameters
+ *
+ *      dst         Destination buffer
+ *      src         First line of the source plane
+ *      linesize    Distance between source lines in bytes
+ *      width       Plane width in bytes
+ *      height      Plane height in lines
+ *
+ * Returns:         Pointer just past the copied data in dst.
+ *
+ */
+static unsigned char *rtsp_copy_plane(unsigned char *dst, const unsigned char *src,
+                                      int linesize, int width, int height)
+{
+    int y;
+
+    if (linesize == width) {
+        memcpy(dst, src, width * height);
+        return dst + width * height;
+    }
+
+    for (y = 0; y < height; y++) {
+        memcpy(dst, src, width);
+        dst += width;
+        src += linesize;
+    }
+
+    return dst;
+}
+
+/**
+ * netcam_read_rtsp_image
+ *
+ *      The 'get_image' method for RTSP cameras.  It reads packets from the
+ *      stream until the decoder returns a picture, and places the picture
+ *      as YUV420P in the 'latest' buffer.
+ *
+ * Parameters
+ *
+ *      netcam  Pointer to the netcam context
+ *
+ * Returns:     0 on success, -1 on any failure.  After a read failure the
+ *              stream is closed, so the handler thread knows it has to
+ *              reconnect.
+ *
+ */
+int netcam_read_rtsp_image(netcam_context_ptr netcam)
+{
+    rtsp_context_pointer rtsp = netcam->rtsp;
+    AVCodecContext *c;
+    AVPacket packet;
+    netcam_buff_ptr buffer;
+    netcam_buff *xchg;
+    struct timeval curtime;
+    unsigned char *dst;
+    size_t size;
+    int got_picture = 0;
+
+    /* Not connected, the handler thread will try to reconnect. */
+    if (rtsp->format_context == NULL)
+        return -1;
+
+    c = rtsp->codec_context;
+
+    av_init_packet(&packet);
+
+    while (!got_picture) {
+        rtsp->deadline = time(NULL) + netcam->timeout.tv_sec;
+
+        if (av_read_frame(rtsp->format_context, &packet) < 0) {
+            MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Error reading RTSP stream"
+                       " - closing it");
+            rtsp_close(rtsp);
+            return -1;
+        }
+
+        /*
+         * In key frame mode other frames are not even handed to the
+         * decoder.  The skip_frame setting takes care of codecs that
+         * do not flag their key frames on packet level.
+         */
+        if (packet.stream_index == rtsp->video_stream_index &&
+            FFMPEG_PASSTHROUGH(netcam->cnt)) {
+            pthread_mutex_lock(&netcam->mutex);
+
+            /* Nobody collects them (e.g. the main loop is stuck) */
+            if (rtsp->packets.used + packet.size > RTSP_MAX_PENDING) {
+                packet_clear(&rtsp->packets);
+                rtsp->packet_seq++;
+            }
+
+            packet_append(&rtsp->packets, packet.data, packet.size,
+                          (packet.flags & AV_PKT_FLAG_KEY) ? PACKET_KEY : 0,
+                          packet.pts, packet.dts);
+
+            pthread_mutex_unlock(&netcam->mutex);
+        }
+
+        if (packet.stream_index == rtsp->video_stream_index &&
+            (!rtsp->keyframes_only || (packet.flags & AV_PKT_FLAG_KEY))) {
+            if (avcodec_decode_video2(c, rtsp->frame, &got_picture, &packet) < 0) {
+                MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: Error decoding"
+                           " video packet");
+                got_picture = 0;
+            }
+        }
+
+        av_free_packet(&packet);
+    }
+
+    if (c->pix_fmt != PIX_FMT_YUV420P && c->pix_fmt != PIX_FMT_YUVJ420P) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Unsupported pixel format %d"
+                   " - only YUV420P streams can be used, closing the stream", c->pix_fmt);
+        rtsp_close(rtsp);
+        return -1;
+    }
+
+    /*
+     * If the camera changed its resolution (e.g. after a reconnect),
+     * netcam_proc_rtsp reports it so that motion can restart the thread
+     * with new image buffers.
+     */
+    if ((unsigned int)(c->width & ~15) != netcam->width ||
+        (unsigned int)(c->height & ~15) != netcam->height) {
+        if (!rtsp->size_changed)
+            MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Camera width/height mismatch"
+                       " - expected %dx%d, stream %dx%d", netcam->width,
+                       netcam->height, c->width, c->height);
+        rtsp->size_changed = 1;
+        return 0;
+    }
+
+    /* Point to our working buffer and make sure a full picture fits. */
+    buffer = netcam->receiving;
+    size = (netcam->width * netcam->height * 3) / 2;
+
+    if (buffer->size < size) {
+        buffer->ptr = myrealloc(buffer->ptr, size, "netcam_read_rtsp_image");
+        buffer->size = size;
+    }
+
+    dst = (unsigned char *)buffer->ptr;
+    dst = rtsp_copy_plane(dst, rtsp->frame->data[0], rtsp->frame->linesize[0],
+                          netcam->width, netcam->height);
+    dst = rtsp_copy_plane(dst, rtsp->frame->data[1], rtsp->frame->linesize[1],
+                          netcam->width / 2, netcam->height / 2);
+    rtsp_copy_plane(dst, rtsp->frame->data[2], rtsp->frame->linesize[2],
+                    netcam->width / 2, netcam->height / 2);
+    buffer->used = size;
+
+    if (gettimeofday(&curtime, NULL) < 0)
+        MOTION_LOG(WRN, TYPE_NETCAM, SHOW_ERRNO, "%s: gettimeofday");
+
+    netcam->receiving->image_time = curtime;
+    /*
+     * Calculate our "running average" time for this netcam's
+     * frame transmissions (except for the first time).
+     * Note that the average frame time is held in microseconds.
+     */
+    if (netcam->last_image.tv_sec) {
+        netcam->av_frame_time = ((9.0 * netcam->av_frame_time) + 1000000.0 *
+                                 (curtime.tv_sec - netcam->last_image.tv_sec) +
+                                 (curtime.tv_usec- netcam->last_image.tv_usec)) / 10.0;
+
+        MOTION_LOG(DBG, TYPE_NETCAM, NO_ERRNO, "%s: Calculated frame time %f",
+                   netcam->av_frame_time);
+    }
+
+    netcam->last_image = curtime;
+
+    /*
+     * Decoding is complete - set the current 'receiving' buffer atomically
+     * as 'latest', and make the buffer previously in 'latest' become
+     * the new 'receiving'.
+     */
+    pthread_mutex_lock(&netcam->mutex);
+
+    xchg = netcam->latest;
+    netcam->latest = netcam->receiving;
+    netcam->receiving = xchg;
+    netcam->imgcnt++;
+
+    /*
+     * We have a new frame ready.  We send a signal so that
+     * any thread (e.g. the motion main loop) waiting for the
+     * next frame to become available may proceed.
+     */
+    pthread_cond_signal(&netcam->pic_ready);
+
+    pthread_mutex_unlock(&netcam->mutex);
+
+    return 0;
+}
+
+/**
+ * netcam_proc_rtsp
+ *
+ *      Counterpart of netcam_proc_jpeg for RTSP cameras.  The picture has
+ *      already been decoded by the handler thread, so we only wait for a
+ *      new one (see netcam_wait_image) and copy it to the caller.
+ *
+ * Parameters:
+ *
+ *      netcam      Pointer to the netcam context
+ *      image       Pointer to a buffer for the returned image
+ *
+ * Returns:         0 on success, or a NETCAM_* error code.
+ *
+ */
+int netcam_proc_rtsp(netcam_context_ptr netcam, unsigned char *image)
+{
+    netcam_buff_ptr buff;
+    int retcode;
+
+    if (netcam->rtsp->size_changed)
+        return NETCAM_RESTART_ERROR;
+
+    pthread_mutex_lock(&netcam->mutex);
+
+    if ((retcode = netcam_wait_image(netcam)) != 0) {
+        pthread_mutex_unlock(&netcam->mutex);
+        return retcode;
+    }
+
+    netcam->imgcnt_last = netcam->imgcnt;
+
+    /* Set latest buffer as "current". */
+    buff = netcam->latest;
+    netcam->latest = netcam->jpegbuf;
+    netcam->jpegbuf = buff;
+
+    /*
+     * The packets received up to now go with this image into the ring.
+     * The (already cleared) packet buffers of the ring slot are reused
+     * for the next ones.  Images not captured into the ring (e.g. at
+     * startup) leave the packets pending.
+     */
+    if (FFMPEG_PASSTHROUGH(netcam->cnt) && netcam->cnt->current_image &&
+        image == netcam->cnt->current_image->image) {
+        struct packet_data *slot = &netcam->cnt->current_image->packets;
+        struct packet_data xchg_packets = *slot;
+
+        *slot = netcam->rtsp->packets;
+        slot->seq = netcam->rtsp->packet_seq++;
+        netcam->rtsp->packets = xchg_packets;
+        packet_clear(&netcam->rtsp->packets);
+    }
+
+    pthread_mutex_unlock(&netcam->mutex);
+
+    memcpy(image, netcam->jpegbuf->ptr, netcam->jpegbuf->used);
+
+    return 0;
+}
+
+/**
+ * rtsp_open_passthrough
+ *
+ *      Open a movie file taking the packets of the RTSP stream as they are.
+ *
+ * Parameters:
+ *
+ *      netcam      Pointer to the netcam context
+ *      filename    Name of the movie, the extension gets appended to it
+ *
+ * Returns:         Pointer to the ffmpeg struct or NULL on failure.
+ *
+ */
+struct ffmpeg *rtsp_open_passthrough(netcam_context_ptr netcam, char *filename)
+{
+    rtsp_context_pointer rtsp = netcam->rtsp;
+    struct ffmpeg *ffmpeg;
+
+    pthread_mutex_lock(&netcam->mutex);
+    ffmpeg = ffmpeg_open_passthrough(filename, rtsp->codec_id, rtsp->extradata,
+                                     rtsp->extradata_size, rtsp->time_base.num,
+                                     rtsp->time_base.den, rtsp->width,
+                                     rtsp->height);
+    pthread_mutex_unlock(&netcam->mutex);
+
+    return ffmpeg;
+}
+
+#endif /* HAVE_NETCAM_RTSP */
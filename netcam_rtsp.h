@@ -0,0 +1,57 @@
+/*
+ *      netcam_rtsp.h
+ *
+ *      Include file for RTSP/RTP network cameras (e.g. H.264 streams).
+ *      The stream is opened and decoded with libavformat/libavcodec,
+ *      so this input is only available when motion is built with ffmpeg.
+ *
+ *      This software is distributed under the GNU Public license
+ *      Version 2.  See also the file 'COPYING'.
+ *
+ */
+#ifndef _INCLUDE_NETCAM_RTSP_H
+#define _INCLUDE_NETCAM_RTSP_H
+
+#include "ffmpeg.h"
+
+/*
+ * The AVIO interrupt callback, which gives us read timeouts, appeared
+ * in libavformat 53.15.  Older versions can not support rtsp:// netcams.
+ */
+#if defined(HAVE_FFMPEG) && LIBAVFORMAT_BUILD >= (53<<16 | 15<<8)
+#define HAVE_NETCAM_RTSP
+
+typedef struct rtsp_context {
+    char            *path;               /* full URL handed to libavformat */
+    AVFormatContext *format_context;     /* NULL when not connected */
+    AVCodecContext  *codec_context;      /* decoder of the video stream */
+    AVFrame         *frame;              /* last decoded picture */
+    int             video_stream_index;  /* index of the video stream */
+    int             keyframes_only;      /* decode only key frames */
+    int             size_changed;        /* stream size differs from netcam */
+    time_t          deadline;            /* end of current blocking call */
+
+    /* Copies of the stream parameters for passthrough movies (see ffmpeg.h) */
+    int             codec_id;            /* CodecID of the video stream */
+    unsigned char   *extradata;          /* codec global header */
+    int             extradata_size;
+    AVRational      time_base;           /* time base of packet pts/dts */
+    int             width;               /* stream size, netcam->width and */
+    int             height;              /* height are cropped to modulo 16 */
+
+    /* Video packets received since the last netcam_proc_rtsp */
+    struct packet_data packets;
+    unsigned int    packet_seq;          /* sequence number of next batch */
+} rtsp_context, *rtsp_context_pointer;
+
+/* The public interface */
+rtsp_context_pointer rtsp_new_context(void);
+void rtsp_free_context(rtsp_context_pointer);
+int rtsp_connect(netcam_context_ptr);
+int netcam_read_rtsp_image(netcam_context_ptr);
+int netcam_proc_rtsp(netcam_context_ptr, unsigned char *);
+struct ffmpeg *rtsp_open_passthrough(netcam_context_ptr, char *);
+
+#endif /* HAVE_FFMPEG && LIBAVFORMAT_BUILD >= 53.15 */
+
+#endif /* _INCLUDE_NETCAM_RTSP_H */
@@ -11,6 +11,7 @@
 
 #include "picture.h"
 #include "event.h"
+#include "writer.h"
 
 #include <assert.h>
 
@@ -222,9 +223,10 @@ static void put_subjectarea(struct tiff_writing *into, const struct coord *box)
  */
 static void put_jpeg_exif(j_compress_ptr cinfo,
 			  const struct context *cnt,
-			  const struct tm *timestamp,
-			  const struct coord *box)
+			  const struct image_stamp *stamp)
 {
+    const struct tm *timestamp = stamp ? &stamp->timestamp_tm : NULL;
+    const struct coord *box = stamp ? &stamp->location : NULL;
     /* description, datetime, and subtime are the values that are actually
      * put into the EXIF data
     */
@@ -249,9 +251,9 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
     // use as much of it as is indicated by conf->frame_limit
     subtime = NULL;
 
-    if (cnt->conf.exif_text) {
+    if (stamp && cnt->conf.exif_text) {
 	    description = malloc(PATH_MAX);
-	    mystrftime(cnt, description, PATH_MAX-1,
+	    mystrftime_stamped(cnt, stamp, description, PATH_MAX-1,
 		        cnt->conf.exif_text,
 		        timestamp, NULL, 0);
     } else {
@@ -414,7 +416,7 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
  */
 static int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
 				   unsigned char *input_image, int width, int height, int quality,
-				   struct context *cnt, struct tm *tm, struct coord *box)
+				   struct context *cnt, const struct image_stamp *stamp)
 
 {
     int i, j, jpeg_image_size;
@@ -457,7 +459,7 @@ static int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
 
     jpeg_start_compress(&cinfo, TRUE);
 
-    put_jpeg_exif(&cinfo, cnt, tm, box);
+    put_jpeg_exif(&cinfo, cnt, stamp);
 
     for (j = 0; j < height; j += 16) {
         for (i = 0; i < 16; i++) {
@@ -515,7 +517,7 @@ static int put_jpeg_grey_memory(unsigned char *dest_image, int image_size, unsig
 
     jpeg_start_compress (&cjpeg, TRUE);
 
-    put_jpeg_exif(&cjpeg, NULL, NULL, NULL);
+    put_jpeg_exif(&cjpeg, NULL, NULL);
 
     row_ptr[0] = input_image;
 
@@ -549,7 +551,7 @@ static int put_jpeg_grey_memory(unsigned char *dest_image, int image_size, unsig
 static void put_jpeg_yuv420p_file(FILE *fp,
 				  unsigned char *image, int width, int height,
 				  int quality,
-				  struct context *cnt, struct tm *tm, struct coord *box)
+				  struct context *cnt, const struct image_stamp *stamp)
 {
     int i, j;
 
@@ -590,7 +592,7 @@ static void put_jpeg_yuv420p_file(FILE *fp,
     jpeg_stdio_dest(&cinfo, fp);        // Data written to file
     jpeg_start_compress(&cinfo, TRUE);
 
-    put_jpeg_exif(&cinfo, cnt, tm, box);
+    put_jpeg_exif(&cinfo, cnt, stamp);
 
     for (j = 0; j < height; j += 16) {
         for (i = 0; i < 16; i++) {
@@ -644,7 +646,7 @@ static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, i
 
     jpeg_start_compress(&cjpeg, TRUE);
 
-    put_jpeg_exif(&cjpeg, NULL, NULL, NULL);
+    put_jpeg_exif(&cjpeg, NULL, NULL);
 
     row_ptr[0] = image;
 
@@ -744,8 +746,8 @@ void overlay_smartmask(struct context *cnt, unsigned char *out)
 
     i = imgs->motionsize;
     v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    width = imgs->motion_width;
+    height = imgs->motion_height;
 
     /* Set V to 255 to make smartmask appear red. */
     out_v = out + v;
@@ -788,8 +790,8 @@ void overlay_fixed_mask(struct context *cnt, unsigned char *out)
 
     i = imgs->motionsize;
     v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    width = imgs->motion_width;
+    height = imgs->motion_height;
 
     /* Set U and V to 0 to make fixed mask appear green. */
     out_v = out + v;
@@ -827,13 +829,13 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
 {
     int i, x, v, width, height, line;
     struct images *imgs = &cnt->imgs;
-    int *labels = imgs->labels;
+    uint16_t *labels = imgs->labels;
     unsigned char *out_y, *out_u, *out_v;
 
     i = imgs->motionsize;
     v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    width = imgs->motion_width;
+    height = imgs->motion_height;
 
     /* Set U to 255 to make label appear blue. */
     out_u = out + i;
@@ -870,6 +872,7 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  * - image_size is the size of the input image buffer
  * - *image points to the image buffer that contains the YUV420P or Grayscale image about to be put
  * - quality is the jpeg quality setting from the config file.
+ * - stamp is what goes to the EXIF data, see image_stamp_get.
  *
  * Output:
  * - **dest_image is a pointer to a pointer that points to the destination buffer in which the
@@ -878,12 +881,12 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  * Returns the dest_image_size if successful. Otherwise 0.
  */
 int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image_size,
-                       unsigned char *image, int quality)
+                       unsigned char *image, int quality, const struct image_stamp *stamp)
 {
     switch (cnt->imgs.type) {
     case VIDEO_PALETTE_YUV420P:
         return put_jpeg_yuv420p_memory(dest_image, image_size, image,
-                                       cnt->imgs.width, cnt->imgs.height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
+                                       cnt->imgs.width, cnt->imgs.height, quality, cnt, stamp);
     case VIDEO_PALETTE_GREY:
         return put_jpeg_grey_memory(dest_image, image_size, image,
                                     cnt->imgs.width, cnt->imgs.height, quality);
@@ -895,14 +898,15 @@ int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image
     return 0;
 }
 
-void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, int quality)
+static void put_picture_fd_stamped(struct context *cnt, FILE *picture, unsigned char *image,
+                                  int quality, const struct image_stamp *stamp)
 {
     if (cnt->imgs.picture_type == IMAGE_TYPE_PPM) {
         put_ppm_bgr24_file(picture, image, cnt->imgs.width, cnt->imgs.height);
     } else {
         switch (cnt->imgs.type) {
         case VIDEO_PALETTE_YUV420P:
-            put_jpeg_yuv420p_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
+            put_jpeg_yuv420p_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality, cnt, stamp);
             break;
         case VIDEO_PALETTE_GREY:
             put_jpeg_grey_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality);
@@ -914,8 +918,22 @@ void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, in
     }
 }
 
+void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, int quality)
+{
+    struct image_stamp stamp;
 
-void put_picture(struct context *cnt, char *file, unsigned char *image, int ftype)
+    image_stamp_get(cnt, cnt->current_image, &stamp);
+    put_picture_fd_stamped(cnt, picture, image, quality, &stamp);
+}
+
+/**
+ * put_picture_stamped
+ *      Writes the image to a new file. The stamp of the image goes to the
+ *      EXIF data of a jpeg. Called directly by the writer thread, which has
+ *      to pass the stamp of the image it got queued.
+ */
+void put_picture_stamped(struct context *cnt, char *file, unsigned char *image, int ftype,
+                         const struct image_stamp *stamp)
 {
     FILE *picture;
 
@@ -936,11 +954,25 @@ void put_picture(struct context *cnt, char *file, unsigned char *image, int ftyp
         }
     }
 
-    put_picture_fd(cnt, picture, image, cnt->conf.quality);
+    put_picture_fd_stamped(cnt, picture, image, cnt->conf.quality, stamp);
     myfclose(picture);
     event(cnt, EVENT_FILECREATE, NULL, file, (void *)(unsigned long)ftype, NULL);
 }
 
+void put_picture(struct context *cnt, char *file, unsigned char *image, int ftype)
+{
+    struct image_stamp stamp;
+
+    /* With an output queue the writer thread does the work */
+    if (cnt->writer) {
+        writer_put_picture(cnt, file, image, ftype);
+        return;
+    }
+
+    image_stamp_get(cnt, cnt->current_image, &stamp);
+    put_picture_stamped(cnt, file, image, ftype, &stamp);
+}
+
 /**
  * get_pgm
  *      Get the pgm file used as fixed mask
@@ -1035,15 +1067,17 @@ void put_fixed_mask(struct context *cnt, const char *file)
         }
         return;
     }
-    memset(cnt->imgs.out, 255, cnt->imgs.motionsize); /* Initialize to unset */
+    /* The mask has the size of the full picture, see motion_init */
+    memset(cnt->imgs.common_buffer, 255, cnt->imgs.width * cnt->imgs.height); /* Initialize to unset */
 
     /* Write pgm-header. */
     fprintf(picture, "P5\n");
-    fprintf(picture, "%d %d\n", cnt->conf.width, cnt->conf.height);
+    fprintf(picture, "%d %d\n", cnt->imgs.width, cnt->imgs.height);
     fprintf(picture, "%d\n", 255);
 
     /* Write pgm image data at once. */
-    if ((int)fwrite(cnt->imgs.out, cnt->conf.width, cnt->conf.height, picture) != cnt->conf.height) {
+    if ((int)fwrite(cnt->imgs.common_buffer, cnt->imgs.width, cnt->imgs.height, picture) !=
+        cnt->imgs.height) {
         MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Failed writing default mask as pgm file");
         return;
     }
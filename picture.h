@@ -17,8 +17,11 @@ void overlay_fixed_mask(struct context *, unsigned char *);
 void put_fixed_mask(struct context *, const char *);
 void overlay_largest_label(struct context *, unsigned char *);
 void put_picture_fd(struct context *, FILE *, unsigned char *, int);
-int put_picture_memory(struct context *, unsigned char*, int, unsigned char *, int);
+int put_picture_memory(struct context *, unsigned char*, int, unsigned char *, int,
+                       const struct image_stamp *);
 void put_picture(struct context *, char *, unsigned char *, int);
+void put_picture_stamped(struct context *, char *, unsigned char *, int,
+                         const struct image_stamp *);
 unsigned char *get_pgm(FILE *, int, int);
 void preview_save(struct context *);
 
@@ -31,6 +31,18 @@
  */
 #include "rotate.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * The 90 degrees rotations transpose the image in tiles of ROTATE_TILE x
+ * ROTATE_TILE pixels, walked in blocks of ROTATE_BLOCK x ROTATE_BLOCK pixels
+ * so that the source and destination lines of a block stay in the cache.
+ */
+#define ROTATE_TILE     8
+#define ROTATE_BLOCK    64
+
 /*=============================================================================
                     Start of code from bits/byteswap.h
  =============================================================================*/
@@ -128,7 +140,7 @@ static void reverse_inplace_quad(unsigned char *src, int size)
     uint32_t *ndst = (uint32_t *)(src + size - 4); /* last quad */
     register uint32_t tmp;
 
-    while (nsrc < ndst) {
+    while (nsrc <= ndst) {
         tmp = swap_bytes(*ndst);
         *ndst-- = swap_bytes(*nsrc);
         *nsrc++ = tmp;
@@ -136,77 +148,180 @@ static void reverse_inplace_quad(unsigned char *src, int size)
 }
 
 /**
- * rot90cw
+ * transpose_tile
  *
- *  Performs a 90 degrees clockwise rotation of the memory block pointed to
- *  by src. The rotation is NOT performed in-place; dst must point to a
- *  receiving memory block the same size as src.
+ *  Transposes a tile of ROTATE_TILE x ROTATE_TILE pixels: row i of the
+ *  destination gets column i of the source. The strides may be negative to
+ *  walk the source or the destination bottom up.
  *
  * Parameters:
  *
- *   src    - pointer to the memory block (image) to rotate clockwise
- *   dst    - where to put the rotated memory block
- *   size   - the size (in bytes) of the memory blocks (both src and dst)
- *   width  - the width of the memory block when seen as an image
- *   height - the height of the memory block when seen as an image
+ *   src     - the first pixel of the first source row
+ *   sstride - distance from a source row to the next
+ *   dst     - the first pixel of the first destination row
+ *   dstride - distance from a destination row to the next
  *
  * Returns: nothing
  */
-static void rot90cw(unsigned char *src, register unsigned char *dst, int size,
-                    int width, int height)
+static inline void transpose_tile(const unsigned char *src, int sstride,
+                                  unsigned char *dst, int dstride)
 {
-    unsigned char *endp;
-    register unsigned char *base;
-    int j;
+#ifdef __SSE2__
+    __m128i r0, r1, r2, r3, r4, r5, r6, r7;
+    __m128i t0, t1, t2, t3;
+
+    r0 = _mm_loadl_epi64((const __m128i *)src);
+    r1 = _mm_loadl_epi64((const __m128i *)(src + sstride));
+    r2 = _mm_loadl_epi64((const __m128i *)(src + 2 * sstride));
+    r3 = _mm_loadl_epi64((const __m128i *)(src + 3 * sstride));
+    r4 = _mm_loadl_epi64((const __m128i *)(src + 4 * sstride));
+    r5 = _mm_loadl_epi64((const __m128i *)(src + 5 * sstride));
+    r6 = _mm_loadl_epi64((const __m128i *)(src + 6 * sstride));
+    r7 = _mm_loadl_epi64((const __m128i *)(src + 7 * sstride));
+
+    /* Pairs of rows, then quads of rows, then all 8 rows of each column */
+    t0 = _mm_unpacklo_epi8(r0, r1);
+    t1 = _mm_unpacklo_epi8(r2, r3);
+    t2 = _mm_unpacklo_epi8(r4, r5);
+    t3 = _mm_unpacklo_epi8(r6, r7);
+
+    r0 = _mm_unpacklo_epi16(t0, t1);    /* columns 0-3 of rows 0-3 */
+    r1 = _mm_unpackhi_epi16(t0, t1);    /* columns 4-7 of rows 0-3 */
+    r2 = _mm_unpacklo_epi16(t2, t3);
+    r3 = _mm_unpackhi_epi16(t2, t3);
+
+    t0 = _mm_unpacklo_epi32(r0, r2);    /* columns 0 and 1 */
+    t1 = _mm_unpackhi_epi32(r0, r2);    /* columns 2 and 3 */
+    t2 = _mm_unpacklo_epi32(r1, r3);
+    t3 = _mm_unpackhi_epi32(r1, r3);
+
+    _mm_storel_epi64((__m128i *)dst, t0);
+    _mm_storel_epi64((__m128i *)(dst + dstride), _mm_unpackhi_epi64(t0, t0));
+    _mm_storel_epi64((__m128i *)(dst + 2 * dstride), t1);
+    _mm_storel_epi64((__m128i *)(dst + 3 * dstride), _mm_unpackhi_epi64(t1, t1));
+    _mm_storel_epi64((__m128i *)(dst + 4 * dstride), t2);
+    _mm_storel_epi64((__m128i *)(dst + 5 * dstride), _mm_unpackhi_epi64(t2, t2));
+    _mm_storel_epi64((__m128i *)(dst + 6 * dstride), t3);
+    _mm_storel_epi64((__m128i *)(dst + 7 * dstride), _mm_unpackhi_epi64(t3, t3));
+#else
+    int i, j;
+
+    for (j = 0; j < ROTATE_TILE; j++, src += sstride, dst++)
+        for (i = 0; i < ROTATE_TILE; i++)
+            dst[i * dstride] = src[i];
+#endif
+}
 
-    endp = src + size;
-    for (base = endp - width; base < endp; base++) {
-        src = base;
-        for (j = 0; j < height; j++, src -= width)
-            *dst++ = *src;
+/**
+ * rot90
+ *
+ *  Performs a 90 degrees clockwise or counterclockwise rotation of the
+ *  memory block pointed to by src. The rotation is NOT performed in-place;
+ *  dst must point to a receiving memory block the same size as src.
+ *
+ * Parameters:
+ *
+ *   src       - pointer to the memory block (image) to rotate
+ *   dst       - where to put the rotated memory block
+ *   width     - the width of the memory block when seen as an image
+ *   height    - the height of the memory block when seen as an image
+ *   clockwise - rotate clockwise, otherwise counterclockwise
+ *
+ * Returns: nothing
+ */
+static void rot90(const unsigned char *src, unsigned char *dst,
+                  int width, int height, int clockwise)
+{
+    /* The part of the image covered by whole tiles */
+    int tw = width & ~(ROTATE_TILE - 1);
+    int th = height & ~(ROTATE_TILE - 1);
+    int bx, by, x, y, xend, yend;
+
+    for (by = 0; by < th; by += ROTATE_BLOCK) {
+        yend = by + ROTATE_BLOCK < th ? by + ROTATE_BLOCK : th;
+
+        for (bx = 0; bx < tw; bx += ROTATE_BLOCK) {
+            xend = bx + ROTATE_BLOCK < tw ? bx + ROTATE_BLOCK : tw;
+
+            for (y = by; y < yend; y += ROTATE_TILE) {
+                for (x = bx; x < xend; x += ROTATE_TILE) {
+                    /*
+                     * Clockwise, source column x becomes destination row x,
+                     * read bottom up. Counterclockwise, it becomes row
+                     * width - 1 - x, read top down.
+                     */
+                    if (clockwise)
+                        transpose_tile(src + (y + ROTATE_TILE - 1) * width + x, -width,
+                                       dst + x * height + height - ROTATE_TILE - y, height);
+                    else
+                        transpose_tile(src + y * width + x, width,
+                                       dst + (width - 1 - x) * height + y, -height);
+                }
+            }
+        }
+    }
 
+    /* The columns and rows left over by the tiles */
+    for (y = 0; y < height; y++) {
+        for (x = y < th ? tw : 0; x < width; x++) {
+            if (clockwise)
+                dst[x * height + height - 1 - y] = src[y * width + x];
+            else
+                dst[(width - 1 - x) * height + y] = src[y * width + x];
+        }
     }
 }
 
 /**
- * rot90ccw
+ * flip_h
  *
- *  Performs a 90 degrees counterclockwise rotation of the memory block pointed
- *  to by src. The rotation is not performed in-place; dst must point to a
- *  receiving memory block the same size as src.
+ *  Mirrors an image left to right in-place.
  *
  * Parameters:
  *
- *   src    - pointer to the memory block (image) to rotate counterclockwise
- *   dst    - where to put the rotated memory block
- *   size   - the size (in bytes) of the memory blocks (both src and dst)
- *   width  - the width of the memory block when seen as an image
- *   height - the height of the memory block when seen as an image
+ *   map    - the image
+ *   width  - the width of the image, a multiple of 4
+ *   height - the height of the image
  *
  * Returns: nothing
  */
-static inline void rot90ccw(unsigned char *src, register unsigned char *dst,
-                            int size, int width, int height)
+static void flip_h(unsigned char *map, int width, int height)
 {
-    unsigned char *endp;
-    register unsigned char *base;
-    int j;
+    int y;
 
-    endp = src + size;
-    dst = dst + size - 1;
-    for (base = endp - width; base < endp; base++) {
-        src = base;
-        for (j = 0; j < height; j++, src -= width)
-            *dst-- = *src;
+    for (y = 0; y < height; y++, map += width)
+        reverse_inplace_quad(map, width);
+}
 
-    }
+/**
+ * flip_v
+ *
+ *  Copies an image upside down. The flip is NOT performed in-place.
+ *
+ * Parameters:
+ *
+ *   src    - the image to flip
+ *   dst    - where to put the flipped image
+ *   width  - the width of the image
+ *   height - the height of the image
+ *
+ * Returns: nothing
+ */
+static void flip_v(const unsigned char *src, unsigned char *dst, int width, int height)
+{
+    int y;
+
+    src += (height - 1) * width;
+
+    for (y = 0; y < height; y++, src -= width, dst += width)
+        memcpy(dst, src, width);
 }
 
 /**
  * rotate_init
  *
- *  Initializes rotation data - allocates memory and determines which function
- *  to use for 180 degrees rotation.
+ *  Initializes rotation and flip data - allocates memory and determines which
+ *  function to use for 180 degrees rotation.
  *
  * Parameters:
  *
@@ -234,6 +349,19 @@ void rotate_init(struct context *cnt)
         cnt->rotate_data.degrees = cnt->conf.rotate_deg % 360; /* Range: 0..359 */
     }
 
+    /* Same for conf.flip_axis. */
+    if (!cnt->conf.flip_axis || !strcmp(cnt->conf.flip_axis, "none")) {
+        cnt->rotate_data.axis = FLIP_TYPE_NONE;
+    } else if (!strcmp(cnt->conf.flip_axis, "h")) {
+        cnt->rotate_data.axis = FLIP_TYPE_HORIZONTAL;
+    } else if (!strcmp(cnt->conf.flip_axis, "v")) {
+        cnt->rotate_data.axis = FLIP_TYPE_VERTICAL;
+    } else {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Config option \"flip_axis\" not none, h or v: %s",
+                   cnt->conf.flip_axis);
+        cnt->rotate_data.axis = FLIP_TYPE_NONE;
+    }
+
     /*
      * Upon entrance to this function, imgs.width and imgs.height contain the
      * capture dimensions (as set in the configuration file, or read from a
@@ -256,10 +384,10 @@ void rotate_init(struct context *cnt)
     }
 
     /*
-     * If we're not rotating, let's exit once we have setup the capture dimensions
-     * and output dimensions properly.
+     * If we're not rotating or flipping, let's exit once we have setup the
+     * capture dimensions and output dimensions properly.
      */
-    if (cnt->rotate_data.degrees == 0)
+    if (cnt->rotate_data.degrees == 0 && cnt->rotate_data.axis == FLIP_TYPE_NONE)
         return;
 
     switch (cnt->imgs.type) {
@@ -279,16 +407,20 @@ void rotate_init(struct context *cnt)
         break;
     default:
         cnt->rotate_data.degrees = 0;
+        cnt->rotate_data.axis = FLIP_TYPE_NONE;
         MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Unsupported palette (%d), rotation is disabled",
                     cnt->imgs.type);
         return;
     }
 
     /*
-     * Allocate memory if rotating 90 or 270 degrees, because those rotations
-     * cannot be performed in-place (they can, but it would be too slow).
+     * Allocate memory if rotating 90 or 270 degrees or flipping vertically,
+     * because those cannot be performed in-place (they can, but it would be
+     * too slow). The buffer is swapped with the image by rotate_map, so it
+     * must be as large as the images.
      */
-    if ((cnt->rotate_data.degrees == 90) || (cnt->rotate_data.degrees == 270))
+    if ((cnt->rotate_data.degrees == 90) || (cnt->rotate_data.degrees == 270) ||
+        (cnt->rotate_data.axis == FLIP_TYPE_VERTICAL))
         cnt->rotate_data.temp_buf = mymalloc(size);
 }
 
@@ -309,15 +441,37 @@ void rotate_deinit(struct context *cnt)
         free(cnt->rotate_data.temp_buf);
 }
 
+/**
+ * rotate_swap
+ *
+ *  Hands the image written to the temporary buffer to the caller, and keeps
+ *  the caller's image as the next temporary buffer. This saves copying it
+ *  back.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *   map - pointer to the caller's image pointer
+ *
+ * Returns: nothing
+ */
+static void rotate_swap(struct context *cnt, unsigned char **map)
+{
+    unsigned char *tmp = *map;
+
+    *map = cnt->rotate_data.temp_buf;
+    cnt->rotate_data.temp_buf = tmp;
+}
+
 /**
  * rotate_map
  *
  *  Main entry point for rotation. This is the function that is called from
- *  video.c/video_freebsd.c to perform the rotation.
+ *  vid_next to flip and rotate the captured image.
  *
  * Parameters:
  *
- *   map - pointer to the image/data to rotate
+ *   map - pointer to the pointer to the image/data to rotate
  *   cnt - the current thread's context structure
  *
  * Returns:
@@ -325,7 +479,7 @@ void rotate_deinit(struct context *cnt)
  *   0  - success
  *   -1 - failure (shouldn't happen)
  */
-int rotate_map(struct context *cnt, unsigned char *map)
+int rotate_map(struct context *cnt, unsigned char **map)
 {
     /*
      * The image format is either YUV 4:2:0 planar, in which case the pixel
@@ -337,44 +491,64 @@ int rotate_map(struct context *cnt, unsigned char *map)
      * of width x height bytes.
      */
     int wh, wh4 = 0, w2 = 0, h2 = 0;  /* width * height, width * height / 4 etc. */
-    int size, deg;
+    int deg, yuv;
     int width, height;
+    unsigned char *temp;
 
     deg = cnt->rotate_data.degrees;
     width = cnt->rotate_data.cap_width;
     height = cnt->rotate_data.cap_height;
+    yuv = (cnt->imgs.type == VIDEO_PALETTE_YUV420P);
 
     /*
      * Pre-calculate some stuff:
      *  wh   - size of the Y plane, or the entire greyscale image
-     *  size - size of the entire memory block
      *  wh4  - size of the U plane, and the V plane
      *  w2   - width of the U plane, and the V plane
      *  h2   - as w2, but height instead
      */
     wh = width * height;
-    if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
-        size = wh * 3 / 2;
+    if (yuv) {
         wh4 = wh / 4;
         w2 = width / 2;
         h2 = height / 2;
-    } else { /* VIDEO_PALETTE_GREY */
-        size = wh;
+    }
+
+    /* The flip applies to the captured image, before rotating it. */
+    switch (cnt->rotate_data.axis) {
+    case FLIP_TYPE_HORIZONTAL:
+        flip_h(*map, width, height);
+        if (yuv) {
+            flip_h(*map + wh, w2, h2);
+            flip_h(*map + wh + wh4, w2, h2);
+        }
+        break;
+
+    case FLIP_TYPE_VERTICAL:
+        temp = cnt->rotate_data.temp_buf;
+        flip_v(*map, temp, width, height);
+        if (yuv) {
+            flip_v(*map + wh, temp + wh, w2, h2);
+            flip_v(*map + wh + wh4, temp + wh + wh4, w2, h2);
+        }
+        rotate_swap(cnt, map);
+        break;
     }
 
     switch (deg) {
+    case 0:
+        break;
+
     case 90:
-        /* First do the Y part */
-        rot90cw(map, cnt->rotate_data.temp_buf, wh, width, height);
-        if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
-            /* Then do U and V */
-            rot90cw(map + wh, cnt->rotate_data.temp_buf + wh, wh4, w2, h2);
-            rot90cw(map + wh + wh4, cnt->rotate_data.temp_buf + wh + wh4,
-                    wh4, w2, h2);
+    case 270:
+        /* First do the Y part, then U and V */
+        temp = cnt->rotate_data.temp_buf;
+        rot90(*map, temp, width, height, deg == 90);
+        if (yuv) {
+            rot90(*map + wh, temp + wh, w2, h2, deg == 90);
+            rot90(*map + wh + wh4, temp + wh + wh4, w2, h2, deg == 90);
         }
-
-        /* Then copy back from the temp buffer to map. */
-        memcpy(map, cnt->rotate_data.temp_buf, size);
+        rotate_swap(cnt, map);
         break;
 
     case 180:
@@ -382,26 +556,11 @@ int rotate_map(struct context *cnt, unsigned char *map)
          * 180 degrees is easy - just reverse the data within
          * Y, U and V.
          */
-        reverse_inplace_quad(map, wh);
-        if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
-            reverse_inplace_quad(map + wh, wh4);
-            reverse_inplace_quad(map + wh + wh4, wh4);
-        }
-        break;
-
-    case 270:
-
-        /* First do the Y part */
-        rot90ccw(map, cnt->rotate_data.temp_buf, wh, width, height);
-        if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
-            /* Then do U and V */
-            rot90ccw(map + wh, cnt->rotate_data.temp_buf + wh, wh4, w2, h2);
-            rot90ccw(map + wh + wh4, cnt->rotate_data.temp_buf + wh + wh4,
-                     wh4, w2, h2);
+        reverse_inplace_quad(*map, wh);
+        if (yuv) {
+            reverse_inplace_quad(*map + wh, wh4);
+            reverse_inplace_quad(*map + wh + wh4, wh4);
         }
-
-        /* Then copy back from the temp buffer to map. */
-        memcpy(map, cnt->rotate_data.temp_buf, size);
         break;
 
     default:
@@ -411,4 +570,3 @@ int rotate_map(struct context *cnt, unsigned char *map)
 
     return 0;
 }
-
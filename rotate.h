@@ -13,11 +13,17 @@
 
 #include "motion.h" /* for struct context */
 
+/* Values of rotate_data.axis, set from conf.flip_axis */
+#define FLIP_TYPE_NONE          0
+#define FLIP_TYPE_HORIZONTAL    1   /* "h", mirror left to right */
+#define FLIP_TYPE_VERTICAL      2   /* "v", upside down */
+
 /**
  * rotate_init
  *
  *  Sets up rotation data by allocating a temporary buffer for 90/270 degrees
- *  rotation, and by determining the right rotate-180-degrees function.
+ *  rotation and vertical flips, and by determining the right
+ *  rotate-180-degrees function.
  *
  * Parameters:
  *
@@ -41,20 +47,23 @@ void rotate_deinit(struct context *cnt);
 /**
  * rotate_map
  *
- *  Rotates the image stored in map according to the rotation data
- *  available in cnt. Rotation is performed clockwise. Supports 90,
- *  180 and 270 degrees rotation. 180 degrees rotation is performed
- *  in-place by simply reversing the image data, which is a very
- *  fast operation. 90 and 270 degrees rotation are performed using
- *  a temporary buffer and a somewhat more complicated algorithm,
- *  which makes them slower.
+ *  Flips and then rotates the image *map points to according to the
+ *  rotation data available in cnt. Rotation is performed clockwise.
+ *  Supports 90, 180 and 270 degrees rotation and horizontal and
+ *  vertical flips. 180 degrees rotation and horizontal flips are
+ *  performed in-place by simply reversing the image data, which is a
+ *  very fast operation. 90 and 270 degrees rotation and vertical flips
+ *  are written to a temporary buffer, 90 and 270 degrees in cache
+ *  sized tiles.
  *
- *  Note that to the caller, all rotations will seem as they are
- *  performed in-place.
+ *  Rather than copying the temporary buffer back, its image is swapped
+ *  with *map, which then points to the former temporary buffer. The
+ *  caller's buffer must be imgs.size bytes from malloc, like the images
+ *  of the ring.
  *
  * Parameters:
  *
- *   map - the image map/data to rotate
+ *   map - pointer to the image map/data to rotate
  *   cnt - current thread's context structure
  *
  * Returns:
@@ -62,6 +71,6 @@ void rotate_deinit(struct context *cnt);
  *   0  - success
  *   -1 - failure (rare, shouldn't happen)
  */
-int rotate_map(struct context *cnt, unsigned char *map);
+int rotate_map(struct context *cnt, unsigned char **map);
 
 #endif
@@ -0,0 +1,361 @@
+/*
+ *    segment.c
+ *
+ *    Continuous recording of a camera into a ring of fixed length movie
+ *    segments. The segment files are reused round robin, so recording all
+ *    day doesn't create and delete thousands of files, and their blocks
+ *    stay where they are on the disk (see myseqopen). The index file of the
+ *    ring tells which segments hold which time and where in them motion was
+ *    detected, so an event is found by reading the index instead of looking
+ *    for a file.
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+
+#include "ffmpeg.h"    /* must be first to avoid 'shadow' warning */
+#include "motion.h"
+#include "writer.h"
+#include "segment.h"
+
+#ifdef HAVE_FFMPEG
+
+/* Motion frames less than this apart (ms) belong to the same range */
+#define SEGMENT_RANGE_GAP       1000
+
+/**
+ * segment_write
+ *
+ *      Writes the header (n < 0) or record n of the index.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int segment_write(struct segment_ring *seg, int n, const void *data)
+{
+    size_t size = n < 0 ? sizeof(struct segment_header) : sizeof(struct segment_record);
+    off_t offset = n < 0 ? 0 : sizeof(struct segment_header) +
+                   (off_t)n * sizeof(struct segment_record);
+
+    if (pwrite(seg->index_fd, data, size, offset) != (ssize_t)size) {
+        MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Error writing the segment index"
+                   " of %s", seg->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * segment_index_open
+ *
+ *      Opens the index of the ring, or sets up a new one if there is none or
+ *      the ring has a different size or segment length now.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int segment_index_open(struct context *cnt, struct segment_ring *seg)
+{
+    char name[PATH_MAX];
+    struct segment_header *header = &seg->header;
+    off_t size;
+
+    snprintf(name, sizeof(name), "%s/%s", seg->path, SEGMENT_INDEX_NAME);
+
+    seg->index_fd = open(name, O_RDWR | O_CREAT, 0666);
+
+    if (seg->index_fd == -1 && errno == ENOENT) {
+        if (create_path(name) == -1)
+            return -1;
+
+        seg->index_fd = open(name, O_RDWR | O_CREAT, 0666);
+    }
+
+    if (seg->index_fd == -1) {
+        MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Error opening segment index %s", name);
+        return -1;
+    }
+
+    if (pread(seg->index_fd, header, sizeof(*header), 0) == sizeof(*header) &&
+        !memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) &&
+        header->segments == (uint32_t)cnt->conf.continuous_segments &&
+        header->segment_time == (uint32_t)cnt->conf.continuous &&
+        header->next < header->segments)
+        return 0;
+
+    MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, "%s: New segment index %s for %d segments"
+               " of %d seconds", name, cnt->conf.continuous_segments, cnt->conf.continuous);
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+    header->segments = cnt->conf.continuous_segments;
+    header->segment_time = cnt->conf.continuous;
+
+    /* All records unused */
+    size = sizeof(struct segment_header) + (off_t)header->segments * sizeof(struct segment_record);
+
+    if (ftruncate(seg->index_fd, 0) != 0 || ftruncate(seg->index_fd, size) != 0) {
+        MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO, "%s: Error setting up segment index %s", name);
+        close(seg->index_fd);
+        return -1;
+    }
+
+    if (segment_write(seg, -1, header)) {
+        close(seg->index_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * segment_start
+ *
+ *      Sets up the continuous recording of a camera if ffmpeg_continuous is
+ *      set. Called by motion_init.
+ *
+ * Returns: 0 on success (or no continuous recording), -1 on error
+ */
+int segment_start(struct context *cnt)
+{
+    struct segment_ring *seg;
+    char tmp[PATH_MAX];
+    const char *codec = cnt->conf.ffmpeg_video_codec;
+
+    if (cnt->conf.continuous <= 0)
+        return 0;
+
+    if (cnt->conf.continuous_segments < 2) {
+        MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, "%s: ffmpeg_continuous_segments must be"
+                   " at least 2, continuous recording disabled");
+        return -1;
+    }
+
+    seg = mymalloc(sizeof(struct segment_ring));
+
+    mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.continuous_path ? cnt->conf.continuous_path :
+               DEF_CONTINUOUSPATH, cnt->currenttime_tm, NULL, 0);
+    snprintf(seg->path, sizeof(seg->path), "%s/%s", cnt->conf.filepath, tmp);
+
+    /*
+     * Segments are overwritten in place, mpeg1 would be appended to the
+     * old one and the camera packets are not kept for every frame.
+     */
+    if (!codec || !strcmp(codec, "mpeg1") || !strcmp(codec, FFMPEG_PASSTHROUGH_CODEC)) {
+        MOTION_LOG(WRN, TYPE_EVENTS, NO_ERRNO, "%s: ffmpeg_video_codec %s is not supported"
+                   " for continuous recording - using %s", codec ? codec : "(none)",
+                   DEF_FFMPEG_CODEC);
+        codec = DEF_FFMPEG_CODEC;
+    }
+
+    seg->codec = codec;
+
+    if (segment_index_open(cnt, seg)) {
+        free(seg);
+        return -1;
+    }
+
+    cnt->segment = seg;
+
+    MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, "%s: Continuous recording into %s, %d segments"
+               " of %d seconds", seg->path, seg->header.segments, seg->header.segment_time);
+
+    return 0;
+}
+
+/**
+ * segment_close
+ *
+ *      Closes the segment being recorded, completes its record and moves
+ *      the ring on to the next one.
+ */
+static void segment_close(struct context *cnt)
+{
+    struct segment_ring *seg = cnt->segment;
+
+    if (!seg->movie)
+        return;
+
+    if (cnt->writer)
+        writer_close_movie(cnt, seg->movie);
+    else
+        ffmpeg_close(seg->movie);
+
+    seg->movie = NULL;
+
+    seg->record.flags &= ~SEGMENT_OPEN;
+    segment_write(seg, seg->current, &seg->record);
+
+    seg->header.next = (seg->current + 1) % seg->header.segments;
+    segment_write(seg, -1, &seg->header);
+}
+
+/**
+ * segment_stop
+ *
+ *      Closes the segment being recorded and the index. Called by
+ *      motion_cleanup.
+ */
+void segment_stop(struct context *cnt)
+{
+    struct segment_ring *seg = cnt->segment;
+
+    if (!seg)
+        return;
+
+    segment_close(cnt);
+    close(seg->index_fd);
+
+    cnt->segment = NULL;
+    free(seg);
+}
+
+/**
+ * segment_open
+ *
+ *      Starts the next segment of the ring with the image as first frame.
+ *      The file of the oldest segment is overwritten, or removed if the
+ *      movie format (file extension) changed since.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int segment_open(struct context *cnt, struct image_data *img)
+{
+    struct segment_ring *seg = cnt->segment;
+    struct segment_record old;
+    char filename[PATH_MAX];
+    unsigned char *u = NULL, *v = NULL;
+    int size = cnt->imgs.width * cnt->imgs.height;
+    int rate = cnt->lastrate;
+    const char *name;
+
+    seg->current = seg->header.next;
+
+    if (pread(seg->index_fd, &old, sizeof(old), sizeof(struct segment_header) +
+              (off_t)seg->current * sizeof(struct segment_record)) != sizeof(old))
+        memset(&old, 0, sizeof(old));
+
+    /* The record is invalid until the segment is complete */
+    memset(&seg->record, 0, sizeof(seg->record));
+    seg->record.start = (int64_t)img->timestamp_tv.tv_sec * 1000000 + img->timestamp_tv.tv_usec;
+    seg->record.flags = SEGMENT_OPEN;
+
+    if (segment_write(seg, seg->current, &seg->record))
+        return -1;
+
+    if (rate > 30)
+        rate = 30;
+    else if (rate < 2)
+        rate = 2;
+
+    if (cnt->imgs.type != VIDEO_PALETTE_GREY) {
+        u = img->image + size;
+        v = u + size / 4;
+    }
+
+    /* PATH_MAX - 4 to allow for the extension to be appended without overflow */
+    snprintf(filename, PATH_MAX - 4, "%s/%05u", seg->path, seg->current);
+
+    seg->movie = ffmpeg_open((char *)seg->codec, filename, img->image, u, v,
+                             cnt->imgs.width, cnt->imgs.height, rate, cnt->conf.ffmpeg_bps,
+                             cnt->conf.ffmpeg_vbr, cnt->conf.ffmpeg_gop, cnt->conf.ffmpeg_threads,
+                             cnt->conf.ffmpeg_preset, cnt->conf.ffmpeg_tune);
+
+    if (!seg->movie) {
+        MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, "%s: Error creating segment %s", filename);
+        return -1;
+    }
+
+    name = strrchr(filename, '/') + 1;
+    snprintf(seg->record.name, sizeof(seg->record.name), "%s", name);
+
+    if (old.name[0] && strcmp(old.name, seg->record.name)) {
+        snprintf(filename, sizeof(filename), "%s/%s", seg->path, old.name);
+        unlink(filename);
+    }
+
+    return 0;
+}
+
+/**
+ * segment_put
+ *
+ *      Adds an image to the continuous recording. A new segment is started
+ *      whenever the capture time crosses a multiple of ffmpeg_continuous
+ *      seconds, so the segments start at the same times every day. Images
+ *      flagged with motion are recorded as ranges in the index.
+ */
+void segment_put(struct context *cnt, struct image_data *img)
+{
+    struct segment_ring *seg = cnt->segment;
+    struct segment_record *rec;
+    time_t slot;
+    int64_t usec;
+    uint32_t offset;
+
+    if (!seg)
+        return;
+
+    slot = img->timestamp_tv.tv_sec / seg->header.segment_time;
+
+    if (seg->movie && slot != seg->slot)
+        segment_close(cnt);
+
+    if (!seg->movie) {
+        /* Don't try again before the next segment if this one failed */
+        if (slot == seg->slot)
+            return;
+
+        seg->slot = slot;
+
+        if (segment_open(cnt, img))
+            return;
+    }
+
+    rec = &seg->record;
+    usec = (int64_t)img->timestamp_tv.tv_sec * 1000000 + img->timestamp_tv.tv_usec - rec->start;
+    offset = usec > 0 ? usec / 1000 : 0;
+
+    rec->frames++;
+    rec->duration = offset;
+
+    if (img->flags & IMAGE_MOTION) {
+        rec->motion_frames++;
+
+        if (rec->ranges && offset - rec->motion[rec->ranges - 1].end <= SEGMENT_RANGE_GAP) {
+            rec->motion[rec->ranges - 1].end = offset;
+        } else if (rec->ranges < SEGMENT_MAX_RANGES) {
+            rec->motion[rec->ranges].start = offset;
+            rec->motion[rec->ranges].end = offset;
+            rec->ranges++;
+            /* Let readers of the index see the event right away */
+            segment_write(seg, seg->current, rec);
+        } else {
+            rec->motion[rec->ranges - 1].end = offset;
+            rec->flags |= SEGMENT_RANGES_FULL;
+        }
+    }
+
+    if (cnt->writer) {
+        writer_put_movie(cnt, seg->movie, img->image, &img->timestamp_tv);
+        /* Not an event, the copy of the image must not be reused */
+        writer_forget(cnt);
+    } else {
+        int size = cnt->imgs.width * cnt->imgs.height;
+        unsigned char *u = NULL, *v = NULL;
+
+        if (cnt->imgs.type != VIDEO_PALETTE_GREY) {
+            u = img->image + size;
+            v = u + size / 4;
+        }
+
+        /* On errors ffmpeg_put_frame frees the movie */
+        if (ffmpeg_put_other_image(seg->movie, img->image, u, v, &img->timestamp_tv) == -1) {
+            seg->movie = NULL;
+            cnt->finish = 1;
+            cnt->restart = 0;
+        }
+    }
+}
+
+#endif /* HAVE_FFMPEG */
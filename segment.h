@@ -0,0 +1,71 @@
+/*
+ *    segment.h
+ *
+ *    Include file for segment.c
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+#ifndef _INCLUDE_SEGMENT_H_
+#define _INCLUDE_SEGMENT_H_
+
+#include <stdint.h>
+#include "motion.h"
+
+/*
+ * Layout of the index file of the continuous recording ring. The file starts
+ * with a struct segment_header, followed by one struct segment_record for
+ * each segment of the ring, in host byte order. A record with start 0 is
+ * unused. The motion ranges are offsets in ms from the start of the segment.
+ */
+#define SEGMENT_INDEX_NAME      "index"
+#define SEGMENT_MAGIC           "MOTNSEG1"
+#define SEGMENT_MAX_RANGES      8
+
+#define SEGMENT_OPEN            0x0001  /* still being recorded (or crashed) */
+#define SEGMENT_RANGES_FULL     0x0002  /* the last range covers several events */
+
+struct segment_header {
+    char magic[8];              /* SEGMENT_MAGIC */
+    uint32_t segments;          /* number of records following */
+    uint32_t segment_time;      /* length of a segment in seconds */
+    uint32_t next;              /* record written next, i.e. the oldest */
+    uint32_t reserved;
+};
+
+struct segment_range {
+    uint32_t start;             /* ms from the start of the segment */
+    uint32_t end;
+};
+
+struct segment_record {
+    int64_t start;              /* capture time of the first frame, us since the epoch */
+    uint32_t duration;          /* ms up to the last frame */
+    uint32_t frames;
+    uint32_t motion_frames;
+    uint16_t flags;             /* SEGMENT_* */
+    uint16_t ranges;            /* entries used in motion */
+    struct segment_range motion[SEGMENT_MAX_RANGES];
+    char name[32];              /* file name of the segment in the ring directory */
+};
+
+struct ffmpeg;
+
+/* State of the continuous recording of a camera */
+struct segment_ring {
+    char path[PATH_MAX];        /* ring directory */
+    int index_fd;               /* index file, see struct segment_header */
+    struct segment_header header;
+    struct ffmpeg *movie;       /* segment being recorded, NULL if none */
+    uint32_t current;           /* its record */
+    struct segment_record record;
+    time_t slot;                /* start time / segment_time of the segment */
+    const char *codec;          /* ffmpeg_video_codec, or the default */
+};
+
+int segment_start(struct context *);
+void segment_stop(struct context *);
+void segment_put(struct context *, struct image_data *);
+
+#endif /* _INCLUDE_SEGMENT_H_ */
@@ -0,0 +1,256 @@
+/*
+ *    smartmask.c
+ *
+ *    Keeps the smart mask learned by a camera in smart_mask_file, so a
+ *    restarted camera thread detects with it right away instead of
+ *    learning it again for minutes. The file is mapped, loaded when the
+ *    thread starts, written every time the smart mask is tuned and when
+ *    the thread stops. A mask of another picture size, e.g. after a netcam
+ *    changed its dimensions, is scaled to the new one. Each thread needs a
+ *    file of its own, the name is expanded like sql_spill_file and a file
+ *    locked by another thread or process isn't used.
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "motion.h"
+#include "smartmask.h"
+
+/* Largest width and height taken from a file, and largest width * height */
+#define SMARTMASK_MAX_SIZE      65536
+#define SMARTMASK_MAX_PIXELS    (16384 * 16384)
+
+/**
+ * smartmask_size
+ *
+ *      Size of the file for a detection picture of size pixels.
+ */
+static size_t smartmask_size(size_t size)
+{
+    return sizeof(struct smartmask_header) + size * (2 + sizeof(uint16_t));
+}
+
+/**
+ * smartmask_resample
+ *
+ *      Copies a plane of sw x sh elements of bpp bytes to one of dw x dh,
+ *      taking the nearest element.
+ */
+static void smartmask_resample(unsigned char *dst, int dw, int dh,
+                               const unsigned char *src, int sw, int sh, int bpp)
+{
+    int x, y;
+
+    for (y = 0; y < dh; y++) {
+        const unsigned char *row = src + ((size_t)y * sh / dh) * sw * bpp;
+
+        for (x = 0; x < dw; x++, dst += bpp)
+            memcpy(dst, row + ((size_t)x * sw / dw) * bpp, bpp);
+    }
+}
+
+/**
+ * smartmask_restore
+ *
+ *      Copies the planes of the file with the given header into the smart
+ *      mask buffers, scaling them if the size differs. The header's width
+ *      and height are checked by smartmask_load.
+ */
+static void smartmask_restore(struct context *cnt, int fd, const char *file,
+                              const struct smartmask_header *header)
+{
+    struct images *imgs = &cnt->imgs;
+    int sw = header->width, sh = header->height;
+    size_t ssize = (size_t)sw * sh;
+    size_t size = smartmask_size(ssize);
+    unsigned char *map, *planes;
+    struct stat sb;
+
+    if (fstat(fd, &sb) || sb.st_size < (off_t)size) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Smart mask file %s is truncated, not loaded",
+                   file);
+        return;
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error mapping smart mask file %s",
+                   file);
+        return;
+    }
+
+    planes = map + sizeof(struct smartmask_header);
+
+    if (sw == imgs->motion_width && sh == imgs->motion_height) {
+        memcpy(imgs->smartmask, planes, ssize);
+        memcpy(imgs->smartmask_final, planes + ssize, ssize);
+        memcpy(imgs->smartmask_buffer, planes + 2 * ssize, ssize * sizeof(uint16_t));
+    } else {
+        smartmask_resample(imgs->smartmask, imgs->motion_width, imgs->motion_height,
+                           planes, sw, sh, 1);
+        smartmask_resample(imgs->smartmask_final, imgs->motion_width, imgs->motion_height,
+                           planes + ssize, sw, sh, 1);
+        smartmask_resample((unsigned char *)imgs->smartmask_buffer, imgs->motion_width,
+                           imgs->motion_height, planes + 2 * ssize, sw, sh, sizeof(uint16_t));
+
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Smart mask of %dx%d scaled to %dx%d",
+                   sw, sh, imgs->motion_width, imgs->motion_height);
+    }
+
+    munmap(map, size);
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Smart mask loaded from %s, saved %ld seconds ago",
+               file, (long)(time(NULL) - header->saved));
+}
+
+/**
+ * smartmask_load
+ *
+ *      Maps smart_mask_file and loads the smart mask from it, if it holds a
+ *      complete one. Called by motion_init once the smart mask buffers are
+ *      initialized. Nothing is kept without smart_mask_speed at start, the
+ *      mask would be empty. The file stays locked while it is mapped, so
+ *      that two threads with the same smart_mask_file don't overwrite each
+ *      other's mask or truncate the mapping under each other.
+ */
+void smartmask_load(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    struct smartmask_header header;
+    struct smartmask_file *smf;
+    size_t size = smartmask_size(imgs->motionsize);
+    char file[PATH_MAX];
+    unsigned char *map;
+    int fd;
+
+    if (!cnt->conf.smart_mask_file || cnt->conf.smart_mask_speed <= 0 ||
+        cnt->conf.smart_mask_speed > 10)
+        return;
+
+    mystrftime(cnt, file, sizeof(file), cnt->conf.smart_mask_file, cnt->currenttime_tm,
+               NULL, 0);
+
+    fd = open(file, O_RDWR | O_CREAT, 0666);
+
+    if (fd == -1 && errno == ENOENT) {
+        if (create_path(file) == -1)
+            return;
+
+        fd = open(file, O_RDWR | O_CREAT, 0666);
+    }
+
+    if (fd == -1) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error opening smart mask file %s", file);
+        return;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK)
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Smart mask file %s is used by another"
+                       " thread, set a different smart_mask_file for each thread, e.g."
+                       " with %%t", file);
+        else
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error locking smart mask file %s",
+                       file);
+        close(fd);
+        return;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        !memcmp(header.magic, SMARTMASK_MAGIC, sizeof(header.magic)) &&
+        (header.flags & SMARTMASK_VALID) &&
+        header.width > 0 && header.width <= SMARTMASK_MAX_SIZE &&
+        header.height > 0 && header.height <= SMARTMASK_MAX_SIZE &&
+        (uint64_t)header.width * header.height <= SMARTMASK_MAX_PIXELS)
+        smartmask_restore(cnt, fd, file, &header);
+
+    if (ftruncate(fd, size) != 0) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error setting up smart mask file %s", file);
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error mapping smart mask file %s", file);
+        close(fd);
+        return;
+    }
+
+    smf = mymalloc(sizeof(struct smartmask_file));
+    smf->fd = fd;
+    smf->map = map;
+    smf->size = size;
+    cnt->smartmask_file = smf;
+
+    /* In the layout for this picture size right away */
+    smartmask_save(cnt);
+}
+
+/**
+ * smartmask_save
+ *
+ *      Writes the smart mask to the mapping of smart_mask_file. The kernel
+ *      writes it to the file in the background. The header isn't valid while
+ *      the planes are copied, so a crash in between loses the mask instead
+ *      of leaving half of it.
+ */
+void smartmask_save(struct context *cnt)
+{
+    struct smartmask_file *smf = cnt->smartmask_file;
+    struct images *imgs = &cnt->imgs;
+    struct smartmask_header *header;
+    unsigned char *planes;
+    int size = imgs->motionsize;
+
+    if (!smf)
+        return;
+
+    header = (struct smartmask_header *)smf->map;
+    planes = smf->map + sizeof(struct smartmask_header);
+
+    header->flags &= ~SMARTMASK_VALID;
+    __sync_synchronize();
+
+    memcpy(planes, imgs->smartmask, size);
+    memcpy(planes + size, imgs->smartmask_final, size);
+    memcpy(planes + 2 * size, imgs->smartmask_buffer, size * sizeof(uint16_t));
+
+    memcpy(header->magic, SMARTMASK_MAGIC, sizeof(header->magic));
+    header->width = imgs->motion_width;
+    header->height = imgs->motion_height;
+    header->saved = time(NULL);
+    __sync_synchronize();
+
+    header->flags |= SMARTMASK_VALID;
+
+    msync(smf->map, smf->size, MS_ASYNC);
+}
+
+/**
+ * smartmask_close
+ *
+ *      Saves the smart mask a last time and unmaps smart_mask_file. Called
+ *      by motion_cleanup before the smart mask buffers are freed.
+ */
+void smartmask_close(struct context *cnt)
+{
+    struct smartmask_file *smf = cnt->smartmask_file;
+
+    if (!smf)
+        return;
+
+    smartmask_save(cnt);
+
+    munmap(smf->map, smf->size);
+    close(smf->fd);
+
+    cnt->smartmask_file = NULL;
+    free(smf);
+}
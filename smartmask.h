@@ -0,0 +1,45 @@
+/*
+ *    smartmask.h
+ *
+ *    Include file for smartmask.c
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+#ifndef _INCLUDE_SMARTMASK_H_
+#define _INCLUDE_SMARTMASK_H_
+
+#include <stdint.h>
+#include "motion.h"
+
+/*
+ * Layout of smart_mask_file. The file starts with a struct smartmask_header,
+ * followed by smartmask, smartmask_final and smartmask_buffer of the
+ * detection picture of width x height, in host byte order.
+ */
+#define SMARTMASK_MAGIC         "MOTNSMK1"
+
+#define SMARTMASK_VALID         0x0001  /* the planes are complete */
+
+struct smartmask_header {
+    char magic[8];              /* SMARTMASK_MAGIC */
+    uint32_t width;             /* of the detection picture */
+    uint32_t height;
+    uint32_t flags;             /* SMARTMASK_* */
+    uint32_t reserved;
+    int64_t saved;              /* time of the last checkpoint */
+};
+
+/* Mapping of smart_mask_file of a camera */
+struct smartmask_file {
+    int fd;
+    unsigned char *map;
+    size_t size;
+};
+
+void smartmask_load(struct context *);
+void smartmask_save(struct context *);
+void smartmask_close(struct context *);
+
+#endif /* _INCLUDE_SMARTMASK_H_ */
@@ -256,128 +256,6 @@ Invalid_Request:
 }
 
 
-#define HASHLEN 16
-typedef char HASH[HASHLEN];
-#define HASHHEXLEN 32
-typedef char HASHHEX[HASHHEXLEN+1];
-#define IN
-#define OUT
-/**
- * CvtHex
- *      Calculates H(A1) as per HTTP Digest spec -- taken from RFC 2617.
- */
-static void CvtHex(IN HASH Bin, OUT HASHHEX Hex)
-{
-    unsigned short i;
-    unsigned char j;
-
-    for (i = 0; i < HASHLEN; i++) {
-        j = (Bin[i] >> 4) & 0xf;
-        if (j <= 9)
-            Hex[i*2] = (j + '0');
-         else
-            Hex[i*2] = (j + 'a' - 10);
-        j = Bin[i] & 0xf;
-        if (j <= 9)
-            Hex[i*2+1] = (j + '0');
-         else
-            Hex[i*2+1] = (j + 'a' - 10);
-    };
-    Hex[HASHHEXLEN] = '\0';
-};
-
-/**
- * DigestCalcHA1
- *      Calculates H(A1) as per spec.
- */
-static void DigestCalcHA1(
-    IN char * pszAlg,
-    IN char * pszUserName,
-    IN char * pszRealm,
-    IN char * pszPassword,
-    IN char * pszNonce,
-    IN char * pszCNonce,
-    OUT HASHHEX SessionKey
-    )
-{
-    MD5_CTX Md5Ctx;
-    HASH HA1;
-
-    MD5Init(&Md5Ctx);
-    MD5Update(&Md5Ctx, (unsigned char *)pszUserName, strlen(pszUserName));
-    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-    MD5Update(&Md5Ctx, (unsigned char *)pszRealm, strlen(pszRealm));
-    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-    MD5Update(&Md5Ctx, (unsigned char *)pszPassword, strlen(pszPassword));
-    MD5Final((unsigned char *)HA1, &Md5Ctx);
-
-    if (strcmp(pszAlg, "md5-sess") == 0) {
-        MD5Init(&Md5Ctx);
-        MD5Update(&Md5Ctx, (unsigned char *)HA1, HASHLEN);
-        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-        MD5Update(&Md5Ctx, (unsigned char *)pszNonce, strlen(pszNonce));
-        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-        MD5Update(&Md5Ctx, (unsigned char *)pszCNonce, strlen(pszCNonce));
-        MD5Final((unsigned char *)HA1, &Md5Ctx);
-    };
-    CvtHex(HA1, SessionKey);
-};
-
-/**
- * DigestCalcResponse
- *      Calculates request-digest/response-digest as per HTTP Digest spec.
- */
-static void DigestCalcResponse(
-    IN HASHHEX HA1,           /* H(A1) */
-    IN char * pszNonce,       /* nonce from server */
-    IN char * pszNonceCount,  /* 8 hex digits */
-    IN char * pszCNonce,      /* client nonce */
-    IN char * pszQop,         /* qop-value: "", "auth", "auth-int" */
-    IN char * pszMethod,      /* method from the request */
-    IN char * pszDigestUri,   /* requested URL */
-    IN HASHHEX HEntity,       /* H(entity body) if qop="auth-int" */
-    OUT HASHHEX Response      /* request-digest or response-digest */
-    )
-{
-    MD5_CTX Md5Ctx;
-    HASH HA2;
-    HASH RespHash;
-    HASHHEX HA2Hex;
-
-    // Calculate H(A2)
-    MD5Init(&Md5Ctx);
-    MD5Update(&Md5Ctx, (unsigned char *)pszMethod, strlen(pszMethod));
-    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-    MD5Update(&Md5Ctx, (unsigned char *)pszDigestUri, strlen(pszDigestUri));
-
-    if (strcmp(pszQop, "auth-int") == 0) {
-        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-        MD5Update(&Md5Ctx, (unsigned char *)HEntity, HASHHEXLEN);
-    }
-    MD5Final((unsigned char *)HA2, &Md5Ctx);
-    CvtHex(HA2, HA2Hex);
-
-    // Calculate response
-    MD5Init(&Md5Ctx);
-    MD5Update(&Md5Ctx, (unsigned char *)HA1, HASHHEXLEN);
-    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-    MD5Update(&Md5Ctx, (unsigned char *)pszNonce, strlen(pszNonce));
-    MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-
-    if (*pszQop) {
-        MD5Update(&Md5Ctx, (unsigned char *)pszNonceCount, strlen(pszNonceCount));
-        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-        MD5Update(&Md5Ctx, (unsigned char *)pszCNonce, strlen(pszCNonce));
-        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-        MD5Update(&Md5Ctx, (unsigned char *)pszQop, strlen(pszQop));
-        MD5Update(&Md5Ctx, (unsigned char *)":", 1);
-    }
-    MD5Update(&Md5Ctx, (unsigned char *)HA2Hex, HASHHEXLEN);
-    MD5Final((unsigned char *)RespHash, &Md5Ctx);
-    CvtHex(RespHash, Response);
-};
-
-
 /**
  * handle_md5_digest
  *
@@ -1160,6 +1038,7 @@ void stream_put(struct context *cnt, unsigned char *image)
              * and leave tmpbuffer->ptr intact.
              */
             unsigned char *wptr = tmpbuffer->ptr;
+            struct image_stamp stamp;
 
             /*
              * For web protocol, our image needs to be preceded
@@ -1172,8 +1051,9 @@ void stream_put(struct context *cnt, unsigned char *image)
             wptr += headlength;
 
             /* Create a jpeg image and place into tmpbuffer. */
+            image_stamp_get(cnt, cnt->current_image, &stamp);
             tmpbuffer->size = put_picture_memory(cnt, wptr, cnt->imgs.size, image,
-                                                 cnt->conf.stream_quality);
+                                                 cnt->conf.stream_quality, &stamp);
 
             /* Fill in the image length into the header. */
             imgsize = sprintf(len, "%9ld\r\n\r\n", tmpbuffer->size);
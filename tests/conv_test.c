@@ -0,0 +1,379 @@
+/*
+ *    conv_test.c
+ *
+ *    Checks the colorspace conversions of video_conv.c against the plain
+ *    loops they replaced, byte for byte, on fixed frames of several sizes.
+ *    "make check" runs it built with the SSE2 kernels and without them.
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "video_conv.h"
+
+/* Room for the conversions that read a pixel past the end of the frame */
+#define PAD     64
+
+#define PATTERN_RANDOM  0
+#define PATTERN_BLACK   1
+#define PATTERN_WHITE   2
+#define PATTERN_STRIPES 3
+#define PATTERN_CYAN    4   /* the V sums of BGR24 wrap around */
+#define PATTERN_LAST    4
+
+static const char *pattern_name[] = { "random", "black", "white", "stripes", "cyan" };
+
+static int failures;
+static int checks;
+
+/**
+ * ref_bayer2rgb24
+ *
+ *      The original frame sized bayer to BGR24 conversion.
+ */
+static void ref_bayer2rgb24(unsigned char *dst, unsigned char *src, long int width,
+                            long int height)
+{
+    long int i;
+    unsigned char *rawpt, *scanpt;
+    long int size;
+
+    rawpt = src;
+    scanpt = dst;
+    size = width * height;
+
+    for (i = 0; i < size; i++) {
+        if (((i / width) & 1) == 0) {
+            if ((i & 1) == 0) {
+                /* B */
+                if ((i > width) && ((i % width) > 0)) {
+                    *scanpt++ = *rawpt;     /* B */
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
+                                *(rawpt + width) + *(rawpt - width)) / 4;    /* G */
+                    *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
+                                *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* R */
+                } else {
+                    /* First line or left column. */
+                    *scanpt++ = *rawpt;     /* B */
+                    *scanpt++ = (*(rawpt + 1) + *(rawpt + width)) / 2;    /* G */
+                    *scanpt++ = *(rawpt + width + 1);       /* R */
+                }
+            } else {
+                /* (B)G */
+                if ((i > width) && ((i % width) < (width - 1))) {
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* B */
+                    *scanpt++ = *rawpt;    /* G */
+                    *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* R */
+                } else {
+                    /* First line or right column. */
+                    *scanpt++ = *(rawpt - 1);       /* B */
+                    *scanpt++ = *rawpt;    /* G */
+                    *scanpt++ = *(rawpt + width);   /* R */
+                }
+            }
+        } else {
+            if ((i & 1) == 0) {
+                /* G(R) */
+                if ((i < (width * (height - 1))) && ((i % width) > 0)) {
+                    *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* B */
+                    *scanpt++ = *rawpt;    /* G */
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* R */
+                } else {
+                    /* Bottom line or left column. */
+                    *scanpt++ = *(rawpt - width);   /* B */
+                    *scanpt++ = *rawpt;    /* G */
+                    *scanpt++ = *(rawpt + 1);       /* R */
+                }
+            } else {
+                /* R */
+                if (i < (width * (height - 1)) && ((i % width) < (width - 1))) {
+                    *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
+                                *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* B */
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
+                                *(rawpt - width) + *(rawpt + width)) / 4;    /* G */
+                    *scanpt++ = *rawpt;     /* R */
+                } else {
+                    /* Bottom line or right column. */
+                    *scanpt++ = *(rawpt - width - 1);       /* B */
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt - width)) / 2;    /* G */
+                    *scanpt++ = *rawpt;     /* R */
+                }
+            }
+        }
+        rawpt++;
+    }
+}
+
+/**
+ * ref_yuv422to420p
+ *
+ *      The original YUYV conversion.
+ */
+static void ref_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height)
+{
+    unsigned char *src, *dest, *src2, *dest2;
+    int i, j;
+
+    /* Create the Y plane. */
+    src = cap_map;
+    dest = map;
+    for (i = width * height; i > 0; i--) {
+        *dest++ = *src;
+        src += 2;
+    }
+    /* Create U and V planes. */
+    src = cap_map + 1;
+    src2 = cap_map + width * 2 + 1;
+    dest = map + width * height;
+    dest2 = dest + (width * height) / 4;
+    for (i = height / 2; i > 0; i--) {
+        for (j = width / 2; j > 0; j--) {
+            *dest = ((int) *src + (int) *src2) / 2;
+            src += 2;
+            src2 += 2;
+            dest++;
+            *dest2 = ((int) *src + (int) *src2) / 2;
+            src += 2;
+            src2 += 2;
+            dest2++;
+        }
+        src += width * 2;
+        src2 += width * 2;
+    }
+}
+
+/**
+ * ref_uyvyto420p
+ *
+ *      The original UYVY conversion. Reads the row after the last one for
+ *      an odd height, so it is only used with even heights.
+ */
+static void ref_uyvyto420p(unsigned char *map, unsigned char *cap_map, unsigned int width,
+                           unsigned int height)
+{
+    unsigned char *pY = map;
+    unsigned char *pU = pY + (width * height);
+    unsigned char *pV = pU + (width * height) / 4;
+    unsigned int uv_offset = width * 2;
+    unsigned int ix, jx;
+
+    for (ix = 0; ix < height; ix++) {
+        for (jx = 0; jx < width; jx += 2) {
+            unsigned short calc;
+
+            if ((ix&1) == 0) {
+                calc = *cap_map;
+                calc += *(cap_map + uv_offset);
+                calc /= 2;
+                *pU++ = (unsigned char) calc;
+            }
+
+            cap_map++;
+            *pY++ = *cap_map++;
+
+            if ((ix&1) == 0) {
+                calc = *cap_map;
+                calc += *(cap_map + uv_offset);
+                calc /= 2;
+                *pV++ = (unsigned char) calc;
+            }
+
+            cap_map++;
+            *pY++ = *cap_map++;
+        }
+    }
+}
+
+/**
+ * ref_rgb24toyuv420p
+ *
+ *      The original BGR24 conversion. Each pair of rows starts at its own
+ *      chroma line, which for even widths is where the original got to.
+ *      Odd widths read and write a pixel more per row.
+ */
+static void ref_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height)
+{
+    unsigned char *y, *u, *v;
+    unsigned char *r, *g, *b;
+    int i, loop;
+
+    b = cap_map;
+    g = b + 1;
+    r = g + 1;
+    y = map;
+    memset(map + width * height, 0, width * height / 4);
+    memset(map + width * height + (width * height) / 4, 0, width * height / 4);
+
+    for (loop = 0; loop < height; loop++) {
+        u = map + width * height + (loop / 2) * (width / 2);
+        v = u + (width * height) / 4;
+        b = cap_map + loop * width * 3;
+        g = b + 1;
+        r = g + 1;
+        y = map + loop * width;
+
+        for (i = 0; i < width; i += 2) {
+            *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
+            *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
+            *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
+            r += 3;
+            g += 3;
+            b += 3;
+            *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
+            *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
+            *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
+            r += 3;
+            g += 3;
+            b += 3;
+            u++;
+            v++;
+        }
+    }
+}
+
+/**
+ * fill
+ *
+ *      Fills a source frame with one of the PATTERN_*, the same each run.
+ */
+static void fill(unsigned char *buf, size_t size, int pattern)
+{
+    unsigned int seed = 12345;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        switch (pattern) {
+        case PATTERN_RANDOM:
+            seed = seed * 1103515245 + 12345;
+            buf[i] = seed >> 16;
+            break;
+        case PATTERN_BLACK:
+            buf[i] = 0;
+            break;
+        case PATTERN_WHITE:
+            buf[i] = 255;
+            break;
+        case PATTERN_STRIPES:
+            buf[i] = (i / 3) & 1 ? 255 : 0;
+            break;
+        case PATTERN_CYAN:
+            /* B and G full, R none for BGR24 */
+            buf[i] = i % 3 == 2 ? 0 : 255;
+            break;
+        }
+    }
+}
+
+/**
+ * compare
+ *
+ *      Reports the first byte where the output differs from the reference.
+ */
+static void compare(const char *name, int width, int height, int pattern,
+                    const unsigned char *out, const unsigned char *ref, size_t size)
+{
+    size_t i;
+
+    checks++;
+
+    for (i = 0; i < size; i++) {
+        if (out[i] != ref[i]) {
+            fprintf(stderr, "%s %dx%d %s: byte %zu is %d, expected %d\n", name, width,
+                    height, pattern_name[pattern], i, out[i], ref[i]);
+            failures++;
+            return;
+        }
+    }
+}
+
+/**
+ * check_size
+ *
+ *      Runs the conversions that can take a frame of this size on each
+ *      pattern. The packed 4:2:2 and the bayer conversions need an even
+ *      width, the UYVY reference an even height.
+ */
+static void check_size(int width, int height)
+{
+    size_t out_size = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+    unsigned char *src = malloc(width * height * 3 + PAD);
+    unsigned char *rgb = malloc(width * height * 3 + PAD);
+    unsigned char *out = malloc(out_size + PAD);
+    unsigned char *ref = malloc(out_size + PAD);
+    unsigned char *scratch = malloc(width * 3 + PAD);
+    int pattern;
+
+    if (!src || !rgb || !out || !ref || !scratch) {
+        fprintf(stderr, "conv_test: out of memory\n");
+        exit(1);
+    }
+
+    for (pattern = 0; pattern <= PATTERN_LAST; pattern++) {
+        fill(src, width * height * 3 + PAD, pattern);
+
+        memset(out, 0, out_size + PAD);
+        memset(ref, 0, out_size + PAD);
+        conv_rgb24toyuv420p(out, src, width, height);
+        ref_rgb24toyuv420p(ref, src, width, height);
+        compare("rgb24", width, height, pattern, out, ref, out_size + PAD);
+
+        if (width & 1)
+            continue;
+
+        memset(out, 0, out_size + PAD);
+        memset(ref, 0, out_size + PAD);
+        conv_yuv422to420p(out, src, width, height);
+        ref_yuv422to420p(ref, src, width, height);
+        compare("yuyv", width, height, pattern, out, ref, out_size + PAD);
+
+        if ((height & 1) == 0) {
+            memset(out, 0, out_size + PAD);
+            memset(ref, 0, out_size + PAD);
+            conv_uyvyto420p(out, src, width, height);
+            ref_uyvyto420p(ref, src, width, height);
+            compare("uyvy", width, height, pattern, out, ref, out_size + PAD);
+        }
+
+        if (height >= 2) {
+            memset(out, 0, out_size + PAD);
+            memset(ref, 0, out_size + PAD);
+            conv_bayertoyuv420p(out, src, width, height, scratch);
+            ref_bayer2rgb24(rgb, src, width, height);
+            ref_rgb24toyuv420p(ref, rgb, width, height);
+            compare("bayer", width, height, pattern, out, ref, out_size + PAD);
+        }
+    }
+
+    free(src);
+    free(rgb);
+    free(out);
+    free(ref);
+    free(scratch);
+}
+
+int main(void)
+{
+    /* Around the 8 and 32 pixel blocks of the SSE2 kernels, and real sizes */
+    static const int widths[] = { 2, 6, 8, 9, 10, 16, 17, 18, 24, 30, 31, 32, 34, 40, 46,
+                                  63, 64, 66, 98, 176, 320, 353, 640 };
+    static const int heights[] = { 1, 2, 3, 4, 15, 16, 144 };
+    unsigned int w, h;
+
+    for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+        for (h = 0; h < sizeof(heights) / sizeof(heights[0]); h++)
+            check_size(widths[w], heights[h]);
+
+    printf("conv_test: %d conversions checked, %d failed (%s)\n", checks, failures,
+#ifdef __SSE2__
+           "SSE2"
+#else
+           "plain C"
+#endif
+           );
+
+    return failures ? 1 : 0;
+}
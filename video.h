@@ -20,6 +20,7 @@
 #endif
 #include "pwc-ioctl.h"
 #include "vloopback_motion.h"
+#include "video_conv.h"
 
 /* video4linux stuff */
 #define NORM_DEFAULT    0
@@ -86,19 +87,18 @@ struct video_dev {
 #endif
 };
 
+struct jpeg_decoder;
+
 /* video functions, video_common.c */
 int vid_start(struct context *cnt);
-int vid_next(struct context *cnt, unsigned char *map);
+int vid_next(struct context *cnt, unsigned char **map);
 void vid_close(struct context *cnt);
 void vid_cleanup(void);
 void vid_init(void);
-void conv_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height);
-void conv_uyvyto420p(unsigned char *map, unsigned char *cap_map, unsigned int width, unsigned int height);
-void conv_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height);
 int sonix_decompress(unsigned char *outp, unsigned char *inp, int width, int height);
-void bayer2rgb24(unsigned char *dst, unsigned char *src, long int width, long int height);
 int vid_do_autobright(struct context *cnt, struct video_dev *viddev);
-int mjpegtoyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height, unsigned int size);
+int mjpegtoyuv420p(struct jpeg_decoder *decoder, unsigned char *map, unsigned char *cap_map,
+                   int width, int height, unsigned int size);
 
 #ifdef HAVE_V4L
 /* video functions, video.c */
@@ -113,9 +113,9 @@ int v4l_next(struct video_dev *viddev, unsigned char *map, int width, int height
 /* video2.c */
 unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int width, int height,
                           int input, int norm, unsigned long freq, int tuner_number);
-void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char *map, int width, int height,
+void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char **map, int width, int height,
                     struct config *conf);
-int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map, int width, int height);
+int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char **map, int width, int height);
 void v4l2_close(struct video_dev *viddev);
 void v4l2_cleanup(struct video_dev *viddev);
 #endif /* HAVE_V4L2 */
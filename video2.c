@@ -70,6 +70,9 @@
 */
 #include "motion.h"
 #include "video.h"
+#include "jpegutils.h"
+
+#include <poll.h>
 
 #ifdef HAVE_LINUX_VIDEODEV2_H
 #include <linux/time.h> /* Seems that is needed for some system */
@@ -84,6 +87,9 @@
 #define MMAP_BUFFERS 4
 #define MIN_MMAP_BUFFERS 2
 
+/* Longest wait for a frame (ms) before v4l2_next gives up on it */
+#define V4L2_POLL_TIMEOUT 5000
+
 #ifndef V4L2_PIX_FMT_SBGGR8
 /* see http://www.siliconimaging.com/RGB%20Bayer.htm */
 #define V4L2_PIX_FMT_SBGGR8  v4l2_fourcc('B','A','8','1')  /*  8  BGBG.. GRGR.. */
@@ -165,6 +171,8 @@ typedef struct {
     struct v4l2_buffer buf;
 
     video_buff *buffers;
+    int userptr;                    /* buffers are image buffers, see v4l2_set_userptr */
+    struct jpeg_decoder *decoder;   /* for the jpeg formats */
 
     s32 pframe;
 
@@ -652,6 +660,107 @@ static int v4l2_set_mmap(src_v4l2_t * vid_source)
     return 0;
 }
 
+/**
+ * v4l2_set_userptr
+ *
+ *      Lets the driver capture YUV420 straight into image buffers of motion
+ *      (V4L2_MEMORY_USERPTR) instead of its mmap buffers. v4l2_next hands the
+ *      filled buffer over to the image ring and queues the buffer the ring
+ *      gave up in its place, so the frame is never copied.
+ *
+ * Returns: 0 on success, -1 if it can't be done (use v4l2_set_mmap)
+ */
+static int v4l2_set_userptr(src_v4l2_t * vid_source, int width, int height)
+{
+    enum v4l2_buf_type type;
+    size_t size = (width * height * 3) / 2;
+    u32 buffer_index;
+
+    if (!(vid_source->cap.capabilities & V4L2_CAP_STREAMING) ||
+        vid_source->dst_fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUV420)
+        return -1;
+
+    /* The planes must be laid out just like a motion image */
+    if (vid_source->dst_fmt.fmt.pix.sizeimage > size ||
+        (vid_source->dst_fmt.fmt.pix.bytesperline &&
+         vid_source->dst_fmt.fmt.pix.bytesperline != (u32)width))
+        return -1;
+
+    memset(&vid_source->req, 0, sizeof(struct v4l2_requestbuffers));
+
+    vid_source->req.count = MMAP_BUFFERS;
+    vid_source->req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vid_source->req.memory = V4L2_MEMORY_USERPTR;
+
+    if (xioctl(vid_source->fd, VIDIOC_REQBUFS, &vid_source->req) == -1) {
+        MOTION_LOG(NTC, TYPE_VIDEO, SHOW_ERRNO, "%s: Driver can't capture into user"
+                   " memory, using mmap buffers");
+        return -1;
+    }
+
+    if (vid_source->req.count < MIN_MMAP_BUFFERS) {
+        MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Only %d user memory buffers,"
+                   " using mmap buffers", vid_source->req.count);
+        goto err;
+    }
+
+    vid_source->buffers = calloc(vid_source->req.count, sizeof(video_buff));
+
+    if (!vid_source->buffers) {
+        MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: Out of memory.");
+        goto err;
+    }
+
+    for (buffer_index = 0; buffer_index < vid_source->req.count; buffer_index++) {
+        vid_source->buffers[buffer_index].size = size;
+        vid_source->buffers[buffer_index].ptr = mymalloc(size);
+
+        memset(&vid_source->buf, 0, sizeof(struct v4l2_buffer));
+
+        vid_source->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        vid_source->buf.memory = V4L2_MEMORY_USERPTR;
+        vid_source->buf.index = buffer_index;
+        vid_source->buf.m.userptr = (unsigned long)vid_source->buffers[buffer_index].ptr;
+        vid_source->buf.length = size;
+
+        if (xioctl(vid_source->fd, VIDIOC_QBUF, &vid_source->buf) == -1) {
+            MOTION_LOG(NTC, TYPE_VIDEO, SHOW_ERRNO, "%s: Driver rejects user memory"
+                       " buffer %d, using mmap buffers", buffer_index);
+            goto err;
+        }
+    }
+
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (xioctl(vid_source->fd, VIDIOC_STREAMON, &type) == -1) {
+        MOTION_LOG(NTC, TYPE_VIDEO, SHOW_ERRNO, "%s: Error starting stream with user"
+                   " memory, using mmap buffers");
+        goto err;
+    }
+
+    vid_source->userptr = 1;
+
+    MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Capturing into the image buffers,"
+               " %d queued", vid_source->req.count);
+
+    return 0;
+
+err:
+    if (vid_source->buffers) {
+        for (buffer_index = 0; buffer_index < vid_source->req.count; buffer_index++)
+            free(vid_source->buffers[buffer_index].ptr);
+
+        free(vid_source->buffers);
+        vid_source->buffers = NULL;
+    }
+
+    /* Give the queue back so that the mmap buffers can be requested */
+    vid_source->req.count = 0;
+    xioctl(vid_source->fd, VIDIOC_REQBUFS, &vid_source->req);
+
+    return -1;
+}
+
 /**
  * v4l2_scan_controls
  */
@@ -804,6 +913,7 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
               int input, int norm, unsigned long freq, int tuner_number)
 {
     src_v4l2_t *vid_source;
+    int scale;
 
     /* Allocate memory for the state structure. */
     if (!(vid_source = calloc(sizeof(src_v4l2_t), 1))) {
@@ -829,10 +939,33 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
     if (v4l2_scan_controls(vid_source))
         goto err;
 
+    switch (vid_source->dst_fmt.fmt.pix.pixelformat) {
+    case V4L2_PIX_FMT_PJPG:
+    case V4L2_PIX_FMT_JPEG:
+    case V4L2_PIX_FMT_MJPEG:
+        scale = conf->mjpeg_decode_scale > 1 ? conf->mjpeg_decode_scale : 1;
+
+        /* Smaller images are decoded for less than the full frames */
+        if (scale > 1 && (scale == 2 || scale == 4 || scale == 8) &&
+            (width / scale) % 8 == 0 && (height / scale) % 8 == 0) {
+            MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Decoding the %dx%d frames"
+                       " at %dx%d", width, height, width / scale, height / scale);
+            width /= scale;
+            height /= scale;
+        } else if (scale > 1) {
+            MOTION_LOG(WRN, TYPE_VIDEO, NO_ERRNO, "%s: Can't decode %dx%d frames"
+                       " at 1/%d, mjpeg_decode_scale ignored", width, height, scale);
+            scale = 1;
+        }
+
+        vid_source->decoder = jpeg_decoder_new(scale);
+        break;
+    }
+
 #if 0
     v4l2_set_fps(vid_source);
 #endif
-    if (v4l2_set_mmap(vid_source))
+    if (v4l2_set_userptr(vid_source, width, height) && v4l2_set_mmap(vid_source))
         goto err;
 
     viddev->size_map = 0;
@@ -851,8 +984,10 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
     return (void *) 1;
 
 err:
-    if (vid_source)
+    if (vid_source) {
+        jpeg_decoder_free(vid_source->decoder);
         free(vid_source);
+    }
 
     viddev->v4l2_private = NULL;
     viddev->v4l2 = 0;
@@ -862,7 +997,7 @@ err:
 /**
  * v4l2_set_input
  */
-void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char *map,
+void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char **map,
                     int width, int height, struct config *conf)
 {
     int input = conf->input;
@@ -913,15 +1048,13 @@ void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char
                 if (v4l2_next(cnt, viddev, map, width, height))
                     break;
 
-                if (vid_source->buf.timestamp.tv_sec > switchTime.tv_sec ||
-                   (vid_source->buf.timestamp.tv_sec == switchTime.tv_sec &&
-                    vid_source->buf.timestamp.tv_usec > switchTime.tv_usec))
+                /* Frames without a capture time can't be told apart */
+                if (!timerisset(&cnt->capture_tv) || timercmp(&cnt->capture_tv, &switchTime, >))
                     break;
 
                 MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: got frame before "
                            " switch timestamp=%ld:%ld",
-                           vid_source->buf.timestamp.tv_sec,
-                           vid_source->buf.timestamp.tv_usec);
+                           cnt->capture_tv.tv_sec, cnt->capture_tv.tv_usec);
             }
         }
 
@@ -934,51 +1067,101 @@ void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char
     }
 }
 
+/**
+ * v4l2_capture_time
+ *
+ *      Turns the timestamp of the dequeued buffer into the wall clock time
+ *      the frame was taken. Current drivers stamp the buffers with the
+ *      monotonic clock when the frame arrives, so the time doesn't include
+ *      how long the buffer waited in the queue. Older ones use the wall
+ *      clock.
+ *
+ * Returns: 0 on success, -1 if the driver doesn't provide the time
+ */
+static int v4l2_capture_time(src_v4l2_t * vid_source, struct timeval *tv)
+{
+    if (!vid_source->buf.timestamp.tv_sec)
+        return -1;
+
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+    if ((vid_source->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        struct timespec mono, real;
+        long long usec;
+
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        clock_gettime(CLOCK_REALTIME, &real);
+
+        /* Age of the frame subtracted from the time now */
+        usec = ((long long)real.tv_sec - mono.tv_sec + vid_source->buf.timestamp.tv_sec) * 1000000 +
+               (real.tv_nsec - mono.tv_nsec) / 1000 + vid_source->buf.timestamp.tv_usec;
+
+        tv->tv_sec = usec / 1000000;
+        tv->tv_usec = usec % 1000000;
+
+        return 0;
+    }
+#endif
+
+    *tv = vid_source->buf.timestamp;
+
+    return 0;
+}
+
 /**
  * v4l2_next
+ *
+ *      Waits for the next frame with poll, so a camera that stopped sending
+ *      doesn't block the thread, and dequeues it. Signals are not blocked,
+ *      xioctl restarts the calls they interrupt.
  */
-int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
+int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char **map,
               int width, int height)
 {
-    sigset_t set, old;
     src_v4l2_t *vid_source = (src_v4l2_t *) viddev->v4l2_private;
+    struct pollfd pfd;
+    int ret;
 
     if (viddev->v4l_fmt != VIDEO_PALETTE_YUV420P)
         return V4L_FATAL_ERROR;
 
-    /* Block signals during IOCTL */
-    sigemptyset(&set);
-    sigaddset(&set, SIGCHLD);
-    sigaddset(&set, SIGALRM);
-    sigaddset(&set, SIGUSR1);
-    sigaddset(&set, SIGTERM);
-    sigaddset(&set, SIGHUP);
-    pthread_sigmask(SIG_BLOCK, &set, &old);
-
     MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: 1) vid_source->pframe %i",
                vid_source->pframe);
 
-    if (vid_source->pframe >= 0) {
+    /* User memory buffers are queued again as soon as they are dequeued */
+    if (vid_source->pframe >= 0 && !vid_source->userptr) {
         if (xioctl(vid_source->fd, VIDIOC_QBUF, &vid_source->buf) == -1) {
             MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: VIDIOC_QBUF");
-            pthread_sigmask(SIG_UNBLOCK, &old, NULL);
             return -1;
         }
     }
 
+    pfd.fd = vid_source->fd;
+    pfd.events = POLLIN;
+
+    do
+        ret = poll(&pfd, 1, V4L2_POLL_TIMEOUT);
+    while (ret == -1 && errno == EINTR);
+
+    if (ret <= 0) {
+        MOTION_LOG(ERR, TYPE_VIDEO, ret ? SHOW_ERRNO : NO_ERRNO, "%s: No frame from"
+                   " the device for %d ms", V4L2_POLL_TIMEOUT);
+        /* The last buffer is queued already */
+        vid_source->pframe = -1;
+        return 1;
+    }
+
     memset(&vid_source->buf, 0, sizeof(struct v4l2_buffer));
 
     vid_source->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vid_source->buf.memory = V4L2_MEMORY_MMAP;
+    vid_source->buf.memory = vid_source->userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
 
     if (xioctl(vid_source->fd, VIDIOC_DQBUF, &vid_source->buf) == -1) {
-        int ret;
         /*
          * Some drivers return EIO when there is no signal,
          * driver might dequeue an (empty) buffer despite
          * returning an error, or even stop capturing.
          */
-        if (errno == EIO) {
+        if (errno == EIO && !vid_source->userptr) {
             vid_source->pframe++;
 
             if ((u32)vid_source->pframe >= vid_source->req.count)
@@ -997,10 +1180,12 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
             ret = -1;
         }
 
-        pthread_sigmask(SIG_UNBLOCK, &old, NULL);
         return ret;
     }
 
+    if (v4l2_capture_time(vid_source, &cnt->capture_tv))
+        timerclear(&cnt->capture_tv);
+
     MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: 2) vid_source->pframe %i",
                vid_source->pframe);
 
@@ -1013,7 +1198,32 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
     MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: vid_source->buf.bytesused %i",
                vid_source->buf.bytesused);
 
-    pthread_sigmask(SIG_UNBLOCK, &old, NULL);    /*undo the signal blocking */
+    if (vid_source->userptr) {
+        video_buff *the_buffer = &vid_source->buffers[vid_source->buf.index];
+        unsigned char *image = the_buffer->ptr;
+
+        /*
+         * The image the ring gave up takes the place of the new one in the
+         * queue. Round robin cameras sharing the device copy the image, the
+         * buffers of one thread must not end up in the ring of another.
+         */
+        if (viddev->usage_count > 1) {
+            memcpy(*map, image, viddev->v4l_bufsize);
+        } else {
+            the_buffer->ptr = *map;
+            *map = image;
+        }
+
+        vid_source->buf.m.userptr = (unsigned long)the_buffer->ptr;
+        vid_source->buf.length = the_buffer->size;
+
+        if (xioctl(vid_source->fd, VIDIOC_QBUF, &vid_source->buf) == -1) {
+            MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: VIDIOC_QBUF");
+            return -1;
+        }
+
+        return 0;
+    }
 
     {
         video_buff *the_buffer = &vid_source->buffers[vid_source->buf.index];
@@ -1023,26 +1233,26 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
 
         switch (vid_source->dst_fmt.fmt.pix.pixelformat) {
         case V4L2_PIX_FMT_RGB24:
-            conv_rgb24toyuv420p(map, the_buffer->ptr, width, height);
+            conv_rgb24toyuv420p(*map, the_buffer->ptr, width, height);
             return 0;
 
         case V4L2_PIX_FMT_UYVY:
-            conv_uyvyto420p(map, the_buffer->ptr, (unsigned)width, (unsigned)height);
+            conv_uyvyto420p(*map, the_buffer->ptr, (unsigned)width, (unsigned)height);
             return 0;
 
         case V4L2_PIX_FMT_YUYV:
         case V4L2_PIX_FMT_YUV422P:
-            conv_yuv422to420p(map, the_buffer->ptr, width, height);
+            conv_yuv422to420p(*map, the_buffer->ptr, width, height);
             return 0;
 
         case V4L2_PIX_FMT_YUV420:
-            memcpy(map, the_buffer->ptr, viddev->v4l_bufsize);
+            memcpy(*map, the_buffer->ptr, viddev->v4l_bufsize);
             return 0;
 
         case V4L2_PIX_FMT_PJPG:
         case V4L2_PIX_FMT_JPEG:
         case V4L2_PIX_FMT_MJPEG:
-            return mjpegtoyuv420p(map, the_buffer->ptr, width, height,
+            return mjpegtoyuv420p(vid_source->decoder, *map, the_buffer->ptr, width, height,
                                   vid_source->buffers[vid_source->buf.index].content_length);
 
         /* FIXME: quick hack to allow work all bayer formats */
@@ -1051,15 +1261,15 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
         case V4L2_PIX_FMT_SGRBG8:
         /* case V4L2_PIX_FMT_SPCA561: */
         case V4L2_PIX_FMT_SBGGR8:    /* bayer */
-            bayer2rgb24(cnt->imgs.common_buffer, the_buffer->ptr, width, height);
-            conv_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
+            conv_bayertoyuv420p(*map, the_buffer->ptr, width, height, cnt->imgs.common_buffer);
             return 0;
 
         case V4L2_PIX_FMT_SPCA561:
         case V4L2_PIX_FMT_SN9C10X:
-            sonix_decompress(map, the_buffer->ptr, width, height);
-            bayer2rgb24(cnt->imgs.common_buffer, map, width, height);
-            conv_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
+            /* The bayer frame can't be converted in place, map is the output */
+            sonix_decompress(cnt->imgs.common_buffer, the_buffer->ptr, width, height);
+            conv_bayertoyuv420p(*map, cnt->imgs.common_buffer, width, height,
+                                cnt->imgs.common_buffer + width * height);
             return 0;
         }
     }
@@ -1091,8 +1301,12 @@ void v4l2_cleanup(struct video_dev *viddev)
     if (vid_source->buffers) {
         unsigned int i;
 
-        for (i = 0; i < vid_source->req.count; i++)
-            munmap(vid_source->buffers[i].ptr, vid_source->buffers[i].size);
+        for (i = 0; i < vid_source->req.count; i++) {
+            if (vid_source->userptr)
+                free(vid_source->buffers[i].ptr);
+            else
+                munmap(vid_source->buffers[i].ptr, vid_source->buffers[i].size);
+        }
 
         free(vid_source->buffers);
         vid_source->buffers = NULL;
@@ -1103,6 +1317,8 @@ void v4l2_cleanup(struct video_dev *viddev)
         vid_source->controls = NULL;
     }
 
+    jpeg_decoder_free(vid_source->decoder);
+
     free(vid_source);
     viddev->v4l2_private = NULL;
 }
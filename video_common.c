@@ -168,257 +168,34 @@ int sonix_decompress(unsigned char *outp, unsigned char *inp, int width, int hei
     return 0;
 }
 
-/**
- * bayer2rgb24
- * BAYER2RGB24 ROUTINE TAKEN FROM:
- *
- * Sonix SN9C10x based webcam basic I/F routines
- * Takafumi Mizuno <taka-qce@ls-a.jp>
- *
- */
-void bayer2rgb24(unsigned char *dst, unsigned char *src, long int width, long int height)
-{
-    long int i;
-    unsigned char *rawpt, *scanpt;
-    long int size;
-
-    rawpt = src;
-    scanpt = dst;
-    size = width * height;
-
-    for (i = 0; i < size; i++) {
-        if (((i / width) & 1) == 0) {    // %2 changed to & 1
-            if ((i & 1) == 0) {
-                /* B */
-                if ((i > width) && ((i % width) > 0)) {
-                    *scanpt++ = *rawpt;     /* B */
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
-                                *(rawpt + width) + *(rawpt - width)) / 4;    /* G */
-                    *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
-                                *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* R */
-                } else {
-                    /* First line or left column. */
-                    *scanpt++ = *rawpt;     /* B */
-                    *scanpt++ = (*(rawpt + 1) + *(rawpt + width)) / 2;    /* G */
-                    *scanpt++ = *(rawpt + width + 1);       /* R */
-                }
-            } else {
-                /* (B)G */
-                if ((i > width) && ((i % width) < (width - 1))) {
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* B */
-                    *scanpt++ = *rawpt;    /* G */
-                    *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* R */
-                } else {
-                    /* First line or right column. */
-                    *scanpt++ = *(rawpt - 1);       /* B */
-                    *scanpt++ = *rawpt;    /* G */
-                    *scanpt++ = *(rawpt + width);   /* R */
-                }
-            }
-        } else {
-            if ((i & 1) == 0) {
-                /* G(R) */
-                if ((i < (width * (height - 1))) && ((i % width) > 0)) {
-                    *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* B */
-                    *scanpt++ = *rawpt;    /* G */
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* R */
-                } else {
-                    /* Bottom line or left column. */
-                    *scanpt++ = *(rawpt - width);   /* B */
-                    *scanpt++ = *rawpt;    /* G */
-                    *scanpt++ = *(rawpt + 1);       /* R */
-                }
-            } else {
-                /* R */
-                if (i < (width * (height - 1)) && ((i % width) < (width - 1))) {
-                    *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
-                                *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* B */
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
-                                *(rawpt - width) + *(rawpt + width)) / 4;    /* G */
-                    *scanpt++ = *rawpt;     /* R */
-                } else {
-                    /* Bottom line or right column. */
-                    *scanpt++ = *(rawpt - width - 1);       /* B */
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt - width)) / 2;    /* G */
-                    *scanpt++ = *rawpt;     /* R */
-                }
-            }
-        }
-        rawpt++;
-    }
-
-}
-
-/**
- * conv_yuv422to420p
- *
- *
- */
-void conv_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height)
-{
-    unsigned char *src, *dest, *src2, *dest2;
-    int i, j;
-
-    /* Create the Y plane. */
-    src = cap_map;
-    dest = map;
-    for (i = width * height; i > 0; i--) {
-        *dest++ = *src;
-        src += 2;
-    }
-    /* Create U and V planes. */
-    src = cap_map + 1;
-    src2 = cap_map + width * 2 + 1;
-    dest = map + width * height;
-    dest2 = dest + (width * height) / 4;
-    for (i = height / 2; i > 0; i--) {
-        for (j = width / 2; j > 0; j--) {
-            *dest = ((int) *src + (int) *src2) / 2;
-            src += 2;
-            src2 += 2;
-            dest++;
-            *dest2 = ((int) *src + (int) *src2) / 2;
-            src += 2;
-            src2 += 2;
-            dest2++;
-        }
-        src += width * 2;
-        src2 += width * 2;
-    }
-}
-
-/**
- * conv_uyvyto420p
- *
- *
- */
-void conv_uyvyto420p(unsigned char *map, unsigned char *cap_map, unsigned int width, unsigned int height)
-{
-    uint8_t *pY = map;
-    uint8_t *pU = pY + (width * height);
-    uint8_t *pV = pU + (width * height) / 4;
-    uint32_t uv_offset = width * 2 * sizeof(uint8_t);
-    uint32_t ix, jx;
-
-    for (ix = 0; ix < height; ix++) {
-        for (jx = 0; jx < width; jx += 2) {
-            uint16_t calc;
-
-            if ((ix&1) == 0) {
-                calc = *cap_map;
-                calc += *(cap_map + uv_offset);
-                calc /= 2;
-                *pU++ = (uint8_t) calc;
-            }
-
-            cap_map++;
-            *pY++ = *cap_map++;
-
-            if ((ix&1) == 0) {
-                calc = *cap_map;
-                calc += *(cap_map + uv_offset);
-                calc /= 2;
-                *pV++ = (uint8_t) calc;
-            }
-
-            cap_map++;
-            *pY++ = *cap_map++;
-        }
-    }
-}
-
-/**
- * conv_rgb24toyuv420p
- *
- *
- */
-void conv_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height)
-{
-    unsigned char *y, *u, *v;
-    unsigned char *r, *g, *b;
-    int i, loop;
-
-    b = cap_map;
-    g = b + 1;
-    r = g + 1;
-    y = map;
-    u = y + width * height;
-    v = u + (width * height) / 4;
-    memset(u, 0, width * height / 4);
-    memset(v, 0, width * height / 4);
-
-    for (loop = 0; loop < height; loop++) {
-        for (i = 0; i < width; i += 2) {
-            *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
-            *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
-            *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
-            r += 3;
-            g += 3;
-            b += 3;
-            *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
-            *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
-            *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
-            r += 3;
-            g += 3;
-            b += 3;
-            u++;
-            v++;
-        }
-
-        if ((loop & 1) == 0) {
-            u -= width / 2;
-            v -= width / 2;
-        }
-    }
-}
-
 /**
  * mjpegtoyuv420p
  *
+ *      Decodes a frame with the decompressor of the device straight into
+ *      map, or with decode_jpeg_raw if the device has none.
+ *
  * Return values
  *  -1 on fatal error
  *  0  on success
  *  2  if jpeg lib threw a "corrupt jpeg data" warning.
  *     in this case, "a damaged output image is likely."
  */
-int mjpegtoyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height, unsigned int size)
+int mjpegtoyuv420p(struct jpeg_decoder *decoder, unsigned char *map, unsigned char *cap_map,
+                   int width, int height, unsigned int size)
 {
-    uint8_t *yuv[3];
-    unsigned char *y, *u, *v;
-    int loop, ret;
-
-    yuv[0] = mymalloc(width * height * sizeof(yuv[0][0]));
-    yuv[1] = mymalloc(width * height / 4 * sizeof(yuv[1][0]));
-    yuv[2] = mymalloc(width * height / 4 * sizeof(yuv[2][0]));
+    int ret;
 
-
-    ret = decode_jpeg_raw(cap_map, size, 0, 420, width, height, yuv[0], yuv[1], yuv[2]);
+    if (decoder)
+        ret = jpeg_decoder_yuv420p(decoder, cap_map, size, map, width, height);
+    else
+        ret = decode_jpeg_raw(cap_map, size, 0, 420, width, height, map,
+                              map + width * height, map + (width * height * 5) / 4);
 
     if (ret == 1) {
         MOTION_LOG(CRT, TYPE_VIDEO, NO_ERRNO, "%s: Corrupt image ... continue");
         ret = 2;
     }
 
-    y = map;
-    u = y + width * height;
-    v = u + (width * height) / 4;
-    memset(y, 0, width * height);
-    memset(u, 0, width * height / 4);
-    memset(v, 0, width * height / 4);
-
-    for(loop = 0; loop < width * height; loop++)
-        *map++ = yuv[0][loop];
-
-    for(loop = 0; loop < width * height / 4; loop++)
-        *map++ = yuv[1][loop];
-
-    for(loop = 0; loop < width * height / 4; loop++)
-        *map++ = yuv[2][loop];
-
-    free(yuv[0]);
-    free(yuv[1]);
-    free(yuv[2]);
-
     return ret;
 }
 
@@ -467,7 +244,7 @@ int vid_do_autobright(struct context *cnt, struct video_dev *viddev)
     brightness_window_high = MIN2(brightness_target + AUTOBRIGHT_HYSTERESIS, 255);
     brightness_window_low = MAX2(brightness_target - AUTOBRIGHT_HYSTERESIS, 1);
 
-    for (i = 0; i < cnt->imgs.motionsize; i += 101) {
+    for (i = 0; i < cnt->imgs.width * cnt->imgs.height; i += 101) {
         avg += image[i];
         j++;
     }
@@ -878,7 +655,9 @@ int vid_start(struct context *cnt)
  *
  * Parameters:
  *     cnt        Pointer to the context for this thread
- *     map        Pointer to the buffer in which the function puts the new image
+ *     map        Pointer to the buffer in which the function puts the new image.
+ *                A V4L2 device capturing into image buffers (see v4l2_set_userptr)
+ *                swaps the buffer for the one holding the new image instead.
  *
  * Global variable
  *     viddevs    The viddevs struct is "global" within the context of video.c
@@ -891,16 +670,26 @@ int vid_start(struct context *cnt)
  *    with bit 0 set            Non fatal V4L error (copy grey image and discard this image)
  *    with bit 1 set            Non fatal Netcam error
  */
-int vid_next(struct context *cnt, unsigned char *map)
+int vid_next(struct context *cnt, unsigned char **map)
 {
     int ret = -2;
     struct config *conf = &cnt->conf;
 
+    /* Set by the devices that know when the frame was taken */
+    timerclear(&cnt->capture_tv);
+
     if (conf->netcam_url) {
         if (cnt->video_dev == -1)
             return NETCAM_GENERAL_ERROR;
 
-        return netcam_next(cnt, map);
+        ret = netcam_next(cnt, *map);
+
+        /* Rotate the image as specified. */
+        if (ret == 0 && (cnt->rotate_data.degrees > 0 ||
+                         cnt->rotate_data.axis != FLIP_TYPE_NONE))
+            rotate_map(cnt, map);
+
+        return ret;
     }
 #if defined(HAVE_V4L) || defined(HAVE_V4L2)
     /*
@@ -939,8 +728,8 @@ int vid_next(struct context *cnt, unsigned char *map)
         } else {
 #endif
 #ifdef HAVE_V4L
-            v4l_set_input(cnt, dev, map, width, height, conf);
-            ret = v4l_next(dev, map, width, height);
+            v4l_set_input(cnt, dev, *map, width, height, conf);
+            ret = v4l_next(dev, *map, width, height);
 #endif
 #ifdef HAVE_V4L2
         }
@@ -952,7 +741,7 @@ int vid_next(struct context *cnt, unsigned char *map)
         }
 
         /* Rotate the image as specified. */
-        if (cnt->rotate_data.degrees > 0)
+        if (cnt->rotate_data.degrees > 0 || cnt->rotate_data.axis != FLIP_TYPE_NONE)
             rotate_map(cnt, map);
 
     }
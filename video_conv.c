@@ -0,0 +1,398 @@
+/*      video_conv.c
+ *
+ *      Colorspace conversions of the captured frames to YUV 4:2:0.
+ *      They depend on nothing else in motion, so that "make check" can
+ *      build them on their own, see tests/conv_test.c.
+ *      Split from video_common.c:
+ *      Copyright 2000 by Jeroen Vreeken (pe1rxq@amsat.org)
+ *                2006 by Krzysztof Blaszkowski (kb@sysmikro.com.pl)
+ *                2007 by Angel Carpintero (motiondevelop@gmail.com)
+ *      This software is distributed under the GNU public license version 2
+ *      See also the file 'COPYING'.
+ *
+ */
+#include <string.h>
+
+#include "video_conv.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * bayer2rgb24_row
+ * BAYER2RGB24 ROUTINE TAKEN FROM:
+ *
+ * Sonix SN9C10x based webcam basic I/F routines
+ * Takafumi Mizuno <taka-qce@ls-a.jp>
+ *
+ *      Interpolates one row of the BGGR pattern to BGR24, so the whole frame
+ *      never needs an intermediate RGB image. The width is even (see
+ *      vid_start), so the parity of the column is that of the pixel index.
+ */
+static void bayer2rgb24_row(unsigned char *dst, const unsigned char *src, long int width,
+                            long int height, long int row)
+{
+    const unsigned char *rawpt = src + row * width;
+    unsigned char *scanpt = dst;
+    long int x;
+
+    for (x = 0; x < width; x++, rawpt++) {
+        if ((row & 1) == 0) {
+            if ((x & 1) == 0) {
+                /* B */
+                if (row > 0 && x > 0) {
+                    *scanpt++ = *rawpt;     /* B */
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
+                                *(rawpt + width) + *(rawpt - width)) / 4;    /* G */
+                    *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
+                                *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* R */
+                } else {
+                    /* First line or left column. */
+                    *scanpt++ = *rawpt;     /* B */
+                    *scanpt++ = (*(rawpt + 1) + *(rawpt + width)) / 2;    /* G */
+                    *scanpt++ = *(rawpt + width + 1);       /* R */
+                }
+            } else {
+                /* (B)G */
+                if (row > 0 && x < width - 1) {
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* B */
+                    *scanpt++ = *rawpt;    /* G */
+                    *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* R */
+                } else {
+                    /* First line or right column. */
+                    *scanpt++ = *(rawpt - 1);       /* B */
+                    *scanpt++ = *rawpt;    /* G */
+                    *scanpt++ = *(rawpt + width);   /* R */
+                }
+            }
+        } else {
+            if ((x & 1) == 0) {
+                /* G(R) */
+                if (row < height - 1 && x > 0) {
+                    *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* B */
+                    *scanpt++ = *rawpt;    /* G */
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* R */
+                } else {
+                    /* Bottom line or left column. */
+                    *scanpt++ = *(rawpt - width);   /* B */
+                    *scanpt++ = *rawpt;    /* G */
+                    *scanpt++ = *(rawpt + 1);       /* R */
+                }
+            } else {
+                /* R */
+                if (row < height - 1 && x < width - 1) {
+                    *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
+                                *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* B */
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
+                                *(rawpt - width) + *(rawpt + width)) / 4;    /* G */
+                    *scanpt++ = *rawpt;     /* R */
+                } else {
+                    /* Bottom line or right column. */
+                    *scanpt++ = *(rawpt - width - 1);       /* B */
+                    *scanpt++ = (*(rawpt - 1) + *(rawpt - width)) / 2;    /* G */
+                    *scanpt++ = *rawpt;     /* R */
+                }
+            }
+        }
+    }
+}
+
+/**
+ * conv_422to420p_rows
+ *
+ *      Converts a pair of rows of packed 4:2:2 (YUYV or UYVY, with the luma
+ *      at byte yoff of each pixel) to planar. The chroma of the two rows is
+ *      averaged rounding down. With SSE2 32 pixels are done at a time, the
+ *      remaining ones and the last row of an odd height (src2 NULL, luma
+ *      only) byte by byte.
+ */
+static void conv_422to420p_rows(unsigned char *y, unsigned char *u, unsigned char *v,
+                                const unsigned char *src, const unsigned char *src2,
+                                int width, int yoff)
+{
+    int coff = 1 - yoff;
+    int x = 0;
+
+#ifdef __SSE2__
+    if (src2) {
+        const __m128i lo = _mm_set1_epi16(0x00ff);
+        const __m128i one = _mm_set1_epi8(1);
+
+        for (; x + 32 <= width; x += 32) {
+            const unsigned char *s = src + x * 2, *s2 = src2 + x * 2;
+            __m128i a[4], b[4], ya[4], yb[4], ca[4], cb[4], c0, c1, d0, d1;
+            int k;
+
+            for (k = 0; k < 4; k++) {
+                a[k] = _mm_loadu_si128((const __m128i *)(s + 16 * k));
+                b[k] = _mm_loadu_si128((const __m128i *)(s2 + 16 * k));
+
+                if (yoff) {
+                    ya[k] = _mm_srli_epi16(a[k], 8);
+                    yb[k] = _mm_srli_epi16(b[k], 8);
+                    ca[k] = _mm_and_si128(a[k], lo);
+                    cb[k] = _mm_and_si128(b[k], lo);
+                } else {
+                    ya[k] = _mm_and_si128(a[k], lo);
+                    yb[k] = _mm_and_si128(b[k], lo);
+                    ca[k] = _mm_srli_epi16(a[k], 8);
+                    cb[k] = _mm_srli_epi16(b[k], 8);
+                }
+            }
+
+            _mm_storeu_si128((__m128i *)(y + x), _mm_packus_epi16(ya[0], ya[1]));
+            _mm_storeu_si128((__m128i *)(y + x + 16), _mm_packus_epi16(ya[2], ya[3]));
+            _mm_storeu_si128((__m128i *)(y + width + x), _mm_packus_epi16(yb[0], yb[1]));
+            _mm_storeu_si128((__m128i *)(y + width + x + 16), _mm_packus_epi16(yb[2], yb[3]));
+
+            /* UVUV... of both rows, _mm_avg_epu8 rounds up so take the odd sums down */
+            c0 = _mm_packus_epi16(ca[0], ca[1]);
+            c1 = _mm_packus_epi16(ca[2], ca[3]);
+            d0 = _mm_packus_epi16(cb[0], cb[1]);
+            d1 = _mm_packus_epi16(cb[2], cb[3]);
+            c0 = _mm_sub_epi8(_mm_avg_epu8(c0, d0), _mm_and_si128(_mm_xor_si128(c0, d0), one));
+            c1 = _mm_sub_epi8(_mm_avg_epu8(c1, d1), _mm_and_si128(_mm_xor_si128(c1, d1), one));
+
+            _mm_storeu_si128((__m128i *)(u + x / 2),
+                             _mm_packus_epi16(_mm_and_si128(c0, lo), _mm_and_si128(c1, lo)));
+            _mm_storeu_si128((__m128i *)(v + x / 2),
+                             _mm_packus_epi16(_mm_srli_epi16(c0, 8), _mm_srli_epi16(c1, 8)));
+        }
+    }
+#endif
+
+    for (; x < width; x += 2) {
+        const unsigned char *s = src + x * 2;
+
+        y[x] = s[yoff];
+        y[x + 1] = s[yoff + 2];
+
+        if (src2) {
+            const unsigned char *s2 = src2 + x * 2;
+
+            y[width + x] = s2[yoff];
+            y[width + x + 1] = s2[yoff + 2];
+            u[x / 2] = (s[coff] + s2[coff]) / 2;
+            v[x / 2] = (s[coff + 2] + s2[coff + 2]) / 2;
+        }
+    }
+}
+
+/**
+ * conv_422to420p
+ *
+ *      Converts a packed 4:2:2 image (YUYV, or UYVY for yoff 1) to planar
+ *      YUV420P a pair of rows at a time, see conv_422to420p_rows.
+ */
+static void conv_422to420p(unsigned char *map, const unsigned char *cap_map, int width,
+                           int height, int yoff)
+{
+    unsigned char *y = map;
+    unsigned char *u = y + width * height;
+    unsigned char *v = u + (width * height) / 4;
+    int row;
+
+    for (row = 0; row + 1 < height; row += 2) {
+        conv_422to420p_rows(y, u, v, cap_map, cap_map + width * 2, width, yoff);
+        y += width * 2;
+        u += width / 2;
+        v += width / 2;
+        cap_map += width * 4;
+    }
+
+    if (row < height)
+        conv_422to420p_rows(y, u, v, cap_map, NULL, width, yoff);
+}
+
+/**
+ * conv_yuv422to420p
+ *
+ *
+ */
+void conv_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height)
+{
+    conv_422to420p(map, cap_map, width, height, 0);
+}
+
+/**
+ * conv_uyvyto420p
+ *
+ *
+ */
+void conv_uyvyto420p(unsigned char *map, unsigned char *cap_map, unsigned int width, unsigned int height)
+{
+    conv_422to420p(map, cap_map, width, height, 1);
+}
+
+#ifdef __SSE2__
+/**
+ * rgb24_pairsum
+ *
+ *      Adds up the neighbouring 32 bit lanes of a and b: a0 + a1, a2 + a3,
+ *      b0 + b1, b2 + b3.
+ */
+static inline __m128i rgb24_pairsum(__m128i a, __m128i b)
+{
+    __m128 fa = _mm_castsi128_ps(a), fb = _mm_castsi128_ps(b);
+
+    return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))),
+                         _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+/**
+ * rgb24_load4
+ *
+ *      Loads 4 BGR24 pixels as 16 bit B, G, R, 0 lanes, 2 pixels in lo and
+ *      2 in hi. Reads 16 bytes, 4 more than the pixels take.
+ */
+static inline void rgb24_load4(const unsigned char *src, __m128i *lo, __m128i *hi)
+{
+    __m128i x = _mm_loadu_si128((const __m128i *)src);
+
+    /* One pixel in each 32 bit lane, the 4th byte is the next pixel's B */
+    x = _mm_unpacklo_epi64(_mm_unpacklo_epi32(x, _mm_srli_si128(x, 3)),
+                           _mm_unpacklo_epi32(_mm_srli_si128(x, 6), _mm_srli_si128(x, 9)));
+    x = _mm_and_si128(x, _mm_set1_epi32(0x00ffffff));
+
+    *lo = _mm_unpacklo_epi8(x, _mm_setzero_si128());
+    *hi = _mm_unpackhi_epi8(x, _mm_setzero_si128());
+}
+
+/**
+ * rgb24_chroma
+ *
+ *      Adds the chroma of 8 pixels, given as (c * pixel) >> 17 for each, to
+ *      4 bytes of u or v the way the plain loop does: + 32 for each pixel,
+ *      modulo 256.
+ */
+static inline void rgb24_chroma(unsigned char *uv, __m128i c0, __m128i c1)
+{
+    const __m128i bias = _mm_set1_epi32(32);
+    __m128i sum;
+    int bytes;
+
+    memcpy(&bytes, uv, 4);
+    sum = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), _mm_setzero_si128()),
+                             _mm_setzero_si128());
+    sum = _mm_add_epi32(sum, rgb24_pairsum(_mm_add_epi32(c0, bias), _mm_add_epi32(c1, bias)));
+    sum = _mm_and_si128(sum, _mm_set1_epi32(0xff));
+    sum = _mm_packs_epi32(sum, sum);
+    bytes = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    memcpy(uv, &bytes, 4);
+}
+#endif /* __SSE2__ */
+
+/**
+ * conv_rgb24toyuv420p_row
+ *
+ *      Converts a row of BGR24 and adds its share of the chroma to u and v,
+ *      which the two rows of a pair have in common. With SSE2 8 pixels are
+ *      done at a time with the same integer math, so the result is the same
+ *      to the bit. The remaining pixels are done by the plain loop.
+ */
+static void conv_rgb24toyuv420p_row(unsigned char *y, unsigned char *u, unsigned char *v,
+                                    const unsigned char *cap_map, int width)
+{
+    const unsigned char *b, *g, *r;
+    int i = 0;
+
+#ifdef __SSE2__
+    {
+        const __m128i cy = _mm_setr_epi16(3736, 19235, 9796, 0, 3736, 19235, 9796, 0);
+        const __m128i cu = _mm_setr_epi16(14221, -9437, -4784, 0, 14221, -9437, -4784, 0);
+        const __m128i cv = _mm_setr_epi16(-3277, -16941, 20218, 0, -3277, -16941, 20218, 0);
+
+        /* The second load reads 4 bytes past the 8 pixels */
+        for (; i + 10 <= width; i += 8) {
+            __m128i lo0, hi0, lo1, hi1, y0, y1;
+
+            rgb24_load4(cap_map + i * 3, &lo0, &hi0);
+            rgb24_load4(cap_map + i * 3 + 12, &lo1, &hi1);
+
+            y0 = rgb24_pairsum(_mm_madd_epi16(lo0, cy), _mm_madd_epi16(hi0, cy));
+            y1 = rgb24_pairsum(_mm_madd_epi16(lo1, cy), _mm_madd_epi16(hi1, cy));
+            y0 = _mm_packs_epi32(_mm_srai_epi32(y0, 15), _mm_srai_epi32(y1, 15));
+            _mm_storel_epi64((__m128i *)(y + i), _mm_packus_epi16(y0, y0));
+
+            rgb24_chroma(u + i / 2,
+                _mm_srai_epi32(rgb24_pairsum(_mm_madd_epi16(lo0, cu), _mm_madd_epi16(hi0, cu)), 17),
+                _mm_srai_epi32(rgb24_pairsum(_mm_madd_epi16(lo1, cu), _mm_madd_epi16(hi1, cu)), 17));
+            rgb24_chroma(v + i / 2,
+                _mm_srai_epi32(rgb24_pairsum(_mm_madd_epi16(lo0, cv), _mm_madd_epi16(hi0, cv)), 17),
+                _mm_srai_epi32(rgb24_pairsum(_mm_madd_epi16(lo1, cv), _mm_madd_epi16(hi1, cv)), 17));
+        }
+    }
+#endif
+
+    b = cap_map + i * 3;
+    g = b + 1;
+    r = g + 1;
+    y += i;
+    u += i / 2;
+    v += i / 2;
+
+    for (; i < width; i += 2) {
+        *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
+        *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
+        *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
+        r += 3;
+        g += 3;
+        b += 3;
+        *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
+        *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
+        *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
+        r += 3;
+        g += 3;
+        b += 3;
+        u++;
+        v++;
+    }
+}
+
+/**
+ * conv_rgb24toyuv420p
+ *
+ *
+ */
+void conv_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height)
+{
+    unsigned char *y, *u, *v;
+    int loop;
+
+    y = map;
+    u = y + width * height;
+    v = u + (width * height) / 4;
+    memset(u, 0, width * height / 4);
+    memset(v, 0, width * height / 4);
+
+    for (loop = 0; loop < height; loop++)
+        conv_rgb24toyuv420p_row(y + loop * width, u + (loop / 2) * (width / 2),
+                                v + (loop / 2) * (width / 2), cap_map + loop * width * 3, width);
+}
+
+/**
+ * conv_bayertoyuv420p
+ *
+ *      Converts a BGGR bayer frame to YUV 4:2:0 a row at a time through
+ *      scratch, which must hold 3 * width bytes. The result is the same as
+ *      that of the whole frame converted to BGR24 and then to YUV, without
+ *      writing and reading back a frame sized RGB image. src and map must
+ *      not overlap.
+ */
+void conv_bayertoyuv420p(unsigned char *map, unsigned char *src, int width, int height,
+                         unsigned char *scratch)
+{
+    unsigned char *u = map + width * height;
+    unsigned char *v = u + (width * height) / 4;
+    int row;
+
+    memset(u, 0, width * height / 4);
+    memset(v, 0, width * height / 4);
+
+    for (row = 0; row < height; row++) {
+        bayer2rgb24_row(scratch, src, width, height, row);
+        conv_rgb24toyuv420p_row(map + row * width, u + (row / 2) * (width / 2),
+                                v + (row / 2) * (width / 2), scratch, width);
+    }
+}
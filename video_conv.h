@@ -0,0 +1,19 @@
+/*	video_conv.h
+ *
+ *	Include file for video_conv.c
+ *      This software is distributed under the GNU public license version 2
+ *      See also the file 'COPYING'.
+ *
+ */
+
+#ifndef _INCLUDE_VIDEO_CONV_H
+#define _INCLUDE_VIDEO_CONV_H
+
+/* Colorspace conversions to YUV 4:2:0, video_conv.c */
+void conv_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height);
+void conv_uyvyto420p(unsigned char *map, unsigned char *cap_map, unsigned int width, unsigned int height);
+void conv_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height);
+void conv_bayertoyuv420p(unsigned char *map, unsigned char *src, int width, int height,
+                         unsigned char *scratch);
+
+#endif /* _INCLUDE_VIDEO_CONV_H */
@@ -0,0 +1,725 @@
+/*
+ *    writer.c
+ *
+ *    Output queue of a camera. motion_loop queues the pictures, the movie
+ *    frames and the notifications about the files it wants written and a
+ *    writer thread does the jpeg compression, the movie encoding and the
+ *    actual writing. A slow or hanging file system then no longer stalls
+ *    the capture and the motion detection.
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+
+#include "ffmpeg.h"    /* must be first to avoid 'shadow' warning */
+#include "picture.h"   /* already includes motion.h */
+#include "event.h"
+#include "writer.h"
+
+#define WRITER_PICTURE          1   /* write a picture file */
+#define WRITER_EVENT            2   /* dispatch a file event */
+#define WRITER_MOVIE            3   /* encode a movie frame */
+#define WRITER_PACKETS          4   /* copy camera packets to a movie */
+#define WRITER_CLOSE            5   /* close a movie */
+#define WRITER_COMPRESS         6   /* compress a pre_capture image */
+
+struct writer_job {
+    struct writer_job *next;
+    int type;                       /* WRITER_* */
+    struct writer_frame *frame;     /* PICTURE, MOVIE, COMPRESS */
+    char *filename;                 /* PICTURE, EVENT */
+    int ftype;                      /* PICTURE: FTYPE_*, EVENT: EVENT_* */
+    void *eventdata;                /* EVENT */
+    struct image_stamp *stamp;      /* PICTURE, EVENT, COMPRESS: for the EXIF data and %-expansions */
+    struct timeval timestamp_tv;    /* MOVIE: capture time, unset if none */
+    struct writer_jpeg *jpeg;       /* COMPRESS: the result */
+#ifdef HAVE_FFMPEG
+    struct ffmpeg *movie;           /* MOVIE, PACKETS, CLOSE */
+    struct packet_data packets;     /* PACKETS */
+#endif
+};
+
+/**
+ * writer_frame_release
+ *
+ *      Drops a reference to a frame. The last one puts the frame on the
+ *      spare list, or frees it if there are enough spare frames already.
+ *      Must be called with the writer mutex locked.
+ */
+static void writer_frame_release(struct writer *writer, struct writer_frame *frame)
+{
+    if (!frame || --frame->refcount > 0)
+        return;
+
+    if (writer->spare_count < writer->size) {
+        frame->next = writer->spare;
+        writer->spare = frame;
+        writer->spare_count++;
+    } else {
+        free(frame->image);
+        free(frame);
+    }
+}
+
+/**
+ * writer_frame_new
+ *
+ *      Returns a copy of the image in a spare frame or a new one, with no
+ *      reference taken yet.
+ */
+static struct writer_frame *writer_frame_new(struct context *cnt, unsigned char *image)
+{
+    struct writer *writer = cnt->writer;
+    struct writer_frame *frame;
+
+    pthread_mutex_lock(&writer->mutex);
+
+    if ((frame = writer->spare) != NULL) {
+        writer->spare = frame->next;
+        writer->spare_count--;
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    if (!frame) {
+        frame = mymalloc(sizeof(struct writer_frame));
+        frame->image = mymalloc(cnt->imgs.size);
+    }
+
+    memcpy(frame->image, image, cnt->imgs.size);
+    frame->refcount = 0;
+
+    return frame;
+}
+
+/**
+ * writer_frame_get
+ *
+ *      Returns a reference to a copy of the image. Jobs queued for the same
+ *      image during one event share the copy.
+ *
+ * Parameters:
+ *
+ *      cnt     current thread's context struct
+ *      image   the image to copy, cnt->imgs.size bytes
+ *
+ * Returns: the frame, holding one reference for the caller
+ */
+static struct writer_frame *writer_frame_get(struct context *cnt, unsigned char *image)
+{
+    struct writer *writer = cnt->writer;
+    struct writer_frame *frame;
+
+    pthread_mutex_lock(&writer->mutex);
+
+    if (writer->cached && writer->cached_src == image) {
+        frame = writer->cached;
+        frame->refcount++;
+        pthread_mutex_unlock(&writer->mutex);
+        return frame;
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    frame = writer_frame_new(cnt, image);
+
+    pthread_mutex_lock(&writer->mutex);
+    writer_frame_release(writer, writer->cached);
+    frame->refcount = 2;    /* the caller and the cache */
+    writer->cached = frame;
+    writer->cached_src = image;
+    pthread_mutex_unlock(&writer->mutex);
+
+    return frame;
+}
+
+/**
+ * writer_reserve
+ *
+ *      Makes room for one more picture or movie frame in the queue. When the
+ *      queue is full we either wait for the writer thread or drop it, as set
+ *      by output_queue_policy.
+ *
+ * Returns: 0 if the job can be queued, -1 if it has to be dropped
+ */
+static int writer_reserve(struct context *cnt)
+{
+    struct writer *writer = cnt->writer;
+
+    pthread_mutex_lock(&writer->mutex);
+
+    if (writer->depth >= writer->size && writer->policy == WRITER_POLICY_BLOCK) {
+        struct timeval start, end;
+
+        writer->waits++;
+        gettimeofday(&start, NULL);
+
+        while (writer->depth >= writer->size && !writer->finish)
+            pthread_cond_wait(&writer->job_done, &writer->mutex);
+
+        gettimeofday(&end, NULL);
+        writer->wait_usec += (end.tv_sec - start.tv_sec) * 1000000LL +
+                             (end.tv_usec - start.tv_usec);
+    }
+
+    if (writer->depth >= writer->size) {
+        writer->dropped++;
+
+        if (writer->drop_burst++ == 0)
+            MOTION_LOG(WRN, TYPE_EVENTS, NO_ERRNO, "%s: Output queue full (%d), dropping"
+                       " pictures and movie frames", writer->size);
+
+        pthread_mutex_unlock(&writer->mutex);
+        return -1;
+    }
+
+    if (writer->drop_burst) {
+        MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, "%s: Output queue has room again, %lu"
+                   " pictures and movie frames were dropped", writer->drop_burst);
+        writer->drop_burst = 0;
+    }
+
+    if (++writer->depth > writer->max_depth)
+        writer->max_depth = writer->depth;
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    return 0;
+}
+
+/**
+ * writer_try_reserve
+ *
+ *      Makes room for one more job that is better left undone than waited
+ *      for, whatever output_queue_policy says.
+ *
+ * Returns: 0 if the job can be queued, -1 if the queue is full
+ */
+static int writer_try_reserve(struct writer *writer)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&writer->mutex);
+
+    if (writer->depth < writer->size) {
+        if (++writer->depth > writer->max_depth)
+            writer->max_depth = writer->depth;
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    return ret;
+}
+
+/**
+ * writer_queue
+ *
+ *      Appends a job to the queue and wakes up the writer thread.
+ */
+static void writer_queue(struct writer *writer, struct writer_job *job)
+{
+    pthread_mutex_lock(&writer->mutex);
+
+    if (writer->tail)
+        writer->tail->next = job;
+    else
+        writer->head = job;
+
+    writer->tail = job;
+    writer->queued++;
+
+    pthread_cond_signal(&writer->job_ready);
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+#ifdef HAVE_FFMPEG
+/**
+ * writer_movie_failed
+ *
+ *      ffmpeg has freed a movie it failed to write. motion_loop still holds
+ *      it and may have queued more frames, so the remaining jobs of the
+ *      movie, its close included, are skipped. The camera is stopped the
+ *      way motion_loop would have stopped it.
+ */
+static void writer_movie_failed(struct context *cnt, struct ffmpeg *movie)
+{
+    cnt->writer->dead_movie = movie;
+    cnt->finish = 1;
+    cnt->restart = 0;
+}
+#endif /* HAVE_FFMPEG */
+
+/**
+ * writer_run
+ *
+ *      Does the work of a job. Errors are handled the way motion_loop
+ *      would have handled them.
+ */
+static void writer_run(struct context *cnt, struct writer_job *job)
+{
+    /* For the handlers of the file events, see writer_stamp */
+    cnt->writer->stamp = job->stamp;
+
+    switch (job->type) {
+    case WRITER_PICTURE:
+        put_picture_stamped(cnt, job->filename, job->frame->image, job->ftype, job->stamp);
+        break;
+
+    case WRITER_EVENT:
+        event(cnt, job->ftype, NULL, job->filename, job->eventdata, NULL);
+        break;
+
+    case WRITER_COMPRESS:
+    {
+        struct writer *writer = cnt->writer;
+        int size;
+
+        if (!writer->scratch)
+            writer->scratch = mymalloc(cnt->imgs.size);
+
+        size = put_picture_memory(cnt, writer->scratch, cnt->imgs.size, job->frame->image,
+                                  cnt->conf.quality, job->stamp);
+
+        /* Handed back to motion_loop even if it failed, the image stays raw then */
+        if (size > 0)
+            packet_append(&job->jpeg->jpeg, writer->scratch, size, PACKET_KEY, 0, 0);
+
+        pthread_mutex_lock(&writer->mutex);
+        job->jpeg->next = writer->compressed;
+        writer->compressed = job->jpeg;
+        pthread_mutex_unlock(&writer->mutex);
+
+        job->jpeg = NULL;
+        break;
+    }
+
+#ifdef HAVE_FFMPEG
+    case WRITER_MOVIE:
+    {
+        int size = cnt->imgs.width * cnt->imgs.height;
+        unsigned char *y = job->frame->image;
+        unsigned char *u = NULL, *v = NULL;
+
+        if (job->movie == cnt->writer->dead_movie)
+            break;
+
+        /* Grey images have no chroma, ffmpeg supplies it */
+        if (!job->movie->grey) {
+            u = y + size;
+            v = u + size / 4;
+        }
+
+        if (ffmpeg_put_other_image(job->movie, y, u, v,
+                timerisset(&job->timestamp_tv) ? &job->timestamp_tv : NULL) == -1)
+            writer_movie_failed(cnt, job->movie);
+        break;
+    }
+
+    case WRITER_PACKETS:
+        if (job->movie == cnt->writer->dead_movie)
+            break;
+
+        if (ffmpeg_put_packets(job->movie, &job->packets) == -1)
+            writer_movie_failed(cnt, job->movie);
+        break;
+
+    case WRITER_CLOSE:
+        /*
+         * The jobs are run in order, nothing of the dead movie can follow
+         * its close. A new movie may get the same address from now on.
+         */
+        if (job->movie == cnt->writer->dead_movie)
+            cnt->writer->dead_movie = NULL;
+        else
+            ffmpeg_close(job->movie);
+        break;
+#endif /* HAVE_FFMPEG */
+    }
+
+    cnt->writer->stamp = NULL;
+}
+
+/**
+ * writer_loop
+ *
+ *      The writer thread. Runs the jobs in the order they were queued and
+ *      only ends once the queue is empty.
+ */
+static void *writer_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct writer *writer = cnt->writer;
+    struct writer_job *job;
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    pthread_mutex_lock(&writer->mutex);
+
+    for (;;) {
+        while (!writer->head && !writer->finish)
+            pthread_cond_wait(&writer->job_ready, &writer->mutex);
+
+        if ((job = writer->head) == NULL)
+            break;
+
+        if ((writer->head = job->next) == NULL)
+            writer->tail = NULL;
+
+        pthread_mutex_unlock(&writer->mutex);
+
+        writer_run(cnt, job);
+
+        if (job->filename)
+            free(job->filename);
+        if (job->stamp)
+            free(job->stamp);
+#ifdef HAVE_FFMPEG
+        packet_free(&job->packets);
+#endif
+
+        pthread_mutex_lock(&writer->mutex);
+
+        if (job->type != WRITER_EVENT && job->type != WRITER_CLOSE) {
+            writer->depth--;
+            pthread_cond_signal(&writer->job_done);
+        }
+
+        writer_frame_release(writer, job->frame);
+        free(job);
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    return NULL;
+}
+
+/**
+ * writer_start
+ *
+ *      Starts the writer thread of a camera if output_queue is set.
+ *
+ * Returns: 0 on success (or no output queue), -1 if the thread could not be
+ *          started and motion_loop has to write itself
+ */
+int writer_start(struct context *cnt)
+{
+    struct writer *writer;
+
+    if (cnt->conf.output_queue <= 0)
+        return 0;
+
+    writer = mymalloc(sizeof(struct writer));
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->job_ready, NULL);
+    pthread_cond_init(&writer->job_done, NULL);
+    writer->size = cnt->conf.output_queue;
+
+    if (cnt->conf.output_queue_policy && !strcmp(cnt->conf.output_queue_policy, "drop"))
+        writer->policy = WRITER_POLICY_DROP;
+    else
+        writer->policy = WRITER_POLICY_BLOCK;
+
+    cnt->writer = writer;
+
+    if (pthread_create(&writer->thread_id, NULL, &writer_loop, cnt)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start the writer thread,"
+                   " writing from the motion loop");
+        cnt->writer = NULL;
+        pthread_cond_destroy(&writer->job_done);
+        pthread_cond_destroy(&writer->job_ready);
+        pthread_mutex_destroy(&writer->mutex);
+        free(writer);
+        return -1;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Output queue of %d pictures / movie frames,"
+               " %s when full", writer->size,
+               writer->policy == WRITER_POLICY_DROP ? "dropping" : "waiting");
+
+    return 0;
+}
+
+/**
+ * writer_stop
+ *
+ *      Lets the writer thread finish the queued jobs, stops it and reports
+ *      the statistics of the queue.
+ */
+void writer_stop(struct context *cnt)
+{
+    struct writer *writer = cnt->writer;
+    struct writer_frame *frame;
+    struct writer_jpeg *jpeg;
+
+    if (!writer)
+        return;
+
+    writer_forget(cnt);
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->finish = 1;
+    pthread_cond_signal(&writer->job_ready);
+    pthread_mutex_unlock(&writer->mutex);
+
+    pthread_join(writer->thread_id, NULL);
+    cnt->writer = NULL;
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Output queue: %lu jobs, %lu dropped, waited"
+               " %lu times for %llu ms, at most %d of %d waiting", writer->queued,
+               writer->dropped, writer->waits, writer->wait_usec / 1000,
+               writer->max_depth, writer->size);
+
+    while ((frame = writer->spare) != NULL) {
+        writer->spare = frame->next;
+        free(frame->image);
+        free(frame);
+    }
+
+    while ((jpeg = writer->compressed) != NULL) {
+        writer->compressed = jpeg->next;
+        packet_free(&jpeg->jpeg);
+        free(jpeg);
+    }
+
+    free(writer->scratch);
+
+    pthread_cond_destroy(&writer->job_done);
+    pthread_cond_destroy(&writer->job_ready);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer);
+}
+
+/**
+ * writer_thread
+ *
+ * Returns: true if called by the writer thread of the camera
+ */
+int writer_thread(struct context *cnt)
+{
+    return cnt->writer && pthread_equal(pthread_self(), cnt->writer->thread_id);
+}
+
+/**
+ * writer_stamp
+ *
+ *      The handlers of the file events expand their %-specifiers with this.
+ *      motion_loop may have moved on to other images and events already, so
+ *      the writer thread must not look at cnt->current_image.
+ *
+ * Returns: the stamp of the job the writer thread is running, NULL if not
+ *          called by the writer thread, which uses the current image
+ */
+const struct image_stamp *writer_stamp(struct context *cnt)
+{
+    return writer_thread(cnt) ? cnt->writer->stamp : NULL;
+}
+
+/**
+ * writer_forget
+ *
+ *      Drops the copy of the image shared by the jobs of the last event,
+ *      motion_loop may change the image from now on.
+ */
+void writer_forget(struct context *cnt)
+{
+    struct writer *writer = cnt->writer;
+
+    /* The cache only belongs to motion_loop */
+    if (!writer || writer_thread(cnt) || !writer->cached)
+        return;
+
+    pthread_mutex_lock(&writer->mutex);
+    writer_frame_release(writer, writer->cached);
+    writer->cached = NULL;
+    writer->cached_src = NULL;
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+/**
+ * writer_put_picture
+ *
+ *      Queues a picture file. The EXIF data and the file events get the
+ *      stamp of the current image.
+ */
+void writer_put_picture(struct context *cnt, char *file, unsigned char *image, int ftype)
+{
+    struct writer_job *job;
+
+    if (writer_reserve(cnt))
+        return;
+
+    job = mymalloc(sizeof(struct writer_job));
+    job->type = WRITER_PICTURE;
+    job->frame = writer_frame_get(cnt, image);
+    job->filename = mystrdup(file);
+    job->ftype = ftype;
+    job->stamp = mymalloc(sizeof(struct image_stamp));
+    image_stamp_get(cnt, cnt->current_image, job->stamp);
+
+    writer_queue(cnt->writer, job);
+}
+
+/**
+ * writer_event
+ *
+ *      Queues a file event (EVENT_FILECREATE, EVENT_FILECLOSE) so that it
+ *      follows the writes of the file. The handlers of these events then
+ *      always run in the writer thread, with the stamp of the current image.
+ *
+ * Returns: 0 if queued, -1 if called by the writer thread, which has to
+ *          dispatch the event itself
+ */
+int writer_event(struct context *cnt, int type, char *filename, void *eventdata)
+{
+    struct writer_job *job;
+
+    if (writer_thread(cnt))
+        return -1;
+
+    job = mymalloc(sizeof(struct writer_job));
+    job->type = WRITER_EVENT;
+    job->ftype = type;
+    job->eventdata = eventdata;
+    job->stamp = mymalloc(sizeof(struct image_stamp));
+    image_stamp_get(cnt, cnt->current_image, job->stamp);
+
+    if (filename)
+        job->filename = mystrdup(filename);
+
+    writer_queue(cnt->writer, job);
+
+    return 0;
+}
+
+/**
+ * writer_compress
+ *
+ *      Queues the jpeg compression of an image of the pre_capture ring (see
+ *      image_ring_compress), so that motion_loop doesn't spend the time.
+ *      The image is copied, motion_loop may go on using it. Nothing is
+ *      queued if the queue is full, the image then stays raw.
+ *
+ * Parameters:
+ *
+ *      cnt     current thread's context struct
+ *      slot    index of the image in the ring
+ *      img     the image
+ *
+ * Returns: 0 if queued, -1 if not
+ */
+int writer_compress(struct context *cnt, int slot, struct image_data *img)
+{
+    struct writer_job *job;
+
+    if (writer_try_reserve(cnt->writer))
+        return -1;
+
+    job = mymalloc(sizeof(struct writer_job));
+    job->type = WRITER_COMPRESS;
+    job->frame = writer_frame_new(cnt, img->image);
+    job->frame->refcount = 1;
+    job->stamp = mymalloc(sizeof(struct image_stamp));
+    image_stamp_get(cnt, img, job->stamp);
+
+    job->jpeg = mymalloc(sizeof(struct writer_jpeg));
+    job->jpeg->slot = slot;
+    job->jpeg->timestamp_tv = img->timestamp_tv;
+
+    writer_queue(cnt->writer, job);
+
+    return 0;
+}
+
+/**
+ * writer_compressed
+ *
+ *      Takes the jpegs compressed since the last call, newest first. The
+ *      caller frees them.
+ */
+struct writer_jpeg *writer_compressed(struct context *cnt)
+{
+    struct writer *writer = cnt->writer;
+    struct writer_jpeg *jpeg;
+
+    pthread_mutex_lock(&writer->mutex);
+    jpeg = writer->compressed;
+    writer->compressed = NULL;
+    pthread_mutex_unlock(&writer->mutex);
+
+    return jpeg;
+}
+
+#ifdef HAVE_FFMPEG
+/**
+ * writer_put_movie
+ *
+ *      Queues a frame for a movie opened by motion_loop, with its capture
+ *      time or NULL (see ffmpeg_put_image).
+ */
+void writer_put_movie(struct context *cnt, struct ffmpeg *movie, unsigned char *image,
+                      const struct timeval *tv)
+{
+    struct writer_job *job;
+
+    if (writer_reserve(cnt))
+        return;
+
+    job = mymalloc(sizeof(struct writer_job));
+    job->type = WRITER_MOVIE;
+    job->frame = writer_frame_get(cnt, image);
+    job->movie = movie;
+
+    if (tv)
+        job->timestamp_tv = *tv;
+
+    writer_queue(cnt->writer, job);
+}
+
+/**
+ * writer_put_packets
+ *
+ *      Queues a copy of the camera packets of an image for a passthrough
+ *      movie. Dropped packets are noticed by ffmpeg_put_packets through
+ *      their sequence numbers.
+ */
+void writer_put_packets(struct context *cnt, struct ffmpeg *movie, struct packet_data *packets)
+{
+    struct writer_job *job;
+    unsigned char *data = packets->data;
+    int i;
+
+    if (packets->count == 0 || writer_reserve(cnt))
+        return;
+
+    job = mymalloc(sizeof(struct writer_job));
+    job->type = WRITER_PACKETS;
+    job->movie = movie;
+
+    for (i = 0; i < packets->count; data += packets->info[i].size, i++)
+        packet_append(&job->packets, data, packets->info[i].size, packets->info[i].flags,
+                      packets->info[i].pts, packets->info[i].dts);
+
+    job->packets.seq = packets->seq;
+
+    writer_queue(cnt->writer, job);
+}
+
+/**
+ * writer_close_movie
+ *
+ *      Queues the closing of a movie. The caller must not use the movie
+ *      any more.
+ */
+void writer_close_movie(struct context *cnt, struct ffmpeg *movie)
+{
+    struct writer_job *job;
+
+    job = mymalloc(sizeof(struct writer_job));
+    job->type = WRITER_CLOSE;
+    job->movie = movie;
+
+    writer_queue(cnt->writer, job);
+}
+#endif /* HAVE_FFMPEG */
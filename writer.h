@@ -0,0 +1,95 @@
+/*
+ *    writer.h
+ *
+ *    Include file for writer.c
+ *
+ *    This software is distributed under the GNU Public License Version 2
+ *    see also the file 'COPYING'.
+ *
+ */
+#ifndef _INCLUDE_WRITER_H_
+#define _INCLUDE_WRITER_H_
+
+#include "motion.h"
+
+#define WRITER_POLICY_BLOCK     0   /* main loop waits for room in the queue */
+#define WRITER_POLICY_DROP      1   /* new pictures and frames are dropped */
+
+/*
+ * Copy of an image handed to the writer thread. The same copy is shared
+ * by all the jobs queued for one image during one event.
+ */
+struct writer_frame {
+    struct writer_frame *next;      /* list of spare frames */
+    unsigned char *image;
+    int refcount;                   /* protected by the writer mutex */
+};
+
+/*
+ * A pre_capture image compressed by the writer thread, handed back to
+ * motion_loop, see writer_compress().
+ */
+struct writer_jpeg {
+    struct writer_jpeg *next;
+    int slot;                       /* index of the image in the ring */
+    struct timeval timestamp_tv;    /* of the image, tells it is still there */
+    struct packet_data jpeg;        /* empty if the compression failed */
+};
+
+struct writer_job;
+struct ffmpeg;
+
+struct writer {
+    pthread_t thread_id;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready;       /* signalled when a job is queued */
+    pthread_cond_t job_done;        /* signalled when a job is taken */
+    int finish;
+
+    struct writer_job *head;        /* jobs, oldest first */
+    struct writer_job *tail;
+
+    int size;                       /* max pictures / frames waiting */
+    int policy;                     /* WRITER_POLICY_* */
+    int depth;                      /* pictures / frames waiting */
+
+    struct writer_frame *spare;     /* released frames kept for reuse */
+    int spare_count;
+
+    struct writer_frame *cached;    /* copy of the image of the current */
+    unsigned char *cached_src;      /* event, see writer_forget() */
+
+    const struct image_stamp *stamp; /* of the running job, see writer_stamp() */
+
+    struct ffmpeg *dead_movie;      /* freed by ffmpeg after an error, its
+                                       jobs are skipped up to its close */
+
+    struct writer_jpeg *compressed; /* not taken by motion_loop yet */
+    unsigned char *scratch;         /* to compress in */
+
+    /* Statistics, reported when the writer stops */
+    unsigned long queued;
+    unsigned long dropped;
+    unsigned long waits;
+    unsigned long long wait_usec;
+    int max_depth;
+    unsigned long drop_burst;       /* drops since the last queued job */
+};
+
+int writer_start(struct context *);
+void writer_stop(struct context *);
+int writer_thread(struct context *);
+const struct image_stamp *writer_stamp(struct context *);
+void writer_forget(struct context *);
+void writer_put_picture(struct context *, char *, unsigned char *, int);
+int writer_compress(struct context *, int, struct image_data *);
+struct writer_jpeg *writer_compressed(struct context *);
+int writer_event(struct context *, int, char *, void *);
+#ifdef HAVE_FFMPEG
+void writer_put_movie(struct context *, struct ffmpeg *, unsigned char *,
+                      const struct timeval *);
+void writer_put_packets(struct context *, struct ffmpeg *, struct packet_data *);
+void writer_close_movie(struct context *, struct ffmpeg *);
+#endif
+
+#endif /* _INCLUDE_WRITER_H_ */